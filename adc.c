@@ -17,6 +17,11 @@
   * This interface allows one buffer of samples to be collected while the
   * previous one is processed, which speeds up entropy collection.
   *
+  * Alternatively, #adc_sample_buffer can be used as a ring buffer which is
+  * filled continuously (see beginContinuousADCSampling()). In that mode,
+  * getADCWritePosition() can be used to find out where the newest samples
+  * are, which allows samples to be streamed out without any gaps.
+  *
   * For details on hardware interfacing requirements, see initADC().
   *
   * All references to the "PIC32 Family Reference Manual" refer to section 17,
@@ -32,6 +37,7 @@
 #include <math.h>
 #include <p32xxxx.h>
 #include "adc.h"
+#include "test_result.h"
 #include "pic32_system.h"
 #include "ssd1306.h"
 
@@ -40,6 +46,10 @@
   * taken periodically. */
 volatile uint16_t adc_sample_buffer[SAMPLE_BUFFER_SIZE];
 
+/** Non-zero if #adc_sample_buffer is being filled continuously (see
+  * beginContinuousADCSampling()), zero if it is not. */
+static volatile int is_continuous;
+
 /** Set up the PIC32 ADC to sample from AN2 periodically using Timer3 as the
   * trigger. DMA is used to move the ADC result into #adc_sample_buffer. */
 void initADC(void)
@@ -107,21 +117,15 @@ void initADC(void)
 	T3CONbits.ON = 1; // turn timer on
 }
 
-/** Begin collecting #SAMPLE_BUFFER_SIZE samples, filling
-  * up #adc_sample_buffer. This will return before all the samples have been
-  * collected, allowing the caller to do something else while samples are
-  * collected in the background. isADCBufferFull() can be used to determine
-  * when #adc_sample_buffer is full.
-  *
-  * It is okay to call this while the sample buffer is still being filled up.
-  * In that case, calling this will abort the current fill and commence
-  * filling from the start.
+/** Abort any existing DMA transfer and begin filling #adc_sample_buffer from
+  * the start.
+  * \param continuous Non-zero to keep filling #adc_sample_buffer forever
+  *                   (wrapping around to the start whenever it is full), zero
+  *                   to stop once it is full.
+  * \warning This must be called with interrupts disabled.
   */
-void beginFillingADCBuffer(void)
+static void restartADCTransfer(int continuous)
 {
-	uint32_t status;
-
-	status = disableInterrupts();
 	DCH0CONbits.CHEN = 0; // disable channel
 	asm("nop"); // just to be safe
 	DCH0ECONbits.CABORT = 1; // abort any existing transfer and reset pointers
@@ -142,10 +146,90 @@ void beginFillingADCBuffer(void)
 	DCH0SSIZ = sizeof(uint16_t); // source size
 	DCH0DSIZ = sizeof(adc_sample_buffer); // destination size
 	DCH0CSIZ = sizeof(uint16_t); // cell size (bytes transferred per event)
+	if (continuous)
+	{
+		DCH0CONbits.CHAEN = 1; // re-enable channel after each block
+	}
+	else
+	{
+		DCH0CONbits.CHAEN = 0; // stop after one block
+	}
 	DCH0CONbits.CHEN = 1; // enable channel
+}
+
+/** Begin collecting #SAMPLE_BUFFER_SIZE samples, filling
+  * up #adc_sample_buffer. This will return before all the samples have been
+  * collected, allowing the caller to do something else while samples are
+  * collected in the background. isADCBufferFull() can be used to determine
+  * when #adc_sample_buffer is full.
+  *
+  * It is okay to call this while the sample buffer is still being filled up.
+  * In that case, calling this will abort the current fill and commence
+  * filling from the start.
+  *
+  * If the sample buffer is being filled continuously
+  * (see beginContinuousADCSampling()), this won't disturb that. Instead,
+  * isADCBufferFull() will return a non-zero value once the filling has
+  * wrapped around. Samples will continue to be overwritten after that,
+  * but every entry will still be a sample from the same continuous run.
+  */
+void beginFillingADCBuffer(void)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	if (is_continuous)
+	{
+		DCH0INTCLR = 0x08; // clear block transfer complete flag
+	}
+	else
+	{
+		restartADCTransfer(0);
+	}
+	restoreInterrupts(status);
+}
+
+/** Begin filling #adc_sample_buffer continuously. Once the end of the buffer
+  * is reached, filling wraps around to the start, so the buffer always
+  * holds the most recent #SAMPLE_BUFFER_SIZE samples (about 170 ms worth).
+  * Use getADCWritePosition() to find out where the next sample will go.
+  * Continuous filling keeps going until endContinuousADCSampling() is
+  * called.
+  */
+void beginContinuousADCSampling(void)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	restartADCTransfer(1);
+	is_continuous = 1;
 	restoreInterrupts(status);
 }
 
+/** Stop filling #adc_sample_buffer continuously. Filling will stop once the
+  * end of the buffer is reached, so that anything waiting on
+  * isADCBufferFull() will still see the buffer become full. */
+void endContinuousADCSampling(void)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	DCH0CONbits.CHAEN = 0; // stop after the current block
+	is_continuous = 0;
+	restoreInterrupts(status);
+}
+
+/** Get the position in #adc_sample_buffer which the next sample will be
+  * written to. This is mainly useful when the buffer is being filled
+  * continuously (see beginContinuousADCSampling()); all samples before this
+  * position (wrapping around to the end of the buffer) are valid.
+  * \return Index into #adc_sample_buffer of the next sample.
+  */
+uint32_t getADCWritePosition(void)
+{
+	return (DCH0DPTR / sizeof(uint16_t)) & (SAMPLE_BUFFER_SIZE - 1);
+}
+
 /** Check whether ADC buffer (#adc_sample_buffer) is full.
   * \return 0 if ADC buffer is not full, non-zero if it is.
   */
@@ -154,9 +238,15 @@ int isADCBufferFull(void)
 	return DCH0INTbits.CHBCIF;
 }
 
-/** Test ADC (and implicitly, the hardware noise source) by displaying some
-  * statistics about some ADC samples. */
-void testADC(void)
+/** Finish testing the ADC, once #adc_sample_buffer has been filled (see
+  * beginFillingADCBuffer() and isADCBufferFull()), by calculating and
+  * displaying statistics about the samples. Splitting the test up like this
+  * allows other tests to run while the samples are collected.
+  * \param parameters See testADC().
+  * \param num_parameters See testADC().
+  * \param result The structured result will be written here.
+  */
+void finishADCTest(const int32_t *parameters, unsigned int num_parameters, TestResult *result)
 {
 	unsigned int i;
 	double mean;
@@ -164,13 +254,6 @@ void testADC(void)
 	double standard_deviation;
 	char sbuffer[256];
 
-	// Fill the sample buffer.
-	beginFillingADCBuffer();
-	while(isADCBufferFull() == 0)
-	{
-		// do nothing
-	}
-
 	// Calculate statistics.
 	// The conversion factor 3.226 = 3300 mV / 1023.
 	mean = 0.0;
@@ -198,4 +281,38 @@ void testADC(void)
 	nextLine();
 	sprintf(sbuffer, "%g mV", standard_deviation);
 	writeStringToDisplay(sbuffer);
+
+	result->num_values = 2;
+	result->values[0] = (int32_t)(mean * 1000.0);
+	result->values[1] = (int32_t)(standard_deviation * 1000.0);
+	result->outcome = TEST_PASS;
+	if ((num_parameters >= 1) && (result->values[1] < parameters[0]))
+	{
+		nextLine();
+		writeStringToDisplay("Too little noise");
+		result->outcome = TEST_FAIL;
+	}
+}
+
+/** Test ADC (and implicitly, the hardware noise source) by displaying some
+  * statistics about some ADC samples.
+  *
+  * The result has two values: the mean and the RMS noise of the samples,
+  * both in microvolts.
+  * \param parameters Optional parameter 0 is the minimum acceptable RMS
+  *                   noise, in microvolts; a noise source which has failed
+  *                   will produce much less noise than normal. If it is
+  *                   absent (or 0), the test always passes.
+  * \param num_parameters Number of entries in parameters.
+  * \param result The structured result will be written here.
+  */
+void testADC(const int32_t *parameters, unsigned int num_parameters, TestResult *result)
+{
+	// Fill the sample buffer.
+	beginFillingADCBuffer();
+	while(isADCBufferFull() == 0)
+	{
+		// do nothing
+	}
+	finishADCTest(parameters, num_parameters, result);
 }
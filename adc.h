@@ -9,10 +9,13 @@
 #define PIC32_ADC_H_INCLUDED
 
 #include <stdint.h>
+#include "test_result.h"
 
 /** Size of #sample_buffer, in number of samples.
   * \warning This must be a multiple of 16, or else hardwareRandom32Bytes()
   *          will attempt to read past the end of the sample buffer.
+  * \warning This must be a power of 2, since getADCWritePosition() uses it
+  *          to generate an AND mask.
   */
 #define SAMPLE_BUFFER_SIZE		4096
 
@@ -21,6 +24,10 @@ extern volatile uint16_t adc_sample_buffer[SAMPLE_BUFFER_SIZE];
 extern void initADC(void);
 extern void beginFillingADCBuffer(void);
 extern int isADCBufferFull(void);
-extern void testADC(void);
+extern void beginContinuousADCSampling(void);
+extern void endContinuousADCSampling(void);
+extern uint32_t getADCWritePosition(void);
+extern void finishADCTest(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
+extern void testADC(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
 
 #endif // #ifndef PIC32_ADC_H_INCLUDED
@@ -31,6 +31,7 @@
 #include <p32xxxx.h>
 #include "pic32_system.h"
 #include "atsha204.h"
+#include "test_result.h"
 #include "ssd1306.h"
 
 /** Token which represents a one bit. It is sent least-significant bit
@@ -519,25 +520,40 @@ int atsha204Random(uint8_t *random_bytes)
 }
 
 /** Test ATSHA204 by attempting to wake it and then getting the output of its
-  * random number generator. */
-void testATSHA204(void)
+  * random number generator.
+  *
+  * The result has two values: whether the wake test passed (1) or failed
+  * (0), and the first 4 random bytes as a big-endian number (0 if the
+  * random number generator couldn't be read).
+  * \param parameters Unused; this test has no parameters.
+  * \param num_parameters Unused.
+  * \param result The structured result will be written here.
+  */
+void testATSHA204(const int32_t *parameters, unsigned int num_parameters, TestResult *result)
 {
 	uint8_t buffer[32];
 	char sbuffer[256];
 
+	result->outcome = TEST_PASS;
+	result->num_values = 2;
 	writeStringToDisplay("ATSHA204:");
 	nextLine();
 	if (atsha204Wake() == 0)
 	{
 		writeStringToDisplay("Wake test: pass");
+		result->values[0] = 1;
 	}
 	else
 	{
 		writeStringToDisplay("Wake test: fail");
+		result->values[0] = 0;
+		result->outcome = TEST_FAIL;
 	}
 	nextLine();
 	if (atsha204Random(buffer) == 0)
 	{
+		result->values[1] = (int32_t)(((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16)
+			| ((uint32_t)buffer[2] << 8) | buffer[3]);
 		sprintf(sbuffer, "Random: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
 			 buffer[0], buffer[1], buffer[2], buffer[3],
 			 buffer[4], buffer[5], buffer[6], buffer[7],
@@ -547,6 +563,8 @@ void testATSHA204(void)
 	else
 	{
 		writeStringToDisplay("Random: error");
+		result->values[1] = 0;
+		result->outcome = TEST_FAIL;
 	}
 	atsha204Sleep();
 }
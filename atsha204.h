@@ -9,12 +9,13 @@
 #define	ATSHA204_H_INCLUDED
 
 #include <stdint.h>
+#include "test_result.h"
 
 extern void initATSHA204(void);
 extern int atsha204Wake(void);
 extern void atsha204Sleep(void);
 extern int atsha204Random(uint8_t *random_bytes);
-extern void testATSHA204(void);
+extern void testATSHA204(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
 
 #endif	// #ifndef ATSHA204_H_INCLUDED
 
@@ -0,0 +1,316 @@
+/** \file bulk_dump.c
+  *
+  * \brief Host tool which dumps the DUT's serial flash or ADC samples over
+  *        the Bulk stream.
+  *
+  * The dump is requested with a "dump" command on the test runner's command
+  * channel (see dumpCommand() in test_runner.c), which goes over the HID
+  * stream, but the data itself comes back on the Bulk stream (see
+  * usb_bulk_stream.c), which is far faster. So this needs both of the
+  * DUT's device nodes: the hidraw node for the command, and the usbfs node
+  * to claim the Bulk stream interface and read its Bulk IN endpoint. Build
+  * it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -o bulk_dump bulk_dump.c hid_stream_client.c
+  *
+  * Usage:
+  *
+  *     bulk_dump [-t TIMEOUT_MS] HIDRAW USBFS OUTPUT flash ADDRESS LENGTH
+  *     bulk_dump [-t TIMEOUT_MS] HIDRAW USBFS OUTPUT adc
+  *
+  * where HIDRAW is eg. /dev/hidraw3 and USBFS is eg. /dev/bus/usb/001/007
+  * (see lsusb). The raw data is written to OUTPUT; ADC samples are 16 bit
+  * little-endian. Then a line of the form
+  * "<bytes> bytes in <seconds> s (<rate> kB/s)" is printed. The time runs
+  * from sending the command to the last byte arriving, so it includes
+  * reading the serial flash (or filling the ADC buffer), not just the Bulk
+  * stream.
+  *
+  * The exit status is 0 if the whole dump arrived and 2 otherwise.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include "hid_stream_client.h"
+
+/** Channel which carries commands and responses (CHANNEL_COMMAND in
+  * stream_channels.h). */
+#define CHANNEL_COMMAND				0
+/** Most channel data bytes in one frame. */
+#define MAX_FRAME_DATA				61
+/** Longest line which the DUT sends, including '\n'. */
+#define MAX_LINE_LENGTH				256
+/** Interface number of the Bulk stream interface (see usb_bulk_stream.c). */
+#define INTERFACE_NUMBER			1
+/** Endpoint address of the Bulk stream's Bulk IN endpoint. */
+#define BULK_IN_ENDPOINT			0x83
+/** Size of each read from the Bulk IN endpoint, in bytes. This is a
+  * multiple of the maximum packet size, so that only the last read of a
+  * dump is a short one. */
+#define READ_SIZE					16384
+/** Timeout used when throwing away stale Bulk stream data, in
+  * milliseconds. */
+#define DRAIN_TIMEOUT				50
+/** Default time to wait for the response and for each read, in
+  * milliseconds. Dumping the ADC takes about 170 ms before anything is
+  * sent. */
+#define DEFAULT_TIMEOUT				5000
+
+/** Connection to the DUT's HID stream. */
+static HIDStreamClient client;
+/** Response and read timeout, in milliseconds. */
+static int timeout;
+
+/** Send a command line on the command channel. See sendCommand() in
+  * remote_test.c.
+  * \param line The null-terminated line, including its '\n'.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+static int sendCommand(const char *line)
+{
+	uint8_t frame[MAX_FRAME_DATA + 2];
+	size_t length;
+	size_t count;
+
+	length = strlen(line);
+	while (length > 0)
+	{
+		count = (length < MAX_FRAME_DATA) ? length : MAX_FRAME_DATA;
+		frame[0] = (uint8_t)(count + 1);
+		frame[1] = CHANNEL_COMMAND;
+		memcpy(&(frame[2]), line, count);
+		if (hidStreamClientWrite(&client, frame, count + 2, timeout) < 0)
+		{
+			return -1;
+		}
+		line += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/** Read the next line which the DUT sends on the command channel. Data on
+  * other channels is skipped. See readResponse() in remote_test.c.
+  * \param line The null-terminated line (including its '\n') will be
+  *             written here. This must have space for #MAX_LINE_LENGTH + 1
+  *             bytes.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+static int readResponse(char *line)
+{
+	uint8_t data[MAX_FRAME_DATA];
+	uint8_t header[2];
+	size_t data_length;
+	size_t i;
+	size_t length;
+
+	length = 0;
+	while (1)
+	{
+		if ((hidStreamClientRead(&client, header, 1, timeout) < 0)
+			|| ((header[0] > 0) && (hidStreamClientRead(&client, &(header[1]), 1, timeout) < 0)))
+		{
+			return -1;
+		}
+		data_length = (header[0] > 0) ? (header[0] - 1u) : 0;
+		if ((data_length > 0) && (hidStreamClientRead(&client, data, data_length, timeout) < 0))
+		{
+			return -1;
+		}
+		if ((header[0] == 0) || (header[1] != CHANNEL_COMMAND))
+		{
+			continue;
+		}
+		// The DUT doesn't send anything after the response until the next
+		// command, so a frame never holds the start of another line.
+		for (i = 0; i < data_length; i++)
+		{
+			line[length] = (char)data[i];
+			if ((line[length] == '\n') || (length == (MAX_LINE_LENGTH - 1)))
+			{
+				line[length + 1] = '\0';
+				return 0;
+			}
+			length++;
+		}
+	}
+}
+
+/** Read from the Bulk IN endpoint.
+  * \param fd File descriptor of the opened usbfs node.
+  * \param buffer The data will be written here.
+  * \param length The most bytes to read.
+  * \param read_timeout How long to wait, in milliseconds.
+  * \return The number of bytes read, or -1 on error (errno will be set,
+  *         to ETIMEDOUT if nothing arrived in time).
+  */
+static int bulkRead(int fd, uint8_t *buffer, unsigned int length, unsigned int read_timeout)
+{
+	struct usbdevfs_bulktransfer transfer;
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.ep = BULK_IN_ENDPOINT;
+	transfer.len = length;
+	transfer.timeout = read_timeout;
+	transfer.data = buffer;
+	return ioctl(fd, USBDEVFS_BULK, &transfer);
+}
+
+/** Get the current time, in seconds. */
+static double currentTime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/** Send a dump command and copy the data which comes back to a file.
+  * \param fd File descriptor of the opened usbfs node, with the Bulk stream
+  *           interface claimed.
+  * \param command The null-terminated command line, including its '\n'.
+  * \param file The data will be written here.
+  * \return 0 on success, 2 on error.
+  */
+static int dump(int fd, const char *command, FILE *file)
+{
+	static uint8_t buffer[READ_SIZE];
+	char response[MAX_LINE_LENGTH + 1];
+	unsigned long length;
+	unsigned long done;
+	double start_time;
+	double seconds;
+	int got;
+
+	// Throw away anything left in the Bulk stream by an earlier dump which
+	// was interrupted.
+	while (bulkRead(fd, buffer, sizeof(buffer), DRAIN_TIMEOUT) > 0)
+	{
+		// do nothing
+	}
+	start_time = currentTime();
+	if ((sendCommand(command) < 0) || (readResponse(response) < 0))
+	{
+		fprintf(stderr, "Couldn't send dump command: %s\n", strerror(errno));
+		return 2;
+	}
+	if (sscanf(response, "dump %lu", &length) != 1)
+	{
+		fprintf(stderr, "Unexpected response: %s", response);
+		return 2;
+	}
+	done = 0;
+	while (done < length)
+	{
+		got = bulkRead(fd, buffer, sizeof(buffer), (unsigned int)timeout);
+		if (got < 0)
+		{
+			fprintf(stderr, "Bulk read failed after %lu of %lu bytes: %s\n", done, length, strerror(errno));
+			return 2;
+		}
+		if (fwrite(buffer, 1, (size_t)got, file) != (size_t)got)
+		{
+			fprintf(stderr, "Couldn't write output file\n");
+			return 2;
+		}
+		done += (unsigned long)got;
+	}
+	seconds = currentTime() - start_time;
+	printf("%lu bytes in %.3f s (%.1f kB/s)\n", done, seconds, (double)done / seconds / 1024.0);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bulk_dump [-t TIMEOUT_MS] HIDRAW USBFS OUTPUT flash ADDRESS LENGTH\n");
+	fprintf(stderr, "       bulk_dump [-t TIMEOUT_MS] HIDRAW USBFS OUTPUT adc\n");
+}
+
+int main(int argc, char **argv)
+{
+	char command[MAX_LINE_LENGTH];
+	unsigned int interface_number;
+	FILE *file;
+	int fd;
+	int option;
+	int num_arguments;
+	int exit_status;
+
+	timeout = DEFAULT_TIMEOUT;
+	while ((option = getopt(argc, argv, "t:")) != -1)
+	{
+		if (option == 't')
+		{
+			timeout = atoi(optarg);
+		}
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	num_arguments = argc - optind;
+	if ((num_arguments == 6) && !strcmp(argv[optind + 3], "flash"))
+	{
+		snprintf(command, sizeof(command), "dump flash %s %s\n", argv[optind + 4], argv[optind + 5]);
+	}
+	else if ((num_arguments == 4) && !strcmp(argv[optind + 3], "adc"))
+	{
+		strcpy(command, "dump adc\n");
+	}
+	else
+	{
+		usage();
+		return 2;
+	}
+
+	if (hidStreamClientOpen(&client, argv[optind]) < 0)
+	{
+		fprintf(stderr, "Couldn't open %s: %s\n", argv[optind], strerror(errno));
+		return 2;
+	}
+	fd = open(argv[optind + 1], O_RDWR);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Couldn't open %s: %s\n", argv[optind + 1], strerror(errno));
+		hidStreamClientClose(&client);
+		return 2;
+	}
+	interface_number = INTERFACE_NUMBER;
+	if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface_number) < 0)
+	{
+		fprintf(stderr, "Couldn't claim the Bulk stream interface: %s\n", strerror(errno));
+		close(fd);
+		hidStreamClientClose(&client);
+		return 2;
+	}
+	file = fopen(argv[optind + 2], "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Couldn't create %s: %s\n", argv[optind + 2], strerror(errno));
+		exit_status = 2;
+	}
+	else
+	{
+		exit_status = dump(fd, command, file);
+		if (fclose(file) != 0)
+		{
+			fprintf(stderr, "Couldn't write %s\n", argv[optind + 2]);
+			exit_status = 2;
+		}
+	}
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface_number);
+	close(fd);
+	hidStreamClientClose(&client);
+	return exit_status;
+}
@@ -0,0 +1,473 @@
+/** \file capture_to_pcapng.c
+  *
+  * \brief Host tool which retrieves the DUT's captured USB transactions and
+  *        writes them to a pcapng file.
+  *
+  * The DUT's USB HAL can record a summary of every completed transaction
+  * (see usbSetCaptureEndpoints() in usb_hal.c). This tool enables that
+  * capture mode using a vendor-specific request on the Bulk stream
+  * interface, then repeatedly drains the records (see getCapture() in
+  * usb_bulk_stream.c) and writes them to a pcapng file which Wireshark can
+  * open. The file uses the Linux usbmon link type, so Wireshark decodes
+  * the packets as it would a capture taken on the host. This shows the
+  * device's view of the bus, including the core timer timestamps of each
+  * transaction. Build it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -o capture_to_pcapng capture_to_pcapng.c
+  *
+  * Usage:
+  *
+  *     capture_to_pcapng [-m ENDPOINT_MASK] [-t SECONDS] DEVICE OUTPUT
+  *
+  * DEVICE is the DUT's usbfs node, eg. /dev/bus/usb/001/007 (see lsusb).
+  * ENDPOINT_MASK selects which endpoints to capture (bit n = endpoint n).
+  * The default leaves out the control endpoint, since otherwise the
+  * requests which drain the records would be captured too. Capture runs
+  * for the specified number of seconds, or until interrupted with Ctrl-C.
+  *
+  * Only the first few bytes of each packet are captured, and each
+  * transaction is written as a separate usbmon event: SETUP transactions
+  * and OUT transactions as submissions, IN transactions as completions.
+  * The data toggle of each transaction has no usbmon equivalent, so it is
+  * left out.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/usbdevice_fs.h>
+
+/** Interface number of the Bulk stream interface (see usb_bulk_stream.c). */
+#define INTERFACE_NUMBER			1
+/** Vendor-specific request which enables or disables capture mode. */
+#define VENDOR_SET_CAPTURE			1
+/** Vendor-specific request which drains captured records. */
+#define VENDOR_GET_CAPTURE			2
+/** Number of data bytes in each captured record (USB_CAPTURE_DATA_SIZE in
+  * usb_hal.h). */
+#define CAPTURE_DATA_SIZE			8
+/** Size, in bytes, of each record sent by the DUT. */
+#define CAPTURE_RECORD_LENGTH		(12 + CAPTURE_DATA_SIZE)
+/** Most records which the DUT sends in response to one request. */
+#define MAX_CAPTURE_RECORDS			12
+/** Frequency, in Hz, of the DUT's core timer (CORE_TIMER_FREQUENCY in
+  * pic32_system.h). */
+#define CORE_TIMER_FREQUENCY		36000000
+/** Default endpoint mask: every endpoint except the control endpoint. */
+#define DEFAULT_ENDPOINT_MASK		0xfffe
+/** Time to wait between drain requests when the DUT has nothing to send,
+  * in microseconds. The DUT's capture ring holds 128 records, so this must
+  * be short enough that it doesn't fill up in between. */
+#define POLL_INTERVAL				2000
+/** Timeout for each control transfer, in milliseconds. */
+#define CONTROL_TIMEOUT				1000
+/** Token packet identifiers (see usb_defs.h). */
+#define PID_OUT						0x1
+#define PID_IN						0x9
+#define PID_SETUP					0xd
+/** pcapng link type for Linux usbmon packets with the 64 byte header
+  * (LINKTYPE_USB_LINUX_MMAPPED). */
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+/** Size, in bytes, of the usbmon header which precedes each packet. */
+#define USBMON_HEADER_LENGTH		64
+
+/** Transfer type of each endpoint, in usbmon format (0 = isochronous,
+  * 1 = interrupt, 2 = control, 3 = bulk). Indexed by endpoint number. */
+static uint8_t transfer_types[16];
+/** Bus number of the DUT. */
+static unsigned int bus_number;
+/** Device address of the DUT. */
+static unsigned int device_address;
+/** Set by the SIGINT handler to stop capturing. */
+static volatile sig_atomic_t stop_requested;
+
+/** SIGINT handler. */
+static void handleInterrupt(int signal_number)
+{
+	(void)signal_number;
+	stop_requested = 1;
+}
+
+/** Write a 16 bit value to a buffer, in little-endian format. */
+static void writeU16(uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = (uint8_t)value;
+	buffer[1] = (uint8_t)(value >> 8);
+}
+
+/** Write a 32 bit value to a buffer, in little-endian format. */
+static void writeU32(uint8_t *buffer, uint32_t value)
+{
+	writeU16(buffer, (uint16_t)value);
+	writeU16(&(buffer[2]), (uint16_t)(value >> 16));
+}
+
+/** Write a 64 bit value to a buffer, in little-endian format. */
+static void writeU64(uint8_t *buffer, uint64_t value)
+{
+	writeU32(buffer, (uint32_t)value);
+	writeU32(&(buffer[4]), (uint32_t)(value >> 32));
+}
+
+/** Read a 16 bit little-endian value from a buffer. */
+static uint16_t readU16(const uint8_t *buffer)
+{
+	return (uint16_t)(buffer[0] | (buffer[1] << 8));
+}
+
+/** Read a 32 bit little-endian value from a buffer. */
+static uint32_t readU32(const uint8_t *buffer)
+{
+	return readU16(buffer) | ((uint32_t)readU16(&(buffer[2])) << 16);
+}
+
+/** Write one pcapng block.
+  * \param file The file to write to.
+  * \param type Block type.
+  * \param body Block body (everything between the total length fields).
+  * \param length Size of body, in bytes. This is padded to a multiple of 4.
+  * \return 0 on success, -1 on error.
+  */
+static int writeBlock(FILE *file, uint32_t type, const uint8_t *body, size_t length)
+{
+	static const uint8_t padding[3];
+	uint8_t header[8];
+	uint8_t trailer[4];
+	size_t padded_length;
+
+	padded_length = (length + 3) & ~(size_t)3;
+	writeU32(header, type);
+	writeU32(&(header[4]), (uint32_t)(padded_length + 12));
+	writeU32(trailer, (uint32_t)(padded_length + 12));
+	if ((fwrite(header, sizeof(header), 1, file) != 1)
+		|| ((length > 0) && (fwrite(body, length, 1, file) != 1))
+		|| ((padded_length > length) && (fwrite(padding, padded_length - length, 1, file) != 1))
+		|| (fwrite(trailer, sizeof(trailer), 1, file) != 1))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/** Write the section header block and interface description block which
+  * begin every pcapng file.
+  * \return 0 on success, -1 on error.
+  */
+static int writeFileHeader(FILE *file)
+{
+	uint8_t shb[16];
+	uint8_t idb[8];
+
+	writeU32(shb, 0x1a2b3c4d); // byte-order magic
+	writeU16(&(shb[4]), 1); // major version
+	writeU16(&(shb[6]), 0); // minor version
+	writeU64(&(shb[8]), UINT64_MAX); // section length not specified
+	writeU16(idb, LINKTYPE_USB_LINUX_MMAPPED);
+	writeU16(&(idb[2]), 0); // reserved
+	writeU32(&(idb[4]), 0); // no snapshot length limit
+	if ((writeBlock(file, 0x0a0d0d0a, shb, sizeof(shb)) != 0)
+		|| (writeBlock(file, 0x00000001, idb, sizeof(idb)) != 0))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/** Write one captured record as an enhanced packet block.
+  * \param file The file to write to.
+  * \param record The record, in the format sent by the DUT.
+  * \param id usbmon URB ID to use.
+  * \param timestamp Time of the transaction, in microseconds since the Unix
+  *                  epoch.
+  * \return 0 on success, -1 on error.
+  */
+static int writeRecord(FILE *file, const uint8_t *record, uint64_t id, uint64_t timestamp)
+{
+	uint8_t epb[20 + USBMON_HEADER_LENGTH + CAPTURE_DATA_SIZE];
+	uint8_t *usbmon;
+	unsigned int endpoint;
+	unsigned int direction;
+	unsigned int pid;
+	uint32_t length;
+	uint32_t captured_length;
+
+	endpoint = record[4] & 15;
+	direction = record[5];
+	pid = record[6];
+	length = readU16(&(record[8]));
+	captured_length = readU16(&(record[10]));
+	if (captured_length > CAPTURE_DATA_SIZE)
+	{
+		captured_length = CAPTURE_DATA_SIZE;
+	}
+
+	memset(epb, 0, sizeof(epb));
+	usbmon = &(epb[20]);
+	writeU64(&(usbmon[0]), id);
+	// Data coming from the host is seen by usbmon when the URB is
+	// submitted; data going to the host when the URB completes.
+	usbmon[8] = (uint8_t)((direction == 0) ? 'S' : 'C');
+	usbmon[9] = transfer_types[endpoint];
+	usbmon[10] = (uint8_t)(endpoint | ((direction != 0) ? 0x80 : 0x00));
+	usbmon[11] = (uint8_t)device_address;
+	writeU16(&(usbmon[12]), (uint16_t)bus_number);
+	writeU64(&(usbmon[16]), timestamp / 1000000);
+	writeU32(&(usbmon[24]), (uint32_t)(timestamp % 1000000));
+	if (pid == PID_SETUP)
+	{
+		// The SETUP packet goes in the usbmon header, not in the data.
+		usbmon[14] = 0; // setup present
+		usbmon[15] = '<'; // no data
+		memcpy(&(usbmon[40]), &(record[12]), captured_length);
+		length = 0;
+		captured_length = 0;
+	}
+	else
+	{
+		usbmon[14] = '-'; // no setup
+		usbmon[15] = 0; // data present
+		memcpy(&(usbmon[USBMON_HEADER_LENGTH]), &(record[12]), captured_length);
+	}
+	writeU32(&(usbmon[32]), length);
+	writeU32(&(usbmon[36]), captured_length);
+
+	writeU32(&(epb[0]), 0); // interface ID
+	writeU32(&(epb[4]), (uint32_t)(timestamp >> 32));
+	writeU32(&(epb[8]), (uint32_t)timestamp);
+	writeU32(&(epb[12]), USBMON_HEADER_LENGTH + captured_length);
+	writeU32(&(epb[16]), USBMON_HEADER_LENGTH + length);
+	return writeBlock(file, 0x00000006, epb, 20 + USBMON_HEADER_LENGTH + captured_length);
+}
+
+/** Read the DUT's descriptors from its usbfs node, to find out the transfer
+  * type of each endpoint. Endpoints which aren't described are assumed to
+  * be control endpoints.
+  * \param fd File descriptor of the opened usbfs node.
+  */
+static void readTransferTypes(int fd)
+{
+	uint8_t descriptors[4096];
+	ssize_t length;
+	ssize_t i;
+
+	memset(transfer_types, 2, sizeof(transfer_types));
+	length = read(fd, descriptors, sizeof(descriptors));
+	i = 0;
+	while ((length > 0) && ((i + 1) < length) && (descriptors[i] >= 2))
+	{
+		// Endpoint descriptors have type 5 (see section 9.6.6 of the USB
+		// specification).
+		if ((descriptors[i + 1] == 5) && ((i + 3) < length))
+		{
+			// Attribute values are 0 = control, 1 = isochronous, 2 = bulk,
+			// 3 = interrupt, which need to be converted to usbmon values.
+			transfer_types[descriptors[i + 2] & 15] = (uint8_t)("\x02\x00\x03\x01"[descriptors[i + 3] & 3]);
+		}
+		i += descriptors[i];
+	}
+}
+
+/** Send a vendor-specific request to the Bulk stream interface.
+  * \return Number of bytes transferred in the Data stage, or -1 on error.
+  */
+static int vendorRequest(int fd, uint8_t request_type, uint8_t request, uint16_t value, uint8_t *data, uint16_t length)
+{
+	struct usbdevfs_ctrltransfer transfer;
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.bRequestType = request_type;
+	transfer.bRequest = request;
+	transfer.wValue = value;
+	transfer.wIndex = INTERFACE_NUMBER;
+	transfer.wLength = length;
+	transfer.timeout = CONTROL_TIMEOUT;
+	transfer.data = data;
+	return ioctl(fd, USBDEVFS_CONTROL, &transfer);
+}
+
+/** Get the current time, in microseconds since the Unix epoch. */
+static uint64_t currentTime(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((uint64_t)now.tv_sec * 1000000) + (uint64_t)now.tv_usec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: capture_to_pcapng [-m ENDPOINT_MASK] [-t SECONDS] DEVICE OUTPUT\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t response[4 + (MAX_CAPTURE_RECORDS * CAPTURE_RECORD_LENGTH)];
+	unsigned long endpoint_mask;
+	double duration;
+	FILE *file;
+	int fd;
+	int option;
+	int length;
+	int i;
+	int is_first_record;
+	int result;
+	uint32_t dropped;
+	uint32_t first_dropped;
+	uint32_t last_timestamp;
+	uint64_t ticks;
+	uint64_t start_time;
+	uint64_t end_time;
+	uint64_t id;
+	uint64_t num_records;
+	const uint8_t *record;
+
+	endpoint_mask = DEFAULT_ENDPOINT_MASK;
+	duration = 0.0;
+	while ((option = getopt(argc, argv, "m:t:")) != -1)
+	{
+		if (option == 'm')
+		{
+			endpoint_mask = strtoul(optarg, NULL, 0);
+		}
+		else if (option == 't')
+		{
+			duration = atof(optarg);
+		}
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	if ((argc - optind) != 2)
+	{
+		usage();
+		return 2;
+	}
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Couldn't open %s: %s\n", argv[optind], strerror(errno));
+		return 2;
+	}
+	if (sscanf(argv[optind], "/dev/bus/usb/%u/%u", &bus_number, &device_address) != 2)
+	{
+		bus_number = 0;
+		device_address = 0;
+	}
+	readTransferTypes(fd);
+	file = fopen(argv[optind + 1], "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Couldn't create %s: %s\n", argv[optind + 1], strerror(errno));
+		close(fd);
+		return 2;
+	}
+	if (writeFileHeader(file) != 0)
+	{
+		fprintf(stderr, "Couldn't write to %s\n", argv[optind + 1]);
+		fclose(file);
+		close(fd);
+		return 2;
+	}
+
+	// Throw away anything left over from a previous capture.
+	vendorRequest(fd, 0x41, VENDOR_SET_CAPTURE, 0, NULL, 0);
+	while (vendorRequest(fd, 0xc1, VENDOR_GET_CAPTURE, 0, response, sizeof(response)) > 4)
+	{
+		// do nothing
+	}
+	if (vendorRequest(fd, 0xc1, VENDOR_GET_CAPTURE, 0, response, sizeof(response)) < 4)
+	{
+		fprintf(stderr, "DUT doesn't support capture: %s\n", strerror(errno));
+		fclose(file);
+		close(fd);
+		return 2;
+	}
+	first_dropped = readU32(response);
+	dropped = first_dropped;
+	if (vendorRequest(fd, 0x41, VENDOR_SET_CAPTURE, (uint16_t)endpoint_mask, NULL, 0) < 0)
+	{
+		fprintf(stderr, "Couldn't enable capture: %s\n", strerror(errno));
+		fclose(file);
+		close(fd);
+		return 2;
+	}
+	signal(SIGINT, handleInterrupt);
+	fprintf(stderr, "Capturing; press Ctrl-C to stop\n");
+
+	// Core timer timestamps are converted into wall clock time by lining up
+	// the first record with the time it was received. The core timer wraps
+	// around every 2 ^ 32 / CORE_TIMER_FREQUENCY seconds, which is far
+	// longer than the time between polls.
+	start_time = currentTime();
+	end_time = start_time + (uint64_t)(duration * 1000000.0);
+	is_first_record = 1;
+	last_timestamp = 0;
+	ticks = 0;
+	id = 0;
+	num_records = 0;
+	result = 0;
+	while (!stop_requested && ((duration <= 0.0) || (currentTime() < end_time)))
+	{
+		length = vendorRequest(fd, 0xc1, VENDOR_GET_CAPTURE, 0, response, sizeof(response));
+		if (length < 4)
+		{
+			fprintf(stderr, "Couldn't get capture records: %s\n", strerror(errno));
+			result = 2;
+			break;
+		}
+		if (readU32(response) != dropped)
+		{
+			fprintf(stderr, "Warning: DUT dropped %u transactions\n", (unsigned int)(readU32(response) - dropped));
+			dropped = readU32(response);
+		}
+		for (i = 4; (i + CAPTURE_RECORD_LENGTH) <= length; i += CAPTURE_RECORD_LENGTH)
+		{
+			record = &(response[i]);
+			if (is_first_record)
+			{
+				start_time = currentTime();
+				is_first_record = 0;
+			}
+			else
+			{
+				ticks += (uint32_t)(readU32(record) - last_timestamp);
+			}
+			last_timestamp = readU32(record);
+			if (writeRecord(file, record, id++, start_time + ((ticks * 1000000) / CORE_TIMER_FREQUENCY)) != 0)
+			{
+				fprintf(stderr, "Couldn't write to %s\n", argv[optind + 1]);
+				stop_requested = 1;
+				result = 2;
+				break;
+			}
+			num_records++;
+		}
+		if (length < (int)sizeof(response))
+		{
+			// Ring is empty (or nearly so), so give it time to fill up.
+			usleep(POLL_INTERVAL);
+		}
+	}
+
+	vendorRequest(fd, 0x41, VENDOR_SET_CAPTURE, 0, NULL, 0);
+	if (fclose(file) != 0)
+	{
+		result = 2;
+	}
+	close(fd);
+	fprintf(stderr, "Captured %llu transactions (%u dropped)\n", (unsigned long long)num_records, (unsigned int)(dropped - first_dropped));
+	return result;
+}
@@ -0,0 +1,336 @@
+/** \file hid_stream_bench.c
+  *
+  * \brief Byte-at-a-time benchmark of the HID stream, on the simulated USB
+  *        module.
+  *
+  * Most of the firmware talks to the HID stream one byte at a time, through
+  * streamPutOneByte() and streamGetOneByte(), so this is the case which
+  * matters most. This links usb_hid_stream.c with the simulated USB module
+  * in usb_hal_sim.c and the scripted host in usb_sim_host.c, enumerates the
+  * device, and then:
+  * - transmits N megabytes with streamPutOneByte(), which the host reads
+  *   from the Interrupt IN endpoint;
+  * - receives N megabytes with streamGetOneByte(), which the host sends as
+  *   full reports to the Interrupt OUT endpoint.
+  * The data is checked at the other end. For each direction, the
+  * statistics from streamGetStatistics() and usbGetInterruptStatistics()
+  * are turned into per-kilobyte figures and printed as one JSON object:
+  * - "bytes_per_second": throughput in simulated bus time, i.e. what a
+  *   full speed bus allows if the PIC32 took no time to run the stream code;
+  * - "host_seconds": wall clock time the simulation took, which is a rough
+  *   relative measure of how much work the stream code does per byte;
+  * - "callbacks_per_kb" and "critical_sections_per_kb": see
+  *   #HIDStreamStatistics;
+  * - "interrupts_per_kb" and "average_interrupt_batch": see
+  *   #USBInterruptStatistics;
+  * - "reports" and "average_report_fill": number of reports and average
+  *   number of data bytes per report (out of 63).
+  *
+  * Build and run it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -Wno-attributes -I.. -o hid_stream_bench hid_stream_bench.c usb_sim_host.c usb_hal_sim.c ../usb_standard_requests.c ../usb_composite.c ../usb_hid_stream.c ../usb_bulk_stream.c ../usb_adc_stream.c ../serial_fifo.c ../scheduler.c
+  *     ./hid_stream_bench [-c THRESHOLD,LATENCY] [MEGABYTES]
+  *
+  * MEGABYTES defaults to 1. -c sets the transmit coalescing policy (see
+  * streamSetTransmitCoalescing()) before the transmit half; eg. -c 63,2
+  * waits up to 2 frames for a full report. The transmit half writes as fast
+  * as it can, so it shows coalescing under load (which is when reports are
+  * full even without it). The exit status is 0 if the data arrived intact
+  * both ways, 1 if it didn't, and 2 if the arguments were bad.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "pic32_system.h"
+#include "usb_hal.h"
+#include "usb_defs.h"
+#include "usb_standard_requests.h"
+#include "usb_hid_stream.h"
+#include "usb_bulk_stream.h"
+#include "usb_adc_stream.h"
+#include "scheduler.h"
+#include "usb_hal_sim.h"
+#include "usb_sim_host.h"
+
+/** Largest MEGABYTES argument, so that #test_bytes doesn't overflow. */
+#define MAX_MEGABYTES				4095
+
+/** Number of bytes pushed each way. */
+static uint32_t test_bytes;
+/** Number of bytes the host has sent or received so far. */
+static uint32_t host_position;
+/** Number of bytes which arrived wrong. */
+static uint32_t num_mismatched;
+
+/** Get the byte which should be at some position in the stream. See
+  * expectedByte() in serial_fifo_stress.c.
+  * \param position Position in the stream.
+  * \return The byte at that position.
+  */
+static uint8_t expectedByte(uint32_t position)
+{
+	position *= 2654435761u;
+	position ^= position >> 15;
+	return (uint8_t)(position >> 8);
+}
+
+/** Check one byte which arrived at either end of the stream.
+  * \param one_byte The byte.
+  * \param position Its position in the stream.
+  */
+static void checkByte(uint8_t one_byte, uint32_t position)
+{
+	if (one_byte != expectedByte(position))
+	{
+		if (num_mismatched == 0)
+		{
+			fprintf(stderr, "Byte %u is 0x%02x, expected 0x%02x\n", position, one_byte, expectedByte(position));
+		}
+		num_mismatched++;
+	}
+}
+
+/** Received callback for the Interrupt IN pipe. */
+static void reportReceived(SimPipe *pipe, const uint8_t *packet, uint32_t length)
+{
+	uint32_t i;
+
+	if ((length < 1) || (packet[0] != (length - 1)))
+	{
+		fprintf(stderr, "Bad report: %u bytes with report ID %u\n", length, packet[0]);
+		num_mismatched++;
+		return;
+	}
+	for (i = 1; i < length; i++)
+	{
+		checkByte(packet[i], host_position);
+		host_position++;
+	}
+}
+
+/** Transmit callback for the Interrupt OUT pipe. This always sends full
+  * reports, so that the receive figures only depend on the device. */
+static int reportTransmit(SimPipe *pipe, uint8_t *packet)
+{
+	uint32_t count;
+	uint32_t i;
+
+	if (host_position >= test_bytes)
+	{
+		return -1;
+	}
+	count = MIN(test_bytes - host_position, MAX_PACKET_SIZE - 1);
+	packet[0] = (uint8_t)count;
+	for (i = 0; i < count; i++)
+	{
+		packet[1 + i] = expectedByte(host_position + i);
+	}
+	host_position += count;
+	return (int)(count + 1);
+}
+
+/** Get the wall clock time.
+  * \return The time, in seconds.
+  */
+static double wallClock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/** Clear all the statistics which runDirection() reports. */
+static void clearStatistics(void)
+{
+	streamClearStatistics();
+	usbClearInterruptStatistics();
+}
+
+/** Push #test_bytes through the stream in one direction, one byte at a
+  * time, and print the results as a JSON object.
+  * \param name Name of the direction: "transmit" or "receive".
+  * \param pipe The host's pipe.
+  * \param is_transmit Non-zero to use streamPutOneByte(), zero to use
+  *                    streamGetOneByte().
+  * \param is_last Non-zero if this is the last object to print.
+  * \return 0 if the data arrived intact, 1 if not.
+  */
+static int runDirection(const char *name, SimPipe *pipe, int is_transmit, int is_last)
+{
+	HIDStreamStatistics statistics;
+	USBInterruptStatistics interrupt_statistics;
+	uint64_t start_time;
+	double start_wall_clock;
+	double seconds;
+	double kilobytes;
+	uint32_t reports;
+	uint32_t report_bytes;
+	uint32_t i;
+
+	host_position = 0;
+	num_mismatched = 0;
+	simAddPipe(pipe);
+	clearStatistics();
+	start_time = simGetBusTime();
+	start_wall_clock = wallClock();
+	for (i = 0; i < test_bytes; i++)
+	{
+		if (is_transmit)
+		{
+			streamPutOneByte(expectedByte(i));
+		}
+		else
+		{
+			checkByte(streamGetOneByte(), i);
+		}
+	}
+	while (host_position < test_bytes)
+	{
+		simRunHost();
+	}
+	seconds = (double)(simGetBusTime() - start_time) / CORE_TIMER_FREQUENCY;
+	simRemovePipe(pipe);
+	streamGetStatistics(&statistics);
+	usbGetInterruptStatistics(&interrupt_statistics);
+	if (is_transmit)
+	{
+		reports = statistics.reports_transmitted;
+		report_bytes = statistics.bytes_transmitted;
+	}
+	else
+	{
+		reports = statistics.reports_received;
+		report_bytes = statistics.bytes_received;
+	}
+	kilobytes = (double)test_bytes / 1024.0;
+	printf("  \"%s\": {\"bytes\": %u, \"bytes_per_second\": %.0f, \"host_seconds\": %.3f, \"callbacks_per_kb\": %.2f, \"critical_sections_per_kb\": %.2f, \"interrupts_per_kb\": %.2f, \"average_interrupt_batch\": %.3f, \"reports\": %u, \"average_report_fill\": %.2f, \"errors\": %u}%s\n", name, test_bytes, (double)test_bytes / seconds, wallClock() - start_wall_clock, statistics.callbacks / kilobytes, statistics.critical_sections / kilobytes, interrupt_statistics.interrupts / kilobytes, (interrupt_statistics.interrupts == 0)? 0.0 : (double)interrupt_statistics.events / interrupt_statistics.interrupts, reports, (reports == 0)? 0.0 : (double)report_bytes / reports, num_mismatched, is_last? "" : ",");
+	if (num_mismatched != 0)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: hid_stream_bench [-c THRESHOLD,LATENCY] [MEGABYTES]\n");
+	fprintf(stderr, "MEGABYTES must be from 1 to %u.\n", MAX_MEGABYTES);
+}
+
+/** Parse an unsigned decimal number from the start of a string.
+  * \param string The string.
+  * \param terminator The character which must follow the number.
+  * \param end Will be set to point to that character.
+  * \param value The number will be written here.
+  * \return 0 on success, -1 if there was no number, it was followed by
+  *         something other than terminator, or it was too big.
+  */
+static int parseNumber(const char *string, char terminator, const char **end, unsigned int *value)
+{
+	unsigned long number;
+	char *number_end;
+
+	if ((string[0] < '0') || (string[0] > '9'))
+	{
+		return -1;
+	}
+	errno = 0;
+	number = strtoul(string, &number_end, 10);
+	if ((errno != 0) || (number > UINT32_MAX) || (*number_end != terminator))
+	{
+		return -1;
+	}
+	*end = number_end;
+	*value = (unsigned int)number;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	SimEnumeration enumeration;
+	SimPipe interrupt_in;
+	SimPipe interrupt_out;
+	unsigned int threshold;
+	unsigned int max_latency;
+	unsigned int megabytes;
+	const char *end;
+	int set_coalescing;
+	int option;
+	int failed;
+
+	megabytes = 1;
+	set_coalescing = 0;
+	threshold = 1;
+	max_latency = 0;
+	while ((option = getopt(argc, argv, "c:")) != -1)
+	{
+		if ((option == 'c')
+			&& (parseNumber(optarg, ',', &end, &threshold) == 0)
+			&& (parseNumber(end + 1, '\0', &end, &max_latency) == 0))
+		{
+			set_coalescing = 1;
+		}
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	if (optind < argc)
+	{
+		if (((argc - optind) != 1)
+			|| (parseNumber(argv[optind], '\0', &end, &megabytes) != 0)
+			|| (megabytes < 1) || (megabytes > MAX_MEGABYTES))
+		{
+			usage();
+			return 2;
+		}
+	}
+	test_bytes = megabytes * 1024 * 1024;
+
+	// Same order as main() in main.c.
+	usbInit();
+	usbHIDStreamInit();
+	usbBulkStreamInit();
+	usbADCStreamInit();
+	usbDisconnect();
+	usbSetupControlEndpoint();
+	initScheduler();
+	restoreInterrupts(1);
+	usbConnect();
+	simSetIdleHook(&simRunHost);
+	if (!simEnumerate(&enumeration))
+	{
+		fprintf(stderr, "Enumeration failed\n");
+		return 1;
+	}
+	if (set_coalescing)
+	{
+		streamSetTransmitCoalescing(threshold, max_latency);
+	}
+
+	memset(&interrupt_in, 0, sizeof(interrupt_in));
+	interrupt_in.endpoint_address = 0x81;
+	interrupt_in.type = SIM_PIPE_INTERRUPT;
+	interrupt_in.received = &reportReceived;
+	memset(&interrupt_out, 0, sizeof(interrupt_out));
+	interrupt_out.endpoint_address = 0x02;
+	interrupt_out.type = SIM_PIPE_INTERRUPT;
+	interrupt_out.transmit = &reportTransmit;
+
+	printf("{\n");
+	printf("  \"coalescing\": {\"threshold\": %u, \"max_latency\": %u},\n", threshold, max_latency);
+	failed = 0;
+	failed |= runDirection("transmit", &interrupt_in, 1, 0);
+	failed |= runDirection("receive", &interrupt_out, 0, 1);
+	printf("}\n");
+	return failed;
+}
@@ -0,0 +1,467 @@
+/** \file hid_stream_client.c
+  *
+  * \brief Linux host-side client for the device's HID stream.
+  *
+  * This file implements the host side of the HID stream described at the
+  * top of usb_hid_stream.c: a byte stream which is broken up into HID
+  * reports, where the report ID is the number of data bytes in the report
+  * (1 to 63). It talks to the device through the Linux hidraw driver, so no
+  * special driver or library is needed. This is meant to be built on the
+  * host, not for the device. For example:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -c hid_stream_client.c
+  *
+  * and then linked into a host program which includes hid_stream_client.h.
+  *
+  * The API is buffer-oriented: hidStreamClientRead() and
+  * hidStreamClientWrite() transfer whole buffers, and never do a system
+  * call per byte. Each hidraw read() or write() transfers exactly one
+  * report, so the best that can be done is:
+  * - When writing, every report except the last one of a buffer is full
+  *   (63 data bytes).
+  * - When reading, the hidraw device is non-blocking and is drained of all
+  *   available reports every time epoll says it's readable, so many
+  *   reports can be read per wakeup. Data bytes of a report which don't fit
+  *   in the caller's buffer are kept for the next read.
+  *
+  * Writes to a hidraw device are synchronous in the kernel (each write()
+  * returns once the report has been sent), so only reads are driven by
+  * epoll. If credit-based flow control is enabled (see
+  * hidStreamClientEnableCredit()), reports are only written when the device
+  * has room for them, so those writes never wait on NAKs.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include "hid_stream_client.h"
+
+/** Maximum number of data bytes in one report. */
+#define MAX_REPORT_DATA				(HID_STREAM_MAX_REPORT_SIZE - 1)
+/** Report ID of the device's credit feature report (see getCreditReport()
+  * in usb_hid_stream.c). */
+#define CREDIT_REPORT_ID			64
+/** Size of the credit feature report, in bytes, including the report ID. */
+#define CREDIT_REPORT_SIZE			9
+/** Report ID of the device's timestamp feature report (see
+  * getTimestampReport() in usb_hid_stream.c). */
+#define TIMESTAMP_REPORT_ID			65
+/** Size of the timestamp feature report, in bytes, including the report
+  * ID. */
+#define TIMESTAMP_REPORT_SIZE		5
+/** How long, in milliseconds, to wait before asking the device for more
+  * credit again. This is about how long the device takes to receive one
+  * report. */
+#define CREDIT_POLL_INTERVAL		1
+
+/** Returns the smaller of two values. */
+#define MIN(a, b)			(((a) < (b))? (a) : (b))
+
+/** Read a 32 bit little-endian integer from a buffer.
+  * \param buffer The buffer to read from.
+  * \return The integer.
+  */
+static uint32_t readU32LittleEndian(const uint8_t *buffer)
+{
+	return ((uint32_t)buffer[0])
+		| ((uint32_t)buffer[1] << 8)
+		| ((uint32_t)buffer[2] << 16)
+		| ((uint32_t)buffer[3] << 24);
+}
+
+/** Get the current time, for use with remainingTime().
+  * \return Current time in milliseconds, from an arbitrary starting point.
+  */
+static int64_t currentTime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((int64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/** Calculate how much time is left before a deadline.
+  * \param deadline The deadline, in the units of currentTime(), or -1 for
+  *                 no deadline.
+  * \return Number of milliseconds left (0 if the deadline has passed), or
+  *         -1 if there is no deadline.
+  */
+static int remainingTime(int64_t deadline)
+{
+	int64_t now;
+
+	if (deadline < 0)
+	{
+		return -1;
+	}
+	now = currentTime();
+	if (now >= deadline)
+	{
+		return 0;
+	}
+	return (int)(deadline - now);
+}
+
+/** Ask the device for its current credit limit.
+  * \param client The client.
+  * \param bytes_received If this is not NULL, the device's count of bytes
+  *                       received will be written here.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+static int getCredit(HIDStreamClient *client, uint32_t *bytes_received)
+{
+	uint8_t report[CREDIT_REPORT_SIZE];
+	int r;
+
+	memset(report, 0, sizeof(report));
+	report[0] = CREDIT_REPORT_ID;
+	r = ioctl(client->fd, HIDIOCGFEATURE(sizeof(report)), report);
+	if (r < 0)
+	{
+		return -1;
+	}
+	if ((r < CREDIT_REPORT_SIZE) || (report[0] != CREDIT_REPORT_ID))
+	{
+		errno = EPROTO;
+		return -1;
+	}
+	if (bytes_received != NULL)
+	{
+		*bytes_received = readU32LittleEndian(&(report[1]));
+	}
+	client->credit_limit = readU32LittleEndian(&(report[5]));
+	return 0;
+}
+
+/** Work out how many data bytes the device will currently accept in one
+  * report, according to the most recent credit limit.
+  * \param client The client.
+  * \return The number of data bytes (0 to #MAX_REPORT_DATA).
+  */
+static uint32_t creditAvailable(HIDStreamClient *client)
+{
+	int32_t available;
+
+	// The counters are free-running, so the difference has to be
+	// interpreted as a signed number.
+	available = (int32_t)(client->credit_limit - client->bytes_sent);
+	if (available <= 1)
+	{
+		return 0; // no room for even the report ID and one data byte
+	}
+	return MIN((uint32_t)(available - 1), MAX_REPORT_DATA);
+}
+
+/** Open a connection to a device's HID stream.
+  * \param client The client state to initialise.
+  * \param path Path to the hidraw device node of the device's HID interface
+  *             (for example, "/dev/hidraw0").
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+int hidStreamClientOpen(HIDStreamClient *client, const char *path)
+{
+	struct epoll_event event;
+	int saved_errno;
+
+	memset(client, 0, sizeof(*client));
+	client->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (client->fd < 0)
+	{
+		return -1;
+	}
+	client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (client->epoll_fd < 0)
+	{
+		saved_errno = errno;
+		close(client->fd);
+		errno = saved_errno;
+		return -1;
+	}
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = client->fd;
+	if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->fd, &event) < 0)
+	{
+		saved_errno = errno;
+		close(client->epoll_fd);
+		close(client->fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+/** Close a connection opened by hidStreamClientOpen().
+  * \param client The client to close.
+  */
+void hidStreamClientClose(HIDStreamClient *client)
+{
+	close(client->epoll_fd);
+	close(client->fd);
+	client->epoll_fd = -1;
+	client->fd = -1;
+}
+
+/** Start using credit-based flow control. From now on, reports will only be
+  * written when the device has advertised enough space for them, so the
+  * device never has to NAK them.
+  * \param client The client.
+  * \return 0 on success, -1 on error (errno will be set). An error probably
+  *         means that the device firmware doesn't support credit.
+  * \warning This must be called while no written reports are still on their
+  *          way to the device, for example just after opening it.
+  */
+int hidStreamClientEnableCredit(HIDStreamClient *client)
+{
+	uint32_t bytes_received;
+
+	if (getCredit(client, &bytes_received) < 0)
+	{
+		return -1;
+	}
+	client->bytes_sent = bytes_received;
+	client->use_credit = 1;
+	return 0;
+}
+
+/** Read bytes from the HID stream, without blocking. This reads as many
+  * bytes as are currently available, up to the specified length.
+  * \param client The client.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The maximum number of bytes to read.
+  * \return The number of bytes actually read (which may be 0), or -1 on
+  *         error (errno will be set). If the device sends a report whose
+  *         length doesn't match its report ID, errno will be EPROTO.
+  */
+ssize_t hidStreamClientReadNonBlocking(HIDStreamClient *client, uint8_t *buffer, size_t length)
+{
+	size_t done;
+	size_t count;
+	ssize_t r;
+
+	done = 0;
+	while (done < length)
+	{
+		if (client->receive_offset < client->receive_length)
+		{
+			// Use up the rest of the previous report first.
+			count = MIN(client->receive_length - client->receive_offset, length - done);
+			memcpy(&(buffer[done]), &(client->receive_report[client->receive_offset]), count);
+			client->receive_offset += count;
+			done += count;
+			continue;
+		}
+		r = read(client->fd, client->receive_report, sizeof(client->receive_report));
+		if (r < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				break; // no more reports for now
+			}
+			return (done > 0) ? (ssize_t)done : -1;
+		}
+		if ((r < 1) || (client->receive_report[0] > MAX_REPORT_DATA)
+			|| (client->receive_report[0] != (r - 1)))
+		{
+			// Report ID must be equal to the number of data bytes.
+			client->receive_length = 0;
+			client->receive_offset = 0;
+			errno = EPROTO;
+			return (done > 0) ? (ssize_t)done : -1;
+		}
+		client->receive_length = (unsigned int)r;
+		client->receive_offset = 1; // skip report ID
+	}
+	return (ssize_t)done;
+}
+
+/** Read bytes from the HID stream. This will block until exactly length
+  * bytes have been read, or until the timeout expires.
+  * \param client The client.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The number of bytes to read.
+  * \param timeout_ms Timeout in milliseconds, or -1 to wait forever.
+  * \return 0 on success, -1 on error or timeout (errno will be set; it will
+  *         be ETIMEDOUT on timeout). Bytes which were read before an error
+  *         or timeout are lost.
+  */
+int hidStreamClientRead(HIDStreamClient *client, uint8_t *buffer, size_t length, int timeout_ms)
+{
+	struct epoll_event event;
+	int64_t deadline;
+	size_t done;
+	ssize_t r;
+	int timeout;
+
+	deadline = (timeout_ms < 0) ? -1 : (currentTime() + timeout_ms);
+	done = 0;
+	while (1)
+	{
+		r = hidStreamClientReadNonBlocking(client, &(buffer[done]), length - done);
+		if (r < 0)
+		{
+			return -1;
+		}
+		done += (size_t)r;
+		if (done >= length)
+		{
+			return 0;
+		}
+		timeout = remainingTime(deadline);
+		if (timeout == 0)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if ((epoll_wait(client->epoll_fd, &event, 1, timeout) < 0) && (errno != EINTR))
+		{
+			return -1;
+		}
+	}
+}
+
+/** Write bytes to the HID stream, without waiting for credit. This writes
+  * as many bytes as the device will accept, up to the specified length.
+  * Bytes are packed into as few reports as possible.
+  * \param client The client.
+  * \param buffer The bytes to write.
+  * \param length The maximum number of bytes to write.
+  * \return The number of bytes actually written (which may be 0 if credit
+  *         has run out), or -1 on error (errno will be set).
+  */
+ssize_t hidStreamClientWriteNonBlocking(HIDStreamClient *client, const uint8_t *buffer, size_t length)
+{
+	uint8_t report[HID_STREAM_MAX_REPORT_SIZE];
+	size_t done;
+	uint32_t count;
+	ssize_t r;
+
+	done = 0;
+	while (done < length)
+	{
+		count = (uint32_t)MIN(length - done, MAX_REPORT_DATA);
+		if (client->use_credit)
+		{
+			if (creditAvailable(client) < count)
+			{
+				// Only ask the device for more credit when it's needed,
+				// since each request is a control transfer.
+				if (getCredit(client, NULL) < 0)
+				{
+					return (done > 0) ? (ssize_t)done : -1;
+				}
+			}
+			count = MIN(count, creditAvailable(client));
+			if (count == 0)
+			{
+				break; // out of credit
+			}
+		}
+		report[0] = (uint8_t)count;
+		memcpy(&(report[1]), &(buffer[done]), count);
+		r = write(client->fd, report, count + 1);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				break;
+			}
+			return (done > 0) ? (ssize_t)done : -1;
+		}
+		client->bytes_sent += count + 1;
+		done += count;
+	}
+	return (ssize_t)done;
+}
+
+/** Write bytes to the HID stream. This will block until all length bytes
+  * have been written, or until the timeout expires.
+  * \param client The client.
+  * \param buffer The bytes to write.
+  * \param length The number of bytes to write.
+  * \param timeout_ms Timeout in milliseconds, or -1 to wait forever.
+  * \return 0 on success, -1 on error or timeout (errno will be set; it will
+  *         be ETIMEDOUT on timeout).
+  */
+int hidStreamClientWrite(HIDStreamClient *client, const uint8_t *buffer, size_t length, int timeout_ms)
+{
+	struct timespec interval;
+	int64_t deadline;
+	size_t done;
+	ssize_t r;
+
+	deadline = (timeout_ms < 0) ? -1 : (currentTime() + timeout_ms);
+	interval.tv_sec = 0;
+	interval.tv_nsec = CREDIT_POLL_INTERVAL * 1000000L;
+	done = 0;
+	while (1)
+	{
+		r = hidStreamClientWriteNonBlocking(client, &(buffer[done]), length - done);
+		if (r < 0)
+		{
+			return -1;
+		}
+		done += (size_t)r;
+		if (done >= length)
+		{
+			return 0;
+		}
+		if (remainingTime(deadline) == 0)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		// The device doesn't say when it has more credit, so wait a bit
+		// before asking again.
+		nanosleep(&interval, NULL);
+	}
+}
+
+/** Get the current value of the device's core timer, using the timestamp
+  * feature report. This goes through the control endpoint, so it works no
+  * matter what is happening on the HID stream. The round trip takes at
+  * least a couple of USB frames.
+  * \param client The client.
+  * \param timestamp The device's core timer value will be written here. The
+  *                  core timer counts at half the device's CPU clock
+  *                  frequency.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+int hidStreamClientGetDeviceTime(HIDStreamClient *client, uint32_t *timestamp)
+{
+	uint8_t report[TIMESTAMP_REPORT_SIZE];
+	int r;
+
+	memset(report, 0, sizeof(report));
+	report[0] = TIMESTAMP_REPORT_ID;
+	r = ioctl(client->fd, HIDIOCGFEATURE(sizeof(report)), report);
+	if (r < 0)
+	{
+		return -1;
+	}
+	if ((r < TIMESTAMP_REPORT_SIZE) || (report[0] != TIMESTAMP_REPORT_ID))
+	{
+		errno = EPROTO;
+		return -1;
+	}
+	*timestamp = readU32LittleEndian(&(report[1]));
+	return 0;
+}
@@ -0,0 +1,53 @@
+/** \file hid_stream_client.h
+  *
+  * \brief Describes types and functions exported by hid_stream_client.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef HID_STREAM_CLIENT_H
+#define	HID_STREAM_CLIENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Largest report (including report ID) which the device sends or accepts
+  * on its Interrupt endpoints. */
+#define HID_STREAM_MAX_REPORT_SIZE	64
+
+/** State of one connection to a device's HID stream. All fields are private
+  * to hid_stream_client.c. */
+typedef struct HIDStreamClientStruct
+{
+	/** File descriptor of the opened hidraw device. */
+	int fd;
+	/** epoll instance which waits on #fd. */
+	int epoll_fd;
+	/** Most recently read report, of which some data bytes haven't been
+	  * returned to the caller yet. */
+	uint8_t receive_report[HID_STREAM_MAX_REPORT_SIZE];
+	/** Index into #receive_report of the next data byte to return. */
+	unsigned int receive_offset;
+	/** Number of valid bytes (including report ID) in #receive_report. */
+	unsigned int receive_length;
+	/** Non-zero if credit-based flow control is in use (see
+	  * hidStreamClientEnableCredit()). */
+	int use_credit;
+	/** Free-running count of report bytes (including report IDs) sent on
+	  * the Interrupt OUT endpoint. Only used when #use_credit is set. */
+	uint32_t bytes_sent;
+	/** Most recent credit limit obtained from the device. Only used when
+	  * #use_credit is set. */
+	uint32_t credit_limit;
+} HIDStreamClient;
+
+extern int hidStreamClientOpen(HIDStreamClient *client, const char *path);
+extern void hidStreamClientClose(HIDStreamClient *client);
+extern int hidStreamClientEnableCredit(HIDStreamClient *client);
+extern ssize_t hidStreamClientReadNonBlocking(HIDStreamClient *client, uint8_t *buffer, size_t length);
+extern int hidStreamClientRead(HIDStreamClient *client, uint8_t *buffer, size_t length, int timeout_ms);
+extern ssize_t hidStreamClientWriteNonBlocking(HIDStreamClient *client, const uint8_t *buffer, size_t length);
+extern int hidStreamClientWrite(HIDStreamClient *client, const uint8_t *buffer, size_t length, int timeout_ms);
+extern int hidStreamClientGetDeviceTime(HIDStreamClient *client, uint32_t *timestamp);
+
+#endif	// #ifndef HID_STREAM_CLIENT_H
@@ -0,0 +1,443 @@
+/** \file loopback_test.c
+  *
+  * \brief Host tool which qualifies the USB link of DUTs in loopback mode.
+  *
+  * The DUT must be in loopback mode (hold down the cancel button while
+  * powering it up; see loopback.c), so that it echoes everything it
+  * receives on the HID stream. For each DUT, this tool measures:
+  * - Ping latency: the round-trip time of the timestamp feature report,
+  *   which goes through the control endpoint. The device's core timer
+  *   values are also compared with the host's clock, to check the DUT's
+  *   crystal.
+  * - Echo latency: the time taken for a single byte to go through the HID
+  *   stream and come back.
+  * - Throughput and data integrity: a pseudo-random pattern is streamed
+  *   through the DUT, and every echoed byte is checked.
+  *
+  * Latencies are reported as percentiles, in microseconds. Build it on the
+  * host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -o loopback_test loopback_test.c hid_stream_client.c
+  *
+  * Usage:
+  *
+  *     loopback_test [-n SAMPLES] [-s BYTES] [-b MIN_BYTES_PER_SECOND] [-t TIMEOUT_MS] DEVICE...
+  *
+  * where each DEVICE is the hidraw device node of a DUT (eg. /dev/hidraw3).
+  * DUTs are tested one at a time, so that they don't compete for bus
+  * bandwidth. A DUT passes if every echoed byte was correct and its
+  * throughput was at least MIN_BYTES_PER_SECOND (default 0).
+  *
+  * The exit status is 0 if every DUT passed, 1 if any DUT failed and 2 if
+  * the tool itself couldn't run.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include "hid_stream_client.h"
+
+/** Frequency, in Hz, of the DUT's core timer (CORE_TIMER_FREQUENCY in
+  * pic32_system.h). */
+#define CORE_TIMER_FREQUENCY		36000000
+/** Default number of ping and echo latency samples. */
+#define DEFAULT_SAMPLES				200
+/** Default number of bytes to stream through each DUT. */
+#define DEFAULT_STREAM_LENGTH		65536
+/** Default timeout for each phase of the test, in milliseconds. */
+#define DEFAULT_TIMEOUT				10000
+/** Most bytes which are allowed to be on their way to or from the DUT
+  * during the throughput test. This is less than the DUT's receive FIFO,
+  * so that the DUT never has to NAK reports because its echoes are
+  * backed up. */
+#define STREAM_WINDOW				384
+
+/** Returns the smaller of two values. */
+#define MIN(a, b)			(((a) < (b))? (a) : (b))
+
+/** Results of testing one DUT. */
+typedef struct ResultsStruct
+{
+	/** Ping latency percentiles (50th, 90th, 99th and 100th), in
+	  * microseconds. */
+	double ping_latency[4];
+	/** Echo latency percentiles (50th, 90th, 99th and 100th), in
+	  * microseconds. */
+	double echo_latency[4];
+	/** How far the DUT's core timer is from where it should be, in parts
+	  * per million. Positive means the DUT's clock is fast. */
+	double clock_error;
+	/** Sustained throughput of the echo, in bytes per second (counting
+	  * each byte once, even though it crosses the bus twice). */
+	double throughput;
+	/** Number of echoed bytes which didn't match what was sent. */
+	size_t corrupt_bytes;
+	/** Number of bytes which weren't echoed before the timeout. */
+	size_t missing_bytes;
+} Results;
+
+/** Percentiles which are reported. */
+static const double percentiles[4] = {50.0, 90.0, 99.0, 100.0};
+
+/** Get the current time.
+  * \return Current time in microseconds, from an arbitrary starting point.
+  */
+static int64_t currentTime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/** Comparison function for qsort(), for sorting latencies. */
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/** Work out percentiles of a set of samples, using the nearest-rank method.
+  * \param samples The samples. These will be sorted.
+  * \param count Number of samples (must be at least 1).
+  * \param out The values of each entry of #percentiles will be written
+  *            here.
+  */
+static void computePercentiles(double *samples, size_t count, double *out)
+{
+	size_t i;
+	size_t rank;
+
+	qsort(samples, count, sizeof(double), compareDoubles);
+	for (i = 0; i < 4; i++)
+	{
+		rank = (size_t)((percentiles[i] / 100.0) * (double)count + 0.999999);
+		if (rank < 1)
+		{
+			rank = 1;
+		}
+		if (rank > count)
+		{
+			rank = count;
+		}
+		out[i] = samples[rank - 1];
+	}
+}
+
+/** Throw away anything the DUT sent before the test started. */
+static void discardInput(HIDStreamClient *client)
+{
+	uint8_t buffer[256];
+
+	while (hidStreamClientRead(client, buffer, 1, 50) == 0)
+	{
+		while (hidStreamClientReadNonBlocking(client, buffer, sizeof(buffer)) > 0)
+		{
+			// do nothing
+		}
+	}
+}
+
+/** Measure ping latency and the DUT's clock error.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+static int measurePing(HIDStreamClient *client, size_t samples, Results *results)
+{
+	double *latencies;
+	int64_t start;
+	int64_t end;
+	int64_t first_host_time;
+	uint32_t last_device_time;
+	uint32_t device_time;
+	uint64_t device_ticks;
+	double host_elapsed;
+	double device_elapsed;
+	size_t i;
+
+	latencies = malloc(samples * sizeof(double));
+	if (latencies == NULL)
+	{
+		return -1;
+	}
+	first_host_time = 0;
+	last_device_time = 0;
+	device_ticks = 0;
+	for (i = 0; i < samples; i++)
+	{
+		start = currentTime();
+		if (hidStreamClientGetDeviceTime(client, &device_time) < 0)
+		{
+			free(latencies);
+			return -1;
+		}
+		end = currentTime();
+		latencies[i] = (double)(end - start);
+		// The device samples its core timer somewhere in the middle of the
+		// round trip.
+		if (i == 0)
+		{
+			first_host_time = (start + end) / 2;
+			last_device_time = device_time;
+		}
+		else
+		{
+			// Pings are much less than a core timer wraparound apart.
+			device_ticks += (uint32_t)(device_time - last_device_time);
+			last_device_time = device_time;
+		}
+	}
+	host_elapsed = (double)(((start + end) / 2) - first_host_time) / 1e6;
+	device_elapsed = (double)device_ticks / CORE_TIMER_FREQUENCY;
+	results->clock_error = 0.0;
+	if (host_elapsed > 0.0)
+	{
+		results->clock_error = ((device_elapsed / host_elapsed) - 1.0) * 1e6;
+	}
+	computePercentiles(latencies, samples, results->ping_latency);
+	free(latencies);
+	return 0;
+}
+
+/** Measure the round-trip time of single bytes through the HID stream.
+  * \return 0 on success, -1 on error (errno will be set; it will be EPROTO
+  *         if the wrong byte came back).
+  */
+static int measureEcho(HIDStreamClient *client, size_t samples, int timeout, Results *results)
+{
+	double *latencies;
+	int64_t start;
+	uint8_t sent;
+	uint8_t received;
+	size_t i;
+
+	latencies = malloc(samples * sizeof(double));
+	if (latencies == NULL)
+	{
+		return -1;
+	}
+	for (i = 0; i < samples; i++)
+	{
+		sent = (uint8_t)i;
+		start = currentTime();
+		if ((hidStreamClientWrite(client, &sent, 1, timeout) < 0)
+			|| (hidStreamClientRead(client, &received, 1, timeout) < 0))
+		{
+			free(latencies);
+			return -1;
+		}
+		latencies[i] = (double)(currentTime() - start);
+		if (received != sent)
+		{
+			free(latencies);
+			errno = EPROTO;
+			return -1;
+		}
+	}
+	computePercentiles(latencies, samples, results->echo_latency);
+	free(latencies);
+	return 0;
+}
+
+/** Stream a pseudo-random pattern through the DUT, checking every echoed
+  * byte and measuring the throughput.
+  * \return 0 on success (even if bytes were corrupt or missing), -1 on
+  *         error (errno will be set).
+  */
+static int measureThroughput(HIDStreamClient *client, size_t length, int timeout, Results *results)
+{
+	uint8_t *pattern;
+	uint8_t buffer[1024];
+	struct pollfd pfd;
+	uint32_t state;
+	size_t sent;
+	size_t received;
+	size_t i;
+	ssize_t r;
+	int progress;
+	int64_t start;
+	int64_t last_progress;
+
+	pattern = malloc(length);
+	if (pattern == NULL)
+	{
+		return -1;
+	}
+	// xorshift32, so that dropped, duplicated or reordered bytes are
+	// obvious.
+	state = 0x2545f491;
+	for (i = 0; i < length; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		pattern[i] = (uint8_t)state;
+	}
+
+	results->corrupt_bytes = 0;
+	sent = 0;
+	received = 0;
+	start = currentTime();
+	last_progress = start;
+	while (received < length)
+	{
+		progress = 0;
+		if ((sent < length) && ((sent - received) < STREAM_WINDOW))
+		{
+			r = hidStreamClientWriteNonBlocking(client, &(pattern[sent]), MIN(STREAM_WINDOW - (sent - received), length - sent));
+			if (r < 0)
+			{
+				free(pattern);
+				return -1;
+			}
+			sent += (size_t)r;
+			progress |= (r > 0);
+		}
+		r = hidStreamClientReadNonBlocking(client, buffer, MIN(sizeof(buffer), length - received));
+		if (r < 0)
+		{
+			free(pattern);
+			return -1;
+		}
+		for (i = 0; i < (size_t)r; i++)
+		{
+			if (buffer[i] != pattern[received + i])
+			{
+				results->corrupt_bytes++;
+			}
+		}
+		received += (size_t)r;
+		progress |= (r > 0);
+
+		if (progress)
+		{
+			last_progress = currentTime();
+		}
+		else if ((currentTime() - last_progress) > ((int64_t)timeout * 1000))
+		{
+			break; // the DUT has stopped echoing
+		}
+		else
+		{
+			pfd.fd = client->fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, 1);
+		}
+	}
+	results->missing_bytes = length - received;
+	results->throughput = (double)received / ((double)(last_progress - start) / 1e6);
+	free(pattern);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: loopback_test [-n SAMPLES] [-s BYTES] [-b MIN_BYTES_PER_SECOND] [-t TIMEOUT_MS] DEVICE...\n");
+}
+
+int main(int argc, char **argv)
+{
+	HIDStreamClient client;
+	Results results;
+	size_t samples;
+	size_t stream_length;
+	double min_throughput;
+	int timeout;
+	int option;
+	int exit_status;
+	int passed;
+	int i;
+
+	samples = DEFAULT_SAMPLES;
+	stream_length = DEFAULT_STREAM_LENGTH;
+	min_throughput = 0.0;
+	timeout = DEFAULT_TIMEOUT;
+	while ((option = getopt(argc, argv, "n:s:b:t:")) != -1)
+	{
+		if (option == 'n')
+		{
+			samples = strtoul(optarg, NULL, 0);
+		}
+		else if (option == 's')
+		{
+			stream_length = strtoul(optarg, NULL, 0);
+		}
+		else if (option == 'b')
+		{
+			min_throughput = atof(optarg);
+		}
+		else if (option == 't')
+		{
+			timeout = atoi(optarg);
+		}
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	if ((optind >= argc) || (samples == 0) || (stream_length == 0))
+	{
+		usage();
+		return 2;
+	}
+
+	exit_status = 0;
+	for (i = optind; i < argc; i++)
+	{
+		if (hidStreamClientOpen(&client, argv[i]) < 0)
+		{
+			printf("%s: ERROR (couldn't open: %s)\n", argv[i], strerror(errno));
+			exit_status = 2;
+			continue;
+		}
+		memset(&results, 0, sizeof(results));
+		discardInput(&client);
+		if (measurePing(&client, samples, &results) < 0)
+		{
+			printf("%s: ERROR (ping failed: %s)\n", argv[i], strerror(errno));
+			exit_status = 2;
+		}
+		else if (measureEcho(&client, samples, timeout, &results) < 0)
+		{
+			printf("%s: FAIL (echo failed: %s)\n", argv[i], strerror(errno));
+			if (exit_status == 0)
+			{
+				exit_status = 1;
+			}
+		}
+		else if (measureThroughput(&client, stream_length, timeout, &results) < 0)
+		{
+			printf("%s: ERROR (stream failed: %s)\n", argv[i], strerror(errno));
+			exit_status = 2;
+		}
+		else
+		{
+			passed = (results.corrupt_bytes == 0) && (results.missing_bytes == 0)
+				&& (results.throughput >= min_throughput);
+			printf("%s: %s\n", argv[i], passed ? "PASS" : "FAIL");
+			printf("  ping latency (us):  p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+				results.ping_latency[0], results.ping_latency[1], results.ping_latency[2], results.ping_latency[3]);
+			printf("  echo latency (us):  p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n",
+				results.echo_latency[0], results.echo_latency[1], results.echo_latency[2], results.echo_latency[3]);
+			printf("  throughput:         %.0f bytes/s\n", results.throughput);
+			printf("  integrity:          %zu corrupt, %zu missing of %zu bytes\n",
+				results.corrupt_bytes, results.missing_bytes, stream_length);
+			printf("  clock error:        %+.0f ppm\n", results.clock_error);
+			if (!passed && (exit_status == 0))
+			{
+				exit_status = 1;
+			}
+		}
+		hidStreamClientClose(&client);
+	}
+	return exit_status;
+}
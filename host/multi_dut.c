@@ -0,0 +1,508 @@
+/** \file multi_dut.c
+  *
+  * \brief Host tool which runs a test session against many DUTs at once.
+  *
+  * This finds every attached DUT (every hidraw device whose USB vendor and
+  * product IDs match the ones in usb_descriptors.h), sends each one a
+  * request over its HID stream and checks the response. All DUTs are
+  * handled concurrently from a single epoll event loop, so the time taken
+  * hardly depends on the number of DUTs. The results are printed one line
+  * per DUT, followed by a summary. Build it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -o multi_dut multi_dut.c hid_stream_client.c
+  *
+  * Usage:
+  *
+  *     multi_dut -r REQUEST -e EXPECTED [-t TIMEOUT_MS] [-i VID:PID] [DEVICE...]
+  *
+  * REQUEST and EXPECTED are hexadecimal byte strings. A DUT passes if the
+  * first bytes it sends back are EXPECTED. If DEVICE paths (eg.
+  * /dev/hidraw3) are given, only those are used instead of searching for
+  * DUTs. Devices created with the Linux uhid driver (/dev/uhid) look just
+  * like real DUTs to this tool, so simulated DUTs can be used to test it
+  * without any hardware.
+  *
+  * The exit status is 0 if every DUT passed, 1 if any DUT failed and 2 if
+  * the tool itself couldn't run.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "hid_stream_client.h"
+
+/** Default USB vendor ID to search for (see usb_descriptors.h). */
+#define DEFAULT_VENDOR_ID			0x04f3
+/** Default USB product ID to search for (see usb_descriptors.h). */
+#define DEFAULT_PRODUCT_ID			0x0210
+/** Bus type which hidraw uses for USB devices (BUS_USB in
+  * linux/input.h). */
+#define HID_BUS_USB					0x03
+/** Maximum number of DUTs which can be tested at once. */
+#define MAX_DUTS					128
+/** Maximum size, in bytes, of a request or expected response. */
+#define MAX_MESSAGE_LENGTH			1024
+/** Maximum length of a device node path. */
+#define MAX_PATH_LENGTH				64
+/** Default timeout for each DUT, in milliseconds. */
+#define DEFAULT_TIMEOUT				5000
+
+/** Result of a test session on one DUT. */
+typedef enum SessionResultEnum
+{
+	/** Session hasn't finished yet. */
+	RESULT_RUNNING		= 0,
+	/** DUT sent back the expected response. */
+	RESULT_PASS			= 1,
+	/** DUT sent back something else. */
+	RESULT_FAIL			= 2,
+	/** DUT didn't send back enough bytes in time. */
+	RESULT_TIMEOUT		= 3,
+	/** Couldn't talk to the DUT. */
+	RESULT_ERROR		= 4
+} SessionResult;
+
+/** State of the test session on one DUT. */
+typedef struct SessionStruct
+{
+	/** Path of the DUT's hidraw device node. */
+	char path[MAX_PATH_LENGTH];
+	/** Connection to the DUT's HID stream. */
+	HIDStreamClient client;
+	/** Number of bytes of the request which have been sent. */
+	size_t sent;
+	/** Bytes received from the DUT so far. */
+	uint8_t response[MAX_MESSAGE_LENGTH];
+	/** Number of valid bytes in #response. */
+	size_t received;
+	/** Outcome of the session. */
+	SessionResult result;
+	/** errno value, if #result is #RESULT_ERROR. */
+	int error;
+	/** How long the session took, in milliseconds. */
+	int64_t elapsed;
+} Session;
+
+/** All DUTs being tested. */
+static Session sessions[MAX_DUTS];
+/** Number of valid entries in #sessions. */
+static unsigned int num_sessions;
+
+/** Request to send to every DUT. */
+static uint8_t request[MAX_MESSAGE_LENGTH];
+/** Number of valid bytes in #request. */
+static size_t request_length;
+/** Response expected from every DUT. */
+static uint8_t expected[MAX_MESSAGE_LENGTH];
+/** Number of valid bytes in #expected. */
+static size_t expected_length;
+
+/** Get the current time.
+  * \return Current time in milliseconds, from an arbitrary starting point.
+  */
+static int64_t currentTime(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((int64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/** Convert a hexadecimal string (eg. "0a1b2c") into bytes.
+  * \param hex The string to convert.
+  * \param buffer The bytes will be written here. This must have space for
+  *               #MAX_MESSAGE_LENGTH bytes.
+  * \param length The number of bytes will be written here.
+  * \return 0 on success, non-zero if the string isn't valid.
+  */
+static int parseHex(const char *hex, uint8_t *buffer, size_t *length)
+{
+	size_t i;
+	unsigned int value;
+
+	if ((strlen(hex) % 2) != 0)
+	{
+		return 1;
+	}
+	*length = strlen(hex) / 2;
+	if (*length > MAX_MESSAGE_LENGTH)
+	{
+		return 1;
+	}
+	for (i = 0; i < *length; i++)
+	{
+		if (sscanf(&(hex[i * 2]), "%2x", &value) != 1)
+		{
+			return 1;
+		}
+		buffer[i] = (uint8_t)value;
+	}
+	return 0;
+}
+
+/** Add a DUT to #sessions.
+  * \param path Path of the DUT's hidraw device node.
+  * \return 0 on success, non-zero if there are too many DUTs.
+  */
+static int addSession(const char *path)
+{
+	Session *session;
+
+	if (num_sessions >= MAX_DUTS)
+	{
+		return 1;
+	}
+	session = &(sessions[num_sessions]);
+	memset(session, 0, sizeof(*session));
+	snprintf(session->path, sizeof(session->path), "%s", path);
+	num_sessions++;
+	return 0;
+}
+
+/** Find every hidraw device with the specified USB vendor and product IDs,
+  * and add them to #sessions.
+  * \param vendor_id The USB vendor ID to look for.
+  * \param product_id The USB product ID to look for.
+  * \return 0 on success, non-zero on error.
+  */
+static int discoverDUTs(unsigned int vendor_id, unsigned int product_id)
+{
+	DIR *dir;
+	struct dirent *entry;
+	FILE *f;
+	char line[256];
+	char path[300];
+	unsigned int bus;
+	unsigned int vendor;
+	unsigned int product;
+
+	dir = opendir("/sys/class/hidraw");
+	if (dir == NULL)
+	{
+		return 1;
+	}
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strncmp(entry->d_name, "hidraw", 6) != 0)
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", entry->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+		{
+			continue;
+		}
+		while (fgets(line, sizeof(line), f) != NULL)
+		{
+			// The line looks like "HID_ID=0003:000004F3:00000210".
+			if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+			{
+				if ((bus == HID_BUS_USB) && (vendor == vendor_id) && (product == product_id))
+				{
+					snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+					if (addSession(path))
+					{
+						fprintf(stderr, "Too many DUTs; only testing the first %d\n", MAX_DUTS);
+					}
+				}
+				break;
+			}
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return 0;
+}
+
+/** Finish the test session on one DUT.
+  * \param session The session to finish.
+  * \param result Outcome of the session.
+  * \param start_time When the sessions were started, in the units of
+  *                   currentTime().
+  */
+static void finishSession(Session *session, SessionResult result, int64_t start_time)
+{
+	if (session->result != RESULT_RUNNING)
+	{
+		return;
+	}
+	if (result == RESULT_ERROR)
+	{
+		session->error = errno;
+	}
+	session->result = result;
+	session->elapsed = currentTime() - start_time;
+	hidStreamClientClose(&(session->client));
+}
+
+/** Handle any bytes received from a DUT, and decide whether its session
+  * is finished.
+  * \param session The session to update.
+  * \param start_time When the sessions were started, in the units of
+  *                   currentTime().
+  */
+static void receiveFromDUT(Session *session, int64_t start_time)
+{
+	ssize_t r;
+
+	r = hidStreamClientReadNonBlocking(&(session->client), &(session->response[session->received]), expected_length - session->received);
+	if (r < 0)
+	{
+		finishSession(session, RESULT_ERROR, start_time);
+		return;
+	}
+	session->received += (size_t)r;
+	if (session->received >= expected_length)
+	{
+		if (memcmp(session->response, expected, expected_length) == 0)
+		{
+			finishSession(session, RESULT_PASS, start_time);
+		}
+		else
+		{
+			finishSession(session, RESULT_FAIL, start_time);
+		}
+	}
+}
+
+/** Run the test session on every DUT in #sessions concurrently.
+  * \param timeout Timeout for every DUT, in milliseconds.
+  * \return 0 on success, non-zero if the event loop couldn't run.
+  */
+static int runSessions(int timeout)
+{
+	struct epoll_event event;
+	struct epoll_event events[MAX_DUTS];
+	Session *session;
+	int64_t start_time;
+	int64_t remaining;
+	unsigned int running;
+	unsigned int i;
+	int epoll_fd;
+	int n;
+	ssize_t r;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+	{
+		return 1;
+	}
+	start_time = currentTime();
+	for (i = 0; i < num_sessions; i++)
+	{
+		session = &(sessions[i]);
+		if (hidStreamClientOpen(&(session->client), session->path) < 0)
+		{
+			session->error = errno;
+			session->result = RESULT_ERROR;
+			continue;
+		}
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = session;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->client.fd, &event) < 0)
+		{
+			finishSession(session, RESULT_ERROR, start_time);
+		}
+	}
+	while (1)
+	{
+		// Send as much of each request as each DUT will accept right now.
+		// With credit-based flow control disabled, this sends everything.
+		running = 0;
+		for (i = 0; i < num_sessions; i++)
+		{
+			session = &(sessions[i]);
+			if (session->result != RESULT_RUNNING)
+			{
+				continue;
+			}
+			running++;
+			if (session->sent < request_length)
+			{
+				r = hidStreamClientWriteNonBlocking(&(session->client), &(request[session->sent]), request_length - session->sent);
+				if (r < 0)
+				{
+					finishSession(session, RESULT_ERROR, start_time);
+					continue;
+				}
+				session->sent += (size_t)r;
+			}
+			if (expected_length == 0)
+			{
+				finishSession(session, RESULT_PASS, start_time);
+			}
+		}
+		if (running == 0)
+		{
+			break;
+		}
+		remaining = (start_time + timeout) - currentTime();
+		if (remaining <= 0)
+		{
+			for (i = 0; i < num_sessions; i++)
+			{
+				finishSession(&(sessions[i]), RESULT_TIMEOUT, start_time);
+			}
+			break;
+		}
+		n = epoll_wait(epoll_fd, events, MAX_DUTS, (int)remaining);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			close(epoll_fd);
+			return 1;
+		}
+		for (i = 0; i < (unsigned int)n; i++)
+		{
+			receiveFromDUT((Session *)events[i].data.ptr, start_time);
+		}
+	}
+	close(epoll_fd);
+	return 0;
+}
+
+/** Print the results of every session, and a summary.
+  * \return Number of DUTs which didn't pass.
+  */
+static unsigned int printResults(void)
+{
+	static const char * const result_names[] = {"RUNNING", "PASS", "FAIL", "TIMEOUT", "ERROR"};
+	unsigned int counts[5];
+	unsigned int i;
+	size_t j;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < num_sessions; i++)
+	{
+		printf("%s: %s (%lld ms)", sessions[i].path, result_names[sessions[i].result], (long long)sessions[i].elapsed);
+		if (sessions[i].result == RESULT_ERROR)
+		{
+			printf(": %s", strerror(sessions[i].error));
+		}
+		else if ((sessions[i].result == RESULT_FAIL) || (sessions[i].result == RESULT_TIMEOUT))
+		{
+			printf(": got ");
+			for (j = 0; j < sessions[i].received; j++)
+			{
+				printf("%02x", sessions[i].response[j]);
+			}
+		}
+		printf("\n");
+		counts[sessions[i].result]++;
+	}
+	printf("%u DUTs: %u passed, %u failed, %u timed out, %u errors\n", num_sessions,
+		counts[RESULT_PASS], counts[RESULT_FAIL], counts[RESULT_TIMEOUT], counts[RESULT_ERROR]);
+	return num_sessions - counts[RESULT_PASS];
+}
+
+/** Print usage information. */
+static void usage(void)
+{
+	fprintf(stderr, "Usage: multi_dut -r REQUEST -e EXPECTED [-t TIMEOUT_MS] [-i VID:PID] [DEVICE...]\n");
+	fprintf(stderr, "REQUEST and EXPECTED are hexadecimal byte strings.\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int vendor_id;
+	unsigned int product_id;
+	int timeout;
+	int have_request;
+	int have_expected;
+	int opt;
+	int i;
+
+	vendor_id = DEFAULT_VENDOR_ID;
+	product_id = DEFAULT_PRODUCT_ID;
+	timeout = DEFAULT_TIMEOUT;
+	have_request = 0;
+	have_expected = 0;
+	while ((opt = getopt(argc, argv, "r:e:t:i:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r':
+			if (parseHex(optarg, request, &request_length))
+			{
+				usage();
+				return 2;
+			}
+			have_request = 1;
+			break;
+		case 'e':
+			if (parseHex(optarg, expected, &expected_length))
+			{
+				usage();
+				return 2;
+			}
+			have_expected = 1;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		case 'i':
+			if (sscanf(optarg, "%x:%x", &vendor_id, &product_id) != 2)
+			{
+				usage();
+				return 2;
+			}
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (!have_request || !have_expected)
+	{
+		usage();
+		return 2;
+	}
+	num_sessions = 0;
+	if (optind < argc)
+	{
+		for (i = optind; i < argc; i++)
+		{
+			if (addSession(argv[i]))
+			{
+				fprintf(stderr, "Too many DUTs\n");
+				return 2;
+			}
+		}
+	}
+	else
+	{
+		if (discoverDUTs(vendor_id, product_id))
+		{
+			fprintf(stderr, "Couldn't search for DUTs: %s\n", strerror(errno));
+			return 2;
+		}
+	}
+	if (num_sessions == 0)
+	{
+		fprintf(stderr, "No DUTs found\n");
+		return 2;
+	}
+	if (runSessions(timeout))
+	{
+		fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+		return 2;
+	}
+	if (printResults() != 0)
+	{
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,424 @@
+/** \file remote_test.c
+  *
+  * \brief Host tool which runs tests on a DUT over USB.
+  *
+  * This talks to the DUT's test runner (see test_runner.c) using its
+  * command channel. The HID stream is split into channels (see
+  * stream_channels.c), so this tool does the host side of that framing:
+  * each frame is a length byte (the number of bytes which follow), a
+  * channel number and up to 61 bytes of channel data. Result lines which
+  * the DUT sends on its log channel (when the operator runs a test using
+  * the pushbuttons) are ignored. Build it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -o remote_test remote_test.c hid_stream_client.c
+  *
+  * Usage:
+  *
+  *     remote_test [-t TIMEOUT_MS] DEVICE [TEST[:PARAMETER,...]]...
+  *     remote_test [-t TIMEOUT_MS] -s|-c DEVICE
+  *     remote_test [-t TIMEOUT_MS] -w SECONDS DEVICE
+  *
+  * where DEVICE is the hidraw device node of the DUT (eg. /dev/hidraw3) and
+  * each TEST is a test number, optionally followed by parameters, for
+  * example "1:5" runs test 1 with parameter 5. If no tests are given, every
+  * test is run (without parameters), in order. The DUT's result line for
+  * each test is printed to standard output as-is, for example:
+  *
+  *     result 1 flash pass duration_us=213450 jedec_id=0x00bf258e failed_step=0
+  *
+  * With -s, the DUT runs every test back to back and this prints its result
+  * and time budget lines (see runSequence() in test_runner.c), for example:
+  *
+  *     budget 1 flash duration_us=213450 budget_us=100000 over
+  *     budget total duration_us=612305 budget_us=600000 over=1 failed=0
+  *
+  * -c is like -s, but the DUT overlaps the tests, so there is only one
+  * budget (for the whole sequence) and no per-test budget lines.
+  *
+  * With -w, nothing is run. Instead, this measures how often the DUT's CPU
+  * wakes up from idle mode, over the specified number of seconds, and
+  * prints the rate, along with the rate of USB interrupts over the same
+  * time (every USB interrupt which arrives while the CPU is idle wakes it
+  * up). The DUT should be left alone while this happens.
+  *
+  * The exit status is 0 if every test passed (and, with -s or -c, every
+  * budget was met), 1 if any test didn't pass (or went over budget) and
+  * 2 if the tool couldn't talk to the DUT.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "hid_stream_client.h"
+
+/** Channel which carries commands and responses (CHANNEL_COMMAND in
+  * stream_channels.h). */
+#define CHANNEL_COMMAND				0
+/** Most channel data bytes in one frame. */
+#define MAX_FRAME_DATA				61
+/** Longest line which the DUT sends, including '\n'. */
+#define MAX_LINE_LENGTH				256
+/** Default time to wait for each response, in milliseconds. Tests can take
+  * several seconds. */
+#define DEFAULT_TIMEOUT				30000
+
+/** Connection to the DUT. */
+static HIDStreamClient client;
+/** Response timeout, in milliseconds. */
+static int timeout;
+
+/** Send a command line on the command channel.
+  * \param line The null-terminated line, including its '\n'.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+static int sendCommand(const char *line)
+{
+	uint8_t frame[MAX_FRAME_DATA + 2];
+	size_t length;
+	size_t count;
+
+	length = strlen(line);
+	while (length > 0)
+	{
+		count = (length < MAX_FRAME_DATA) ? length : MAX_FRAME_DATA;
+		frame[0] = (uint8_t)(count + 1);
+		frame[1] = CHANNEL_COMMAND;
+		memcpy(&(frame[2]), line, count);
+		if (hidStreamClientWrite(&client, frame, count + 2, timeout) < 0)
+		{
+			return -1;
+		}
+		line += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/** Read the next line which the DUT sends on the command channel. Data on
+  * other channels is skipped.
+  * \param line The null-terminated line (including its '\n') will be
+  *             written here. This must have space for #MAX_LINE_LENGTH + 1
+  *             bytes.
+  * \return 0 on success, -1 on error (errno will be set).
+  */
+static int readResponse(char *line)
+{
+	static uint8_t data[MAX_FRAME_DATA];
+	static size_t data_length;
+	static size_t data_offset;
+	uint8_t header[2];
+	size_t length;
+
+	length = 0;
+	while (1)
+	{
+		while (data_offset < data_length)
+		{
+			line[length] = (char)data[data_offset];
+			data_offset++;
+			if ((line[length] == '\n') || (length == (MAX_LINE_LENGTH - 1)))
+			{
+				line[length + 1] = '\0';
+				return 0;
+			}
+			length++;
+		}
+		// Get the next command channel frame.
+		do
+		{
+			if ((hidStreamClientRead(&client, header, 1, timeout) < 0)
+				|| ((header[0] > 0) && (hidStreamClientRead(&client, &(header[1]), 1, timeout) < 0)))
+			{
+				return -1;
+			}
+			data_length = (header[0] > 0) ? (header[0] - 1u) : 0;
+			if ((data_length > 0) && (hidStreamClientRead(&client, data, data_length, timeout) < 0))
+			{
+				return -1;
+			}
+		} while ((header[0] == 0) || (header[1] != CHANNEL_COMMAND));
+		data_offset = 0;
+	}
+}
+
+/** Run one test and print its result line.
+  * \param test A test argument, of the form "TEST[:PARAMETER,...]".
+  * \return 0 if the test passed, 1 if it didn't, 2 on error.
+  */
+static int runTest(const char *test)
+{
+	char command[MAX_LINE_LENGTH];
+	char response[MAX_LINE_LENGTH + 1];
+	char *p;
+
+	if (strlen(test) > (MAX_LINE_LENGTH - 8))
+	{
+		fprintf(stderr, "Test argument too long: %s\n", test);
+		return 2;
+	}
+	sprintf(command, "run %s\n", test);
+	for (p = command; *p != '\0'; p++)
+	{
+		if ((*p == ':') || (*p == ','))
+		{
+			*p = ' ';
+		}
+	}
+	if ((sendCommand(command) < 0) || (readResponse(response) < 0))
+	{
+		fprintf(stderr, "Couldn't run test %s: %s\n", test, strerror(errno));
+		return 2;
+	}
+	fputs(response, stdout);
+	if (strncmp(response, "result ", 7) != 0)
+	{
+		return 1;
+	}
+	// The outcome is the fourth word.
+	p = strchr(response + 7, ' ');
+	p = (p != NULL) ? strchr(p + 1, ' ') : NULL;
+	if ((p == NULL) || (strncmp(p + 1, "pass ", 5) != 0))
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Get the number of tests which the DUT has.
+  * \return The number of tests, or -1 on error.
+  */
+static int countTests(void)
+{
+	char response[MAX_LINE_LENGTH + 1];
+	int count;
+
+	if (sendCommand("list\n") < 0)
+	{
+		return -1;
+	}
+	count = 0;
+	while (1)
+	{
+		if (readResponse(response) < 0)
+		{
+			return -1;
+		}
+		if (!strcmp(response, "end\n"))
+		{
+			return count;
+		}
+		if (!strncmp(response, "test ", 5))
+		{
+			count++;
+		}
+	}
+}
+
+/** Run every test back to back, and print the result and budget lines.
+  * \param concurrent Non-zero to ask the DUT to overlap the tests.
+  * \return 0 if every test passed and was within its budget, 1 if not, 2 on
+  *         error.
+  */
+static int runSequence(int concurrent)
+{
+	char response[MAX_LINE_LENGTH + 1];
+	unsigned int num_over;
+	unsigned int num_failed;
+
+	if (sendCommand(concurrent ? "sequence concurrent\n" : "sequence\n") < 0)
+	{
+		fprintf(stderr, "Couldn't run sequence: %s\n", strerror(errno));
+		return 2;
+	}
+	while (1)
+	{
+		if (readResponse(response) < 0)
+		{
+			fprintf(stderr, "Couldn't run sequence: %s\n", strerror(errno));
+			return 2;
+		}
+		fputs(response, stdout);
+		if (!strncmp(response, "error", 5))
+		{
+			return 1;
+		}
+		if (!strncmp(response, "budget total ", 13))
+		{
+			break;
+		}
+	}
+	if ((sscanf(response, "budget total duration_us=%*u budget_us=%*u over=%u failed=%u", &num_over, &num_failed) != 2)
+		|| (num_over != 0) || (num_failed != 0))
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Get the number of times the DUT's CPU has woken up from idle mode, and
+  * the number of USB interrupts it has handled.
+  * \param wake_ups The wake-up count will be written here.
+  * \param interrupts The USB interrupt count will be written here.
+  * \return 0 on success, -1 on error.
+  */
+static int getWakeUpCounts(unsigned long *wake_ups, unsigned long *interrupts)
+{
+	char response[MAX_LINE_LENGTH + 1];
+
+	if ((sendCommand("wakeups\n") < 0) || (readResponse(response) < 0))
+	{
+		fprintf(stderr, "Couldn't get wake-up count: %s\n", strerror(errno));
+		return -1;
+	}
+	if (sscanf(response, "wakeups %lu", wake_ups) != 1)
+	{
+		fprintf(stderr, "Unexpected response: %s", response);
+		return -1;
+	}
+	if ((sendCommand("interrupts\n") < 0) || (readResponse(response) < 0))
+	{
+		fprintf(stderr, "Couldn't get interrupt count: %s\n", strerror(errno));
+		return -1;
+	}
+	if (sscanf(response, "interrupts count=%lu", interrupts) != 1)
+	{
+		fprintf(stderr, "Unexpected response: %s", response);
+		return -1;
+	}
+	return 0;
+}
+
+/** Measure and print the DUT's idle wake-up rate, and how much of it is
+  * due to USB interrupts. The rest comes from timers (Timer4 and core
+  * timer deadlines). The two commands at each end of the measurement cost
+  * a few USB interrupts of their own, which is negligible over a few
+  * seconds.
+  * \param seconds How long to measure for.
+  * \return 0 on success, 2 on error.
+  */
+static int measureWakeUpRate(int seconds)
+{
+	unsigned long first_wake_ups;
+	unsigned long first_interrupts;
+	unsigned long wake_ups;
+	unsigned long interrupts;
+
+	if (getWakeUpCounts(&first_wake_ups, &first_interrupts) < 0)
+	{
+		return 2;
+	}
+	sleep((unsigned int)seconds);
+	if (getWakeUpCounts(&wake_ups, &interrupts) < 0)
+	{
+		return 2;
+	}
+	// The counts are 32 bits on the DUT.
+	wake_ups = (wake_ups - first_wake_ups) & 0xffffffffUL;
+	interrupts = (interrupts - first_interrupts) & 0xffffffffUL;
+	printf("%.1f wake-ups per second, %.1f USB interrupts per second\n", (double)wake_ups / seconds, (double)interrupts / seconds);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: remote_test [-t TIMEOUT_MS] DEVICE [TEST[:PARAMETER,...]]...\n");
+	fprintf(stderr, "       remote_test [-t TIMEOUT_MS] -s|-c DEVICE\n");
+	fprintf(stderr, "       remote_test [-t TIMEOUT_MS] -w SECONDS DEVICE\n");
+}
+
+/** Combine the outcome of a test with the overall exit status. */
+static int worstStatus(int a, int b)
+{
+	return (a > b) ? a : b;
+}
+
+int main(int argc, char **argv)
+{
+	char test[16];
+	int option;
+	int sequence;
+	int concurrent;
+	int wake_up_seconds;
+	int exit_status;
+	int num_tests;
+	int i;
+
+	timeout = DEFAULT_TIMEOUT;
+	sequence = 0;
+	concurrent = 0;
+	wake_up_seconds = 0;
+	while ((option = getopt(argc, argv, "cst:w:")) != -1)
+	{
+		if (option == 's')
+		{
+			sequence = 1;
+		}
+		else if (option == 'c')
+		{
+			sequence = 1;
+			concurrent = 1;
+		}
+		else if (option == 't')
+		{
+			timeout = atoi(optarg);
+		}
+		else if (option == 'w')
+		{
+			wake_up_seconds = atoi(optarg);
+		}
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	if ((optind >= argc) || ((sequence || (wake_up_seconds > 0)) && ((optind + 1) < argc))
+		|| (sequence && (wake_up_seconds > 0)))
+	{
+		usage();
+		return 2;
+	}
+	if (hidStreamClientOpen(&client, argv[optind]) < 0)
+	{
+		fprintf(stderr, "Couldn't open %s: %s\n", argv[optind], strerror(errno));
+		return 2;
+	}
+
+	exit_status = 0;
+	if (wake_up_seconds > 0)
+	{
+		exit_status = measureWakeUpRate(wake_up_seconds);
+	}
+	else if (sequence)
+	{
+		exit_status = runSequence(concurrent);
+	}
+	else if ((optind + 1) < argc)
+	{
+		for (i = optind + 1; (i < argc) && (exit_status < 2); i++)
+		{
+			exit_status = worstStatus(exit_status, runTest(argv[i]));
+		}
+	}
+	else
+	{
+		num_tests = countTests();
+		if (num_tests < 0)
+		{
+			fprintf(stderr, "Couldn't list tests: %s\n", strerror(errno));
+			exit_status = 2;
+		}
+		for (i = 0; (i < num_tests) && (exit_status < 2); i++)
+		{
+			sprintf(test, "%d", i);
+			exit_status = worstStatus(exit_status, runTest(test));
+		}
+	}
+	hidStreamClientClose(&client);
+	return exit_status;
+}
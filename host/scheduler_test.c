@@ -0,0 +1,470 @@
+/** \file scheduler_test.c
+  *
+  * \brief Host test for the cooperative scheduler in scheduler.c.
+  *
+  * This builds scheduler.c on the host, with the functions it needs from
+  * pic32_system.c replaced by a fake core timer and fake interrupts. Time
+  * only moves when a test says so, and idleWithInterruptsDisabled() plays
+  * the part of an interrupt which ends the idle (the core timer interrupt,
+  * at whatever deadline setCoreTimerWakeUp() was given, or some other
+  * interrupt which signals events). That makes it possible to check:
+  * - that tasks are woken by the events they wait for, and only those;
+  * - that deadlines are compared correctly when the core timer wraps
+  *   around, both when deciding whether a task is ready (isTaskReady()) and
+  *   when choosing the wake-up time for an idle CPU (getEarliestDeadline(),
+  *   through runScheduler());
+  * - that tasks which return #TASK_FINISHED are removed, wherever they are
+  *   in the list;
+  * - that tasks can add tasks while the scheduler is running them.
+  *
+  * runScheduler() never returns, so the fake idle gets out of it with
+  * longjmp() once a test has seen enough.
+  *
+  * Build and run it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -Wno-attributes -I.. -o scheduler_test scheduler_test.c ../scheduler.c
+  *     ./scheduler_test
+  *
+  * The exit status is 0 if every check passed, and 1 otherwise.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include "pic32_system.h"
+#include "scheduler.h"
+
+/** Most wake-ups which one run of runScheduler() records. */
+#define MAX_WAKE_UPS				8
+
+/** What the fake idle does to end an idle. */
+typedef enum IdleActionEnum
+{
+	/** Advance the core timer to the wake-up deadline, like the core timer
+	  * interrupt. */
+	IDLE_TIMER					= 0,
+	/** Signal #idle_events, like an interrupt service routine. */
+	IDLE_SIGNAL					= 1
+} IdleAction;
+
+/** Fake core timer. */
+static uint32_t now;
+/** Non-zero while the fake interrupts are disabled. */
+static uint32_t interrupts_disabled;
+/** Deadline given to the most recent setCoreTimerWakeUp(). */
+static uint32_t wake_up_deadline;
+/** Non-zero if a core timer wake-up is set. */
+static int is_wake_up_set;
+/** What the fake idle does. */
+static IdleAction idle_action;
+/** Events which the fake idle signals, for #IDLE_SIGNAL. */
+static uint32_t idle_events;
+/** The fake idle leaves runScheduler() once it has been called this many
+  * times. */
+static unsigned int max_idles;
+/** Number of times the fake idle has been called. */
+static unsigned int num_idles;
+/** Core timer deadline at each idle, or 0xffffffff for an idle with no
+  * wake-up set. */
+static uint32_t idle_deadlines[MAX_WAKE_UPS];
+/** Where the fake idle jumps to, to leave runScheduler(). */
+static jmp_buf leave_scheduler;
+/** Number of failed checks. */
+static unsigned int num_failures;
+
+uint32_t disableInterrupts(void)
+{
+	uint32_t status;
+
+	status = interrupts_disabled;
+	interrupts_disabled = 1;
+	return status;
+}
+
+void restoreInterrupts(uint32_t status)
+{
+	interrupts_disabled = status;
+}
+
+uint32_t getCoreTimer(void)
+{
+	return now;
+}
+
+int setCoreTimerWakeUp(uint32_t deadline)
+{
+	wake_up_deadline = deadline;
+	if ((int32_t)(now - deadline) >= 0)
+	{
+		is_wake_up_set = 0;
+		return 0;
+	}
+	is_wake_up_set = 1;
+	return 1;
+}
+
+void idleWithInterruptsDisabled(void)
+{
+	if (!interrupts_disabled)
+	{
+		printf("FAIL: idle with interrupts enabled\n");
+		num_failures++;
+	}
+	if (num_idles < MAX_WAKE_UPS)
+	{
+		idle_deadlines[num_idles] = is_wake_up_set ? wake_up_deadline : 0xffffffff;
+	}
+	num_idles++;
+	if (num_idles > max_idles)
+	{
+		interrupts_disabled = 0;
+		longjmp(leave_scheduler, 1);
+	}
+	if (idle_action == IDLE_SIGNAL)
+	{
+		signalEvents(idle_events);
+	}
+	else if (is_wake_up_set)
+	{
+		now = wake_up_deadline;
+	}
+	else
+	{
+		// Nothing would ever wake the CPU up.
+		printf("FAIL: idle with nothing to wake up\n");
+		num_failures++;
+		interrupts_disabled = 0;
+		longjmp(leave_scheduler, 1);
+	}
+	is_wake_up_set = 0;
+}
+
+/** Record the outcome of a check, and print it if it failed.
+  * \param condition Non-zero if the check passed.
+  * \param description What was checked.
+  */
+static void check(int condition, const char *description)
+{
+	if (!condition)
+	{
+		printf("FAIL: %s\n", description);
+		num_failures++;
+	}
+}
+
+/** Reset the fake hardware and the scheduler.
+  * \param start Initial value of the core timer.
+  */
+static void reset(uint32_t start)
+{
+	now = start;
+	interrupts_disabled = 0;
+	wake_up_deadline = 0;
+	is_wake_up_set = 0;
+	idle_action = IDLE_TIMER;
+	idle_events = 0;
+	max_idles = 0;
+	num_idles = 0;
+	memset(idle_deadlines, 0, sizeof(idle_deadlines));
+	initScheduler();
+}
+
+/** Run runScheduler() until the fake idle has been called a number of
+  * times.
+  * \param idles How many idles to allow before leaving.
+  */
+static void runSchedulerFor(unsigned int idles)
+{
+	max_idles = idles;
+	if (setjmp(leave_scheduler) == 0)
+	{
+		runScheduler();
+	}
+}
+
+/** Events which woke #eventTask, each time it woke. */
+static uint32_t event_task_events[4];
+/** Number of times #eventTask has woken from a wait. */
+static unsigned int event_task_wakes;
+
+/** Task which waits for button presses, forever. */
+static TaskStatus eventTask(Task *task)
+{
+	TASK_BEGIN(task);
+	while (1)
+	{
+		TASK_WAIT_EVENT(task, EVENT_BUTTON_PRESS);
+		if (event_task_wakes < 4)
+		{
+			event_task_events[event_task_wakes] = task->events;
+		}
+		event_task_wakes++;
+	}
+	TASK_END(task);
+}
+
+/** Check that tasks are woken by events they wait for, and not by others. */
+static void testEventWakeUp(void)
+{
+	Task task;
+
+	reset(1000);
+	event_task_wakes = 0;
+	addTask(&task, &eventTask);
+	check(runTasksOnce() != 0, "new task runs");
+	check(runTasksOnce() == 0, "waiting task doesn't run");
+	signalEvents(EVENT_STREAM_RECEIVED);
+	check(runTasksOnce() == 0, "task isn't woken by other events");
+	signalEvents(EVENT_BUTTON_PRESS);
+	check(runTasksOnce() != 0, "task is woken by its event");
+	check((event_task_wakes == 1) && (event_task_events[0] == EVENT_BUTTON_PRESS), "task sees the event which woke it");
+	signalEvents(EVENT_BUTTON_PRESS | EVENT_STREAM_RECEIVED);
+	check(runTasksOnce() != 0, "task is woken when several events are signalled");
+	check((event_task_wakes == 2) && (event_task_events[1] == EVENT_BUTTON_PRESS), "task only sees events it waits for");
+	check(runTasksOnce() == 0, "events are consumed");
+
+	// The same, but with the event signalled by an "interrupt" while the
+	// scheduler idles. No deadline is pending, so no wake-up should be set.
+	reset(1000);
+	event_task_wakes = 0;
+	addTask(&task, &eventTask);
+	idle_action = IDLE_SIGNAL;
+	idle_events = EVENT_BUTTON_PRESS;
+	runSchedulerFor(3);
+	check(event_task_wakes == 3, "scheduler wakes task after each interrupt");
+	check((idle_deadlines[0] == 0xffffffff) && (idle_deadlines[1] == 0xffffffff), "no wake-up set without deadlines");
+}
+
+/** Core timer values at which #deadlineTask ran. */
+static uint32_t deadline_task_runs[2][4];
+/** Number of times each #deadlineTask has run. */
+static unsigned int deadline_task_count[2];
+/** Deadlines, relative to the core timer when each #deadlineTask starts. */
+static uint32_t deadline_task_delays[2][3];
+
+/** The two #deadlineTask tasks. */
+static Task deadline_tasks[2];
+
+/** Task which waits for the deadlines in #deadline_task_delays, one after
+  * the other, then finishes. */
+static TaskStatus deadlineTask(Task *task)
+{
+	static uint32_t start[2];
+	static unsigned int step[2];
+	unsigned int n;
+
+	n = (task == &(deadline_tasks[0])) ? 0 : 1;
+	if (deadline_task_count[n] < 4)
+	{
+		deadline_task_runs[n][deadline_task_count[n]] = now;
+	}
+	deadline_task_count[n]++;
+	TASK_BEGIN(task);
+	start[n] = now;
+	for (step[n] = 0; step[n] < 3; step[n]++)
+	{
+		TASK_WAIT_DEADLINE(task, start[n] + deadline_task_delays[n][step[n]]);
+	}
+	TASK_END(task);
+}
+
+/** Check that deadlines work across the core timer wrapping around. */
+static void testDeadlineWrap(void)
+{
+	uint32_t start;
+
+	// isTaskReady(): the deadline is after the wrap, the current time
+	// isn't, so an unsigned comparison would run the task far too early.
+	start = 0xffffff00;
+	reset(start);
+	memset(deadline_task_count, 0, sizeof(deadline_task_count));
+	deadline_task_delays[0][0] = 0x200;
+	deadline_task_delays[0][1] = 0x300;
+	deadline_task_delays[0][2] = 0x300;
+	addTask(&(deadline_tasks[0]), &deadlineTask);
+	check(runTasksOnce() != 0, "deadline task starts");
+	now = 0xfffffff0;
+	check(runTasksOnce() == 0, "deadline after wrap isn't reached before wrap");
+	now = 0x000000ff;
+	check(runTasksOnce() == 0, "deadline after wrap isn't reached just before it");
+	now = 0x00000100;
+	check(runTasksOnce() != 0, "deadline after wrap is reached");
+	now = 0x00000180;
+	check(runTasksOnce() == 0, "next deadline isn't reached early");
+	now = 0x00001000;
+	check(runTasksOnce() != 0, "late deadline is reached");
+
+	// getEarliestDeadline(): two tasks whose deadlines interleave across
+	// the wrap. Task 1 is later in the list but its first deadline (just
+	// before the wrap) comes first; task 0's deadlines come after the
+	// wrap, so an unsigned comparison of the deadlines would pick the
+	// wrong one every time.
+	start = 0xffffff00;
+	reset(start);
+	memset(deadline_task_count, 0, sizeof(deadline_task_count));
+	deadline_task_delays[0][0] = 0x140; // 0x00000040
+	deadline_task_delays[0][1] = 0x180; // 0x00000080
+	deadline_task_delays[0][2] = 0x1c0; // 0x000000c0
+	deadline_task_delays[1][0] = 0x0f0; // 0xfffffff0
+	deadline_task_delays[1][1] = 0x160; // 0x00000060
+	deadline_task_delays[1][2] = 0x1a0; // 0x000000a0
+	addTask(&(deadline_tasks[0]), &deadlineTask);
+	addTask(&(deadline_tasks[1]), &deadlineTask);
+	runSchedulerFor(6);
+	check(idle_deadlines[0] == 0xfffffff0, "earliest deadline is before wrap");
+	check(idle_deadlines[1] == 0x00000040, "earliest deadline is after wrap");
+	check(idle_deadlines[2] == 0x00000060, "earliest deadline alternates between tasks (1)");
+	check(idle_deadlines[3] == 0x00000080, "earliest deadline alternates between tasks (2)");
+	check(idle_deadlines[4] == 0x000000a0, "earliest deadline alternates between tasks (3)");
+	check(idle_deadlines[5] == 0x000000c0, "earliest deadline alternates between tasks (4)");
+	// Both tasks have finished now, so the next idle has no wake-up (and
+	// the fake idle leaves the scheduler there).
+	check((num_idles == 7) && (idle_deadlines[6] == 0xffffffff), "no wake-up once deadline tasks finish");
+	check((deadline_task_count[0] == 4) && (deadline_task_runs[0][1] == 0x00000040) && (deadline_task_runs[0][3] == 0x000000c0), "task 0 ran at its deadlines");
+	check((deadline_task_count[1] == 4) && (deadline_task_runs[1][1] == 0xfffffff0) && (deadline_task_runs[1][3] == 0x000000a0), "task 1 ran at its deadlines");
+}
+
+/** Number of times each #finishingTask has run. */
+static unsigned int finishing_task_runs[3];
+/** The #finishingTask tasks. */
+static Task finishing_tasks[3];
+
+/** Task which yields a number of times (its index in #finishing_tasks),
+  * then finishes. */
+static TaskStatus finishingTask(Task *task)
+{
+	static unsigned int yields[3];
+	unsigned int n;
+
+	n = (unsigned int)(task - finishing_tasks);
+	finishing_task_runs[n]++;
+	TASK_BEGIN(task);
+	for (yields[n] = 0; yields[n] < n; yields[n]++)
+	{
+		TASK_YIELD(task);
+	}
+	TASK_END(task);
+}
+
+/** Check that finished tasks are removed from the list, whether they're at
+  * the front, in the middle or at the end. */
+static void testRemoval(void)
+{
+	Task waiting;
+	unsigned int i;
+
+	// Task 0 finishes first (from the front of the list), then task 1 (from
+	// the middle, with the waiting task after it), then task 2 (from the
+	// end, with the waiting task before it).
+	reset(0);
+	memset(finishing_task_runs, 0, sizeof(finishing_task_runs));
+	event_task_wakes = 0;
+	addTask(&(finishing_tasks[0]), &finishingTask);
+	addTask(&(finishing_tasks[1]), &finishingTask);
+	addTask(&waiting, &eventTask);
+	addTask(&(finishing_tasks[2]), &finishingTask);
+	for (i = 0; i < 6; i++)
+	{
+		signalEvents(EVENT_BUTTON_PRESS);
+		runTasksOnce();
+	}
+	check((finishing_task_runs[0] == 1) && (finishing_task_runs[1] == 2) && (finishing_task_runs[2] == 3), "finished tasks aren't run again");
+	// The first pass only starts the waiting task.
+	check(event_task_wakes == 5, "task after a removed task still runs");
+	check(runTasksOnce() == 0, "only the waiting task is left");
+
+	// A finished task can be added again.
+	addTask(&(finishing_tasks[0]), &finishingTask);
+	check(runTasksOnce() != 0, "finished task can be added again");
+	check(finishing_task_runs[0] == 2, "re-added task runs");
+	signalEvents(EVENT_BUTTON_PRESS);
+	runTasksOnce();
+	check((finishing_task_runs[0] == 2) && (event_task_wakes == 6), "re-added task is removed again");
+}
+
+/** Task added by #spawnerTask. */
+static Task child_task;
+/** Number of times #childTask has run. */
+static unsigned int child_task_runs;
+/** Number of times #spawnerTask has run. */
+static unsigned int spawner_task_runs;
+
+/** Task which is added from inside another task. It waits for one button
+  * press, then finishes. */
+static TaskStatus childTask(Task *task)
+{
+	child_task_runs++;
+	TASK_BEGIN(task);
+	TASK_WAIT_EVENT(task, EVENT_BUTTON_PRESS);
+	TASK_END(task);
+}
+
+/** Task which adds #child_task, then finishes straight away, so that the
+  * scheduler removes it from the list in the same pass. */
+static TaskStatus spawnerTask(Task *task)
+{
+	spawner_task_runs++;
+	TASK_BEGIN(task);
+	addTask(&child_task, &childTask);
+	TASK_END(task);
+}
+
+/** Check that a task can add a task. */
+static void testAddFromTask(void)
+{
+	Task waiting;
+	Task spawner;
+
+	// The spawner is the last task in the list, so the child is added
+	// right after it, and the spawner's removal has to keep the child.
+	reset(0);
+	child_task_runs = 0;
+	spawner_task_runs = 0;
+	event_task_wakes = 0;
+	addTask(&waiting, &eventTask);
+	addTask(&spawner, &spawnerTask);
+	runTasksOnce();
+	runTasksOnce();
+	check(spawner_task_runs == 1, "spawner runs once");
+	check(child_task_runs == 1, "child added by a task runs");
+	check(runTasksOnce() == 0, "child waits");
+	signalEvents(EVENT_BUTTON_PRESS);
+	check(runTasksOnce() != 0, "child and existing task wake up");
+	check((child_task_runs == 2) && (event_task_wakes == 1), "child and existing task both see the event");
+	signalEvents(EVENT_BUTTON_PRESS);
+	runTasksOnce();
+	check((child_task_runs == 2) && (event_task_wakes == 2), "finished child is removed");
+
+	// Through runScheduler(): the child must run without the CPU idling
+	// first.
+	reset(0);
+	child_task_runs = 0;
+	spawner_task_runs = 0;
+	addTask(&spawner, &spawnerTask);
+	runSchedulerFor(0);
+	check((spawner_task_runs == 1) && (child_task_runs == 1) && (num_idles == 1), "scheduler runs added task before idling");
+}
+
+int main(void)
+{
+	// A broken task list can make the scheduler go round in circles, so
+	// don't wait forever.
+	alarm(10);
+	num_failures = 0;
+	testEventWakeUp();
+	testDeadlineWrap();
+	testRemoval();
+	testAddFromTask();
+	if (num_failures != 0)
+	{
+		printf("%u checks failed\n", num_failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,343 @@
+/** \file serial_fifo_stress.c
+  *
+  * \brief Host stress test for the circular buffers in serial_fifo.c.
+  *
+  * The circular buffers are meant to be shared by exactly one producer and
+  * one consumer without any locking (see the top of serial_fifo.c). On the
+  * device, one side runs in an interrupt service handler, so races between
+  * the two sides are rare and hard to provoke. This runs the producer and
+  * consumer in two threads instead, so that they really do run at the same
+  * time, and checks that every byte comes out in the order it went in.
+  *
+  * Each round starts the free-running head and tail indices a little
+  * before 2 ^ 32, so that they wrap around during the round, and then
+  * pushes enough bytes through to go around the storage array many times.
+  * The producer picks at random between circularBufferWriteBlock(),
+  * circularBufferWrite() and circularBufferPeekFree() followed by
+  * circularBufferCommitWrite(). The storage array has spare bytes past its
+  * end, and when circularBufferPeekFree() returns a region which stops at
+  * the wrap point, the producer sometimes writes past it into the spare
+  * bytes, so that circularBufferCommitWrite() has to move them to the start
+  * of the storage array. The consumer likewise picks between
+  * circularBufferReadBlock(), circularBufferRead() and
+  * circularBufferPeek() or circularBufferPeekAt() followed by
+  * circularBufferCommitRead(). The functions in serial_fifo.c which would
+  * normally idle the CPU or disable interrupts are stubbed out here.
+  *
+  * On the device, a volatile index is enough, but between threads it isn't:
+  * it doesn't stop the host's CPU (or compiler) from making the new index
+  * visible before the bytes it covers. So serial_fifo.c is compiled into
+  * this file, with its index accesses (#LOAD_INDEX and #STORE_INDEX)
+  * replaced by acquire loads and release stores.
+  *
+  * Build and run it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -Wno-attributes -pthread -I.. -o serial_fifo_stress serial_fifo_stress.c
+  *     ./serial_fifo_stress [ROUNDS]
+  *
+  * The exit status is 0 if every byte was received intact and in order, and
+  * 1 otherwise.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "pic32_system.h"
+#include "serial_fifo.h"
+#include "usb_callbacks.h"
+
+#define LOAD_INDEX(index)			__atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define STORE_INDEX(index, value)	__atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+#include "serial_fifo.c"
+
+/** Size of the circular buffer under test, in bytes. This is small so that
+  * the indices go around the storage array often. */
+#define BUFFER_SIZE					256
+/** Number of spare bytes after the end of the storage array, which the
+  * producer may write into when using circularBufferPeekFree(). */
+#define BUFFER_EXTRA				64
+/** Number of bytes pushed through the buffer in each round. */
+#define BYTES_PER_ROUND				(4 * 1024 * 1024)
+/** Default number of rounds. */
+#define DEFAULT_ROUNDS				16
+
+/** The circular buffer under test. */
+static volatile CircularBuffer buffer;
+/** Storage for #buffer, including the spare bytes. */
+static volatile uint8_t buffer_storage[BUFFER_SIZE + BUFFER_EXTRA];
+/** Value of the head and tail indices at the start of the current round. */
+static uint32_t round_start;
+/** Number of times the producer wrote past the wrap point, in the current
+  * round. */
+static unsigned long num_moved;
+/** Number of bytes which the consumer got out of order, in the current
+  * round. */
+static unsigned long num_mismatched;
+/** Number of bytes which the consumer has received, in the current
+  * round. */
+static unsigned long num_received;
+
+uint32_t disableInterrupts(void)
+{
+	return 0;
+}
+
+void restoreInterrupts(uint32_t status)
+{
+}
+
+/** The blocking functions call this while they wait for the other side, so
+  * give the other thread a chance to run. */
+void idleWithInterruptsDisabled(void)
+{
+	sched_yield();
+}
+
+void usbFatalError(void)
+{
+	fprintf(stderr, "usbFatalError() called\n");
+	abort();
+}
+
+/** Get the byte which should be at some position in the stream. This is a
+  * hash of the position, so that a byte which turns up a multiple of
+  * #BUFFER_SIZE away from where it belongs is still caught.
+  * \param position Position in the stream, counting from the start of the
+  *                 round.
+  * \return The byte at that position.
+  */
+static uint8_t expectedByte(uint32_t position)
+{
+	position *= 2654435761u;
+	position ^= position >> 15;
+	return (uint8_t)(position >> 8);
+}
+
+/** Get a random number, using a generator which is private to a thread.
+  * \param state The generator state.
+  * \param limit One more than the largest number which may be returned.
+  * \return A random number between 0 and limit - 1.
+  */
+static uint32_t randomBelow(uint32_t *state, uint32_t limit)
+{
+	*state = *state * 1103515245u + 12345u;
+	return (*state >> 8) % limit;
+}
+
+/** The producer thread. This writes #BYTES_PER_ROUND bytes. */
+static void *producer(void *arg)
+{
+	uint8_t chunk[BUFFER_SIZE];
+	volatile uint8_t *free_region;
+	uint32_t state;
+	uint32_t sent;
+	uint32_t length;
+	uint32_t span;
+	uint32_t space;
+	uint32_t i;
+
+	state = (uint32_t)(uintptr_t)arg;
+	sent = 0;
+	while (sent < BYTES_PER_ROUND)
+	{
+		length = 1 + randomBelow(&state, BUFFER_SIZE);
+		if (length > (BYTES_PER_ROUND - sent))
+		{
+			length = BYTES_PER_ROUND - sent;
+		}
+		switch (randomBelow(&state, 3))
+		{
+		case 0:
+			for (i = 0; i < length; i++)
+			{
+				chunk[i] = expectedByte(sent + i);
+			}
+			length = circularBufferWriteBlock(&buffer, chunk, length);
+			break;
+		case 1:
+			// These block when the buffer is full.
+			length = (length + 15) / 16;
+			for (i = 0; i < length; i++)
+			{
+				circularBufferWrite(&buffer, expectedByte(sent + i), 0);
+			}
+			break;
+		default:
+			space = circularBufferSpaceRemaining(&buffer);
+			span = circularBufferPeekFree(&buffer, &free_region);
+			// When the region stops at the wrap point rather than at the
+			// tail, the spare bytes after the end of storage can be used.
+			if (span < space)
+			{
+				span += BUFFER_EXTRA;
+				if (span > space)
+				{
+					span = space;
+				}
+			}
+			if (length > span)
+			{
+				length = span;
+			}
+			for (i = 0; i < length; i++)
+			{
+				free_region[i] = expectedByte(sent + i);
+			}
+			if (&(free_region[length]) > &(buffer_storage[BUFFER_SIZE]))
+			{
+				num_moved++;
+			}
+			circularBufferCommitWrite(&buffer, length);
+			break;
+		}
+		if (length == 0)
+		{
+			sched_yield();
+		}
+		sent += length;
+	}
+	return NULL;
+}
+
+/** Check a byte which the consumer got.
+  * \param one_byte The byte.
+  */
+static void checkByte(uint8_t one_byte)
+{
+	if (one_byte != expectedByte((uint32_t)num_received))
+	{
+		if (num_mismatched == 0)
+		{
+			fprintf(stderr, "Byte %lu of round starting at 0x%08x is 0x%02x, expected 0x%02x\n", num_received, round_start, one_byte, expectedByte((uint32_t)num_received));
+		}
+		num_mismatched++;
+	}
+	num_received++;
+}
+
+/** The consumer thread. This reads #BYTES_PER_ROUND bytes. */
+static void *consumer(void *arg)
+{
+	uint8_t chunk[BUFFER_SIZE];
+	volatile uint8_t *region;
+	uint32_t state;
+	uint32_t length;
+	uint32_t offset;
+	uint32_t span;
+	uint32_t i;
+
+	state = (uint32_t)(uintptr_t)arg;
+	while (num_received < BYTES_PER_ROUND)
+	{
+		length = 1 + randomBelow(&state, BUFFER_SIZE);
+		if (length > (BYTES_PER_ROUND - num_received))
+		{
+			length = (uint32_t)(BYTES_PER_ROUND - num_received);
+		}
+		switch (randomBelow(&state, 3))
+		{
+		case 0:
+			length = circularBufferReadBlock(&buffer, chunk, length);
+			for (i = 0; i < length; i++)
+			{
+				checkByte(chunk[i]);
+			}
+			break;
+		case 1:
+			// These block when the buffer is empty.
+			length = (length + 15) / 16;
+			for (i = 0; i < length; i++)
+			{
+				checkByte(circularBufferRead(&buffer, 0));
+			}
+			break;
+		default:
+			// Look at two regions, like a consumer which has two DMA
+			// transfers queued, then commit both at once.
+			span = circularBufferPeek(&buffer, &region);
+			if (span > length)
+			{
+				span = length;
+			}
+			for (i = 0; i < span; i++)
+			{
+				checkByte(region[i]);
+			}
+			offset = span;
+			span = circularBufferPeekAt(&buffer, offset, &region);
+			if (span > (length - offset))
+			{
+				span = length - offset;
+			}
+			for (i = 0; i < span; i++)
+			{
+				checkByte(region[i]);
+			}
+			length = offset + span;
+			circularBufferCommitRead(&buffer, length);
+			break;
+		}
+		if (length == 0)
+		{
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t producer_thread;
+	pthread_t consumer_thread;
+	unsigned long total_moved;
+	unsigned int num_rounds;
+	unsigned int num_failed;
+	unsigned int round;
+
+	num_rounds = DEFAULT_ROUNDS;
+	if (argc > 1)
+	{
+		num_rounds = (unsigned int)atoi(argv[1]);
+	}
+	num_failed = 0;
+	total_moved = 0;
+	for (round = 0; round < num_rounds; round++)
+	{
+		initCircularBuffer(&buffer, buffer_storage, BUFFER_SIZE);
+		// Start somewhere in the last few laps before the indices wrap
+		// around, at a different point in the storage array each round.
+		round_start = 0u - (1 + round * 37) * (BUFFER_SIZE + 13);
+		STORE_INDEX(buffer.head, round_start);
+		STORE_INDEX(buffer.tail, round_start);
+		num_moved = 0;
+		num_mismatched = 0;
+		num_received = 0;
+		if ((pthread_create(&producer_thread, NULL, &producer, (void *)(uintptr_t)(round * 2 + 1)) != 0)
+			|| (pthread_create(&consumer_thread, NULL, &consumer, (void *)(uintptr_t)(round * 2 + 2)) != 0))
+		{
+			fprintf(stderr, "Couldn't create threads\n");
+			return 1;
+		}
+		pthread_join(producer_thread, NULL);
+		pthread_join(consumer_thread, NULL);
+		total_moved += num_moved;
+		if ((num_mismatched != 0) || (num_received != BYTES_PER_ROUND)
+			|| (LOAD_INDEX(buffer.head) != (uint32_t)(round_start + BYTES_PER_ROUND))
+			|| (LOAD_INDEX(buffer.tail) != LOAD_INDEX(buffer.head)))
+		{
+			fprintf(stderr, "Round %u failed: %lu of %lu bytes wrong, head = 0x%08x, tail = 0x%08x\n", round, num_mismatched, num_received, LOAD_INDEX(buffer.head), LOAD_INDEX(buffer.tail));
+			num_failed++;
+		}
+	}
+	printf("%u of %u rounds passed, %lu writes moved past the wrap point\n", num_rounds - num_failed, num_rounds, total_moved);
+	if ((num_failed != 0) || ((num_rounds > 0) && (total_moved == 0)))
+	{
+		return 1;
+	}
+	return 0;
+}
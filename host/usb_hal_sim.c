@@ -0,0 +1,1287 @@
+/** \file usb_hal_sim.c
+  *
+  * \brief Host-side model of the PIC32 USB module, implementing the API in
+  *        usb_hal.h.
+  *
+  * This lets the firmware's USB class drivers (usb_standard_requests.c,
+  * usb_composite.c, usb_hid_stream.c, usb_bulk_stream.c and
+  * usb_adc_stream.c) run on the host, against a simulated host controller
+  * (see usb_sim_host.c), so that enumeration and stream throughput can be
+  * measured and USB bugs can be reproduced without a board.
+  *
+  * There are two halves. The device half is usb_hal.c with the PIC32
+  * registers replaced by variables. The code which doesn't touch registers
+  * (ping-pong buffer descriptor management, transfer queues, capture ring
+  * and interrupt statistics) is shared with usb_hal.c through
+  * usb_hal_queue.h. The rest (the interrupt service handler, software data
+  * toggle checking, extended transmits, stalls and so on) is a port, and
+  * each ported function names its counterpart in usb_hal.c.
+  *
+  * The bus half (see usb_hal_sim.h) models the serial interface engine
+  * (SIE) of the USB module: given a SETUP, OUT or IN token from the host,
+  * it finds the buffer descriptor which the module would use, moves the
+  * data, hands the buffer descriptor back and pushes an entry onto a 4
+  * entry U1STAT FIFO, just like the real module. It answers with:
+  * - no response, if the device isn't connected, the address doesn't match
+  *   or the endpoint isn't enabled in that direction;
+  * - STALL, if EPSTALL or BSTALL is set (a SETUP token clears EPSTALL);
+  * - NAK, if PKTDIS is set (which every SETUP token does), if the U1STAT
+  *   FIFO is full or if the buffer descriptor isn't owned by the module.
+  *   An isochronous IN endpoint doesn't handshake, so it doesn't respond
+  *   instead.
+  *
+  * The module doesn't check data toggles (DTS is always 0 in usb_hal.c),
+  * so neither does this; that's up to the interrupt service handler. To
+  * exercise that, simDropNextHandshake() loses the next handshake on the
+  * way to the host.
+  *
+  * Interrupts are modelled with a flag. Bus functions which make the USB
+  * interrupt pending run the interrupt service handler straight away if
+  * interrupts are enabled; otherwise it runs as soon as restoreInterrupts()
+  * enables them. idleWithInterruptsDisabled() calls the idle hook (see
+  * simSetIdleHook()), which is where the simulated host gets to put
+  * transactions on the bus, until the USB interrupt or the core timer
+  * wake-up (see setCoreTimerWakeUp()) is pending. The CPU is infinitely
+  * fast: firmware code takes no simulated time.
+  *
+  * Simulated time is bus time. A frame is #SIM_FRAME_BYTES bytes long and
+  * every transaction costs its payload plus 13 bytes of tokens, handshake,
+  * CRCs and inter-packet gaps, so that at most 19 maximum size bulk packets
+  * fit in a frame, as in table 5-9 of the USB specification. getCoreTimer()
+  * advances 24 counts per byte, so a frame is 36000 counts, as on the
+  * PIC32.
+  *
+  * adc_sample_buffer and the continuous sampling functions of adc.c are
+  * simulated too, with a "DMA" which writes about 24 samples per frame into
+  * adc_sample_buffer. It writes lazily, whenever the write position is
+  * asked for or an isochronous packet is read by the host. Sample n (since
+  * sampling began) has the value n modulo 2 ^ 16, so a host can check that
+  * the stream is continuous.
+  *
+  * This file is built into the host programs which use it; see the top of
+  * usb_sim_throughput.c for an example build line.
+  *
+  * All references to the "USB specification" refer to revision 2.0, obtained
+  * from http://www.usb.org/developers/docs/usb_20_110512.zip (see usb_20.pdf)
+  * on 26 March 2012.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "usb_hal.h"
+#include "usb_defs.h"
+#include "usb_callbacks.h"
+#include "usb_standard_requests.h" // for usbResetSeen() callback
+#include "pic32_system.h"
+#include "adc.h"
+#include "usb_hal_sim.h"
+
+/** Endpoint control register bit: handshaking enabled. */
+#define EPHSHK						0x01
+/** Endpoint control register bit: endpoint is stalled. */
+#define EPSTALL						0x02
+/** Endpoint control register bit: transmit (IN) enabled. */
+#define EPTXEN						0x04
+/** Endpoint control register bit: receive (OUT and SETUP) enabled. */
+#define EPRXEN						0x08
+
+/** Number of entries in the simulated U1STAT FIFO. */
+#define STAT_FIFO_SIZE				4
+
+/** Bytes of bus time taken by a transaction, in addition to its payload:
+  * token packet, data packet overhead, handshake packet and inter-packet
+  * gaps. */
+#define TRANSACTION_OVERHEAD		13
+/** Bytes of bus time taken by a transaction which is NAKed or STALLed, or
+  * which gets no response. */
+#define HANDSHAKE_ONLY_COST			8
+/** Bytes of bus time taken by the start-of-frame packet. */
+#define SOF_COST					6
+/** Number of core timer counts per byte of bus time. */
+#define CORE_TIMER_PER_BYTE			(CORE_TIMER_FREQUENCY / 1000 / SIM_FRAME_BYTES)
+/** Number of frames a bus reset lasts for (section 7.1.7.5 of the USB
+  * specification says at least 10 ms). */
+#define RESET_FRAMES				10
+
+/** Core timer counts between samples of the simulated ADC. This gives a
+  * little over 24 samples per frame, so that the sample clock drifts
+  * relative to the frame clock, as it does on the board. */
+#define ADC_SAMPLE_PERIOD			1497
+
+/** If the CPU idles for this many frames with nothing that could wake it
+  * up, the firmware is deadlocked. */
+#define DEADLOCK_FRAMES				60000
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used in #endpoint_states to signify that no state structure has
+  * been supplied. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
+/** Simulated buffer descriptor. The first word is laid out like the real
+  * one (see usb_hal.c), so that the CPU and SIE views overlap in the same
+  * way. The buffer address is a pointer instead of a physical address,
+  * because host pointers don't fit in 32 bits. */
+typedef struct SimBufferDescriptorStruct
+{
+	union
+	{
+		/** Interpretation when handing descriptor to USB module. */
+		struct
+		{
+			unsigned int reserved1	: 2;
+			/** Set to 1 to issue stall handshake when buffer is used. */
+			unsigned int BSTALL		: 1;
+			/** Set to 1 to enable checking of data toggle sequence bit. */
+			unsigned int DTS		: 1;
+			/** Set to 1 to stop DMA from auto-incrementing address. */
+			unsigned int NINC		: 1;
+			/** Set to 1 to tell USB module to keep the buffer forever. */
+			unsigned int KEEP		: 1;
+			/** Value of data toggle sequence to use. */
+			unsigned int DATA0_1	: 1;
+			/** 0 = owned by CPU, 1 = owned by USB module. */
+			unsigned int UOWN		: 1;
+			unsigned int reserved2	: 8;
+			/** Bytes to send or maximum number of bytes to receive. */
+			unsigned int BYTE_COUNT	: 10;
+			unsigned int reserved3	: 6;
+		} CTRL;
+		/** Interpretation when getting descriptor from USB module. */
+		struct
+		{
+			unsigned int reserved1	: 2;
+			/** Packet identifier of token packet. */
+			unsigned int PID		: 4;
+			/** Value of data toggle sequence bit of transacted packet. */
+			unsigned int DATA0_1	: 1;
+			/** 0 = owned by CPU, 1 = owned by USB module. */
+			unsigned int UOWN		: 1;
+			unsigned int reserved2	: 8;
+			/** Actual number of bytes sent or received. */
+			unsigned int BYTE_COUNT	: 10;
+			unsigned int reserved3	: 6;
+		} STATUS;
+	};
+	/** Packet buffer. */
+	uint8_t *buffer;
+} SimBufferDescriptor;
+
+/** One entry of the U1STAT FIFO. */
+typedef struct SimStatusStruct
+{
+	/** Endpoint number (ENDPT). */
+	unsigned int endpoint;
+	/** 0 = receive, 1 = transmit (DIR). */
+	unsigned int direction;
+	/** Buffer descriptor which was used (PPBI). */
+	unsigned int pp;
+} SimStatus;
+
+/** Simulated buffer descriptor table. */
+static SimBufferDescriptor bdt_table[NUM_ENDPOINTS * 4];
+
+/** Point a buffer descriptor at a packet buffer. The simulated USB module
+  * reads packets straight from host memory. */
+#define SET_BUFFER_ADDRESS(index, buf)	(bdt_table[(index)].buffer = (uint8_t *)(buf))
+
+#include "usb_hal_queue.h"
+/** Simulated U1CONbits.USBEN: non-zero if the device is connected. */
+static unsigned int usb_enabled;
+/** Simulated U1CONbits.PKTDIS: non-zero if packet processing is
+  * disabled. */
+static unsigned int packets_disabled;
+/** Simulated U1ADDRbits.DEVADDR. */
+static unsigned int device_address;
+/** Simulated U1IRbits.URSTIF. */
+static unsigned int reset_flag;
+/** Simulated U1IRbits.UERRIF. */
+static unsigned int error_flag;
+/** Simulated U1IRbits.SOFIF. */
+static unsigned int sof_flag;
+/** Simulated U1IEbits.SOFIE. */
+static unsigned int sof_interrupt_enabled;
+/** Simulated endpoint control registers (U1EPx). */
+static uint32_t endpoint_control[NUM_ENDPOINTS];
+/** The buffer descriptor (#BDT_EVEN or #BDT_ODD) which the SIE will use
+  * next, for each direction of each endpoint. */
+static unsigned int hardware_pp[NUM_ENDPOINTS][2];
+/** The U1STAT FIFO. The oldest entry is at #stat_head. TRNIF is set
+  * whenever this isn't empty. */
+static SimStatus stat_fifo[STAT_FIFO_SIZE];
+/** Index into #stat_fifo of the oldest entry. */
+static unsigned int stat_head;
+/** Number of entries in #stat_fifo. */
+static unsigned int stat_count;
+/** Non-zero if the next handshake should be lost (see
+  * simDropNextHandshake()). */
+static unsigned int drop_next_handshake;
+
+/** Non-zero if interrupts are enabled. */
+static unsigned int interrupts_enabled;
+/** Number of times idleWithInterruptsDisabled() has woken up. */
+static uint32_t idle_wake_up_count;
+/** Simulated Compare CP0 register (see setCoreTimerWakeUp()). */
+static uint32_t core_timer_compare;
+/** Non-zero if the core timer wake-up is armed. */
+static unsigned int core_timer_armed;
+/** Function which idleWithInterruptsDisabled() calls while the CPU is
+  * idle. NULL means none. */
+static void (*idle_hook)(void);
+
+/** Number of frames since the simulation started. */
+static uint32_t frame_number;
+/** Bytes of bus time used so far in the current frame. */
+static uint32_t frame_bytes;
+
+/** The simulated ADC's sample buffer. */
+volatile uint16_t adc_sample_buffer[SAMPLE_BUFFER_SIZE];
+/** Non-zero if the simulated ADC is sampling continuously. */
+static unsigned int adc_running;
+/** Value of the core timer when continuous sampling began. */
+static uint32_t adc_start_time;
+/** Number of samples written since continuous sampling began. */
+static uint32_t adc_samples_written;
+
+static void usbInterruptHandler(void);
+
+/** Called by the firmware whenever an unrecoverable error occurs. */
+void usbFatalError(void)
+{
+	fprintf(stderr, "usbFatalError() called in frame %u\n", frame_number);
+	abort();
+}
+
+/** Simulated version of usbActivityLED() in pic32_system.c. There is no
+  * LED. */
+void usbActivityLED(void)
+{
+}
+
+/** Simulated version of delayCycles() in pic32_system.c. The CPU is
+  * infinitely fast, so this returns straight away. */
+void delayCycles(uint32_t num_cycles)
+{
+}
+
+/** Get the current value of the simulated core timer.
+  * \return Core timer counts since the simulation started (this wraps
+  *         around, just like on the PIC32).
+  */
+uint32_t getCoreTimer(void)
+{
+	return (uint32_t)simGetBusTime();
+}
+
+/** Check whether the USB interrupt is pending.
+  * \return Non-zero if it is pending, zero if not.
+  */
+static int isUSBInterruptPending(void)
+{
+	return (stat_count != 0) || reset_flag || error_flag
+		|| (sof_flag && sof_interrupt_enabled);
+}
+
+/** Check whether the core timer interrupt is pending.
+  * \return Non-zero if it is pending, zero if not.
+  */
+static int isCoreTimerInterruptPending(void)
+{
+	return core_timer_armed && ((int32_t)(getCoreTimer() - core_timer_compare) >= 0);
+}
+
+/** Run interrupt service handlers, for as long as interrupts are enabled
+  * and pending. */
+static void serviceInterrupts(void)
+{
+	while (interrupts_enabled
+		&& (isUSBInterruptPending() || isCoreTimerInterruptPending()))
+	{
+		interrupts_enabled = 0;
+		if (isCoreTimerInterruptPending())
+		{
+			// The core timer interrupt only wakes the CPU up.
+			core_timer_armed = 0;
+		}
+		if (isUSBInterruptPending())
+		{
+			usbInterruptHandler();
+		}
+		interrupts_enabled = 1;
+	}
+}
+
+/** Simulated version of disableInterrupts() in pic32_system.c.
+  * \return Previous interrupt state, to pass to restoreInterrupts().
+  */
+uint32_t disableInterrupts(void)
+{
+	uint32_t status;
+
+	status = interrupts_enabled;
+	interrupts_enabled = 0;
+	return status;
+}
+
+/** Simulated version of restoreInterrupts() in pic32_system.c. Any pending
+  * interrupts are serviced as soon as interrupts are enabled.
+  * \param status Value returned by disableInterrupts(), or 1 to
+  *               unconditionally enable interrupts.
+  */
+void restoreInterrupts(uint32_t status)
+{
+	if ((status & 1) != 0)
+	{
+		interrupts_enabled = 1;
+		serviceInterrupts();
+	}
+}
+
+/** Simulated version of idleWithInterruptsDisabled() in pic32_system.c.
+  * While the CPU is idle, the idle hook runs the rest of the world, until
+  * an interrupt is pending.
+  */
+void idleWithInterruptsDisabled(void)
+{
+	uint32_t start_frame;
+
+	start_frame = frame_number;
+	while (!isUSBInterruptPending() && !isCoreTimerInterruptPending())
+	{
+		if ((idle_hook == NULL)
+			|| (!core_timer_armed && ((frame_number - start_frame) > DEADLOCK_FRAMES)))
+		{
+			fprintf(stderr, "Firmware idled with nothing to wake it up\n");
+			usbFatalError();
+		}
+		idle_hook();
+	}
+	idle_wake_up_count++;
+}
+
+/** Simulated version of setCoreTimerWakeUp() in pic32_system.c.
+  * \param deadline The core timer value (see getCoreTimer()) to wake up at.
+  * \return Non-zero if the wake-up was set, 0 if the deadline has already
+  *         passed.
+  */
+int setCoreTimerWakeUp(uint32_t deadline)
+{
+	core_timer_compare = deadline;
+	core_timer_armed = 1;
+	if ((int32_t)(getCoreTimer() - deadline) >= 0)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/** Get the number of times the CPU has come out of idle mode.
+  * \return The number of wake-ups. This wraps around.
+  */
+uint32_t getIdleWakeUpCount(void)
+{
+	return idle_wake_up_count;
+}
+
+/** Let the simulated ADC's DMA catch up with the current time. */
+static void advanceADC(void)
+{
+	uint32_t target;
+
+	if (adc_running)
+	{
+		target = (getCoreTimer() - adc_start_time) / ADC_SAMPLE_PERIOD;
+		while (adc_samples_written != target)
+		{
+			adc_sample_buffer[adc_samples_written & (SAMPLE_BUFFER_SIZE - 1)] = (uint16_t)adc_samples_written;
+			adc_samples_written++;
+		}
+	}
+}
+
+/** Simulated version of beginContinuousADCSampling() in adc.c. */
+void beginContinuousADCSampling(void)
+{
+	adc_start_time = getCoreTimer();
+	adc_samples_written = 0;
+	adc_running = 1;
+}
+
+/** Simulated version of endContinuousADCSampling() in adc.c. */
+void endContinuousADCSampling(void)
+{
+	advanceADC();
+	adc_running = 0;
+}
+
+/** Simulated version of getADCWritePosition() in adc.c.
+  * \return Index into #adc_sample_buffer of the next sample.
+  */
+uint32_t getADCWritePosition(void)
+{
+	advanceADC();
+	return adc_samples_written & (SAMPLE_BUFFER_SIZE - 1);
+}
+
+/** Resets the USB HAL state after a USB reset. See usbHALReset() in
+  * usb_hal.c. */
+static void usbHALReset(void)
+{
+	unsigned int endpoint;
+	unsigned int i;
+	unsigned int num_receives;
+	uint8_t *receive_buffers[2];
+	uint32_t receive_lengths[2];
+	USBTransfer *receive_transfers;
+	USBTransfer *transmit_transfers;
+	PingPongState *pp_state;
+
+	device_address = 0;
+	memset(hardware_pp, 0, sizeof(hardware_pp)); // PPBRST
+	for (endpoint = 0; endpoint < NUM_ENDPOINTS; endpoint++)
+	{
+		pp_state = &(ping_pong_states[endpoint][BDT_RX]);
+		num_receives = 0;
+		for (i = 0; i < pp_state->queued; i++)
+		{
+			if ((bdt_table[BDT_IDX(endpoint, BDT_RX, pp_state->next_pp ^ i)].CTRL.UOWN != 0)
+				&& (pp_state->transfer[pp_state->next_pp ^ i] == NULL))
+			{
+				receive_buffers[num_receives] = pp_state->buffer[pp_state->next_pp ^ i];
+				receive_lengths[num_receives] = pp_state->length[pp_state->next_pp ^ i];
+				num_receives++;
+			}
+		}
+		receive_transfers = detachTransfers(endpoint, BDT_RX);
+		transmit_transfers = detachTransfers(endpoint, BDT_TX);
+		for (i = 0; i < 4; i++)
+		{
+			bdt_table[(endpoint << 2) | i].CTRL.UOWN = 0;
+		}
+		memset(ping_pong_states[endpoint], 0, sizeof(ping_pong_states[endpoint]));
+		if (endpoint_states[endpoint] != NULL)
+		{
+			endpoint_states[endpoint]->data_sequence = 0;
+			for (i = 0; i < num_receives; i++)
+			{
+				usbQueueReceivePacketToBuffer(endpoint, receive_buffers[i], receive_lengths[i]);
+			}
+		}
+		abortTransfers(receive_transfers);
+		abortTransfers(transmit_transfers);
+	}
+	usbResetSeen();
+}
+
+/** Initialise the simulated USB module, like usbInit() in usb_hal.c. This
+  * also resets simulated time and the rest of the simulated PIC32, so it
+  * should be called first. */
+void usbInit(void)
+{
+	unsigned int i;
+
+	memset(bdt_table, 0, sizeof(bdt_table));
+	memset(ping_pong_states, 0, sizeof(ping_pong_states));
+	memset(&interrupt_statistics, 0, sizeof(interrupt_statistics));
+	memset(endpoint_states, 0, sizeof(endpoint_states));
+	memset(endpoint_control, 0, sizeof(endpoint_control));
+	memset(hardware_pp, 0, sizeof(hardware_pp));
+	capture_head = 0;
+	capture_tail = 0;
+	capture_dropped = 0;
+	capture_endpoint_mask = 0;
+	usb_enabled = 0;
+	packets_disabled = 0;
+	device_address = 0;
+	reset_flag = 0;
+	error_flag = 0;
+	sof_flag = 0;
+	sof_interrupt_enabled = 0;
+	stat_head = 0;
+	stat_count = 0;
+	drop_next_handshake = 0;
+	interrupts_enabled = 0;
+	idle_wake_up_count = 0;
+	core_timer_armed = 0;
+	frame_number = 0;
+	frame_bytes = 0;
+	adc_running = 0;
+	for (i = 0; i < NUM_ENDPOINTS; i++)
+	{
+		usbDisableEndpoint(i);
+	}
+}
+
+/** Signal USB connect to host. See usbConnect() in usb_hal.c. */
+void usbConnect(void)
+{
+	usb_enabled = 1;
+}
+
+/** Signal USB disconnect to host. See usbDisconnect() in usb_hal.c. */
+void usbDisconnect(void)
+{
+	usb_enabled = 0;
+	usbHALReset();
+}
+
+/** Handoff receive buffer of the appropriate endpoint state to the USB
+  * module. See usbQueueReceivePacket() in usb_hal.c.
+  * \param endpoint The device endpoint number.
+  */
+void usbQueueReceivePacket(unsigned int endpoint)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return;
+	}
+	if (endpoint_states[endpoint] == NULL)
+	{
+		usbFatalError();
+		return;
+	}
+	usbQueueReceivePacketToBuffer(endpoint, endpoint_states[endpoint]->receive_buffer, sizeof(endpoint_states[endpoint]->receive_buffer));
+}
+
+/** Handoff a caller-supplied receive buffer to the USB module. See
+  * usbQueueReceivePacketToBuffer() in usb_hal.c.
+  * \param endpoint The device endpoint number.
+  * \param packet_buffer Persistent buffer to receive the packet into.
+  * \param length Size of packet_buffer, in bytes.
+  */
+void usbQueueReceivePacketToBuffer(unsigned int endpoint, uint8_t *packet_buffer, uint32_t length)
+{
+	PingPongState *pp_state;
+
+	if ((endpoint >= NUM_ENDPOINTS)
+		|| (endpoint_states[endpoint] == NULL)
+		|| (endpoint_states[endpoint]->receiveCallback == NULL)
+		|| (length > MAX_PACKET_SIZE))
+	{
+		usbFatalError();
+		return;
+	}
+	pp_state = &(ping_pong_states[endpoint][BDT_RX]);
+	if ((pp_state->transfer_head != NULL) || (pp_state->queued >= 2))
+	{
+		usbFatalError();
+		return;
+	}
+	armBufferDescriptor(endpoint, BDT_RX, packet_buffer, length, NULL);
+}
+
+/** Simulated interrupt service handler for USB interrupts. This is the same
+  * as _USBHandler() in usb_hal.c, except that it reads the simulated
+  * registers. */
+static void usbInterruptHandler(void)
+{
+	unsigned int endpoint;
+	unsigned int direction;
+	unsigned int is_setup;
+	unsigned int is_extended;
+	unsigned int pp;
+	EndpointState *state;
+	PingPongState *pp_state;
+	USBTransfer *transfer;
+	uint32_t index;
+	uint32_t length;
+	uint32_t transmitted_bytes;
+	uint32_t batch_size;
+
+	usbActivityLED();
+	batch_size = 0;
+	while (1)
+	{
+		if (stat_count != 0)
+		{
+			// Reading U1STAT and clearing TRNIF pops the U1STAT FIFO.
+			endpoint = stat_fifo[stat_head].endpoint;
+			direction = stat_fifo[stat_head].direction;
+			pp = stat_fifo[stat_head].pp;
+			stat_head = (stat_head + 1) % STAT_FIFO_SIZE;
+			stat_count--;
+			state = endpoint_states[endpoint];
+			if (state == NULL)
+			{
+				usbFatalError();
+				return;
+			}
+			pp_state = &(ping_pong_states[endpoint][direction]);
+			if ((pp_state->queued == 0) || (pp != pp_state->next_pp))
+			{
+				// Ping-pong state is out of sync with the USB module.
+				usbFatalError();
+				return;
+			}
+			pp_state->next_pp ^= 1;
+			pp_state->queued--;
+			transfer = pp_state->transfer[pp];
+			pp_state->transfer[pp] = NULL;
+			captureTransaction(endpoint, direction, pp, pp_state->buffer[pp]);
+			if (direction == 0)
+			{
+				index = BDT_IDX(endpoint, BDT_RX, pp);
+				length = bdt_table[index].STATUS.BYTE_COUNT;
+				is_setup = 0;
+				if (bdt_table[index].STATUS.PID == USBPID_SETUP)
+				{
+					is_setup = 1;
+					state->data_sequence = 0;
+				}
+				if (bdt_table[index].STATUS.DATA0_1 == state->data_sequence)
+				{
+					state->data_sequence ^= 1;
+					if (transfer != NULL)
+					{
+						transfer->actual_length += length;
+						if ((length < pp_state->length[pp])
+							|| (transfer->actual_length == transfer->length))
+						{
+							completeTransfer(endpoint, BDT_RX, transfer);
+						}
+						else
+						{
+							armTransfers(endpoint, BDT_RX);
+						}
+					}
+					else
+					{
+						state->receiveCallback(pp_state->buffer[pp], length, is_setup);
+					}
+				}
+				else
+				{
+					// Toggle mismatch: the packet is a retry, so ignore it.
+					if (transfer != NULL)
+					{
+						transfer->armed_length -= pp_state->length[pp];
+						transfer->fully_armed = 0;
+						armTransfers(endpoint, BDT_RX);
+					}
+					else
+					{
+						usbQueueReceivePacketToBuffer(endpoint, pp_state->buffer[pp], pp_state->length[pp]);
+					}
+				}
+				if (is_setup)
+				{
+					packets_disabled = 0;
+				}
+			}
+			else
+			{
+				if (!state->is_isochronous)
+				{
+					state->data_sequence ^= 1;
+				}
+				if (transfer != NULL)
+				{
+					index = BDT_IDX(endpoint, BDT_TX, pp);
+					transfer->actual_length += bdt_table[index].STATUS.BYTE_COUNT;
+					if (transfer->fully_armed
+						&& ((pp_state->queued == 0) || (pp_state->transfer[pp_state->next_pp] != transfer)))
+					{
+						completeTransfer(endpoint, BDT_TX, transfer);
+					}
+					else
+					{
+						armTransfers(endpoint, BDT_TX);
+					}
+				}
+				else if (state->is_extended_transmit)
+				{
+					index = BDT_IDX(endpoint, BDT_TX, pp);
+					transmitted_bytes = bdt_table[index].STATUS.BYTE_COUNT;
+					if (state->transmit_remaining < transmitted_bytes)
+					{
+						usbFatalError();
+					}
+					state->transmit_remaining -= transmitted_bytes;
+					state->transmit_buffer += transmitted_bytes;
+					length = state->transmit_remaining;
+					if (length < MAX_PACKET_SIZE)
+					{
+						is_extended = 0;
+					}
+					else
+					{
+						is_extended = 1;
+					}
+					usbQueueTransmitPacket(state->transmit_buffer, length, endpoint, is_extended);
+				}
+				else
+				{
+					state->transmitCallback();
+				}
+			}
+		}
+		else if (reset_flag)
+		{
+			reset_flag = 0;
+			usbHALReset();
+		}
+		else if (error_flag)
+		{
+			error_flag = 0;
+			fprintf(stderr, "USB error interrupt (receive buffer overrun?)\n");
+			usbFatalError();
+		}
+		else if (sof_interrupt_enabled && sof_flag)
+		{
+			sof_flag = 0;
+			usbClassStartOfFrame();
+		}
+		else
+		{
+			break;
+		}
+		batch_size++;
+	}
+	interrupt_statistics.interrupts++;
+	interrupt_statistics.events += batch_size;
+	interrupt_statistics.last_batch_size = batch_size;
+	if (batch_size > interrupt_statistics.max_batch_size)
+	{
+		interrupt_statistics.max_batch_size = batch_size;
+	}
+}
+
+/** Disable an endpoint. See usbDisableEndpoint() in usb_hal.c.
+  * \param endpoint The device endpoint number.
+  */
+void usbDisableEndpoint(unsigned int endpoint)
+{
+	USBTransfer *receive_transfers;
+	USBTransfer *transmit_transfers;
+
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return;
+	}
+	endpoint_control[endpoint] = 0;
+	endpoint_states[endpoint] = NULL;
+	reclaimBufferDescriptors(endpoint, BDT_RX);
+	reclaimBufferDescriptors(endpoint, BDT_TX);
+	receive_transfers = detachTransfers(endpoint, BDT_RX);
+	transmit_transfers = detachTransfers(endpoint, BDT_TX);
+	abortTransfers(receive_transfers);
+	abortTransfers(transmit_transfers);
+}
+
+/** Enable endpoint. See usbEnableEndpoint() in usb_hal.c.
+  * \param endpoint The endpoint number to activate.
+  * \param type The type of endpoint (see #EndpointType).
+  * \param state Pointer to buffer which holds per-endpoint state.
+  */
+void usbEnableEndpoint(unsigned int endpoint, EndpointType type, EndpointState *state)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return;
+	}
+	endpoint_states[endpoint] = state;
+	state->data_sequence = 0;
+	if (type == ISOCHRONOUS_IN_ENDPOINT)
+	{
+		state->is_isochronous = 1;
+	}
+	else
+	{
+		state->is_isochronous = 0;
+	}
+	if (state->receiveCallback != NULL)
+	{
+		usbQueueReceivePacket(endpoint);
+	}
+	if (type == IN_ENDPOINT)
+	{
+		endpoint_control[endpoint] = EPHSHK | EPTXEN;
+	}
+	else if (type == OUT_ENDPOINT)
+	{
+		endpoint_control[endpoint] = EPHSHK | EPRXEN;
+	}
+	else if (type == CONTROL_ENDPOINT)
+	{
+		endpoint_control[endpoint] = EPHSHK | EPTXEN | EPRXEN;
+	}
+	else if (type == ISOCHRONOUS_IN_ENDPOINT)
+	{
+		endpoint_control[endpoint] = EPTXEN;
+	}
+	else
+	{
+		usbFatalError();
+	}
+}
+
+/** Query whether an endpoint is enabled. See usbEndpointEnabled() in
+  * usb_hal.c.
+  * \return 0 if the endpoint is disabled, non-zero if it is enabled.
+  */
+unsigned int usbEndpointEnabled(unsigned int endpoint)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return 0;
+	}
+	return endpoint_states[endpoint] != NULL;
+}
+
+/** Queue a packet for transmission. See usbQueueTransmitPacket() in
+  * usb_hal.c.
+  * \param packet_buffer Address of persistent packet data to transmit.
+  * \param length Number of bytes to transmit.
+  * \param endpoint The endpoint number of the transmission.
+  * \param is_extended Whether to do an extended transmission.
+  */
+void usbQueueTransmitPacket(const uint8_t *packet_buffer, uint32_t length, unsigned int endpoint, unsigned int is_extended)
+{
+	unsigned int index;
+	PingPongState *pp_state;
+
+	if ((endpoint >= NUM_ENDPOINTS)
+		|| (endpoint_states[endpoint] == NULL)
+		|| (endpoint_states[endpoint]->transmitCallback == NULL))
+	{
+		usbFatalError();
+		return;
+	}
+	pp_state = &(ping_pong_states[endpoint][BDT_TX]);
+	if ((pp_state->transfer_head != NULL) || (pp_state->queued >= 2))
+	{
+		usbFatalError();
+		return;
+	}
+	if ((pp_state->queued != 0)
+		&& (is_extended || endpoint_states[endpoint]->is_extended_transmit))
+	{
+		usbFatalError();
+		return;
+	}
+	index = BDT_IDX(endpoint, BDT_TX, pp_state->next_pp ^ pp_state->queued);
+	if (bdt_table[index].CTRL.UOWN != 0)
+	{
+		usbFatalError();
+		return;
+	}
+	endpoint_states[endpoint]->transmit_remaining = length;
+	endpoint_states[endpoint]->transmit_buffer = packet_buffer;
+	if (length < MAX_PACKET_SIZE)
+	{
+		endpoint_states[endpoint]->is_extended_transmit = 0;
+	}
+	else if (length == MAX_PACKET_SIZE)
+	{
+		endpoint_states[endpoint]->is_extended_transmit = is_extended;
+	}
+	else
+	{
+		if (is_extended)
+		{
+			endpoint_states[endpoint]->is_extended_transmit = 1;
+			length = MAX_PACKET_SIZE;
+		}
+		else
+		{
+			// Tried to send a packet which is too big.
+			usbFatalError();
+		}
+	}
+	armBufferDescriptor(endpoint, BDT_TX, packet_buffer, length, NULL);
+}
+
+/** Cancel queued transmissions. Like usbCancelTransmit() in usb_hal.c, this
+  * is only allowed while PKTDIS is set (i.e. during the Setup stage of a
+  * control transfer).
+  * \param endpoint The endpoint number of the transmission to cancel.
+  */
+void usbCancelTransmit(unsigned int endpoint)
+{
+	if (!packets_disabled || (endpoint >= NUM_ENDPOINTS))
+	{
+		usbFatalError();
+		return;
+	}
+	if (cancelBufferDescriptors(endpoint, BDT_TX) == 0)
+	{
+		usbFatalError();
+	}
+}
+
+/** Cancel queued receives. Like usbCancelTransmit(), this is only allowed
+  * while PKTDIS is set.
+  * \param endpoint The endpoint number of the receive to cancel.
+  * \return Number of queued receives which were cancelled.
+  */
+unsigned int usbCancelReceive(unsigned int endpoint)
+{
+	if (!packets_disabled || (endpoint >= NUM_ENDPOINTS))
+	{
+		usbFatalError();
+		return 0;
+	}
+	return cancelBufferDescriptors(endpoint, BDT_RX);
+}
+
+/** Stall an endpoint. See usbStallEndpoint() in usb_hal.c.
+  * \param endpoint The endpoint number of the endpoint to stall.
+  */
+void usbStallEndpoint(unsigned int endpoint)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return;
+	}
+	endpoint_control[endpoint] |= EPSTALL;
+}
+
+/** Unstall an endpoint. See usbUnstallEndpoint() in usb_hal.c.
+  * \param endpoint The endpoint number of the endpoint to unstall.
+  */
+void usbUnstallEndpoint(unsigned int endpoint)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return;
+	}
+	endpoint_control[endpoint] &= ~EPSTALL;
+}
+
+/** Check whether an endpoint is stalled or not. See usbGetStallStatus() in
+  * usb_hal.c.
+  * \param endpoint The endpoint number of the endpoint to check.
+  * \return Non-zero if the endpoint is stalled, zero if it is not stalled.
+  */
+unsigned int usbGetStallStatus(unsigned int endpoint)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		usbFatalError();
+		return 1;
+	}
+	return (endpoint_control[endpoint] & EPSTALL) != 0;
+}
+
+/** Set the device address which the USB module will respond to. See
+  * usbSetDeviceAddress() in usb_hal.c.
+  * \param address The USB device address to use.
+  */
+void usbSetDeviceAddress(unsigned int address)
+{
+	device_address = address;
+}
+
+/** Enable or disable the start-of-frame interrupt. See
+  * usbEnableSOFInterrupt() in usb_hal.c.
+  * \param enable Non-zero to enable, zero to disable.
+  */
+void usbEnableSOFInterrupt(unsigned int enable)
+{
+	if (enable)
+	{
+		sof_flag = 0;
+		sof_interrupt_enabled = 1;
+	}
+	else
+	{
+		sof_interrupt_enabled = 0;
+	}
+}
+
+/** Use up some bus time in the current frame.
+  * \param bytes Number of bytes of bus time.
+  */
+static void useBusTime(uint32_t bytes)
+{
+	frame_bytes += bytes;
+	if (frame_bytes > SIM_FRAME_BYTES)
+	{
+		// Babble. The host controller should never let this happen.
+		fprintf(stderr, "Transaction overran the end of frame %u\n", frame_number);
+		abort();
+	}
+}
+
+/** Push an entry onto the U1STAT FIFO and hand the buffer descriptor back
+  * to the CPU, as the SIE does at the end of a successful transaction.
+  * \param endpoint The endpoint number.
+  * \param direction #BDT_RX or #BDT_TX.
+  */
+static void completeTransaction(unsigned int endpoint, unsigned int direction)
+{
+	unsigned int pp;
+
+	pp = hardware_pp[endpoint][direction];
+	bdt_table[BDT_IDX(endpoint, direction, pp)].STATUS.UOWN = 0;
+	hardware_pp[endpoint][direction] ^= 1;
+	stat_fifo[(stat_head + stat_count) % STAT_FIFO_SIZE].endpoint = endpoint;
+	stat_fifo[(stat_head + stat_count) % STAT_FIFO_SIZE].direction = direction;
+	stat_fifo[(stat_head + stat_count) % STAT_FIFO_SIZE].pp = pp;
+	stat_count++;
+}
+
+/** Handle a SETUP or OUT token and its data packet.
+  * \param address Device address in the token.
+  * \param endpoint Endpoint number in the token.
+  * \param pid #USBPID_SETUP or #USBPID_OUT.
+  * \param data_toggle Data toggle of the data packet.
+  * \param packet The data.
+  * \param length Number of bytes of data.
+  * \return The handshake which the host sees.
+  */
+static SimHandshake receiveTransaction(unsigned int address, unsigned int endpoint, unsigned int pid, unsigned int data_toggle, const uint8_t *packet, uint32_t length)
+{
+	SimBufferDescriptor *bd;
+	SimHandshake result;
+
+	if ((length > MAX_PACKET_SIZE) || (endpoint >= NUM_ENDPOINTS))
+	{
+		fprintf(stderr, "Host sent a bad OUT or SETUP transaction\n");
+		abort();
+	}
+	if (!usb_enabled || (address != device_address)
+		|| ((endpoint_control[endpoint] & EPRXEN) == 0))
+	{
+		useBusTime(HANDSHAKE_ONLY_COST + length);
+		return SIM_NO_RESPONSE;
+	}
+	useBusTime(TRANSACTION_OVERHEAD + length);
+	if (pid == USBPID_SETUP)
+	{
+		// SETUP tokens clear a protocol stall.
+		endpoint_control[endpoint] &= ~EPSTALL;
+	}
+	bd = &(bdt_table[BDT_IDX(endpoint, BDT_RX, hardware_pp[endpoint][BDT_RX])]);
+	if ((endpoint_control[endpoint] & EPSTALL) != 0)
+	{
+		result = SIM_STALL;
+	}
+	else if (packets_disabled || (stat_count == STAT_FIFO_SIZE) || !bd->CTRL.UOWN)
+	{
+		result = SIM_NAK;
+	}
+	else if (bd->CTRL.BSTALL)
+	{
+		result = SIM_STALL;
+	}
+	else if (length > bd->CTRL.BYTE_COUNT)
+	{
+		// The packet doesn't fit in the buffer, so the module flags an
+		// error instead of completing the transaction.
+		error_flag = 1;
+		result = SIM_NO_RESPONSE;
+	}
+	else
+	{
+		memcpy(bd->buffer, packet, length);
+		bd->STATUS.PID = pid;
+		bd->STATUS.DATA0_1 = data_toggle;
+		bd->STATUS.BYTE_COUNT = length;
+		completeTransaction(endpoint, BDT_RX);
+		if (pid == USBPID_SETUP)
+		{
+			packets_disabled = 1;
+		}
+		result = SIM_ACK;
+		if (drop_next_handshake)
+		{
+			// The device took the packet, but the host never hears about it.
+			drop_next_handshake = 0;
+			result = SIM_NO_RESPONSE;
+		}
+	}
+	serviceInterrupts();
+	return result;
+}
+
+/** Put a SETUP transaction on the bus.
+  * \param address Device address.
+  * \param endpoint Endpoint number.
+  * \param packet The 8 byte request.
+  * \return The handshake which the host sees.
+  */
+SimHandshake simSetup(unsigned int address, unsigned int endpoint, const uint8_t *packet)
+{
+	return receiveTransaction(address, endpoint, USBPID_SETUP, 0, packet, 8);
+}
+
+/** Put an OUT transaction on the bus.
+  * \param address Device address.
+  * \param endpoint Endpoint number.
+  * \param data_toggle Data toggle (0 = DATA0, 1 = DATA1) of the data.
+  * \param packet The data.
+  * \param length Number of bytes of data (up to #MAX_PACKET_SIZE).
+  * \return The handshake which the host sees.
+  */
+SimHandshake simOut(unsigned int address, unsigned int endpoint, unsigned int data_toggle, const uint8_t *packet, uint32_t length)
+{
+	return receiveTransaction(address, endpoint, USBPID_OUT, data_toggle, packet, length);
+}
+
+/** Put an IN transaction on the bus.
+  * \param address Device address.
+  * \param endpoint Endpoint number.
+  * \param packet The data sent by the device will be written here. This
+  *               must have space for #MAX_PACKET_SIZE bytes.
+  * \param length The number of bytes sent by the device will be written
+  *               here.
+  * \param data_toggle The data toggle of the data sent by the device will be
+  *                    written here.
+  * \return #SIM_ACK if the host received data, otherwise the device's
+  *         handshake. If the next handshake is to be dropped (see
+  *         simDropNextHandshake()), the host receives the data, but the
+  *         device never sees the host's ACK, so it will send the same
+  *         packet again.
+  */
+SimHandshake simIn(unsigned int address, unsigned int endpoint, uint8_t *packet, uint32_t *length, unsigned int *data_toggle)
+{
+	SimBufferDescriptor *bd;
+	EndpointState *state;
+	SimHandshake result;
+	unsigned int is_isochronous;
+
+	*length = 0;
+	*data_toggle = 0;
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		fprintf(stderr, "Host sent a bad IN token\n");
+		abort();
+	}
+	if (!usb_enabled || (address != device_address)
+		|| ((endpoint_control[endpoint] & EPTXEN) == 0))
+	{
+		useBusTime(HANDSHAKE_ONLY_COST);
+		return SIM_NO_RESPONSE;
+	}
+	state = endpoint_states[endpoint];
+	is_isochronous = (state != NULL) && state->is_isochronous;
+	bd = &(bdt_table[BDT_IDX(endpoint, BDT_TX, hardware_pp[endpoint][BDT_TX])]);
+	if ((endpoint_control[endpoint] & EPSTALL) != 0)
+	{
+		result = SIM_STALL;
+	}
+	else if (packets_disabled || (stat_count == STAT_FIFO_SIZE) || !bd->CTRL.UOWN)
+	{
+		result = SIM_NAK;
+	}
+	else if (bd->CTRL.BSTALL)
+	{
+		result = SIM_STALL;
+	}
+	else
+	{
+		// The ADC's DMA keeps running while the packet is read out.
+		advanceADC();
+		*length = bd->CTRL.BYTE_COUNT;
+		*data_toggle = bd->CTRL.DATA0_1;
+		memcpy(packet, bd->buffer, *length);
+		useBusTime(TRANSACTION_OVERHEAD + *length);
+		if (drop_next_handshake && !is_isochronous)
+		{
+			drop_next_handshake = 0;
+		}
+		else
+		{
+			bd->STATUS.PID = USBPID_IN;
+			completeTransaction(endpoint, BDT_TX);
+		}
+		serviceInterrupts();
+		return SIM_ACK;
+	}
+	useBusTime(HANDSHAKE_ONLY_COST);
+	if (is_isochronous && (result == SIM_NAK))
+	{
+		// Isochronous endpoints don't handshake.
+		result = SIM_NO_RESPONSE;
+	}
+	return result;
+}
+
+/** Lose the next handshake of a successful non-isochronous transaction. For
+  * SETUP and OUT, the device takes the data but the host sees no response,
+  * so the host should send the same data (with the same data toggle) again.
+  * For IN, the host gets the data but the device doesn't see the host's
+  * ACK, so the device will send the same data again. Either way, the data
+  * toggle mechanism should make sure that nothing is duplicated.
+  */
+void simDropNextHandshake(void)
+{
+	drop_next_handshake = 1;
+}
+
+/** Begin a new frame. This sends a start-of-frame packet, which makes the
+  * start-of-frame interrupt pending. */
+void simStartOfFrame(void)
+{
+	frame_number++;
+	frame_bytes = 0;
+	useBusTime(SOF_COST);
+	if (usb_enabled)
+	{
+		sof_flag = 1;
+	}
+	serviceInterrupts();
+}
+
+/** Reset the bus. The reset lasts #RESET_FRAMES frames, during which there
+  * are no start-of-frame packets. */
+void simBusReset(void)
+{
+	frame_number += RESET_FRAMES;
+	frame_bytes = 0;
+	if (usb_enabled)
+	{
+		reset_flag = 1;
+	}
+	serviceInterrupts();
+}
+
+/** Get the amount of bus time left in the current frame.
+  * \return Number of bytes of bus time left.
+  */
+uint32_t simBusBytesRemaining(void)
+{
+	return SIM_FRAME_BYTES - frame_bytes;
+}
+
+/** Get the current frame number.
+  * \return Number of frames since usbInit() was called.
+  */
+uint32_t simGetFrameNumber(void)
+{
+	return frame_number;
+}
+
+/** Get the amount of simulated time which has passed since usbInit() was
+  * called.
+  * \return Simulated time, in core timer counts (see
+  *         #CORE_TIMER_FREQUENCY). Unlike getCoreTimer(), this doesn't wrap
+  *         around.
+  */
+uint64_t simGetBusTime(void)
+{
+	return ((uint64_t)frame_number * SIM_FRAME_BYTES + frame_bytes) * CORE_TIMER_PER_BYTE;
+}
+
+/** Set the function which is called while the firmware idles (see
+  * idleWithInterruptsDisabled()). This is normally the simulated host's
+  * scheduler, which puts one transaction on the bus, or starts a new frame,
+  * each time it is called.
+  * \param hook The function, or NULL for none.
+  */
+void simSetIdleHook(void (*hook)(void))
+{
+	idle_hook = hook;
+}
@@ -0,0 +1,50 @@
+/** \file usb_hal_sim.h
+  *
+  * \brief Describes the bus side of the simulated USB module in
+  *        usb_hal_sim.c.
+  *
+  * The device side of usb_hal_sim.c is the API in usb_hal.h. The functions
+  * here are what a simulated host (see usb_sim_host.c) uses to put
+  * transactions on the bus and to advance time.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef USB_HAL_SIM_H
+#define	USB_HAL_SIM_H
+
+#include <stdint.h>
+
+/** Number of bytes of bus time in one frame. Full speed USB transfers
+  * 12 megabits per second, so this is 1 millisecond. */
+#define SIM_FRAME_BYTES				1500
+
+/** How a transaction ended, from the host's point of view. */
+typedef enum SimHandshakeEnum
+{
+	/** The device accepted the data (OUT or SETUP), or the host received
+	  * data from the device (IN). */
+	SIM_ACK				= 0,
+	/** The device wasn't ready. The host should try again later. */
+	SIM_NAK				= 1,
+	/** The endpoint is halted, or the request was not supported. */
+	SIM_STALL			= 2,
+	/** The device didn't respond at all. This happens when the device
+	  * isn't connected, the address is wrong, the endpoint isn't enabled in
+	  * that direction, an isochronous IN endpoint has nothing queued, or
+	  * a handshake was lost (see simDropNextHandshake()). */
+	SIM_NO_RESPONSE		= 3
+} SimHandshake;
+
+extern void simBusReset(void);
+extern void simStartOfFrame(void);
+extern SimHandshake simSetup(unsigned int address, unsigned int endpoint, const uint8_t *packet);
+extern SimHandshake simOut(unsigned int address, unsigned int endpoint, unsigned int data_toggle, const uint8_t *packet, uint32_t length);
+extern SimHandshake simIn(unsigned int address, unsigned int endpoint, uint8_t *packet, uint32_t *length, unsigned int *data_toggle);
+extern void simDropNextHandshake(void);
+extern uint32_t simBusBytesRemaining(void);
+extern uint32_t simGetFrameNumber(void);
+extern uint64_t simGetBusTime(void);
+extern void simSetIdleHook(void (*hook)(void));
+
+#endif // #ifndef USB_HAL_SIM_H
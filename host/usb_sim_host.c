@@ -0,0 +1,546 @@
+/** \file usb_sim_host.c
+  *
+  * \brief A scripted USB host controller, for the simulated USB module in
+  *        usb_hal_sim.c.
+  *
+  * This schedules transactions roughly the way a real full speed host
+  * controller does. Each frame, every interrupt and isochronous pipe gets
+  * one transaction, then bulk pipes share whatever bus time is left, in
+  * round-robin order. A bulk pipe which is NAKed isn't tried again until the
+  * next frame (real host controllers retry sooner, but since the simulated
+  * device is infinitely fast, a NAK means it is waiting for something which
+  * won't happen in this frame anyway). Data toggles are tracked per pipe,
+  * so IN packets which the device retransmits after a lost handshake are
+  * discarded, and OUT packets which the device NAKs or doesn't acknowledge
+  * are sent again with the same data toggle.
+  *
+  * simRunHost() does one step of this schedule: one transaction, or the
+  * start of a new frame. A firmware program normally calls it from the idle
+  * hook (see simSetIdleHook()), so that the host runs whenever the firmware
+  * is waiting for USB, and from its own loops while it waits for the host
+  * to catch up.
+  *
+  * Control transfers (simControlTransfer()) and enumeration (simEnumerate())
+  * take over the bus until they are done, so that they can be used as
+  * straight-line code.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "usb_hal.h"
+#include "usb_defs.h"
+#include "usb_hal_sim.h"
+#include "usb_sim_host.h"
+
+/** Bytes of bus time which must be left in a frame before any transaction
+  * is started. This is enough for a maximum size packet plus its token,
+  * handshake and inter-packet gaps. */
+#define TRANSACTION_RESERVE			(MAX_PACKET_SIZE + 13)
+
+/** Number of times a control transaction is tried before the control
+  * transfer is abandoned. */
+#define CONTROL_RETRY_LIMIT			1000
+
+/** Maximum size of a HID report descriptor which simEnumerate() can
+  * read. */
+#define MAX_REPORT_DESCRIPTOR_SIZE	4096
+
+/** Pipes which are in the schedule, in the order they were added. */
+static SimPipe *pipes;
+/** Position in #pipes of the bulk pipe which most recently had a
+  * transaction, for round-robin scheduling. */
+static unsigned int bulk_cursor;
+
+/** Add a pipe to the end of the host's schedule. Its statistics are
+  * cleared, but its data toggle is kept: the device only resets its own
+  * data toggles at "Set Configuration", so a pipe which is removed and added
+  * again must carry on where it left off. A new pipe should be zeroed, so
+  * that it starts at DATA0.
+  * \param pipe The pipe to add. This must persist until it is removed.
+  */
+void simAddPipe(SimPipe *pipe)
+{
+	SimPipe **link;
+
+	pipe->pending_length = -1;
+	pipe->next_frame = simGetFrameNumber();
+	pipe->packets = 0;
+	pipe->bytes = 0;
+	pipe->naks = 0;
+	pipe->duplicates = 0;
+	pipe->no_responses = 0;
+	pipe->stalls = 0;
+	pipe->next = NULL;
+	link = &pipes;
+	while (*link != NULL)
+	{
+		link = &((*link)->next);
+	}
+	*link = pipe;
+}
+
+/** Remove a pipe from the host's schedule. Any OUT packet which the device
+  * hasn't accepted yet is forgotten.
+  * \param pipe The pipe to remove.
+  */
+void simRemovePipe(SimPipe *pipe)
+{
+	SimPipe **link;
+
+	link = &pipes;
+	while (*link != NULL)
+	{
+		if (*link == pipe)
+		{
+			*link = pipe->next;
+			break;
+		}
+		link = &((*link)->next);
+	}
+	bulk_cursor = 0;
+}
+
+/** Remove every pipe from the host's schedule. */
+void simRemoveAllPipes(void)
+{
+	pipes = NULL;
+	bulk_cursor = 0;
+}
+
+/** Count a transaction which didn't transfer any data, and decide when the
+  * pipe should next be tried.
+  * \param pipe The pipe.
+  * \param result How the transaction ended.
+  */
+static void countFailedTransaction(SimPipe *pipe, SimHandshake result)
+{
+	if (result == SIM_NAK)
+	{
+		pipe->naks++;
+	}
+	else if (result == SIM_STALL)
+	{
+		pipe->stalls++;
+	}
+	else
+	{
+		pipe->no_responses++;
+	}
+	if (result != SIM_NO_RESPONSE)
+	{
+		// Try again next frame. A lost handshake is retried straight away,
+		// like a real host controller does after a timeout.
+		pipe->next_frame = simGetFrameNumber() + 1;
+	}
+}
+
+/** Do one transaction on a pipe.
+  * \param pipe The pipe.
+  */
+static void pipeTransaction(SimPipe *pipe)
+{
+	uint8_t packet[MAX_PACKET_SIZE];
+	uint32_t length;
+	unsigned int endpoint;
+	unsigned int data_toggle;
+	SimHandshake result;
+
+	endpoint = pipe->endpoint_address & 0x0f;
+	if ((pipe->endpoint_address & 0x80) != 0)
+	{
+		result = simIn(SIM_DEVICE_ADDRESS, endpoint, packet, &length, &data_toggle);
+		if (result != SIM_ACK)
+		{
+			countFailedTransaction(pipe, result);
+		}
+		else if ((pipe->type != SIM_PIPE_ISOCHRONOUS) && (data_toggle != pipe->data_toggle))
+		{
+			// The device didn't see the ACK for the previous packet, so
+			// this is a retransmission of it.
+			pipe->duplicates++;
+		}
+		else
+		{
+			if (pipe->type != SIM_PIPE_ISOCHRONOUS)
+			{
+				pipe->data_toggle ^= 1;
+			}
+			pipe->packets++;
+			pipe->bytes += length;
+			if (pipe->received != NULL)
+			{
+				pipe->received(pipe, packet, length);
+			}
+		}
+	}
+	else
+	{
+		if (pipe->pending_length < 0)
+		{
+			pipe->pending_length = pipe->transmit(pipe, pipe->pending_packet);
+			if (pipe->pending_length < 0)
+			{
+				// Nothing to send yet.
+				pipe->next_frame = simGetFrameNumber() + 1;
+				return;
+			}
+		}
+		result = simOut(SIM_DEVICE_ADDRESS, endpoint, pipe->data_toggle, pipe->pending_packet, (uint32_t)pipe->pending_length);
+		if (result != SIM_ACK)
+		{
+			countFailedTransaction(pipe, result);
+		}
+		else
+		{
+			pipe->data_toggle ^= 1;
+			pipe->packets++;
+			pipe->bytes += (uint32_t)pipe->pending_length;
+			pipe->pending_length = -1;
+		}
+	}
+}
+
+/** Check whether a pipe may be used in the current frame.
+  * \param pipe The pipe.
+  * \return Non-zero if it may be used, zero if not.
+  */
+static int isPipeDue(SimPipe *pipe)
+{
+	return (int32_t)(simGetFrameNumber() - pipe->next_frame) >= 0;
+}
+
+/** Do one step of the host's schedule: either one transaction, or the start
+  * of a new frame if nothing else can be done in this frame. Any
+  * callbacks of the pipe are called from here. */
+void simRunHost(void)
+{
+	SimPipe *pipe;
+	unsigned int count;
+	unsigned int index;
+	unsigned int i;
+
+	if (simBusBytesRemaining() >= TRANSACTION_RESERVE)
+	{
+		count = 0;
+		for (pipe = pipes; pipe != NULL; pipe = pipe->next)
+		{
+			if ((pipe->type != SIM_PIPE_BULK) && isPipeDue(pipe))
+			{
+				// Periodic pipes get one transaction per frame.
+				pipe->next_frame = simGetFrameNumber() + 1;
+				pipeTransaction(pipe);
+				return;
+			}
+			count++;
+		}
+		for (i = 1; i <= count; i++)
+		{
+			index = (bulk_cursor + i) % count;
+			pipe = pipes;
+			while (index-- > 0)
+			{
+				pipe = pipe->next;
+			}
+			if ((pipe->type == SIM_PIPE_BULK) && isPipeDue(pipe))
+			{
+				bulk_cursor = (bulk_cursor + i) % count;
+				pipeTransaction(pipe);
+				return;
+			}
+		}
+	}
+	simStartOfFrame();
+}
+
+/** Make sure there is enough bus time left in the current frame for a
+  * control transaction, starting a new frame if there isn't. */
+static void reserveBusTime(void)
+{
+	if (simBusBytesRemaining() < TRANSACTION_RESERVE)
+	{
+		simStartOfFrame();
+	}
+}
+
+/** Decide whether to try a control transaction again. The next try is put
+  * in the next frame.
+  * \param retries Number of tries so far. This will be incremented.
+  * \return Non-zero to try again, zero to give up.
+  */
+static int retryControlTransaction(unsigned int *retries)
+{
+	(*retries)++;
+	if (*retries >= CONTROL_RETRY_LIMIT)
+	{
+		return 0;
+	}
+	simStartOfFrame();
+	return 1;
+}
+
+/** Do a control transfer on endpoint 0. This returns once the Status stage
+  * is complete (or the transfer failed).
+  * \param address Device address.
+  * \param setup The 8 byte request. The direction and length of the Data
+  *              stage come from bmRequestType and wLength.
+  * \param data For device-to-host requests, the data from the device will
+  *             be written here; this must have space for wLength bytes.
+  *             For host-to-device requests, wLength bytes of data to send.
+  *             This can be NULL if wLength is 0.
+  * \param length For device-to-host requests, the number of bytes the device
+  *               actually sent will be written here. This can be NULL.
+  * \return #SIM_ACK on success, #SIM_STALL if the device stalled the
+  *         request, otherwise the handshake which was seen when the host
+  *         gave up.
+  */
+int simControlTransfer(unsigned int address, const uint8_t *setup, uint8_t *data, uint32_t *length)
+{
+	uint8_t packet[MAX_PACKET_SIZE];
+	uint32_t packet_length;
+	uint32_t requested;
+	uint32_t done;
+	uint32_t count;
+	unsigned int is_in;
+	unsigned int data_toggle;
+	unsigned int received_toggle;
+	unsigned int retries;
+	SimHandshake result;
+
+	requested = setup[6] | (setup[7] << 8);
+	is_in = (setup[0] & 0x80) != 0;
+	retries = 0;
+	// Setup stage.
+	while (1)
+	{
+		reserveBusTime();
+		result = simSetup(address, 0, setup);
+		if ((result == SIM_ACK) || !retryControlTransaction(&retries))
+		{
+			break;
+		}
+	}
+	if (result != SIM_ACK)
+	{
+		return result;
+	}
+	// Data stage. This always begins with DATA1 (section 8.5.3 of the USB
+	// specification).
+	data_toggle = 1;
+	done = 0;
+	while (done < requested)
+	{
+		reserveBusTime();
+		if (is_in)
+		{
+			result = simIn(address, 0, packet, &packet_length, &received_toggle);
+			if ((result == SIM_ACK) && (received_toggle == data_toggle))
+			{
+				data_toggle ^= 1;
+				count = MIN(packet_length, requested - done);
+				memcpy(&(data[done]), packet, count);
+				done += count;
+				if (packet_length < MAX_PACKET_SIZE)
+				{
+					// A short packet ends the Data stage early.
+					break;
+				}
+				continue;
+			}
+			else if (result == SIM_ACK)
+			{
+				// Retransmission of a packet which was already received.
+				continue;
+			}
+		}
+		else
+		{
+			count = MIN(requested - done, MAX_PACKET_SIZE);
+			result = simOut(address, 0, data_toggle, &(data[done]), count);
+			if (result == SIM_ACK)
+			{
+				data_toggle ^= 1;
+				done += count;
+				continue;
+			}
+		}
+		if ((result == SIM_STALL) || !retryControlTransaction(&retries))
+		{
+			return result;
+		}
+	}
+	// Status stage. This goes in the opposite direction to the Data stage (or
+	// IN if there was no Data stage) and always uses DATA1.
+	while (1)
+	{
+		reserveBusTime();
+		if (is_in && (requested != 0))
+		{
+			result = simOut(address, 0, 1, packet, 0);
+		}
+		else
+		{
+			result = simIn(address, 0, packet, &packet_length, &received_toggle);
+			if ((result == SIM_ACK) && (packet_length != 0))
+			{
+				fprintf(stderr, "Device sent %u bytes in the Status stage of request 0x%02x\n", packet_length, setup[1]);
+				return SIM_STALL;
+			}
+		}
+		if ((result == SIM_ACK) || (result == SIM_STALL)
+			|| !retryControlTransaction(&retries))
+		{
+			break;
+		}
+	}
+	if (result != SIM_ACK)
+	{
+		return result;
+	}
+	if (length != NULL)
+	{
+		*length = done;
+	}
+	return SIM_ACK;
+}
+
+/** Do one control transfer for simEnumerate(), and count it.
+  * \param enumeration Where the count is kept.
+  * \param address Device address.
+  * \param bmRequestType Request type.
+  * \param bRequest Request.
+  * \param wValue Request-specific value.
+  * \param wIndex Request-specific index.
+  * \param wLength Length of the Data stage.
+  * \param data See simControlTransfer().
+  * \param length See simControlTransfer().
+  * \return Non-zero on success, zero on failure.
+  */
+static int enumerationRequest(SimEnumeration *enumeration, unsigned int address, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data, uint32_t *length)
+{
+	uint8_t setup[8];
+	int result;
+
+	setup[0] = bmRequestType;
+	setup[1] = bRequest;
+	setup[2] = (uint8_t)wValue;
+	setup[3] = (uint8_t)(wValue >> 8);
+	setup[4] = (uint8_t)wIndex;
+	setup[5] = (uint8_t)(wIndex >> 8);
+	setup[6] = (uint8_t)wLength;
+	setup[7] = (uint8_t)(wLength >> 8);
+	enumeration->control_transfers++;
+	result = simControlTransfer(address, setup, data, length);
+	if (result != SIM_ACK)
+	{
+		fprintf(stderr, "Request 0x%02x (wValue = 0x%04x) failed with handshake %d\n", bRequest, wValue, result);
+		return 0;
+	}
+	return 1;
+}
+
+/** Reset and enumerate the device, the way an operating system does when
+  * the device is plugged in: read the device descriptor, give the device
+  * address #SIM_DEVICE_ADDRESS, read the device and configuration
+  * descriptors, set the configuration and then read the HID report
+  * descriptor, if there is one. This leaves the device configured.
+  * \param enumeration What was found out will be written here.
+  * \return Non-zero on success, zero if any request failed.
+  */
+int simEnumerate(SimEnumeration *enumeration)
+{
+	static uint8_t report_descriptor[MAX_REPORT_DESCRIPTOR_SIZE];
+	uint8_t buffer[MAX_PACKET_SIZE];
+	uint8_t *descriptor;
+	uint32_t start_frame;
+	uint64_t start_time;
+	uint32_t length;
+	uint32_t total_length;
+	uint32_t offset;
+	uint32_t report_length;
+	unsigned int hid_interface;
+
+	memset(enumeration, 0, sizeof(*enumeration));
+	start_frame = simGetFrameNumber();
+	start_time = simGetBusTime();
+	simBusReset();
+	simStartOfFrame();
+	// Like Windows, ask for a maximum packet's worth of the device
+	// descriptor before setting the address, to find out how big the
+	// control endpoint's packets are.
+	if (!enumerationRequest(enumeration, 0, 0x80, GET_DESCRIPTOR, DESCRIPTOR_DEVICE << 8, 0, MAX_PACKET_SIZE, buffer, &length))
+	{
+		return 0;
+	}
+	if (!enumerationRequest(enumeration, 0, 0x00, SET_ADDRESS, SIM_DEVICE_ADDRESS, 0, 0, NULL, NULL))
+	{
+		return 0;
+	}
+	// Section 9.2.6.3 of the USB specification gives the device 2 ms to
+	// start using its new address.
+	simStartOfFrame();
+	simStartOfFrame();
+	if (!enumerationRequest(enumeration, SIM_DEVICE_ADDRESS, 0x80, GET_DESCRIPTOR, DESCRIPTOR_DEVICE << 8, 0, sizeof(enumeration->device_descriptor), enumeration->device_descriptor, &length))
+	{
+		return 0;
+	}
+	if (length != sizeof(enumeration->device_descriptor))
+	{
+		fprintf(stderr, "Device descriptor is %u bytes long\n", length);
+		return 0;
+	}
+	if (!enumerationRequest(enumeration, SIM_DEVICE_ADDRESS, 0x80, GET_DESCRIPTOR, DESCRIPTOR_CONFIGURATION << 8, 0, 9, enumeration->configuration_descriptor, &length))
+	{
+		return 0;
+	}
+	total_length = enumeration->configuration_descriptor[2] | (enumeration->configuration_descriptor[3] << 8);
+	if ((length != 9) || (total_length > SIM_MAX_CONFIGURATION_SIZE))
+	{
+		fprintf(stderr, "Bad configuration descriptor\n");
+		return 0;
+	}
+	if (!enumerationRequest(enumeration, SIM_DEVICE_ADDRESS, 0x80, GET_DESCRIPTOR, DESCRIPTOR_CONFIGURATION << 8, 0, (uint16_t)total_length, enumeration->configuration_descriptor, &(enumeration->configuration_length)))
+	{
+		return 0;
+	}
+	if (!enumerationRequest(enumeration, SIM_DEVICE_ADDRESS, 0x00, SET_CONFIGURATION, enumeration->configuration_descriptor[5], 0, 0, NULL, NULL))
+	{
+		return 0;
+	}
+	// Look for a HID descriptor, which says how long the report descriptor
+	// is.
+	hid_interface = 0;
+	report_length = 0;
+	offset = 0;
+	while ((offset + 2) <= enumeration->configuration_length)
+	{
+		descriptor = &(enumeration->configuration_descriptor[offset]);
+		if (descriptor[0] < 2)
+		{
+			break;
+		}
+		if (descriptor[1] == DESCRIPTOR_INTERFACE)
+		{
+			hid_interface = descriptor[2];
+		}
+		else if ((descriptor[1] == DESCRIPTOR_HID) && (descriptor[0] >= 9))
+		{
+			report_length = descriptor[7] | (descriptor[8] << 8);
+			break;
+		}
+		offset += descriptor[0];
+	}
+	if ((report_length != 0) && (report_length <= sizeof(report_descriptor)))
+	{
+		if (!enumerationRequest(enumeration, SIM_DEVICE_ADDRESS, 0x81, GET_DESCRIPTOR, DESCRIPTOR_REPORT << 8, (uint16_t)hid_interface, (uint16_t)report_length, report_descriptor, &(enumeration->report_descriptor_length)))
+		{
+			return 0;
+		}
+	}
+	enumeration->frames = simGetFrameNumber() - start_frame;
+	enumeration->bus_time = simGetBusTime() - start_time;
+	return 1;
+}
@@ -0,0 +1,113 @@
+/** \file usb_sim_host.h
+  *
+  * \brief Describes the functions and types exported by usb_sim_host.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef USB_SIM_HOST_H
+#define	USB_SIM_HOST_H
+
+#include <stdint.h>
+#include "usb_hal.h"
+
+/** The address which simEnumerate() gives the device. */
+#define SIM_DEVICE_ADDRESS			1
+
+/** Maximum size of a configuration descriptor (including all its interface,
+  * class and endpoint descriptors) which simEnumerate() can read. */
+#define SIM_MAX_CONFIGURATION_SIZE	256
+
+/** Transfer type of a #SimPipe. */
+typedef enum SimPipeTypeEnum
+{
+	/** Polled once per frame, before any bulk pipe. Data toggles are
+	  * used. */
+	SIM_PIPE_INTERRUPT			= 0,
+	/** Uses whatever bus time is left in the frame. Data toggles are
+	  * used. */
+	SIM_PIPE_BULK				= 1,
+	/** Polled once per frame, before any bulk pipe. There are no
+	  * handshakes and no retries. Only IN is supported. */
+	SIM_PIPE_ISOCHRONOUS		= 2
+} SimPipeType;
+
+/** A host-side pipe to one non-control endpoint of the simulated device.
+  * Fill in endpoint_address, type and one of the callbacks, then pass it to
+  * simAddPipe(). Everything else is private to usb_sim_host.c, apart from the
+  * statistics, which may be read (and cleared) at any time. */
+typedef struct SimPipeStruct
+{
+	/** Endpoint address, as in an endpoint descriptor: bit 7 is set for IN
+	  * endpoints. */
+	uint8_t endpoint_address;
+	/** Transfer type of the endpoint. */
+	SimPipeType type;
+	/** For IN pipes: called for every packet received, with duplicates
+	  * (retries which the data toggle says have already been received)
+	  * removed. */
+	void (*received)(struct SimPipeStruct *pipe, const uint8_t *packet, uint32_t length);
+	/** For OUT pipes: called to get the next packet to send. This should
+	  * write up to #MAX_PACKET_SIZE bytes into packet and return how many
+	  * it wrote, or return -1 if there is nothing to send yet. A packet
+	  * is only asked for once; it is retried until the device accepts
+	  * it. */
+	int (*transmit)(struct SimPipeStruct *pipe, uint8_t *packet);
+	/** Data toggle of the next packet to send or receive. */
+	unsigned int data_toggle;
+	/** OUT packet which the device hasn't accepted yet. */
+	uint8_t pending_packet[MAX_PACKET_SIZE];
+	/** Number of bytes in #pending_packet, or -1 if there's no pending
+	  * packet. */
+	int pending_length;
+	/** Frame number at which the pipe may next be used. */
+	uint32_t next_frame;
+	/** Number of packets successfully transferred. */
+	uint32_t packets;
+	/** Number of data bytes successfully transferred. */
+	uint32_t bytes;
+	/** Number of transactions which the device NAKed. */
+	uint32_t naks;
+	/** Number of IN packets which were discarded because of a data toggle
+	  * mismatch. */
+	uint32_t duplicates;
+	/** Number of transactions which got no response. For isochronous pipes,
+	  * this is the number of frames in which the device had nothing to
+	  * send. */
+	uint32_t no_responses;
+	/** Number of transactions which the device STALLed. */
+	uint32_t stalls;
+	/** Next pipe in the host's schedule. */
+	struct SimPipeStruct *next;
+} SimPipe;
+
+/** What simEnumerate() found out about the device, and how long it took. */
+typedef struct SimEnumerationStruct
+{
+	/** The device descriptor. */
+	uint8_t device_descriptor[18];
+	/** The configuration descriptor, including all its interface, class
+	  * and endpoint descriptors. */
+	uint8_t configuration_descriptor[SIM_MAX_CONFIGURATION_SIZE];
+	/** Number of valid bytes in #configuration_descriptor. */
+	uint32_t configuration_length;
+	/** Size of the HID report descriptor which was read, in bytes. */
+	uint32_t report_descriptor_length;
+	/** Number of control transfers done. */
+	uint32_t control_transfers;
+	/** Number of frames from the start of the bus reset to the end of the
+	  * last control transfer. */
+	uint32_t frames;
+	/** Simulated time taken, in core timer counts (see
+	  * #CORE_TIMER_FREQUENCY). */
+	uint64_t bus_time;
+} SimEnumeration;
+
+extern void simAddPipe(SimPipe *pipe);
+extern void simRemovePipe(SimPipe *pipe);
+extern void simRemoveAllPipes(void);
+extern void simRunHost(void);
+extern int simControlTransfer(unsigned int address, const uint8_t *setup, uint8_t *data, uint32_t *length);
+extern int simEnumerate(SimEnumeration *enumeration);
+
+#endif // #ifndef USB_SIM_HOST_H
@@ -0,0 +1,679 @@
+/** \file usb_sim_throughput.c
+  *
+  * \brief Enumeration time and stream throughput of the firmware's USB
+  *        stack, measured on the host against a simulated USB module.
+  *
+  * This links the firmware's USB class drivers with the simulated USB
+  * module in usb_hal_sim.c and the scripted host controller in
+  * usb_sim_host.c. It enumerates the device, then pushes a known byte
+  * pattern through each stream in turn and checks that it arrives intact:
+  * - HID IN and HID OUT, using streamWrite() and streamRead() on the
+  *   device and the Interrupt endpoints on the host. Every HID IN report
+  *   but the last must be full (63 data bytes);
+  * - Bulk IN and Bulk OUT, using bulkStreamWrite() and bulkStreamRead();
+  * - the Isochronous ADC stream, after selecting alternate setting 1 of its
+  *   interface, checking that the samples are consecutive. Then the host
+  *   stops reading for longer than the ADC sample buffer lasts, and the
+  *   stream must pick up again with exactly one discontinuity.
+  *
+  * Next, the device runs the scheduler with a task which reads the HID
+  * stream when it is told that data has arrived (like the remote command
+  * task in main.c), and the host sends it a report using only the HID
+  * "Set Report" request. The task must get the report.
+  *
+  * Finally, the device runs the scheduler with nothing to do but that task
+  * and one which wakes up as often as the button task in main.c, and the
+  * idle wake-up rate is measured: once with the bus idle (the host still
+  * polls the HID Interrupt IN endpoint, which NAKs), and once with a byte
+  * held back by HID transmit coalescing (see streamSetTransmitCoalescing()),
+  * which keeps the start-of-frame interrupt on. The simulation has no
+  * Timer4, so the board's rate is 20 per second higher than this.
+  *
+  * The device side runs the same way as on the board: the "main loop" calls
+  * the blocking stream functions, which idle with interrupts disabled while
+  * they wait, and the USB interrupt service handler does the rest. While
+  * the device idles, the simulated host gets to put transactions on the
+  * bus. Times are in simulated bus time, so they are what a full speed bus
+  * would allow if the PIC32 took no time at all to handle each packet. They
+  * are an upper bound on what the board can do, and they show how much bus
+  * time each stream's packet scheduling wastes (for example, HID reports
+  * can only go once per frame).
+  *
+  * With -d N, one handshake in every N host steps is lost, so that both
+  * ends have to use the data toggles to resynchronise. The streams must
+  * still arrive intact.
+  *
+  * Build and run it on the host with:
+  *
+  *     gcc -std=gnu99 -O2 -Wall -Wno-attributes -I.. -o usb_sim_throughput usb_sim_throughput.c usb_sim_host.c usb_hal_sim.c ../usb_standard_requests.c ../usb_composite.c ../usb_hid_stream.c ../usb_bulk_stream.c ../usb_adc_stream.c ../serial_fifo.c ../scheduler.c
+  *     ./usb_sim_throughput [-d N] [BYTES]
+  *
+  * BYTES is the number of bytes pushed through each stream (default
+  * 262144). The exit status is 0 if enumeration succeeded and every stream
+  * arrived intact, and 1 otherwise.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "pic32_system.h"
+#include "usb_hal.h"
+#include "usb_defs.h"
+#include "usb_standard_requests.h"
+#include "usb_hid_stream.h"
+#include "usb_bulk_stream.h"
+#include "usb_adc_stream.h"
+#include "scheduler.h"
+#include "pushbuttons.h"
+#include "usb_hal_sim.h"
+#include "usb_sim_host.h"
+
+/** Default number of bytes pushed through each stream. */
+#define DEFAULT_TEST_BYTES			(256 * 1024)
+/** Number of bytes the device reads or writes per stream function call. */
+#define CHUNK_SIZE					256
+/** Number of frames the Isochronous stream is read for. */
+#define ISOCHRONOUS_FRAMES			2000
+/** Number of frames the host stops reading the Isochronous stream for.
+  * This is longer than the ADC sample buffer lasts (about 170 frames), so
+  * the device has to drop samples. */
+#define ISOCHRONOUS_PAUSE_FRAMES	300
+/** Number of frames the Isochronous stream is read for after the pause. */
+#define ISOCHRONOUS_RESUME_FRAMES	100
+/** Interface number of the ADC stream interface. */
+#define ADC_STREAM_INTERFACE		2
+/** Number of data bytes in the report which runSetReportTest() sends. */
+#define SET_REPORT_LENGTH			5
+/** Number of frames each idle wake-up rate is measured over. */
+#define IDLE_FRAMES					1000
+
+/** Number of bytes pushed through each stream. */
+static uint32_t test_bytes;
+/** One handshake in this many host steps is lost. 0 means none are. */
+static unsigned int drop_interval;
+/** Number of host steps so far. */
+static unsigned int host_steps;
+/** Number of bytes the host has sent or received in the current test. */
+static uint32_t host_position;
+/** Number of bytes (or samples, for the Isochronous stream) which arrived
+  * wrong in the current test. */
+static uint32_t num_mismatched;
+/** Next sample number expected on the Isochronous stream. */
+static uint32_t expected_sample;
+/** Number of Isochronous samples received. */
+static uint32_t num_samples;
+/** Number of HID reports received with fewer than #MAX_PACKET_SIZE - 1 data
+  * bytes. */
+static uint32_t num_short_reports;
+/** Value of #num_samples at the first out of sequence sample in the current
+  * test. */
+static uint32_t first_mismatched_sample;
+/** Task which wakes up as often as the button task in main.c. */
+static Task periodic_task;
+/** Task which reads from the HID stream when it is told to (see
+  * receiveTask()). */
+static Task receive_task;
+
+/** Get the byte which should be at some position in a stream. See
+  * expectedByte() in serial_fifo_stress.c.
+  * \param position Position in the stream.
+  * \return The byte at that position.
+  */
+static uint8_t expectedByte(uint32_t position)
+{
+	position *= 2654435761u;
+	position ^= position >> 15;
+	return (uint8_t)(position >> 8);
+}
+
+/** Check bytes which arrived at one end of a stream.
+  * \param data The bytes.
+  * \param length Number of bytes.
+  * \param position Position in the stream of the first byte.
+  */
+static void checkBytes(const uint8_t *data, uint32_t length, uint32_t position)
+{
+	uint32_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		if (data[i] != expectedByte(position + i))
+		{
+			if (num_mismatched == 0)
+			{
+				fprintf(stderr, "Byte %u is 0x%02x, expected 0x%02x\n", position + i, data[i], expectedByte(position + i));
+			}
+			num_mismatched++;
+		}
+	}
+}
+
+/** Idle hook: let the simulated host do one step, occasionally losing a
+  * handshake. */
+static void hostStep(void)
+{
+	host_steps++;
+	if ((drop_interval != 0) && ((host_steps % drop_interval) == 0))
+	{
+		simDropNextHandshake();
+	}
+	simRunHost();
+}
+
+/** Received callback for the HID Interrupt IN pipe. Each report begins
+  * with its report ID, which is the number of data bytes in the report.
+  */
+static void hidReportReceived(SimPipe *pipe, const uint8_t *packet, uint32_t length)
+{
+	if ((length < 1) || (packet[0] != (length - 1)))
+	{
+		fprintf(stderr, "Bad report: %u bytes with report ID %u\n", length, packet[0]);
+		num_mismatched++;
+		return;
+	}
+	if (length < MAX_PACKET_SIZE)
+	{
+		num_short_reports++;
+	}
+	checkBytes(&(packet[1]), length - 1, host_position);
+	host_position += length - 1;
+}
+
+/** Transmit callback for the HID Interrupt OUT pipe. This sends full
+  * reports, without using credit-based flow control.
+  */
+static int hidReportTransmit(SimPipe *pipe, uint8_t *packet)
+{
+	uint32_t count;
+	uint32_t i;
+
+	if (host_position >= test_bytes)
+	{
+		return -1;
+	}
+	count = MIN(test_bytes - host_position, MAX_PACKET_SIZE - 1);
+	packet[0] = (uint8_t)count;
+	for (i = 0; i < count; i++)
+	{
+		packet[1 + i] = expectedByte(host_position + i);
+	}
+	host_position += count;
+	return (int)(count + 1);
+}
+
+/** Received callback for the Bulk IN pipe. */
+static void bulkPacketReceived(SimPipe *pipe, const uint8_t *packet, uint32_t length)
+{
+	checkBytes(packet, length, host_position);
+	host_position += length;
+}
+
+/** Transmit callback for the Bulk OUT pipe. */
+static int bulkPacketTransmit(SimPipe *pipe, uint8_t *packet)
+{
+	uint32_t count;
+	uint32_t i;
+
+	if (host_position >= test_bytes)
+	{
+		return -1;
+	}
+	count = MIN(test_bytes - host_position, MAX_PACKET_SIZE);
+	for (i = 0; i < count; i++)
+	{
+		packet[i] = expectedByte(host_position + i);
+	}
+	host_position += count;
+	return (int)count;
+}
+
+/** Received callback for the Isochronous IN pipe. The simulated ADC's sample
+  * n has the value n modulo 2 ^ 16 (see usb_hal_sim.c). */
+static void isochronousPacketReceived(SimPipe *pipe, const uint8_t *packet, uint32_t length)
+{
+	uint16_t sample;
+	uint32_t i;
+
+	for (i = 0; (i + 1) < length; i += 2)
+	{
+		sample = (uint16_t)(packet[i] | (packet[i + 1] << 8));
+		if (sample != (uint16_t)expected_sample)
+		{
+			if (num_mismatched == 0)
+			{
+				fprintf(stderr, "Sample %u is %u, expected %u\n", num_samples, sample, (uint16_t)expected_sample);
+				first_mismatched_sample = num_samples;
+			}
+			num_mismatched++;
+			expected_sample = sample;
+		}
+		expected_sample++;
+		num_samples++;
+	}
+}
+
+/** Print the results of one stream test.
+  * \param name Name of the stream.
+  * \param pipe The host's pipe.
+  * \param bus_time Simulated time taken, in core timer counts.
+  * \param start_interrupts Value of the interrupt count at the start.
+  * \param start_wake_ups Value of getIdleWakeUpCount() at the start.
+  * \return 0 if the stream arrived intact, 1 if not.
+  */
+static int reportStreamTest(const char *name, SimPipe *pipe, uint64_t bus_time, uint32_t start_interrupts, uint32_t start_wake_ups)
+{
+	USBInterruptStatistics statistics;
+	double seconds;
+
+	usbGetInterruptStatistics(&statistics);
+	seconds = (double)bus_time / CORE_TIMER_FREQUENCY;
+	printf("%-9s %8u bytes in %8.1f ms = %8.0f bytes/s, %6u packets, %5u NAKs, %4u duplicates, %6u interrupts, %6u wake-ups, %s\n", name, host_position, seconds * 1000.0, (double)host_position / seconds, pipe->packets, pipe->naks, pipe->duplicates, statistics.interrupts - start_interrupts, getIdleWakeUpCount() - start_wake_ups, (num_mismatched == 0)? "OK" : "FAILED");
+	if (num_mismatched != 0)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Push #test_bytes bytes through one direction of one stream.
+  * \param name Name of the stream, for the results.
+  * \param pipe The host's pipe, with its endpoint address, type and
+  *             callback filled in.
+  * \param deviceWrite For device-to-host streams, the device's blocking
+  *                    write function. Otherwise NULL.
+  * \param deviceRead For host-to-device streams, the device's blocking read
+  *                   function. Otherwise NULL.
+  * \return 0 if the stream arrived intact, 1 if not.
+  */
+static int runStreamTest(const char *name, SimPipe *pipe, void (*deviceWrite)(const uint8_t *, uint32_t), void (*deviceRead)(uint8_t *, uint32_t))
+{
+	USBInterruptStatistics statistics;
+	uint8_t chunk[CHUNK_SIZE];
+	uint32_t start_wake_ups;
+	uint32_t start_frame;
+	uint64_t start_time;
+	uint32_t position;
+	uint32_t count;
+	uint32_t i;
+
+	host_position = 0;
+	num_mismatched = 0;
+	simAddPipe(pipe);
+	usbGetInterruptStatistics(&statistics);
+	start_wake_ups = getIdleWakeUpCount();
+	start_frame = simGetFrameNumber();
+	start_time = simGetBusTime();
+	for (position = 0; position < test_bytes; position += count)
+	{
+		count = MIN(test_bytes - position, CHUNK_SIZE);
+		if (deviceWrite != NULL)
+		{
+			for (i = 0; i < count; i++)
+			{
+				chunk[i] = expectedByte(position + i);
+			}
+			deviceWrite(chunk, count);
+		}
+		else
+		{
+			deviceRead(chunk, count);
+			checkBytes(chunk, count, position);
+		}
+	}
+	// The last bytes written by the device are still on their way.
+	while (host_position < test_bytes)
+	{
+		if ((simGetFrameNumber() - start_frame) > test_bytes)
+		{
+			fprintf(stderr, "%s stalled after %u bytes\n", name, host_position);
+			num_mismatched++;
+			break;
+		}
+		hostStep();
+	}
+	simRemovePipe(pipe);
+	return reportStreamTest(name, pipe, simGetBusTime() - start_time, statistics.interrupts, start_wake_ups);
+}
+
+/** Check that the HID IN stream test sent full reports. The device writes
+  * faster than the host reads, so the transmit FIFO always holds at least a
+  * report's worth when a report is queued, and only the last report (with
+  * the end of the stream in it) may be short. In particular, reports must
+  * not be split where the transmit FIFO wraps around.
+  * \return 0 if at most one report was short, 1 if not.
+  */
+static int checkHIDReportFill(void)
+{
+	printf("HID IN    %u short reports, %s\n", num_short_reports, (num_short_reports <= 1)? "OK" : "FAILED");
+	if (num_short_reports > 1)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Select an alternate setting of the ADC stream interface.
+  * \param alternate_setting The alternate setting.
+  * \return 0 on success, 1 on failure.
+  */
+static int setADCStreamInterface(uint16_t alternate_setting)
+{
+	uint8_t setup[8];
+
+	setup[0] = 0x01; // host-to-device, standard, interface
+	setup[1] = SET_INTERFACE;
+	setup[2] = (uint8_t)alternate_setting;
+	setup[3] = 0;
+	setup[4] = ADC_STREAM_INTERFACE;
+	setup[5] = 0;
+	setup[6] = 0;
+	setup[7] = 0;
+	if (simControlTransfer(SIM_DEVICE_ADDRESS, setup, NULL, NULL) != SIM_ACK)
+	{
+		fprintf(stderr, "Couldn't select alternate setting %u of interface %u\n", alternate_setting, ADC_STREAM_INTERFACE);
+		return 1;
+	}
+	return 0;
+}
+
+/** Read the Isochronous ADC stream for #ISOCHRONOUS_FRAMES frames, then
+  * stop reading for #ISOCHRONOUS_PAUSE_FRAMES frames and read it again.
+  * \return 0 if every sample was in sequence (apart from one discontinuity
+  *         after the pause), 1 if not.
+  */
+static int runIsochronousTest(void)
+{
+	SimPipe pipe;
+	uint32_t start_frame;
+	uint32_t resume_sample;
+	double seconds;
+	int is_resume_ok;
+	int failed;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.endpoint_address = 0x85;
+	pipe.type = SIM_PIPE_ISOCHRONOUS;
+	pipe.received = &isochronousPacketReceived;
+	num_mismatched = 0;
+	num_samples = 0;
+	expected_sample = 0;
+	if (setADCStreamInterface(1) != 0)
+	{
+		return 1;
+	}
+	simAddPipe(&pipe);
+	start_frame = simGetFrameNumber();
+	while ((simGetFrameNumber() - start_frame) < ISOCHRONOUS_FRAMES)
+	{
+		hostStep();
+	}
+	simRemovePipe(&pipe);
+	seconds = (double)ISOCHRONOUS_FRAMES / 1000.0;
+	printf("ADC ISO  %8u samples in %6u frames = %8.0f samples/s, %6u packets, %5u empty frames, %s\n", num_samples, ISOCHRONOUS_FRAMES, num_samples / seconds, pipe.packets, pipe.no_responses, (num_mismatched == 0)? "OK" : "FAILED");
+	failed = (num_mismatched != 0);
+
+	// Stop reading until the DMA has overwritten the unsent samples. The
+	// packets which were already queued hold copies, so they should still
+	// follow on from the last packet received (so the discontinuity must
+	// not be at the first sample); after those, the device should skip to
+	// the newest samples.
+	start_frame = simGetFrameNumber();
+	while ((simGetFrameNumber() - start_frame) < ISOCHRONOUS_PAUSE_FRAMES)
+	{
+		hostStep();
+	}
+	num_mismatched = 0;
+	resume_sample = num_samples;
+	simAddPipe(&pipe);
+	start_frame = simGetFrameNumber();
+	while ((simGetFrameNumber() - start_frame) < ISOCHRONOUS_RESUME_FRAMES)
+	{
+		hostStep();
+	}
+	simRemovePipe(&pipe);
+	is_resume_ok = (num_mismatched == 1) && (first_mismatched_sample > resume_sample);
+	printf("ADC ISO  resumed after %u frames with %u discontinuities, the first %u samples in, %s\n", ISOCHRONOUS_PAUSE_FRAMES, num_mismatched, first_mismatched_sample - resume_sample, is_resume_ok? "OK" : "FAILED");
+	failed |= !is_resume_ok;
+	if (setADCStreamInterface(0) != 0)
+	{
+		return 1;
+	}
+	return failed;
+}
+
+/** Task which wakes up every #BUTTON_CHECK_PERIOD milliseconds, like the
+  * button task in main.c, and does nothing else.
+  * \param task The task's state.
+  * \return See #TaskStatus.
+  */
+static TaskStatus periodicTask(Task *task)
+{
+	TASK_BEGIN(task);
+	while (1)
+	{
+		TASK_DELAY(task, BUTTON_CHECK_PERIOD * 1000);
+	}
+	TASK_END(task);
+}
+
+/** Run the scheduler for some number of frames. This is runScheduler() in
+  * scheduler.c, except that it stops, and that #periodic_task is the only
+  * task with a deadline.
+  * \param frames Number of frames to run for.
+  */
+static void runSchedulerFor(uint32_t frames)
+{
+	uint32_t start_frame;
+	uint32_t status;
+
+	start_frame = simGetFrameNumber();
+	while ((simGetFrameNumber() - start_frame) < frames)
+	{
+		if (!runTasksOnce())
+		{
+			status = disableInterrupts();
+			if (!periodic_task.has_deadline || setCoreTimerWakeUp(periodic_task.deadline))
+			{
+				idleWithInterruptsDisabled();
+			}
+			restoreInterrupts(status);
+		}
+	}
+}
+
+/** Run the scheduler for #IDLE_FRAMES frames and print how often the CPU
+  * woke up.
+  * \param name Name of the measurement.
+  */
+static void runIdleTest(const char *name)
+{
+	USBInterruptStatistics statistics;
+	uint32_t start_interrupts;
+	uint32_t start_wake_ups;
+	uint32_t start_frame;
+	double seconds;
+
+	usbGetInterruptStatistics(&statistics);
+	start_interrupts = statistics.interrupts;
+	start_wake_ups = getIdleWakeUpCount();
+	start_frame = simGetFrameNumber();
+	runSchedulerFor(IDLE_FRAMES);
+	usbGetInterruptStatistics(&statistics);
+	seconds = (double)(simGetFrameNumber() - start_frame) / 1000.0;
+	printf("%-9s %6.0f wake-ups/s, %6.0f USB interrupts/s\n", name, (getIdleWakeUpCount() - start_wake_ups) / seconds, (statistics.interrupts - start_interrupts) / seconds);
+}
+
+/** Task which reads whatever the HID stream has received, whenever it is
+  * told that something has arrived, like remoteCommandTask() in main.c. It
+  * never polls.
+  * \param task The task's state.
+  * \return See #TaskStatus.
+  */
+static TaskStatus receiveTask(Task *task)
+{
+	uint8_t buffer[MAX_PACKET_SIZE];
+	uint32_t count;
+
+	TASK_BEGIN(task);
+	while (1)
+	{
+		count = streamReadNonBlocking(buffer, sizeof(buffer));
+		checkBytes(buffer, count, host_position);
+		host_position += count;
+		TASK_WAIT_EVENT(task, EVENT_STREAM_RECEIVED);
+	}
+	TASK_END(task);
+}
+
+/** Send a report using only the HID "Set Report" request, while the device
+  * runs the scheduler with #receive_task waiting for data. The task must
+  * be woken up to read it.
+  * \return 0 if the task read the report, 1 if not.
+  */
+static int runSetReportTest(void)
+{
+	uint8_t setup[8];
+	uint8_t report[SET_REPORT_LENGTH + 1];
+	uint32_t i;
+
+	host_position = 0;
+	num_mismatched = 0;
+	// Let the task run once, so that it is waiting for the event.
+	runSchedulerFor(2 * BUTTON_CHECK_PERIOD);
+	report[0] = SET_REPORT_LENGTH;
+	for (i = 0; i < SET_REPORT_LENGTH; i++)
+	{
+		report[1 + i] = expectedByte(i);
+	}
+	setup[0] = 0x21; // host-to-device, class, interface
+	setup[1] = SET_REPORT;
+	setup[2] = SET_REPORT_LENGTH; // report ID
+	setup[3] = REPORT_TYPE_OUTPUT;
+	setup[4] = 0; // interface 0
+	setup[5] = 0;
+	setup[6] = sizeof(report);
+	setup[7] = 0;
+	if (simControlTransfer(SIM_DEVICE_ADDRESS, setup, report, NULL) != SIM_ACK)
+	{
+		fprintf(stderr, "Set Report request failed\n");
+		return 1;
+	}
+	runSchedulerFor(2 * BUTTON_CHECK_PERIOD);
+	printf("Set Report %u of %u bytes read by a waiting task, %s\n", host_position, SET_REPORT_LENGTH, ((host_position == SET_REPORT_LENGTH) && (num_mismatched == 0))? "OK" : "FAILED");
+	if ((host_position != SET_REPORT_LENGTH) || (num_mismatched != 0))
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Measure the idle wake-up rate with the bus idle, and with a byte held
+  * back by HID transmit coalescing. The rates aren't pass/fail, but the
+  * held byte must arrive once coalescing is turned off again.
+  * \param hid_in The host's HID Interrupt IN pipe.
+  * \return 0 if the held byte arrived intact, 1 if not.
+  */
+static int runIdleTests(SimPipe *hid_in)
+{
+	uint32_t start_frame;
+
+	host_position = 0;
+	num_mismatched = 0;
+	simAddPipe(hid_in);
+	runIdleTest("Idle");
+	streamSetTransmitCoalescing(MAX_PACKET_SIZE - 1, 2 * IDLE_FRAMES);
+	streamPutOneByte(expectedByte(0));
+	runIdleTest("Held byte");
+	streamSetTransmitCoalescing(1, 0);
+	start_frame = simGetFrameNumber();
+	while ((host_position < 1) && ((simGetFrameNumber() - start_frame) < 10))
+	{
+		hostStep();
+	}
+	simRemovePipe(hid_in);
+	if ((host_position != 1) || (num_mismatched != 0))
+	{
+		fprintf(stderr, "Held byte didn't arrive\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	SimEnumeration enumeration;
+	SimPipe hid_in;
+	SimPipe hid_out;
+	SimPipe bulk_in;
+	SimPipe bulk_out;
+	int arg;
+	int failed;
+
+	test_bytes = DEFAULT_TEST_BYTES;
+	drop_interval = 0;
+	for (arg = 1; arg < argc; arg++)
+	{
+		if ((strcmp(argv[arg], "-d") == 0) && ((arg + 1) < argc))
+		{
+			arg++;
+			drop_interval = (unsigned int)atoi(argv[arg]);
+		}
+		else
+		{
+			test_bytes = (uint32_t)atoi(argv[arg]);
+		}
+	}
+
+	// Same order as main() in main.c.
+	usbInit();
+	usbHIDStreamInit();
+	usbBulkStreamInit();
+	usbADCStreamInit();
+	usbDisconnect();
+	usbSetupControlEndpoint();
+	initScheduler();
+	restoreInterrupts(1);
+	usbConnect();
+	simSetIdleHook(&hostStep);
+
+	if (!simEnumerate(&enumeration))
+	{
+		fprintf(stderr, "Enumeration failed\n");
+		return 1;
+	}
+	printf("Enumeration: %u control transfers in %u frames (%.1f ms), configuration descriptor %u bytes, report descriptor %u bytes\n", enumeration.control_transfers, enumeration.frames, (double)enumeration.bus_time * 1000.0 / CORE_TIMER_FREQUENCY, enumeration.configuration_length, enumeration.report_descriptor_length);
+
+	memset(&hid_in, 0, sizeof(hid_in));
+	hid_in.endpoint_address = 0x81;
+	hid_in.type = SIM_PIPE_INTERRUPT;
+	hid_in.received = &hidReportReceived;
+	memset(&hid_out, 0, sizeof(hid_out));
+	hid_out.endpoint_address = 0x02;
+	hid_out.type = SIM_PIPE_INTERRUPT;
+	hid_out.transmit = &hidReportTransmit;
+	memset(&bulk_in, 0, sizeof(bulk_in));
+	bulk_in.endpoint_address = 0x83;
+	bulk_in.type = SIM_PIPE_BULK;
+	bulk_in.received = &bulkPacketReceived;
+	memset(&bulk_out, 0, sizeof(bulk_out));
+	bulk_out.endpoint_address = 0x04;
+	bulk_out.type = SIM_PIPE_BULK;
+	bulk_out.transmit = &bulkPacketTransmit;
+
+	failed = 0;
+	num_short_reports = 0;
+	failed |= runStreamTest("HID IN", &hid_in, &streamWrite, NULL);
+	failed |= checkHIDReportFill();
+	failed |= runStreamTest("HID OUT", &hid_out, NULL, &streamRead);
+	failed |= runStreamTest("Bulk IN", &bulk_in, &bulkStreamWrite, NULL);
+	failed |= runStreamTest("Bulk OUT", &bulk_out, NULL, &bulkStreamRead);
+	failed |= runIsochronousTest();
+	addTask(&periodic_task, &periodicTask);
+	addTask(&receive_task, &receiveTask);
+	failed |= runSetReportTest();
+	failed |= runIdleTests(&hid_in);
+	return failed;
+}
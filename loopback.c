@@ -0,0 +1,51 @@
+/** \file loopback.c
+  *
+  * \brief USB link qualification mode, which echoes the HID stream.
+  *
+  * In loopback mode, every byte received on the HID stream is sent straight
+  * back to the host, unmodified. The host (see host/loopback_test.c) can
+  * then measure the sustained throughput and round-trip latency of the USB
+  * link, and check that no data was corrupted, dropped or reordered.
+  *
+  * The echo has to be byte-for-byte, so the timestamped ping isn't part of
+  * the stream. Instead, the host gets the device's core timer through the
+  * timestamp feature report (see getTimestampReport() in usb_hid_stream.c),
+  * which works in every mode.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include "loopback.h"
+#include "usb_hid_stream.h"
+#include "ssd1306.h"
+
+/** Most bytes which are echoed at once. Reports are received into the HID
+  * stream's receive FIFO while the previous bytes are being echoed, so this
+  * lets the echo keep up with back-to-back reports. */
+#define LOOPBACK_BUFFER_SIZE		256
+
+/** Echo the HID stream forever. This never returns. */
+void runLoopback(void)
+{
+	uint8_t buffer[LOOPBACK_BUFFER_SIZE];
+	uint32_t length;
+
+	clearDisplay();
+	writeStringToDisplay("USB loopback mode");
+	nextLine();
+	writeStringToDisplayWordWrap("Every byte received on the HID stream is sent back.");
+
+	// Echoes are sent as soon as possible, so that they can be used to
+	// measure latency. Under load, many bytes are echoed at once, so
+	// reports are still full.
+	streamSetTransmitCoalescing(1, 0);
+	while (1)
+	{
+		// Wait for the first byte, then echo everything else which has
+		// arrived along with it.
+		buffer[0] = streamGetOneByte();
+		length = 1 + streamReadNonBlocking(&(buffer[1]), sizeof(buffer) - 1);
+		streamWrite(buffer, length);
+	}
+}
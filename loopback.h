@@ -0,0 +1,13 @@
+/** \file loopback.h
+  *
+  * \brief Describes functions exported by loopback.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef LOOPBACK_H
+#define	LOOPBACK_H
+
+extern void runLoopback(void);
+
+#endif	// #ifndef LOOPBACK_H
@@ -12,6 +12,8 @@
 #include "usb_standard_requests.h"
 #include "usb_callbacks.h"
 #include "usb_hid_stream.h"
+#include "usb_bulk_stream.h"
+#include "usb_adc_stream.h"
 #include "pic32_system.h"
 #include "serial_fifo.h"
 #include "ssd1306.h"
@@ -19,9 +21,28 @@
 #include "adc.h"
 #include "pushbuttons.h"
 #include "atsha204.h"
+#include "loopback.h"
+#include "stream_channels.h"
+#include "test_runner.h"
+#include "test_result.h"
+#include "scheduler.h"
 
-/** Total number of tests. */
-#define NUM_TESTS		4
+/** Task which handles the pushbuttons. */
+static Task button_task;
+/** Task which services commands from the host. */
+static Task remote_command_task;
+/** Task which runs tests for the operator. */
+static Task operator_task;
+/** Which button was pressed when #EVENT_BUTTON_PRESS was last signalled:
+  * 0 = accept, 1 = cancel (see pollButtonPress()). */
+static int last_button;
+/** Which buttons were held down at power-up (see getButtonsHeld()). */
+static int buttons_held;
+/** Test which the operator is up to. This should be between 0 and
+  * NUM_TESTS - 1 (inclusive). */
+static int test_number;
+/** Which page of the sequence summary is being shown. */
+static unsigned int page;
 
 /** This will be called whenever an unrecoverable error occurs. This should
   * not return. */
@@ -35,12 +56,109 @@ void usbFatalError(void)
 	}
 }
 
+/** Task which watches the pushbuttons, signalling #EVENT_BUTTON_PRESS for
+  * each press. A button must be released before it can be pressed again,
+  * so a button held at power-up isn't counted.
+  * \param task The task's state.
+  * \return See #TaskStatus.
+  */
+static TaskStatus buttonTask(Task *task)
+{
+	TASK_BEGIN(task);
+	while (1)
+	{
+		do
+		{
+			TASK_DELAY(task, BUTTON_CHECK_PERIOD * 1000);
+		} while (!checkNoButtonPress());
+		do
+		{
+			TASK_DELAY(task, BUTTON_CHECK_PERIOD * 1000);
+			last_button = checkButtonPress();
+		} while (last_button < 0);
+		signalEvents(EVENT_BUTTON_PRESS);
+	}
+	TASK_END(task);
+}
+
+/** Task which lets a host run tests at any time (see test_runner.c). This
+  * only runs when the host sends something, so it doesn't wake the CPU
+  * otherwise.
+  * \param task The task's state.
+  * \return See #TaskStatus.
+  */
+static TaskStatus remoteCommandTask(Task *task)
+{
+	TASK_BEGIN(task);
+	while (1)
+	{
+		serviceRemoteCommands();
+		TASK_WAIT_EVENT(task, EVENT_STREAM_RECEIVED);
+	}
+	TASK_END(task);
+}
+
+/** Task which lets the operator run tests using the pushbuttons. If
+  * sequence mode was selected at power-up, that runs first.
+  * \param task The task's state.
+  * \return See #TaskStatus.
+  */
+static TaskStatus operatorTask(Task *task)
+{
+	TestResult result;
+
+	TASK_BEGIN(task);
+	// Holding down the accept button at power-up selects sequence mode,
+	// where every test is run back to back and then a time budget summary
+	// is shown. Holding down both buttons does the same, but overlaps the
+	// tests. The accept button flips between the summary's pages and
+	// the cancel button continues on to the usual interactive mode.
+	if ((buttons_held & BUTTON_ACCEPT) != 0)
+	{
+		runTestSequence(buttons_held == (BUTTON_ACCEPT | BUTTON_CANCEL));
+		page = 0;
+		while (1)
+		{
+			TASK_WAIT_EVENT(task, EVENT_BUTTON_PRESS);
+			if (last_button != 0)
+			{
+				break;
+			}
+			page = (page + 1) % 2;
+			showSequenceSummary(page);
+		}
+	}
+	test_number = 0;
+	while (1)
+	{
+		runTest(test_number, NULL, 0, &result);
+		reportTestResult(test_number, &result);
+
+		TASK_WAIT_EVENT(task, EVENT_BUTTON_PRESS);
+		if (last_button == 0)
+		{
+			test_number++;
+			if (test_number >= NUM_TESTS)
+			{
+				test_number = 0;
+			}
+		}
+		else
+		{
+			test_number--;
+			if (test_number < 0)
+			{
+				test_number = NUM_TESTS - 1;
+			}
+		}
+	}
+	TASK_END(task);
+}
+
 /** Entry point. This is the first thing which is called after startup code.
   * This never returns. */
 int main(void)
 {
-	int test_number; // should be between 0 and NUM_TESTS - 1 (inclusive)
-
 	disableInterrupts();
 
 	// The BitSafe development board has the Vdd/2 reference connected to
@@ -61,6 +179,8 @@ int main(void)
 	initADC();
 	usbInit();
 	usbHIDStreamInit();
+	usbBulkStreamInit();
+	usbADCStreamInit();
 	usbDisconnect(); // just in case
 	usbSetupControlEndpoint();
 	restoreInterrupts(1);
@@ -77,43 +197,21 @@ int main(void)
 	usbConnect();
 
 	displayOn();
-	test_number = 0;
-	while (1)
+	// Holding down the cancel button at power-up selects loopback mode, for
+	// qualifying the USB link.
+	buttons_held = getButtonsHeld();
+	if (buttons_held == BUTTON_CANCEL)
 	{
-		clearDisplay();
-		if (test_number == 0)
-		{
-			testSSD1306();
-		}
-		else if (test_number == 1)
-		{
-			testSST25x();
-		}
-		else if (test_number == 2)
-		{
-			testATSHA204();
-		}
-		else if (test_number == 3)
-		{
-			testADC();
-		}
-
-		waitForNoButtonPress();
-		if (waitForButtonPress() == 0)
-		{
-			test_number++;
-			if (test_number >= NUM_TESTS)
-			{
-				test_number = 0;
-			}
-		}
-		else
-		{
-			test_number--;
-			if (test_number < 0)
-			{
-				test_number = NUM_TESTS - 1;
-			}
-		}
+		runLoopback(); // never returns
 	}
+	// In every other mode, the HID stream is split into channels, so that
+	// a host can run tests remotely (see test_runner.c).
+	streamChannelsInit();
+	// Everything else is done by tasks, so that the operator and a host
+	// can both use the DUT.
+	initScheduler();
+	addTask(&button_task, &buttonTask);
+	addTask(&remote_command_task, &remoteCommandTask);
+	addTask(&operator_task, &operatorTask);
+	runScheduler(); // never returns
 }
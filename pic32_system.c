@@ -2,8 +2,13 @@
   *
   * \brief Miscellaneous PIC32-related system functions
   *
-  * Note that this does use the Timer2 peripheral. See enterIdleMode() for
-  * reasons why.
+  * Note that this does use the Timer4 peripheral (for the LEDs) and the core
+  * timer interrupt (see setCoreTimerWakeUp()).
+  *
+  * There is no periodic interrupt, so an idle CPU is only woken up when
+  * something needs doing. Code which waits for something must use
+  * idleWithInterruptsDisabled(), which doesn't have the race condition
+  * described in enterIdleMode().
   *
   * This file is licensed as described by the file LICENCE.
   */
@@ -36,12 +41,19 @@
 #pragma config DEBUG	= OFF
 #endif // #ifdef __DEBUG
 
+/** Number of _Timer4Handler() calls in between steps of the LED sequence.
+  * Timer4 runs at about 20 Hz, so this makes each step about 0.25 s. */
+#define LED_SEQUENCE_PERIOD		5
+
 /** Counter which counts down number of flashes of USB activity LED. */
 static volatile unsigned int usb_activity_counter;
 
-/** Counter which counts _Timer2Handler() calls in order to blink an LED at
+/** Counter which counts _Timer4Handler() calls in order to blink an LED at
   * a reasonable rate. */
-static uint32_t timer2_interrupt_counter;
+static uint32_t timer4_interrupt_counter;
+
+/** Number of times idleWithInterruptsDisabled() has woken up. */
+static volatile uint32_t idle_wake_up_count;
 
 /** Current LED that is on: 0 = red, 1 = green, 2 = blue. */
 static int led_sequence_counter;
@@ -90,23 +102,41 @@ void __attribute__((nomips16)) delayCycles(uint32_t num_cycles)
 
 /** Delay for at least the specified number of cycles. This is not as precise
   * as delayCycles(), but it consumes less power because the CPU is placed in
-  * idle mode while delaying.
-  * \param num_cycles CPU cycles to delay for.
+  * idle mode while delaying. The core timer interrupt (see
+  * setCoreTimerWakeUp()) ends the delay, so this doesn't depend on any
+  * other interrupt occurring.
+  * \param num_cycles CPU cycles to delay for. This must be less than
+  *                   2 ^ 32 (about 60 seconds).
   */
 void __attribute__((nomips16)) delayCyclesAndIdle(uint32_t num_cycles)
 {
-	uint32_t start_count;
-	uint32_t current_count;
+	uint32_t deadline;
+	uint32_t status;
 
 	// Note that Count is incremented every 2 CPU cycles.
-	num_cycles >>= 1;
-	// Use Count register ($9) to count cycles.
-	asm volatile("mfc0 %0, $9" : "=r"(start_count));
+	deadline = getCoreTimer() + (num_cycles >> 1);
 	do
 	{
-		enterIdleMode();
-		asm volatile("mfc0 %0, $9" : "=r"(current_count));
-	} while ((current_count - start_count) < num_cycles);
+		status = disableInterrupts();
+		if (setCoreTimerWakeUp(deadline))
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	} while ((int32_t)(getCoreTimer() - deadline) < 0);
+}
+
+/** Read the core timer (the Count CP0 register), which is incremented every
+  * 2 CPU cycles (see #CORE_TIMER_FREQUENCY). It wraps around every
+  * 2 ^ 32 counts, so timestamps should only be compared by subtracting them.
+  * \return Current value of the core timer.
+  */
+uint32_t __attribute__((nomips16)) getCoreTimer(void)
+{
+	uint32_t count;
+
+	asm volatile("mfc0 %0, $9" : "=r"(count));
+	return count;
 }
 
 /** Initialise caching module and set up CPU for instruction caching. */
@@ -141,12 +171,67 @@ static void __attribute__ ((nomips16)) prefetchInit(void)
   * calls this function to wait. However, the receive interrupt may occur
   * after the FIFO check but before the call to this function, in which case
   * the receive interrupt will not bring the CPU out of idle mode.
+  * \warning Since there is no periodic interrupt, that can leave the CPU
+  *          idle indefinitely. Use idleWithInterruptsDisabled() for waiting
+  *          on something.
   */
 void __attribute__((nomips16)) enterIdleMode(void)
 {
 	asm volatile("wait");
 }
 
+/** Enter PIC32 idle mode, without the race condition described in
+  * enterIdleMode(). The caller must disable interrupts (see
+  * disableInterrupts()), then check whether there is still something to
+  * wait for, then call this, then restore interrupts. Interrupts stay
+  * disabled while the CPU is idle, but a pending interrupt still
+  * brings the CPU out of idle mode (and if one is already pending, the CPU
+  * doesn't idle at all). Once the caller restores interrupts, the
+  * interrupt service routine runs. So an interrupt which occurs after the
+  * check can't be missed.
+  * \warning This must be called with interrupts disabled, and returns with
+  *          them still disabled.
+  */
+void __attribute__((nomips16)) idleWithInterruptsDisabled(void)
+{
+	asm volatile("wait");
+	idle_wake_up_count++;
+}
+
+/** Arrange for the core timer interrupt to occur when the core timer
+  * reaches a deadline, so that the CPU comes out of idle mode then. This
+  * sets the Compare CP0 register; the interrupt is only used for waking
+  * up, so it doesn't do anything else. Only one deadline can be pending at
+  * once, so this should be called with interrupts disabled, just before
+  * calling idleWithInterruptsDisabled().
+  * \param deadline The core timer value (see getCoreTimer()) to wake up at.
+  *                 This must be less than 2 ^ 31 counts in the future.
+  * \return Non-zero if the wake-up was set, 0 if the deadline has already
+  *         passed (in which case, the caller shouldn't idle).
+  */
+int __attribute__((nomips16)) setCoreTimerWakeUp(uint32_t deadline)
+{
+	// Compare must be set before checking the deadline. If the core timer
+	// reaches Compare after the check, the interrupt will be pending by the
+	// time the caller idles.
+	asm volatile("mtc0 %0, $11" : : "r"(deadline));
+	if ((int32_t)(getCoreTimer() - deadline) >= 0)
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/** Get the number of times the CPU has come out of idle mode (in
+  * idleWithInterruptsDisabled()) since startup. Sampling this twice gives
+  * the idle wake-up rate.
+  * \return The number of wake-ups. This wraps around.
+  */
+uint32_t getIdleWakeUpCount(void)
+{
+	return idle_wake_up_count;
+}
+
 /** Turn off current LED and light up next LED in sequence. */
 static void toggleLEDSequence(void)
 {
@@ -175,21 +260,23 @@ static void toggleLEDSequence(void)
 	}
 }
 
-/** Interrupt service handler for Timer2. See enterIdleMode() for
-  * justification as to why a serial FIFO implementation needs a timer. */
-void __attribute__((vector(_TIMER_2_VECTOR), interrupt(ipl2), nomips16)) _Timer2Handler(void)
+/** Interrupt service handler for the core timer. This is only used to wake
+  * the CPU up (see setCoreTimerWakeUp()). */
+void __attribute__((vector(_CORE_TIMER_VECTOR), interrupt(ipl2), nomips16)) _CoreTimerHandler(void)
 {
-	IFS0bits.T2IF = 0; // clear interrupt flag
-	// Blink the "everything is running and interrupts are enabled" LED.
-	timer2_interrupt_counter++;
-	if (timer2_interrupt_counter == 500)
-	{
-		timer2_interrupt_counter = 0;
-		toggleLEDSequence();
-	}
+	uint32_t compare;
+
+	// The core timer interrupt stays asserted until Compare is written.
+	// Writing the same value back means the next one won't occur until the
+	// core timer wraps around (unless setCoreTimerWakeUp() is called).
+	asm volatile("mfc0 %0, $11" : "=r"(compare));
+	asm volatile("mtc0 %0, $11" : : "r"(compare));
+	IFS0bits.CTIF = 0; // clear interrupt flag
 }
 
-/** Interrupt service handler for Timer4, used to flash USB activity LED. */
+/** Interrupt service handler for Timer4, used to flash USB activity LED and
+  * to blink the "everything is running and interrupts are enabled" LED
+  * sequence. */
 void __attribute__((vector(_TIMER_4_VECTOR), interrupt(ipl2), nomips16)) _Timer4Handler(void)
 {
 	IFS0bits.T4IF = 0; // clear interrupt flag
@@ -198,6 +285,12 @@ void __attribute__((vector(_TIMER_4_VECTOR), interrupt(ipl2), nomips16)) _Timer4
 		toggleLEDSequence();
 		usb_activity_counter--;
 	}
+	timer4_interrupt_counter++;
+	if (timer4_interrupt_counter >= LED_SEQUENCE_PERIOD)
+	{
+		timer4_interrupt_counter = 0;
+		toggleLEDSequence();
+	}
 }
 
 /** Temporarily flash USB activity LED. */
@@ -217,7 +310,7 @@ void pic32SystemInit(void)
 	TRISDCLR = 0x15;
 	PORTDCLR = 0x14;
 	PORTDSET = 0x01; // for blue LED, 0 = on, 1 = off
-	// Initialise Timer4 for USB activity LED flashing.
+	// Initialise Timer4 for LED flashing.
 	T4CONbits.ON = 0; // turn timer off
 	T4CONbits.TCKPS = 7; // 1:256 prescaler
 	T4CONbits.T32 = 0; // 16 bit mode
@@ -230,22 +323,14 @@ void pic32SystemInit(void)
 	IPC4bits.T4IS = 0; // sub-priority level = 0
 	IFS0bits.T4IF = 0; // clear interrupt flag
 	IEC0bits.T4IE = 1; // enable interrupt
-	// Initialise Timer2 for periodic interrupts to wake up the CPU in the case
-	// of a race condition where an interrupt occurs in between a check and
-	// the transition to idle state (enterIdleMode()).
-	T2CONbits.ON = 0; // turn timer off
-	T2CONbits.T32 = 0; // 16 bit mode
-	T2CONbits.TCKPS = 7; // 1:256 prescaler
-	T2CONbits.T32 = 0; // 16 bit mode
-	T2CONbits.TGATE = 0; // disable gated time accumulation
-	T2CONbits.SIDL = 0; // continue in idle mode
-	TMR2 = 0; // clear count
-	PR2 = 141; // frequency = about 2 kHz
-	T2CONbits.ON = 1; // turn timer on
-	IPC2bits.T2IP = 2; // priority level = 2
-	IPC2bits.T2IS = 0; // sub-priority level = 0
-	IFS0bits.T2IF = 0; // clear interrupt flag
-	IEC0bits.T2IE = 1; // enable interrupt
+	// Initialise the core timer interrupt, for waking up from idle mode at
+	// a deadline (see setCoreTimerWakeUp()). Until a deadline is set,
+	// Compare is as far away as it can be.
+	setCoreTimerWakeUp(getCoreTimer() - 1);
+	IPC0bits.CTIP = 2; // priority level = 2
+	IPC0bits.CTIS = 0; // sub-priority level = 0
+	IFS0bits.CTIF = 0; // clear interrupt flag
+	IEC0bits.CTIE = 1; // enable interrupt
 
 	INTCONbits.MVEC = 1; // enable multi-vector mode
 	prefetchInit();
@@ -22,12 +22,19 @@
 #define CYCLES_PER_MILLISECOND		(CYCLES_PER_MICROSECOND * 1000)
 /** Number of CPU cycles per second. */
 #define CYCLES_PER_SECOND			(CYCLES_PER_MILLISECOND * 1000)
+/** Number of core timer (see getCoreTimer()) counts per second. The core
+  * timer is incremented every 2 CPU cycles. */
+#define CORE_TIMER_FREQUENCY		(CYCLES_PER_SECOND / 2)
 
 extern uint32_t __attribute__((nomips16)) disableInterrupts(void);
 extern void __attribute__((nomips16)) restoreInterrupts(uint32_t status);
 extern void __attribute__((nomips16)) delayCycles(uint32_t num_cycles);
 extern void __attribute__((nomips16)) delayCyclesAndIdle(uint32_t num_cycles);
 extern void __attribute__((nomips16)) enterIdleMode(void);
+extern void __attribute__((nomips16)) idleWithInterruptsDisabled(void);
+extern int __attribute__((nomips16)) setCoreTimerWakeUp(uint32_t deadline);
+extern uint32_t getIdleWakeUpCount(void);
+extern uint32_t __attribute__((nomips16)) getCoreTimer(void);
 extern void pic32SystemInit(void);
 extern void usbActivityLED(void);
 
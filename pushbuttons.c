@@ -10,10 +10,15 @@
 
 #include <p32xxxx.h>
 #include "pic32_system.h"
+#include "pushbuttons.h"
 
 /** Number of consistent samples (each sample is 1 ms apart) required to
   * register a button press. */
 #define DEBOUNCE_COUNT	50
+/** Number of consistent samples required by checkButtonPress() and
+  * checkNoButtonPress(), which sample every #BUTTON_CHECK_PERIOD ms. This
+  * gives the same debounce time as #DEBOUNCE_COUNT. */
+#define CHECK_DEBOUNCE_COUNT	(DEBOUNCE_COUNT / BUTTON_CHECK_PERIOD)
 
 /** Bit which specifies which pin (1 = RD0, 2 = RD1, 4 = RD2 etc.) on port D
   * the accept pushbutton is connected to. The pushbutton should connect
@@ -26,10 +31,19 @@
   * the pin and VDD is also required.*/
 #define CANCEL_PIN		(1 << 11)
 
+/** Number of consistent samples still needed before pollButtonPress()
+  * registers a button press. */
+static uint32_t press_debounce_counter;
+/** Number of consistent samples still needed before checkNoButtonPress()
+  * registers that both buttons have been released. */
+static uint32_t release_debounce_counter;
+
 /** Set up PIC32 GPIO to get input from two pushbuttons. */
 void initPushButtons(void)
 {
 	TRISDSET = ACCEPT_PIN | CANCEL_PIN;
+	press_debounce_counter = CHECK_DEBOUNCE_COUNT;
+	release_debounce_counter = CHECK_DEBOUNCE_COUNT;
 }
 
 /** Returns 1 if the accept button is being pressed, 0 if it is not. This
@@ -87,6 +101,79 @@ void waitForNoButtonPress(void)
 	}
 }
 
+/** Check whether neither accept nor cancel buttons are being pressed,
+  * without waiting. This must be called about every #BUTTON_CHECK_PERIOD
+  * milliseconds (it counts calls to debounce) until it returns non-zero.
+  * It is for callers which can't block, such as tasks (see scheduler.c);
+  * others can use waitForNoButtonPress().
+  * \return Non-zero if both buttons have been released for the whole
+  *         debounce period, 0 if not (yet).
+  */
+int checkNoButtonPress(void)
+{
+	if (isAcceptPressed() || isCancelPressed())
+	{
+		release_debounce_counter = CHECK_DEBOUNCE_COUNT; // reset debounce counter
+		return 0;
+	}
+	release_debounce_counter--;
+	if (release_debounce_counter > 0)
+	{
+		return 0;
+	}
+	release_debounce_counter = CHECK_DEBOUNCE_COUNT;
+	return 1;
+}
+
+/** Check for a button press, without waiting at all. This must be called
+  * about every #BUTTON_CHECK_PERIOD milliseconds (it counts calls to
+  * debounce) until it registers a press. It is for callers which can't
+  * block, such as tasks (see scheduler.c); others can use pollButtonPress().
+  * \return See pollButtonPress().
+  */
+int checkButtonPress(void)
+{
+	int accept_pressed;
+	int cancel_pressed;
+
+	accept_pressed = isAcceptPressed();
+	cancel_pressed = isCancelPressed();
+	if (!accept_pressed && !cancel_pressed)
+	{
+		press_debounce_counter = CHECK_DEBOUNCE_COUNT; // reset debounce counter
+		return -1;
+	}
+	press_debounce_counter--;
+	if (press_debounce_counter > 0)
+	{
+		return -1;
+	}
+	press_debounce_counter = CHECK_DEBOUNCE_COUNT;
+	if (cancel_pressed)
+	{
+		return 1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+/** Check for a button press, without waiting for one. This takes about
+  * #BUTTON_CHECK_PERIOD milliseconds, and must be called repeatedly (with
+  * nothing much in between) until it registers a press. This function does
+  * do debouncing.
+  * \return -1 if no button press has been registered yet. Otherwise, 0 if
+  *         the accept button was pressed, or 1 if the cancel button was
+  *         pressed. If both buttons were pressed simultaneously, 1 will be
+  *         returned.
+  */
+int pollButtonPress(void)
+{
+	delayCyclesAndIdle(BUTTON_CHECK_PERIOD * CYCLES_PER_MILLISECOND);
+	return checkButtonPress();
+}
+
 /** Wait until accept or cancel button is pressed. This function does do
   * debouncing.
   * \return 0 if the accept button was pressed, non-zero if the cancel
@@ -94,32 +181,40 @@ void waitForNoButtonPress(void)
   *         non-zero will be returned.
   */
 int waitForButtonPress(void)
+{
+	int button;
+
+	do
+	{
+		button = pollButtonPress();
+	} while (button < 0);
+	return button;
+}
+
+/** Find out which buttons are being held down right now, without waiting for
+  * a press. This is meant for checking whether a button was held down while
+  * the DUT was powered up. This function does do debouncing: a button only
+  * counts as held if it stays pressed for the whole debounce period.
+  * \return A combination of #BUTTON_ACCEPT and #BUTTON_CANCEL (0 if no
+  *         button is held down).
+  */
+int getButtonsHeld(void)
 {
 	uint32_t counter;
-	int accept_pressed;
-	int cancel_pressed;
+	int held;
 
-	counter = DEBOUNCE_COUNT;
-	while (counter > 0)
+	held = BUTTON_ACCEPT | BUTTON_CANCEL;
+	for (counter = 0; counter < DEBOUNCE_COUNT; counter++)
 	{
 		wait1ms();
-		accept_pressed = isAcceptPressed();
-		cancel_pressed = isCancelPressed();
-		if (!accept_pressed && !cancel_pressed)
+		if (!isAcceptPressed())
 		{
-			counter = DEBOUNCE_COUNT; // reset debounce counter
+			held &= ~BUTTON_ACCEPT;
 		}
-		else
+		if (!isCancelPressed())
 		{
-			counter--;
+			held &= ~BUTTON_CANCEL;
 		}
 	}
-	if (cancel_pressed)
-	{
-		return 1;
-	}
-	else
-	{
-		return 0;
-	}
+	return held;
 }
@@ -8,8 +8,22 @@
 #ifndef PIC32_PUSHBUTTONS_H_INCLUDED
 #define PIC32_PUSHBUTTONS_H_INCLUDED
 
+/** Value returned by getButtonsHeld() if the accept button is held. */
+#define BUTTON_ACCEPT	1
+/** Value returned by getButtonsHeld() if the cancel button is held. */
+#define BUTTON_CANCEL	2
+
+/** Time, in milliseconds, between calls to checkButtonPress() or
+  * checkNoButtonPress(). Sampling less often than every millisecond means
+  * an idle CPU doesn't have to wake up as often. */
+#define BUTTON_CHECK_PERIOD	10
+
 extern void initPushButtons(void);
 extern void waitForNoButtonPress(void);
+extern int checkNoButtonPress(void);
+extern int checkButtonPress(void);
+extern int pollButtonPress(void);
 extern int waitForButtonPress(void);
+extern int getButtonsHeld(void);
 
 #endif // #ifndef PIC32_PUSHBUTTONS_H_INCLUDED
@@ -0,0 +1,209 @@
+/** \file scheduler.c
+  *
+  * \brief Cooperative scheduler for stackless tasks.
+  *
+  * This lets several activities (eg. button handling and servicing the
+  * host's commands) make progress concurrently, without an RTOS. Each task
+  * runs until it waits, then the next task runs. A task can wait for
+  * events, for a deadline (measured with the core timer), or both. See
+  * scheduler.h for how to write a task.
+  *
+  * Events are bits (see the EVENT_* definitions in scheduler.h) which
+  * are signalled using signalEvents(). That can be called from anywhere,
+  * including interrupt service routines. Each time the scheduler goes
+  * through its tasks, it takes all the events which were signalled since
+  * the last time, and wakes every task which is waiting for one of them.
+  * Events which no task is waiting for are discarded.
+  *
+  * When no task can run, the CPU is put into idle mode until an interrupt
+  * occurs. If any task is waiting for a deadline, the core timer interrupt
+  * is set up to occur at the earliest one (see setCoreTimerWakeUp()). There
+  * is no periodic tick, so an idle CPU only wakes up when a task has
+  * something to do (or when some other interrupt occurs). The check for
+  * pending events and the idle are done with interrupts disabled (see
+  * idleWithInterruptsDisabled()), so an event which is signalled by an
+  * interrupt service routine can't be missed.
+  *
+  * Tasks can't be pre-empted, so a task which takes a long time to get to
+  * its next wait (eg. running a test) holds up every other task. Interrupt
+  * service routines still run as usual.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include "scheduler.h"
+#include "pic32_system.h"
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used to mark the end of the task list. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
+/** First task in the list of tasks, in order of when they were added. */
+static Task *first_task;
+/** Events which have been signalled but not yet handed out to tasks. */
+static volatile uint32_t pending_events;
+
+/** Initialise the scheduler, with no tasks. This must be called before
+  * calling any of the other functions in this file. */
+void initScheduler(void)
+{
+	first_task = NULL;
+	pending_events = 0;
+}
+
+/** Add a task to the scheduler. The task will be run (from the beginning)
+  * the next time the scheduler goes through its tasks. This can also be
+  * called from within a task.
+  * \param task The task's state. This must remain valid until the task has
+  *             finished.
+  * \param run The function which runs the task.
+  */
+void addTask(Task *task, TaskFunction run)
+{
+	Task **link;
+
+	task->resume_line = 0;
+	task->wait_events = 0;
+	task->events = 0;
+	task->has_deadline = 0;
+	task->deadline = 0;
+	task->run = run;
+	task->next = NULL;
+	for (link = &first_task; *link != NULL; link = &((*link)->next))
+	{
+		// do nothing
+	}
+	*link = task;
+}
+
+/** Signal one or more events, waking up any task which is waiting for them.
+  * This can be called from an interrupt service routine.
+  * \param events The events to signal (a combination of EVENT_* bits).
+  */
+void signalEvents(uint32_t events)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	pending_events |= events;
+	restoreInterrupts(status);
+}
+
+/** Check whether a task is ready to run.
+  * \param task The task to check.
+  * \param events Events which have been signalled.
+  * \param now The current value of the core timer.
+  * \return Non-zero if the task should be run, 0 if it is still waiting.
+  */
+static int isTaskReady(const Task *task, uint32_t events, uint32_t now)
+{
+	if ((task->wait_events == 0) && !task->has_deadline)
+	{
+		return 1; // task yielded
+	}
+	if ((events & task->wait_events) != 0)
+	{
+		return 1;
+	}
+	if (task->has_deadline && ((int32_t)(now - task->deadline) >= 0))
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Go through the tasks once, running each one which is ready to run.
+  * Finished tasks are removed.
+  * \return Non-zero if any task was run, 0 if every task is still waiting.
+  */
+int runTasksOnce(void)
+{
+	Task **link;
+	Task *task;
+	uint32_t status;
+	uint32_t events;
+	uint32_t now;
+	int any_ran;
+
+	status = disableInterrupts();
+	events = pending_events;
+	pending_events = 0;
+	restoreInterrupts(status);
+	now = getCoreTimer();
+
+	any_ran = 0;
+	link = &first_task;
+	while (*link != NULL)
+	{
+		task = *link;
+		if (isTaskReady(task, events, now))
+		{
+			task->events = events & task->wait_events;
+			task->wait_events = 0;
+			task->has_deadline = 0;
+			any_ran = 1;
+			if (task->run(task) == TASK_FINISHED)
+			{
+				*link = task->next; // remove the task
+				continue;
+			}
+		}
+		link = &(task->next);
+	}
+	return any_ran;
+}
+
+/** Find the earliest deadline which any task is waiting for.
+  * \param deadline The earliest deadline will be written here, if there is
+  *                 one.
+  * \return Non-zero if any task is waiting for a deadline, 0 if none are.
+  */
+static int getEarliestDeadline(uint32_t *deadline)
+{
+	Task *task;
+	uint32_t now;
+	int found;
+
+	now = getCoreTimer();
+	found = 0;
+	for (task = first_task; task != NULL; task = task->next)
+	{
+		if (task->has_deadline)
+		{
+			if (!found || ((int32_t)(task->deadline - now) < (int32_t)(*deadline - now)))
+			{
+				*deadline = task->deadline;
+			}
+			found = 1;
+		}
+	}
+	return found;
+}
+
+/** Run tasks forever, idling the CPU whenever every task is waiting. This
+  * never returns. */
+void runScheduler(void)
+{
+	uint32_t status;
+	uint32_t deadline;
+
+	deadline = 0;
+	while (1)
+	{
+		if (!runTasksOnce())
+		{
+			status = disableInterrupts();
+			if (pending_events == 0)
+			{
+				if (!getEarliestDeadline(&deadline) || setCoreTimerWakeUp(deadline))
+				{
+					idleWithInterruptsDisabled();
+				}
+			}
+			restoreInterrupts(status);
+		}
+	}
+}
@@ -0,0 +1,127 @@
+/** \file scheduler.h
+  *
+  * \brief Describes types, macros and functions exported by scheduler.c.
+  *
+  * A task is a function which takes a #Task and is written like this:
+  *
+  *     static TaskStatus exampleTask(Task *task)
+  *     {
+  *         TASK_BEGIN(task);
+  *         while (1)
+  *         {
+  *             TASK_WAIT_EVENT(task, EVENT_BUTTON_PRESS);
+  *             ...
+  *         }
+  *         TASK_END(task);
+  *     }
+  *
+  * Tasks are stackless: each wait returns from the task function, and the
+  * next call jumps back to just after the wait. This means that local
+  * variables don't keep their values across waits (use static variables
+  * instead), and that the wait macros can only be used in the task function
+  * itself, not in functions which it calls. Only one wait macro can be used
+  * per line, and TASK_BEGIN() to TASK_END() must not contain a switch
+  * statement which spans a wait.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef SCHEDULER_H
+#define	SCHEDULER_H
+
+#include <stdint.h>
+#include "pic32_system.h"
+
+/** Event which is signalled when the operator presses a pushbutton. */
+#define EVENT_BUTTON_PRESS			0x00000001
+/** Event which is signalled when the HID stream receives data from the
+  * host (see usb_hid_stream.c). */
+#define EVENT_STREAM_RECEIVED		0x00000002
+
+/** Values which a task function returns. */
+typedef enum TaskStatusEnum
+{
+	/** The task is waiting, and should be called again later. */
+	TASK_WAITING				= 0,
+	/** The task has finished, and should be removed from the scheduler. */
+	TASK_FINISHED				= 1
+} TaskStatus;
+
+struct TaskStruct;
+
+/** Function which runs a task until its next wait. */
+typedef TaskStatus (*TaskFunction)(struct TaskStruct *task);
+
+/** State of a task. Everything in here is managed by the scheduler and the
+  * TASK_* macros. */
+typedef struct TaskStruct
+{
+	/** Line number of the wait which the task will resume after, or 0 to
+	  * start from the beginning. */
+	unsigned int resume_line;
+	/** Events (a combination of EVENT_* bits) which the task is waiting
+	  * for. */
+	uint32_t wait_events;
+	/** Events which woke the task up, so that a task which waits for
+	  * several events can tell which one happened. */
+	uint32_t events;
+	/** Non-zero if the task is waiting for #deadline. */
+	unsigned int has_deadline;
+	/** Core timer value (see getCoreTimer()) which the task is waiting
+	  * for. */
+	uint32_t deadline;
+	/** Function which runs the task. */
+	TaskFunction run;
+	/** Next task in the scheduler's list. */
+	struct TaskStruct *next;
+} Task;
+
+/** Start of a task function's body. */
+#define TASK_BEGIN(task)			switch ((task)->resume_line) { case 0:
+
+/** End of a task function's body. If the task gets here, it is finished
+  * and will be removed from the scheduler. */
+#define TASK_END(task)				} (task)->resume_line = 0; return TASK_FINISHED
+
+/** Return from the task function, and resume from here when it is next
+  * called. This is used by the other wait macros. */
+#define TASK_WAIT_POINT(task)		do { (task)->resume_line = __LINE__; return TASK_WAITING; case __LINE__:; } while (0)
+
+/** Let the other tasks run, then carry on. */
+#define TASK_YIELD(task)			TASK_WAIT_POINT(task)
+
+/** Wait until any of the specified events is signalled (see
+  * signalEvents()). Afterwards, the events field of the task says which
+  * events woke it up. */
+#define TASK_WAIT_EVENT(task, event_mask) \
+	do { (task)->wait_events = (event_mask); TASK_WAIT_POINT(task); } while (0)
+
+/** Wait until the core timer (see getCoreTimer()) reaches the specified
+  * value. The deadline must be less than 2 ^ 31 core timer counts (about
+  * a minute) away. */
+#define TASK_WAIT_DEADLINE(task, when) \
+	do { (task)->deadline = (when); (task)->has_deadline = 1; TASK_WAIT_POINT(task); } while (0)
+
+/** Wait until any of the specified events is signalled, or until the
+  * deadline, whichever happens first. If the events field of the task is 0
+  * afterwards, the deadline was reached. */
+#define TASK_WAIT_EVENT_OR_DEADLINE(task, event_mask, when) \
+	do { (task)->wait_events = (event_mask); (task)->deadline = (when); (task)->has_deadline = 1; TASK_WAIT_POINT(task); } while (0)
+
+/** Wait for the specified number of microseconds (at least). */
+#define TASK_DELAY(task, microseconds) \
+	TASK_WAIT_DEADLINE(task, getCoreTimer() + (microseconds) * (CORE_TIMER_FREQUENCY / 1000000))
+
+/** Wait until a condition is true. The condition is checked every time
+  * the scheduler goes through its tasks, so the scheduler won't idle while
+  * a task is waiting here. Prefer TASK_WAIT_EVENT() where possible. */
+#define TASK_WAIT_UNTIL(task, condition) \
+	while (!(condition)) { TASK_YIELD(task); }
+
+extern void initScheduler(void);
+extern void addTask(Task *task, TaskFunction run);
+extern void signalEvents(uint32_t events);
+extern int runTasksOnce(void);
+extern void runScheduler(void);
+
+#endif	// #ifndef SCHEDULER_H
@@ -4,8 +4,26 @@
   *
   * Each FIFO buffer is intended to be used in a producer-consumer process,
   * with the producer existing in a non-IRH (Interrupt Request Handler) context
-  * and the consumer existing in an IRH context, or vice versa. Synchronisation
-  * is handled using critical sections.
+  * and the consumer existing in an IRH context, or vice versa. No critical
+  * sections are needed, because the producer only ever writes to the head
+  * index and the consumer only ever writes to the tail index. On the PIC32,
+  * aligned 32 bit loads and stores are atomic, so each side always sees a
+  * consistent (if slightly stale) value of the other side's index. A stale
+  * value is harmless: it can only make the buffer appear more full (to the
+  * producer) or more empty (to the consumer) than it really is.
+  *
+  * What does matter is the order: the bytes must be in storage before the
+  * new head is published, and must be out of storage before the new tail is
+  * published. volatile alone doesn't guarantee that, because memcpy() is
+  * given non-volatile pointers and so the compiler may move it past the
+  * index store (or, with link-time optimisation, inline it and do so). So
+  * every index store is preceded by COMPILER_BARRIER(). The PIC32's CPU
+  * doesn't reorder memory accesses itself, so no hardware barrier is needed.
+  *
+  * This only works if there is at most one producer and at most one consumer
+  * active at any time. If either side can be entered from more than one
+  * context, the caller must serialise those entries itself (eg. by disabling
+  * interrupts).
   * The functions in this file don't actually interface with any
   * communications hardware. The interface of circular buffers to hardware
   * must be handled elsewhere.
@@ -14,11 +32,27 @@
   */
 
 #include <stdint.h>
-#include <p32xxxx.h>
+#include <string.h>
 #include "pic32_system.h"
 #include "serial_fifo.h"
 #include "usb_callbacks.h" // for usbFatalError()
 
+/** Stop the compiler from moving memory accesses across this point. Use this
+  * before publishing a new head or tail index. */
+#define COMPILER_BARRIER()			__asm__ volatile("" ::: "memory")
+
+#ifndef LOAD_INDEX
+/** Read a head or tail index which the other side may be changing. A host
+  * build which runs the producer and consumer on separate threads (see
+  * host/serial_fifo_stress.c) can define this as an acquire load, since a
+  * volatile access isn't ordered with respect to other threads there. */
+#define LOAD_INDEX(index)			(index)
+#endif // #ifndef LOAD_INDEX
+#ifndef STORE_INDEX
+/** Publish a new head or tail index. See #LOAD_INDEX. */
+#define STORE_INDEX(index, value)	((index) = (value))
+#endif // #ifndef STORE_INDEX
+
 /** Clear and initialise contents of circular buffer.
   * \param buffer The circular buffer to initialise and clear.
   * \param storage Storage array for buffer contents. This must be large enough
@@ -29,8 +63,8 @@ void initCircularBuffer(volatile CircularBuffer *buffer, volatile uint8_t *stora
 {
 	memset((void *)storage, 0xff, size); // just to be sure
 	memset((void *)storage, 0, size);
-	buffer->next = 0;
-	buffer->remaining = 0;
+	buffer->head = 0;
+	buffer->tail = 0;
 	buffer->size = size;
 	buffer->storage = storage;
 }
@@ -41,7 +75,7 @@ void initCircularBuffer(volatile CircularBuffer *buffer, volatile uint8_t *stora
   */
 int isCircularBufferEmpty(volatile CircularBuffer *buffer)
 {
-	return buffer->remaining == 0;
+	return LOAD_INDEX(buffer->head) == LOAD_INDEX(buffer->tail);
 }
 
 /** Check whether a circular buffer is full.
@@ -50,7 +84,7 @@ int isCircularBufferEmpty(volatile CircularBuffer *buffer)
   */
 int isCircularBufferFull(volatile CircularBuffer *buffer)
 {
-	return buffer->remaining == buffer->size;
+	return (LOAD_INDEX(buffer->head) - LOAD_INDEX(buffer->tail)) == buffer->size;
 }
 
 /** Obtain the remaining space (in number of bytes) in a circular buffer.
@@ -62,8 +96,10 @@ int isCircularBufferFull(volatile CircularBuffer *buffer)
 uint32_t circularBufferSpaceRemaining(volatile CircularBuffer *buffer)
 {
 	// No need to put this in a critical section since (outside of init),
-	// nothing else touches size.
-	return buffer->size - buffer->remaining;
+	// nothing else touches size. If the other side modifies its index
+	// while this is being calculated, the result will only be an
+	// underestimate.
+	return buffer->size - (LOAD_INDEX(buffer->head) - LOAD_INDEX(buffer->tail));
 }
 
 /** Read a byte from a circular buffer. This will block until a byte is
@@ -76,6 +112,7 @@ uint32_t circularBufferSpaceRemaining(volatile CircularBuffer *buffer)
 uint8_t circularBufferRead(volatile CircularBuffer *buffer, int is_irq)
 {
 	uint32_t status;
+	uint32_t tail;
 	uint8_t r;
 
 	while(isCircularBufferEmpty(buffer))
@@ -88,14 +125,22 @@ uint8_t circularBufferRead(volatile CircularBuffer *buffer, int is_irq)
 			usbFatalError();
 			return 0;
 		}
-		enterIdleMode();
+		// Check again with interrupts disabled, so that the producer can't
+		// sneak in before the CPU idles (see idleWithInterruptsDisabled()).
+		status = disableInterrupts();
+		if (isCircularBufferEmpty(buffer))
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
 	}
 
-	status = disableInterrupts();
-	r = buffer->storage[buffer->next];
-	buffer->remaining--;
-	buffer->next = (buffer->next + 1) & (buffer->size - 1);
-	restoreInterrupts(status);
+	// The element must be read before tail is advanced, otherwise the
+	// producer could overwrite it.
+	tail = LOAD_INDEX(buffer->tail);
+	r = buffer->storage[tail & (buffer->size - 1)];
+	COMPILER_BARRIER();
+	STORE_INDEX(buffer->tail, tail + 1);
 	return r;
 }
 
@@ -109,7 +154,7 @@ uint8_t circularBufferRead(volatile CircularBuffer *buffer, int is_irq)
 void circularBufferWrite(volatile CircularBuffer *buffer, uint8_t data, int is_irq)
 {
 	uint32_t status;
-	uint32_t index;
+	uint32_t head;
 
 	while (isCircularBufferFull(buffer))
 	{
@@ -121,12 +166,248 @@ void circularBufferWrite(volatile CircularBuffer *buffer, uint8_t data, int is_i
 			usbFatalError();
 			return;
 		}
-		enterIdleMode();
+		// Check again with interrupts disabled, so that the consumer can't
+		// sneak in before the CPU idles (see idleWithInterruptsDisabled()).
+		status = disableInterrupts();
+		if (isCircularBufferFull(buffer))
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	}
+
+	// The element must be written before head is advanced, otherwise the
+	// consumer could read it before it is valid.
+	head = LOAD_INDEX(buffer->head);
+	buffer->storage[head & (buffer->size - 1)] = data;
+	COMPILER_BARRIER();
+	STORE_INDEX(buffer->head, head + 1);
+}
+
+/** Read up to length bytes from a circular buffer. Unlike
+  * circularBufferRead(), this will not block; it will read as many bytes as
+  * are available (up to length), using at most two calls to memcpy() (one for
+  * the part before the wrap point and one for the part after it).
+  * This is safe to call from an interrupt request handler.
+  * \param buffer The circular buffer to read from.
+  * \param data The bytes read from the buffer will be written here. This must
+  *             have space for at least length bytes.
+  * \param length The maximum number of bytes to read.
+  * \return The number of bytes actually read. This may be less than length
+  *         (including 0) if the buffer did not contain enough bytes.
+  */
+uint32_t circularBufferReadBlock(volatile CircularBuffer *buffer, uint8_t *data, uint32_t length)
+{
+	uint32_t tail;
+	uint32_t index;
+	uint32_t available;
+	uint32_t first_span;
+
+	tail = LOAD_INDEX(buffer->tail);
+	available = LOAD_INDEX(buffer->head) - tail;
+	if (length > available)
+	{
+		length = available;
 	}
+	index = tail & (buffer->size - 1);
+	first_span = buffer->size - index;
+	if (first_span > length)
+	{
+		first_span = length;
+	}
+	memcpy(data, (const void *)&(buffer->storage[index]), first_span);
+	memcpy(&(data[first_span]), (const void *)buffer->storage, length - first_span);
+	// Only publish the new tail after everything has been copied out, so that
+	// the producer cannot overwrite any of it.
+	COMPILER_BARRIER();
+	STORE_INDEX(buffer->tail, tail + length);
+	return length;
+}
+
+/** Write up to length bytes to a circular buffer. Unlike
+  * circularBufferWrite(), this will not block; it will write as many bytes as
+  * will fit (up to length), using at most two calls to memcpy() (one for
+  * the part before the wrap point and one for the part after it).
+  * This is safe to call from an interrupt request handler.
+  * \param buffer The circular buffer to write to.
+  * \param data The bytes to write to the buffer.
+  * \param length The maximum number of bytes to write.
+  * \return The number of bytes actually written. This may be less than length
+  *         (including 0) if the buffer did not have enough space.
+  */
+uint32_t circularBufferWriteBlock(volatile CircularBuffer *buffer, const uint8_t *data, uint32_t length)
+{
+	uint32_t head;
+	uint32_t index;
+	uint32_t space;
+	uint32_t first_span;
+
+	head = LOAD_INDEX(buffer->head);
+	space = buffer->size - (head - LOAD_INDEX(buffer->tail));
+	if (length > space)
+	{
+		length = space;
+	}
+	index = head & (buffer->size - 1);
+	first_span = buffer->size - index;
+	if (first_span > length)
+	{
+		first_span = length;
+	}
+	memcpy((void *)&(buffer->storage[index]), data, first_span);
+	memcpy((void *)buffer->storage, &(data[first_span]), length - first_span);
+	// Only publish the new head after everything has been copied in, so that
+	// the consumer cannot read any of it prematurely.
+	COMPILER_BARRIER();
+	STORE_INDEX(buffer->head, head + length);
+	return length;
+}
+
+/** Look at the bytes at the front of a circular buffer without removing them.
+  * This allows a consumer to hand the contents of the buffer directly to
+  * something else (eg. a DMA engine) without copying them. Because the
+  * returned region must be contiguous, it will stop at the wrap point, so
+  * fewer bytes than are actually available may be returned.
+  *
+  * The bytes remain in the buffer (and so the producer cannot overwrite them)
+  * until circularBufferCommitRead() is called.
+  * \param buffer The circular buffer to look at.
+  * \param data Will be set to point to the first byte of the contiguous
+  *             region.
+  * \return The number of bytes in the contiguous region. This may be 0.
+  */
+uint32_t circularBufferPeek(volatile CircularBuffer *buffer, volatile uint8_t **data)
+{
+	return circularBufferPeekAt(buffer, 0, data);
+}
 
-	status = disableInterrupts();
-	index = (buffer->next + buffer->remaining) & (buffer->size - 1);
-	buffer->storage[index] = data;
-	buffer->remaining++;
-	restoreInterrupts(status);
+/** Like circularBufferPeek(), except this looks at bytes starting some
+  * distance from the front of a circular buffer. This allows a consumer to
+  * have several regions of the buffer in use at once (eg. one per queued
+  * DMA transfer).
+  * \param buffer The circular buffer to look at.
+  * \param offset Number of bytes from the front of the buffer to start
+  *               looking at.
+  * \param data Will be set to point to the first byte of the contiguous
+  *             region.
+  * \return The number of bytes in the contiguous region. This will be 0 if
+  *         offset is greater than or equal to the number of bytes in the
+  *         buffer.
+  */
+uint32_t circularBufferPeekAt(volatile CircularBuffer *buffer, uint32_t offset, volatile uint8_t **data)
+{
+	uint32_t tail;
+	uint32_t index;
+	uint32_t available;
+	uint32_t span;
+
+	tail = LOAD_INDEX(buffer->tail);
+	available = LOAD_INDEX(buffer->head) - tail;
+	if (offset >= available)
+	{
+		available = 0;
+	}
+	else
+	{
+		available -= offset;
+	}
+	index = (tail + offset) & (buffer->size - 1);
+	span = buffer->size - index;
+	if (span > available)
+	{
+		span = available;
+	}
+	*data = &(buffer->storage[index]);
+	return span;
+}
+
+/** Remove bytes from the front of a circular buffer, without reading them.
+  * This is meant to be used after circularBufferPeek(), once the consumer is
+  * finished with the peeked bytes.
+  * \param buffer The circular buffer to remove bytes from.
+  * \param length The number of bytes to remove.
+  * \warning length must not exceed the number of bytes in the buffer,
+  *          otherwise usbFatalError() will be called.
+  */
+void circularBufferCommitRead(volatile CircularBuffer *buffer, uint32_t length)
+{
+	uint32_t tail;
+
+	tail = LOAD_INDEX(buffer->tail);
+	if (length > (LOAD_INDEX(buffer->head) - tail))
+	{
+		// This should never happen.
+		usbFatalError();
+		return;
+	}
+	// Whatever the consumer did with the peeked bytes must be finished
+	// before the producer is allowed to overwrite them.
+	COMPILER_BARRIER();
+	STORE_INDEX(buffer->tail, tail + length);
+}
+
+/** Look at the free space at the back of a circular buffer. This allows a
+  * producer to have something else (eg. a DMA engine) write directly into
+  * the buffer's storage, without copying. Because the returned region must be
+  * contiguous, it will stop at the wrap point, so less space than is actually
+  * free may be returned.
+  *
+  * The written bytes will not be visible to the consumer until
+  * circularBufferCommitWrite() is called.
+  * \param buffer The circular buffer to look at.
+  * \param data Will be set to point to the first free byte.
+  * \return The number of free bytes in the contiguous region. This may be 0.
+  */
+uint32_t circularBufferPeekFree(volatile CircularBuffer *buffer, volatile uint8_t **data)
+{
+	uint32_t head;
+	uint32_t index;
+	uint32_t space;
+	uint32_t span;
+
+	head = LOAD_INDEX(buffer->head);
+	space = buffer->size - (head - LOAD_INDEX(buffer->tail));
+	index = head & (buffer->size - 1);
+	span = buffer->size - index;
+	if (span > space)
+	{
+		span = space;
+	}
+	*data = &(buffer->storage[index]);
+	return span;
+}
+
+/** Add bytes to the back of a circular buffer, without writing them. This is
+  * meant to be used after circularBufferPeekFree(), once the producer has
+  * filled in the free space.
+  *
+  * If the storage array was allocated with extra bytes beyond the end of the
+  * buffer, the producer may write past the wrap point into those extra bytes;
+  * any such bytes will be moved to the start of the storage array. This allows
+  * something which can only write to a contiguous region to write across the
+  * wrap point.
+  * \param buffer The circular buffer to add bytes to.
+  * \param length The number of bytes to add.
+  * \warning length must not exceed the free space in the buffer, otherwise
+  *          usbFatalError() will be called.
+  */
+void circularBufferCommitWrite(volatile CircularBuffer *buffer, uint32_t length)
+{
+	uint32_t head;
+	uint32_t index;
+
+	head = LOAD_INDEX(buffer->head);
+	if (length > (buffer->size - (head - LOAD_INDEX(buffer->tail))))
+	{
+		// This should never happen.
+		usbFatalError();
+		return;
+	}
+	index = head & (buffer->size - 1);
+	if ((index + length) > buffer->size)
+	{
+		memcpy((void *)buffer->storage, (const void *)&(buffer->storage[buffer->size]), index + length - buffer->size);
+	}
+	COMPILER_BARRIER();
+	STORE_INDEX(buffer->head, head + length);
 }
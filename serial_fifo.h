@@ -8,13 +8,17 @@
 #ifndef SERIAL_FIFO_H_INCLUDED
 #define SERIAL_FIFO_H_INCLUDED
 
-/** A circular buffer. */
+/** A circular buffer. The head and tail indices are free-running; they are
+  * only reduced modulo #size when accessing #storage. Thus the number of
+  * elements in the buffer is always head - tail (modulo 2 ^ 32). */
 typedef struct CircularBufferStruct
 {
-	/** Index of the next element to remove. */
-	volatile uint32_t next;
-	/** Number of elements remaining in buffer. */
-	volatile uint32_t remaining;
+	/** Index of the next element to write. This is only ever modified by the
+	  * producer. */
+	volatile uint32_t head;
+	/** Index of the next element to remove. This is only ever modified by the
+	  * consumer. */
+	volatile uint32_t tail;
 	/** The maximum number of elements the buffer can store.
 	  * \warning This must be a power of 2.
 	  */
@@ -29,5 +33,12 @@ extern int isCircularBufferFull(volatile CircularBuffer *buffer);
 extern uint32_t circularBufferSpaceRemaining(volatile CircularBuffer *buffer);
 extern uint8_t circularBufferRead(volatile CircularBuffer *buffer, int is_irq);
 extern void circularBufferWrite(volatile CircularBuffer *buffer, uint8_t data, int is_irq);
+extern uint32_t circularBufferReadBlock(volatile CircularBuffer *buffer, uint8_t *data, uint32_t length);
+extern uint32_t circularBufferWriteBlock(volatile CircularBuffer *buffer, const uint8_t *data, uint32_t length);
+extern uint32_t circularBufferPeek(volatile CircularBuffer *buffer, volatile uint8_t **data);
+extern uint32_t circularBufferPeekAt(volatile CircularBuffer *buffer, uint32_t offset, volatile uint8_t **data);
+extern void circularBufferCommitRead(volatile CircularBuffer *buffer, uint32_t length);
+extern uint32_t circularBufferPeekFree(volatile CircularBuffer *buffer, volatile uint8_t **data);
+extern void circularBufferCommitWrite(volatile CircularBuffer *buffer, uint32_t length);
 
 #endif // #ifndef SERIAL_FIFO_H_INCLUDED
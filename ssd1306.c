@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <p32xxxx.h>
 #include "pic32_system.h"
+#include "test_result.h"
 
 /** Bit which specifies which pin (1 = RD0, 2 = RD1, 4 = RD2 etc.) on port D
   * the OLED controller's chip select line is connected to. */
@@ -586,9 +587,18 @@ int displayCursorAtEnd(void)
 	}
 }
 
-/** Run SSD1306 tests and report result to display. */
-void testSSD1306(void)
+/** Run SSD1306 tests and report result to display. The display interface is
+  * write-only, so this always passes; the operator has to look at the
+  * display to see whether it is working.
+  * \param parameters Unused; this test has no parameters.
+  * \param num_parameters Unused.
+  * \param result The structured result (which has no values) will be
+  *               written here.
+  */
+void testSSD1306(const int32_t *parameters, unsigned int num_parameters, TestResult *result)
 {
+	result->outcome = TEST_PASS;
+	result->num_values = 0;
 	clearDisplay();
 	writeStringToDisplayWordWrap("If you can see this, the display is working.");
 	nextLine();
@@ -8,6 +8,9 @@
 #ifndef PIC32_SSD1306_H_INCLUDED
 #define PIC32_SSD1306_H_INCLUDED
 
+#include <stdint.h>
+#include "test_result.h"
+
 extern void initSSD1306(void);
 extern void displayOn(void);
 extern void displayOff(void);
@@ -16,6 +19,6 @@ extern void nextLine(void);
 extern void writeStringToDisplay(const char *str);
 extern void writeStringToDisplayWordWrap(const char *str);
 extern int displayCursorAtEnd(void);
-extern void testSSD1306(void);
+extern void testSSD1306(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
 
 #endif // #ifndef PIC32_SSD1306_H_INCLUDED
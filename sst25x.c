@@ -13,6 +13,13 @@
   * with sector granularity (see #SECTOR_SIZE) and no wear-levelling is
   * performed. Before calling any other function, initSST25x() must be called.
   *
+  * Erasing and programming take tens of milliseconds, most of which is spent
+  * waiting for the flash. sst25xEraseSector() and sst25xProgramSector() wait
+  * for the whole operation. To do something else in the meantime, begin the
+  * operation with sst25xBeginEraseSector() or sst25xBeginProgramSector(),
+  * then call sst25xContinueWrite() every now and then until it returns 0.
+  * testSST25x() can be split up in the same way (see beginSST25xTest()).
+  *
   * While the code here is written for the SST25x series, other serial flash
   * memory chips (eg. from Winbond) have very similar interfaces. Thus the
   * code can probably be adapted to other serial flash memory chips relatively
@@ -38,6 +45,7 @@
 #include "pic32_system.h"
 #include "ssd1306.h"
 #include "sst25x.h"
+#include "test_result.h"
 
 /** One byte command op codes, taken from Table 5 of the SST25VF080B
   * datasheet. */
@@ -79,6 +87,35 @@ typedef enum SST25xOpCodesEnum
 	SST25X_DBSY					= 0x80
 } SST25xOpCodes;
 
+/** Steps of the erase-program-read cycle in testSST25x(). */
+typedef enum SST25xTestStepEnum
+{
+	/** No test is in progress. */
+	SST25X_TEST_DONE			= 0,
+	/** Waiting for the sector to be erased. */
+	SST25X_TEST_ERASING			= 1,
+	/** Waiting for the sector to be programmed. */
+	SST25X_TEST_PROGRAMMING		= 2
+} SST25xTestStep;
+
+/** Data which the sector program in progress is writing. This points to the
+  * caller's buffer, which must remain valid until the program finishes. */
+static uint8_t *write_data;
+/** Offset into #write_data of the next word to program. */
+static uint32_t write_offset;
+/** Number of bytes which the write in progress will program. This is 0 for
+  * erases. */
+static uint32_t write_length;
+/** Which step the test in progress (see beginSST25xTest()) is up to. */
+static SST25xTestStep test_step;
+/** Address of the sector which the test in progress is using. */
+static uint32_t test_address;
+/** Contents of the sector, as read back by the test. */
+static uint8_t sector_contents[SECTOR_SIZE];
+/** What the test programs the sector with. This is not on the stack
+  * because it must outlive each call to continueSST25xTest(). */
+static uint8_t new_sector_contents[SECTOR_SIZE];
+
 /** Initialise the PIC32's SPI4 module to interface with the SST25x serial
   * flash. SCK4, SDI4 and SDO4 are expected to be directly connected to the
   * serial flash. SS4 should be connected to the serial flash's chip enable
@@ -298,46 +335,51 @@ void sst25xRead(uint8_t *data, uint32_t address, uint32_t length)
 	spiCommand(command_buffer, 4, data, length);
 }
 
-/** Erase an entire sector (#SECTOR_SIZE bytes) of the SST25x serial flash.
-  * Erasing a sector resets its contents to all 1s. Use sst25xProgramSector()
-  * to write arbitrary data to the sector.
+/** Begin erasing an entire sector (#SECTOR_SIZE bytes) of the SST25x serial
+  * flash. This returns as soon as the erase has started; call
+  * sst25xContinueWrite() until it returns 0 to finish the erase.
   * \param address The address of the sector to erase. This must be aligned
   *                to a multiple of #SECTOR_SIZE.
   */
-void sst25xEraseSector(uint32_t address)
+void sst25xBeginEraseSector(uint32_t address)
 {
 	uint8_t command_buffer[4];
 	uint8_t read_buffer[1];
 
 	address &= (0xffffffff ^ (SECTOR_SIZE - 1)); // align to multiple of SECTOR_SIZE
+	write_data = NULL;
+	write_offset = 0;
+	write_length = 0;
 	sst25xWriteEnable();
 	command_buffer[0] = SST25X_SECTOR_ERASE_4K;
 	command_buffer[1] = (uint8_t)(address >> 16);
 	command_buffer[2] = (uint8_t)(address >> 8);
 	command_buffer[3] = (uint8_t)(address);
 	spiCommand(command_buffer, 4, read_buffer, 0);
-	sst25xWaitUntilNotBusy();
-	sst25xWriteDisable(); // just to be safe
 }
 
-/** Program an entire sector (#SECTOR_SIZE bytes) of the SST25x serial flash.
-  * Programming allows the sector to be written with arbitrary data. Before
-  * calling this, the sector should be in an erased state (use
-  * sst25xEraseSector() to do that).
+/** Begin programming an entire sector (#SECTOR_SIZE bytes) of the SST25x
+  * serial flash. This only programs the first word; call
+  * sst25xContinueWrite() until it returns 0 to program the rest.
   * \param data The data to program the sector with. This must be
-  *             exactly #SECTOR_SIZE bytes in size
+  *             exactly #SECTOR_SIZE bytes in size, and must remain valid
+  *             until the program has finished.
   * \param address The address of the sector to program. This must be aligned
   *                to a multiple of #SECTOR_SIZE.
   */
-void sst25xProgramSector(uint8_t *data, uint32_t address)
+void sst25xBeginProgramSector(uint8_t *data, uint32_t address)
 {
-	unsigned int i;
 	uint8_t command_buffer[6];
 	uint8_t read_buffer[1];
 
 	address &= (0xffffffff ^ (SECTOR_SIZE - 1)); // align to multiple of SECTOR_SIZE
+	write_data = data;
+	write_offset = 2;
+	write_length = SECTOR_SIZE;
 	// Use auto-address increment mode with software end-of-write detection.
-	// This follows Figure 11 of the SST25VF080B datasheet.
+	// This follows Figure 11 of the SST25VF080B datasheet. The flash stays
+	// in auto-address increment mode for as long as it takes to send the
+	// next word, so there can be arbitrary gaps between words.
 	sst25xWriteEnable();
 	command_buffer[0] = SST25X_AAI_WORD_PROGRAM;
 	command_buffer[1] = (uint8_t)(address >> 16);
@@ -346,32 +388,102 @@ void sst25xProgramSector(uint8_t *data, uint32_t address)
 	command_buffer[4] = data[0];
 	command_buffer[5] = data[1];
 	spiCommand(command_buffer, 6, read_buffer, 0);
-	sst25xWaitUntilNotBusy();
-	for (i = 2; i < SECTOR_SIZE; i += 2)
+}
+
+/** Carry on with an erase or program which was begun using
+  * sst25xBeginEraseSector() or sst25xBeginProgramSector(). This doesn't
+  * wait for the flash; if it is still busy, this returns straight away.
+  * Otherwise, this programs the next word (if there is one) or finishes
+  * the write.
+  * \return Non-zero if the write is still in progress, 0 if it has
+  *         finished.
+  */
+int sst25xContinueWrite(void)
+{
+	uint8_t command_buffer[3];
+	uint8_t read_buffer[1];
+
+	if ((sst25xReadStatusRegister() & 0x01) != 0)
+	{
+		return 1; // still busy
+	}
+	if (write_offset < write_length)
 	{
 		command_buffer[0] = SST25X_AAI_WORD_PROGRAM;
-		command_buffer[1] = data[i];
-		command_buffer[2] = data[i + 1];
+		command_buffer[1] = write_data[write_offset];
+		command_buffer[2] = write_data[write_offset + 1];
 		spiCommand(command_buffer, 3, read_buffer, 0);
-		sst25xWaitUntilNotBusy();
+		write_offset += 2;
+		return 1;
 	}
-	sst25xWriteDisable(); // exit AAI mode
+	sst25xWriteDisable(); // exit AAI mode, or just to be safe after erase
 	sst25xWaitUntilNotBusy(); // just to be safe
+	return 0;
 }
 
-/** Test SST25x serial flash by querying its JEDEC ID (to test that the SPI
-  * lines are connected properly) and running an erase-program-read cycle
-  * (to test the most commonly used operations).
+/** Erase an entire sector (#SECTOR_SIZE bytes) of the SST25x serial flash.
+  * Erasing a sector resets its contents to all 1s. Use sst25xProgramSector()
+  * to write arbitrary data to the sector. This waits until the erase has
+  * finished.
+  * \param address The address of the sector to erase. This must be aligned
+  *                to a multiple of #SECTOR_SIZE.
   */
-void testSST25x(void)
+void sst25xEraseSector(uint32_t address)
+{
+	sst25xBeginEraseSector(address);
+	while (sst25xContinueWrite())
+	{
+		// do nothing
+	}
+}
+
+/** Program an entire sector (#SECTOR_SIZE bytes) of the SST25x serial flash.
+  * Programming allows the sector to be written with arbitrary data. Before
+  * calling this, the sector should be in an erased state (use
+  * sst25xEraseSector() to do that). This waits until the program has
+  * finished.
+  * \param data The data to program the sector with. This must be
+  *             exactly #SECTOR_SIZE bytes in size
+  * \param address The address of the sector to program. This must be aligned
+  *                to a multiple of #SECTOR_SIZE.
+  */
+void sst25xProgramSector(uint8_t *data, uint32_t address)
+{
+	sst25xBeginProgramSector(data, address);
+	while (sst25xContinueWrite())
+	{
+		// do nothing
+	}
+}
+
+/** Begin testing the SST25x serial flash. This does the quick parts of
+  * testSST25x() (querying the JEDEC ID) and begins the erase. Then
+  * continueSST25xTest() must be called until it returns 0. In between
+  * calls, the caller can do something else (eg. run other tests), as long
+  * as it doesn't use the SST25x serial flash.
+  * \param parameters See testSST25x().
+  * \param num_parameters See testSST25x().
+  * \param result The structured result will be written here (by this and
+  *               by continueSST25xTest()).
+  */
+void beginSST25xTest(const int32_t *parameters, unsigned int num_parameters, TestResult *result)
 {
 	uint8_t command_buffer[1];
 	uint8_t read_buffer[3];
-	uint8_t sector_contents[SECTOR_SIZE];
-	uint8_t new_sector_contents[SECTOR_SIZE];
 	char sbuffer[64];
-	unsigned int i;
-	int abort;
+
+	test_step = SST25X_TEST_DONE;
+	result->num_values = 0;
+	test_address = 0;
+	if (num_parameters >= 1)
+	{
+		if ((parameters[0] < 0) || (parameters[0] >= NUM_SECTORS))
+		{
+			result->outcome = TEST_BAD_PARAMETERS;
+			return;
+		}
+		test_address = (uint32_t)parameters[0] * SECTOR_SIZE;
+	}
 
 	writeStringToDisplay("External memory");
 	nextLine();
@@ -381,43 +493,100 @@ void testSST25x(void)
 	sprintf(sbuffer, "%02x%02x%02x", read_buffer[0], read_buffer[1], read_buffer[2]);
 	writeStringToDisplay(sbuffer);
 	nextLine();
+	result->values[0] = ((int32_t)read_buffer[0] << 16) | ((int32_t)read_buffer[1] << 8) | read_buffer[2];
 
 	writeStringToDisplay("EPR cycle:");
 	nextLine();
 	// Check that erase sets contents to 0xff.
-	sst25xEraseSector(0);
-	memset(sector_contents, 0, sizeof(sector_contents));
-	sst25xRead(sector_contents, 0, SECTOR_SIZE);
-	abort = 0;
-	for (i = 0; i < SECTOR_SIZE; i++)
+	sst25xBeginEraseSector(test_address);
+	test_step = SST25X_TEST_ERASING;
+}
+
+/** Record which step of the erase-program-read cycle failed, and finish the
+  * test.
+  * \param result The structured result to write to.
+  * \param failed_step See testSST25x().
+  */
+static void finishSST25xTest(TestResult *result, int32_t failed_step)
+{
+	result->values[1] = failed_step;
+	result->num_values = 2;
+	result->outcome = (failed_step == 0) ? TEST_PASS : TEST_FAIL;
+	test_step = SST25X_TEST_DONE;
+}
+
+/** Carry on with a test which was begun using beginSST25xTest(). This
+  * doesn't wait for the flash to finish erasing or programming, but it
+  * does read back and verify the sector once it has.
+  * \param result The same result which was passed to beginSST25xTest().
+  * \return Non-zero if the test is still in progress, 0 if it has finished
+  *         (result will then be complete).
+  */
+int continueSST25xTest(TestResult *result)
+{
+	unsigned int i;
+
+	if (test_step == SST25X_TEST_DONE)
 	{
-		if (sector_contents[i] != 0xff)
-		{
-			abort = 1;
-			break;
-		}
+		return 0;
 	}
-	if (abort)
+	if (sst25xContinueWrite())
 	{
-		writeStringToDisplay("erase failed");
+		return 1;
 	}
-	else
+	if (test_step == SST25X_TEST_ERASING)
 	{
+		memset(sector_contents, 0, sizeof(sector_contents));
+		sst25xRead(sector_contents, test_address, SECTOR_SIZE);
+		for (i = 0; i < SECTOR_SIZE; i++)
+		{
+			if (sector_contents[i] != 0xff)
+			{
+				writeStringToDisplay("erase failed");
+				finishSST25xTest(result, 1);
+				return 0;
+			}
+		}
 		// Program and verify.
 		srand(42);
 		for (i = 0; i < SECTOR_SIZE; i++)
 		{
 			new_sector_contents[i] = (uint8_t)rand();
 		}
-		sst25xProgramSector(new_sector_contents, 0);
-		sst25xRead(sector_contents, 0, SECTOR_SIZE);
-		if (memcmp(sector_contents, new_sector_contents, sizeof(sector_contents)))
-		{
-			writeStringToDisplay("verify failed");
-		}
-		else
-		{
-			writeStringToDisplay("pass");
-		}
+		sst25xBeginProgramSector(new_sector_contents, test_address);
+		test_step = SST25X_TEST_PROGRAMMING;
+		return 1;
+	}
+	sst25xRead(sector_contents, test_address, SECTOR_SIZE);
+	if (memcmp(sector_contents, new_sector_contents, sizeof(sector_contents)))
+	{
+		writeStringToDisplay("verify failed");
+		finishSST25xTest(result, 2);
+	}
+	else
+	{
+		writeStringToDisplay("pass");
+		finishSST25xTest(result, 0);
+	}
+	return 0;
+}
+
+/** Test SST25x serial flash by querying its JEDEC ID (to test that the SPI
+  * lines are connected properly) and running an erase-program-read cycle
+  * (to test the most commonly used operations).
+  *
+  * The result has two values: the JEDEC ID, and which step of the
+  * erase-program-read cycle failed (0 = none, 1 = erase, 2 = verify).
+  * \param parameters Optional parameter 0 is the sector number to use for
+  *                   the erase-program-read cycle (default 0).
+  * \param num_parameters Number of entries in parameters.
+  * \param result The structured result will be written here.
+  */
+void testSST25x(const int32_t *parameters, unsigned int num_parameters, TestResult *result)
+{
+	beginSST25xTest(parameters, num_parameters, result);
+	while (continueSST25xTest(result))
+	{
+		// do nothing
 	}
 }
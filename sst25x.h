@@ -9,6 +9,7 @@
 #define	PIC32_SST25X_H
 
 #include <stdint.h>
+#include "test_result.h"
 
 /** Number of bytes in a sector. A sector is the smallest amount of data
   * which can be erased in one operation.
@@ -16,6 +17,8 @@
   *          be invalid.
   */
 #define SECTOR_SIZE			4096
+/** Number of sectors in the SST25VF080B (8 Mbit). */
+#define NUM_SECTORS			256
 
 extern void initSST25x(void);
 extern uint8_t sst25xReadStatusRegister(void);
@@ -23,6 +26,11 @@ extern void sst25xWriteStatusRegister(uint8_t sst25x_status_register);
 extern void sst25xRead(uint8_t *data, uint32_t address, uint32_t length);
 extern void sst25xEraseSector(uint32_t address);
 extern void sst25xProgramSector(uint8_t *data, uint32_t address);
-extern void testSST25x(void);
+extern void sst25xBeginEraseSector(uint32_t address);
+extern void sst25xBeginProgramSector(uint8_t *data, uint32_t address);
+extern int sst25xContinueWrite(void);
+extern void beginSST25xTest(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
+extern int continueSST25xTest(TestResult *result);
+extern void testSST25x(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
 
 #endif	// #ifndef PIC32_SST25X_H
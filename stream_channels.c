@@ -0,0 +1,307 @@
+/** \file stream_channels.c
+  *
+  * \brief Multiplexes several prioritised logical channels over the HID
+  *        stream.
+  *
+  * The HID stream (see usb_hid_stream.c) carries a single stream of bytes.
+  * This file splits that stream into a number of logical channels (see
+  * #StreamChannel), each with its own transmit and receive FIFO, so that
+  * unrelated kinds of traffic can share the stream without getting mixed
+  * up.
+  *
+  * Channel data is carried in frames, using the same scheme as the reports
+  * of the HID stream: the first byte of each frame is the number of bytes
+  * which follow it. The next byte is the channel number, and the rest of
+  * the frame is channel data. So a frame carries up to
+  * #MAX_FRAME_LENGTH - 2 bytes of channel data. A whole frame fits in one
+  * report, so when frames are full and the stream is busy, each report
+  * carries exactly one frame. The host sends frames to the device in the
+  * same format.
+  *
+  * Frames are only written to the HID stream when its transmit FIFO is
+  * nearly empty, and a new frame is only started when a report has been
+  * transmitted (see refillTransmitStream()). At that point, the highest
+  * priority channel with anything to send is chosen. As a result, a
+  * response on #CHANNEL_COMMAND waits behind at most a couple of reports,
+  * no matter how much data is queued on #CHANNEL_BULK.
+  *
+  * Once streamChannelsInit() has been called, the HID stream must only be
+  * accessed through the functions in this file, otherwise the framing will
+  * be corrupted.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include "stream_channels.h"
+#include "usb_hal.h"
+#include "usb_defs.h"
+#include "usb_hid_stream.h"
+#include "usb_callbacks.h" // for usbFatalError()
+#include "serial_fifo.h"
+#include "pic32_system.h"
+
+/** Maximum size of a frame, in bytes, including the length and channel
+  * bytes. This is the most data that one report can carry. */
+#define MAX_FRAME_LENGTH			(MAX_PACKET_SIZE - 1)
+
+/** Size of each channel's transmit and receive FIFO buffers, in number of
+  * bytes.
+  * \warning This must be a power of 2.
+  */
+#define CHANNEL_FIFO_SIZE			256
+
+/** Transmit FIFO buffers, one for each channel. */
+static volatile CircularBuffer transmit_fifos[NUM_CHANNELS];
+/** Receive FIFO buffers, one for each channel. */
+static volatile CircularBuffer receive_fifos[NUM_CHANNELS];
+/** Storage for the transmit FIFO buffers. */
+static volatile uint8_t transmit_fifo_storage[NUM_CHANNELS][CHANNEL_FIFO_SIZE];
+/** Storage for the receive FIFO buffers. */
+static volatile uint8_t receive_fifo_storage[NUM_CHANNELS][CHANNEL_FIFO_SIZE];
+
+/** Number of bytes of the frame currently being received which haven't been
+  * read from the HID stream yet. This doesn't include the length byte. When
+  * this is 0, the next byte in the HID stream is the length byte of a new
+  * frame. */
+static uint32_t receive_frame_remaining;
+/** Flag (non-zero = set, zero = clear) which, when set, indicates that the
+  * channel byte of the frame currently being received has been read. */
+static unsigned int is_receive_channel_known;
+/** Channel number of the frame currently being received. This is only valid
+  * when #is_receive_channel_known is set. It may not be a valid channel
+  * number, in which case the frame is discarded. */
+static uint8_t receive_frame_channel;
+
+/** Move frames from channel transmit FIFOs to the HID stream, highest
+  * priority channel first, until the HID stream has about a report's worth
+  * of bytes waiting to be transmitted. This is the HID stream's transmit
+  * refill callback (see streamSetTransmitRefillCallback()).
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler).
+  */
+static void refillTransmitStream(void)
+{
+	unsigned int channel;
+	uint32_t count;
+	uint8_t frame[MAX_FRAME_LENGTH];
+
+	// Keeping the HID stream's transmit FIFO shallow is what allows higher
+	// priority channels to overtake lower priority ones.
+	while (streamTransmitPending() < MAX_FRAME_LENGTH)
+	{
+		for (channel = 0; channel < NUM_CHANNELS; channel++)
+		{
+			if (!isCircularBufferEmpty(&(transmit_fifos[channel])))
+			{
+				break;
+			}
+		}
+		if (channel == NUM_CHANNELS)
+		{
+			break; // nothing to send
+		}
+		count = circularBufferReadBlock(&(transmit_fifos[channel]), &(frame[2]), MAX_FRAME_LENGTH - 2);
+		frame[0] = (uint8_t)(count + 1);
+		frame[1] = (uint8_t)channel;
+		// The HID stream's transmit FIFO is much larger than two frames, so
+		// there will always be space for this frame.
+		if (streamWriteNonBlocking(frame, count + 2) != (count + 2))
+		{
+			// This should never happen.
+			usbFatalError();
+		}
+	}
+}
+
+/** Read as many frames as possible from the HID stream and put their data
+  * into the appropriate channel receive FIFOs. This stops early if the
+  * current frame's channel receive FIFO is full, so a channel which is
+  * never read will eventually block all the other channels.
+  */
+static void demultiplexReceivedFrames(void)
+{
+	uint8_t chunk[MAX_FRAME_LENGTH];
+	uint8_t one_byte;
+	uint32_t wanted;
+	uint32_t got;
+
+	while (1)
+	{
+		if (receive_frame_remaining == 0)
+		{
+			// Start of a new frame.
+			if (streamReadNonBlocking(&one_byte, 1) == 0)
+			{
+				break;
+			}
+			receive_frame_remaining = one_byte;
+			is_receive_channel_known = 0;
+		}
+		else if (!is_receive_channel_known)
+		{
+			if (streamReadNonBlocking(&one_byte, 1) == 0)
+			{
+				break;
+			}
+			receive_frame_channel = one_byte;
+			is_receive_channel_known = 1;
+			receive_frame_remaining--;
+		}
+		else
+		{
+			wanted = MIN(receive_frame_remaining, sizeof(chunk));
+			if (receive_frame_channel < NUM_CHANNELS)
+			{
+				wanted = MIN(wanted, circularBufferSpaceRemaining(&(receive_fifos[receive_frame_channel])));
+				if (wanted == 0)
+				{
+					break; // channel receive FIFO is full
+				}
+			}
+			got = streamReadNonBlocking(chunk, wanted);
+			if (got == 0)
+			{
+				break;
+			}
+			// Data for channels which don't exist is discarded.
+			if (receive_frame_channel < NUM_CHANNELS)
+			{
+				circularBufferWriteBlock(&(receive_fifos[receive_frame_channel]), chunk, got);
+			}
+			receive_frame_remaining -= got;
+		}
+	}
+}
+
+/** Initialise channel layer. This must be called after usbHIDStreamInit().
+  * From then on, the HID stream must only be accessed using the functions
+  * in this file. */
+void streamChannelsInit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		initCircularBuffer(&(transmit_fifos[i]), transmit_fifo_storage[i], CHANNEL_FIFO_SIZE);
+		initCircularBuffer(&(receive_fifos[i]), receive_fifo_storage[i], CHANNEL_FIFO_SIZE);
+	}
+	receive_frame_remaining = 0;
+	is_receive_channel_known = 0;
+	receive_frame_channel = 0;
+	streamSetTransmitRefillCallback(&refillTransmitStream);
+}
+
+/** Grab bytes from a channel, without blocking. This reads as many bytes as
+  * are currently available, up to the specified length.
+  * \param channel The channel to read from.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The maximum number of bytes to read.
+  * \return The number of bytes actually read. This may be less than length
+  *         (including 0) if fewer bytes were available.
+  */
+uint32_t channelReadNonBlocking(StreamChannel channel, uint8_t *buffer, uint32_t length)
+{
+	uint32_t done;
+
+	if (channel >= NUM_CHANNELS)
+	{
+		// Bad channel number.
+		usbFatalError();
+		return 0;
+	}
+	demultiplexReceivedFrames();
+	done = circularBufferReadBlock(&(receive_fifos[channel]), buffer, length);
+	// Reading may have unblocked the frame currently being received.
+	demultiplexReceivedFrames();
+	return done;
+}
+
+/** Grab bytes from a channel. This will block until exactly length bytes
+  * have been read.
+  * \param channel The channel to read from.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The number of bytes to read.
+  * \warning This will block forever if the host sends a lot of data on some
+  *          other channel which nothing is reading.
+  */
+void channelRead(StreamChannel channel, uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+	uint32_t got;
+
+	done = 0;
+	while (done < length)
+	{
+		// channelReadNonBlocking() may find nothing, then a report may
+		// arrive before the CPU idles; disabling interrupts over both
+		// means that report still wakes the CPU.
+		status = disableInterrupts();
+		got = channelReadNonBlocking(channel, &(buffer[done]), length - done);
+		done += got;
+		if (got == 0)
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	}
+}
+
+/** Send bytes to a channel, without blocking. This writes as many bytes as
+  * there is space for, up to the specified length.
+  * \param channel The channel to write to.
+  * \param buffer The bytes to send.
+  * \param length The maximum number of bytes to send.
+  * \return The number of bytes actually sent. This may be less than length
+  *         (including 0) if there wasn't enough space in the channel's
+  *         transmit FIFO.
+  */
+uint32_t channelWriteNonBlocking(StreamChannel channel, const uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+
+	if (channel >= NUM_CHANNELS)
+	{
+		// Bad channel number.
+		usbFatalError();
+		return 0;
+	}
+	done = circularBufferWriteBlock(&(transmit_fifos[channel]), buffer, length);
+	// If the HID stream is idle, nothing else will move the bytes along.
+	status = disableInterrupts();
+	refillTransmitStream();
+	restoreInterrupts(status);
+	return done;
+}
+
+/** Send bytes to a channel. This will block until all length bytes have been
+  * sent (or at least, queued for sending).
+  * \param channel The channel to write to.
+  * \param buffer The bytes to send.
+  * \param length The number of bytes to send.
+  */
+void channelWrite(StreamChannel channel, const uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+	uint32_t got;
+
+	done = 0;
+	while (done < length)
+	{
+		// As in channelRead(), don't let a transmit completion slip in
+		// between the attempt and the idle.
+		status = disableInterrupts();
+		got = channelWriteNonBlocking(channel, &(buffer[done]), length - done);
+		done += got;
+		if (got == 0)
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	}
+}
@@ -0,0 +1,34 @@
+/** \file stream_channels.h
+  *
+  * \brief Describes functions and constants exported by stream_channels.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef STREAM_CHANNELS_H
+#define	STREAM_CHANNELS_H
+
+#include <stdint.h>
+
+/** Logical channels which are multiplexed over the HID stream. The channel
+  * number is also the priority: when deciding what to transmit next, lower
+  * numbered channels always go first. */
+typedef enum StreamChannelEnum
+{
+	/** Commands from the host and responses to them. */
+	CHANNEL_COMMAND		= 0,
+	/** Diagnostic log messages. */
+	CHANNEL_LOG			= 1,
+	/** Large amounts of data, such as flash dumps or ADC samples. */
+	CHANNEL_BULK		= 2,
+	/** Number of channels. This must be last. */
+	NUM_CHANNELS
+} StreamChannel;
+
+extern void streamChannelsInit(void);
+extern uint32_t channelReadNonBlocking(StreamChannel channel, uint8_t *buffer, uint32_t length);
+extern void channelRead(StreamChannel channel, uint8_t *buffer, uint32_t length);
+extern uint32_t channelWriteNonBlocking(StreamChannel channel, const uint8_t *buffer, uint32_t length);
+extern void channelWrite(StreamChannel channel, const uint8_t *buffer, uint32_t length);
+
+#endif	// #ifndef STREAM_CHANNELS_H
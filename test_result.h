@@ -0,0 +1,49 @@
+/** \file test_result.h
+  *
+  * \brief Describes the structured result which each test produces.
+  *
+  * Every test (testSSD1306(), testSST25x(), testATSHA204() and testADC())
+  * reports what it found on the display for the operator, and also fills
+  * in a #TestResult, so that the result can be sent to a host (see
+  * test_runner.c).
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef TEST_RESULT_H
+#define	TEST_RESULT_H
+
+#include <stdint.h>
+
+/** Most parameters which can be passed to a test. */
+#define MAX_TEST_PARAMETERS		4
+/** Most measured values which a test can report. */
+#define MAX_TEST_VALUES			4
+
+/** Overall outcome of a test. */
+typedef enum TestOutcomeEnum
+{
+	/** The hardware under test worked. */
+	TEST_PASS			= 0,
+	/** The hardware under test didn't work. */
+	TEST_FAIL			= 1,
+	/** The test couldn't be run, because its parameters were invalid. */
+	TEST_BAD_PARAMETERS	= 2
+} TestOutcome;
+
+/** Structured result of one run of a test. */
+typedef struct TestResultStruct
+{
+	/** Whether the test passed. */
+	TestOutcome outcome;
+	/** Number of valid entries in #values. */
+	unsigned int num_values;
+	/** Measured values. What each one means depends on the test (see
+	  * #test_descriptions in test_runner.c). */
+	int32_t values[MAX_TEST_VALUES];
+	/** How long the test took, in microseconds. This is filled in by
+	  * runTest(), not by the test itself. */
+	uint32_t duration;
+} TestResult;
+
+#endif	// #ifndef TEST_RESULT_H
@@ -0,0 +1,761 @@
+/** \file test_runner.c
+  *
+  * \brief Runs tests, either locally or on request from a host.
+  *
+  * Each test is identified by its test number, which is its index in
+  * #test_descriptions. runTest() runs a test and times it. A host can run
+  * tests remotely, using a simple line-based text protocol on the
+  * #CHANNEL_COMMAND channel of the HID stream (see stream_channels.c).
+  * Each line is terminated by '\n' ('\r' is ignored) and consists of words
+  * separated by spaces. The host sends one of these commands:
+  * - "list": the device responds with one line per test, of the form
+  *   "test <number> <name> <value names...>", followed by "end".
+  * - "run <number> [parameters...]": the device runs the test (with up to
+  *   #MAX_TEST_PARAMETERS integer parameters) and responds with one
+  *   result line (see formatTestResult()).
+  * - "sequence [concurrent]": the device runs every test, without
+  *   parameters, back to back (or overlapping, if "concurrent" is given; see
+  *   runSequence()) and responds with the sequence's result and budget
+  *   lines.
+  * - "wakeups": the device responds with "wakeups <count>", where count is
+  *   the number of times the CPU has come out of idle mode since startup
+  *   (see getIdleWakeUpCount()). Sampling this twice gives the idle wake-up
+  *   rate.
+  * - "stats [clear]": the device responds with "stats reports_tx=<count>
+  *   bytes_tx=<count> reports_rx=<count> bytes_rx=<count>
+  *   callbacks=<count> critical_sections=<count>", the HID stream's
+  *   counters (see #HIDStreamStatistics), and then clears them if "clear"
+  *   is given. bytes_tx / reports_tx is the average report fill. The
+  *   counters include the traffic of the commands and responses
+  *   themselves.
+  * - "interrupts [clear]": the device responds with "interrupts
+  *   count=<count> events=<count> last_batch=<count> max_batch=<count>",
+  *   the USB interrupt service handler's counters (see
+  *   #USBInterruptStatistics), and then clears them if "clear" is given.
+  *   events / count is the average number of events handled per interrupt.
+  * - "dump flash <address> <length>" or "dump adc": the device responds
+  *   with "dump <bytes>", and then sends that many bytes of raw data on the
+  *   Bulk stream (see usb_bulk_stream.c): either the contents of the serial
+  *   flash from address onwards, or a fresh #adc_sample_buffer worth of
+  *   samples (little-endian, 16 bits each). See dumpCommand().
+  *
+  * If a command can't be understood, the device responds with a line
+  * beginning with "error". Responses are sent in the same order as
+  * commands, so the host can send several commands at once.
+  *
+  * When a test is run locally (using the pushbuttons), its result line is
+  * also sent on the #CHANNEL_LOG channel, so that a host which is listening
+  * sees every result.
+  *
+  * Each test has a time budget, which is how long the test is expected to
+  * take on a working DUT. runTestSequence() runs every test and flags those
+  * which go over budget, so that the time each board spends on the fixture
+  * can be measured and cut down.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "test_runner.h"
+#include "test_result.h"
+#include "stream_channels.h"
+#include "usb_hal.h"
+#include "usb_hid_stream.h"
+#include "usb_bulk_stream.h"
+#include "pic32_system.h"
+#include "ssd1306.h"
+#include "sst25x.h"
+#include "atsha204.h"
+#include "adc.h"
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used in #test_descriptions to mark the end of the value names. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
+/** Longest command line, in bytes (not including the terminating '\n'),
+  * which the host can send. */
+#define MAX_COMMAND_LENGTH		80
+/** Size of the buffer which holds one response line, in bytes. This is
+  * big enough for the longest result line. */
+#define MAX_RESPONSE_LENGTH		160
+/** Number of bytes of serial flash read at a time by a "dump flash"
+  * command. */
+#define DUMP_CHUNK_SIZE			256
+
+/** Everything the test runner needs to know about a test. */
+typedef struct TestDescriptionStruct
+{
+	/** Name of the test, as used in the remote protocol. This must not
+	  * contain spaces. */
+	const char *name;
+	/** Function which runs the test. */
+	void (*run)(const int32_t *parameters, unsigned int num_parameters, TestResult *result);
+	/** Names of the measured values which the test reports (see the
+	  * documentation of each test function). Unused entries are NULL. */
+	const char *value_names[MAX_TEST_VALUES];
+	/** Bit mask of values which are better shown in hexadecimal (bit n
+	  * corresponds to value n). */
+	unsigned int hex_values;
+	/** How long the test (when run without parameters) should take, in
+	  * microseconds. These were estimated from the datasheets of each part,
+	  * with some margin; tighten them as real timings are collected. */
+	uint32_t budget;
+} TestDescription;
+
+/** Numbers of the tests which runTestsConcurrently() needs to know about.
+  * These must match the order of #test_descriptions. */
+typedef enum TestNumberEnum
+{
+	TEST_DISPLAY				= 0,
+	TEST_FLASH					= 1,
+	TEST_ATSHA204				= 2,
+	TEST_ADC					= 3
+} TestNumber;
+
+/** All tests, in order of test number. */
+static const TestDescription test_descriptions[NUM_TESTS] = {
+	{"display", &testSSD1306, {NULL}, 0, 100000},
+	{"flash", &testSST25x, {"jedec_id", "failed_step", NULL}, 0x01, 100000},
+	{"atsha204", &testATSHA204, {"wake", "random", NULL}, 0x02, 150000},
+	{"adc", &testADC, {"mean_uv", "noise_uv", NULL}, 0, 250000}
+};
+
+/** Command line which is currently being received from the host. */
+static char command_line[MAX_COMMAND_LENGTH + 1];
+/** Number of bytes in #command_line. */
+static unsigned int command_length;
+/** Flag (non-zero = set, zero = clear) which, when set, indicates that the
+  * command line currently being received is too long, and will be
+  * rejected. */
+static unsigned int is_command_too_long;
+/** Results of each test from the most recent sequence, in order of test
+  * number. */
+static TestResult sequence_results[NUM_TESTS];
+/** Time, in microseconds, which the most recent sequence took. */
+static uint32_t sequence_duration;
+/** Time budget, in microseconds, of the most recent sequence. */
+static uint32_t sequence_budget;
+/** Number of budgets which the most recent sequence went over. */
+static unsigned int sequence_num_over;
+/** Number of tests which didn't pass in the most recent sequence. */
+static unsigned int sequence_num_failed;
+/** Flag (non-zero = set, zero = clear) which, when set, indicates that the
+  * tests in the most recent sequence were run concurrently. */
+static unsigned int is_sequence_concurrent;
+
+/** Get the time since a core timer reading.
+  * \param start The core timer reading, from getCoreTimer().
+  * \return The number of microseconds since start.
+  */
+static uint32_t microsecondsSince(uint32_t start)
+{
+	return (getCoreTimer() - start) / (CORE_TIMER_FREQUENCY / 1000000);
+}
+
+/** Run a test, timing it with the core timer. The display is cleared first,
+  * so that the test can report to it.
+  * \param test_number Which test to run. This must be less than
+  *                    #NUM_TESTS.
+  * \param parameters Test-specific parameters. This may be NULL if
+  *                   num_parameters is 0.
+  * \param num_parameters Number of entries in parameters. Tests use default
+  *                       values for parameters which aren't supplied.
+  * \param result The test's result will be written here.
+  */
+void runTest(unsigned int test_number, const int32_t *parameters, unsigned int num_parameters, TestResult *result)
+{
+	uint32_t start;
+
+	clearDisplay();
+	memset(result, 0, sizeof(*result));
+	start = getCoreTimer();
+	test_descriptions[test_number].run(parameters, num_parameters, result);
+	result->duration = microsecondsSince(start);
+}
+
+/** Write the result line for a test. The line looks like
+  * "result <number> <name> <outcome> duration_us=<duration> <values...>",
+  * where outcome is "pass", "fail" or "bad_parameters" and each value is
+  * written as "<value name>=<value>".
+  * \param buffer The line (including '\n' and a null terminator) will be
+  *               written here. This must have space for
+  *               #MAX_RESPONSE_LENGTH bytes.
+  * \param test_number Which test the result is for.
+  * \param result The result.
+  */
+static void formatTestResult(char *buffer, unsigned int test_number, const TestResult *result)
+{
+	const TestDescription *test;
+	const char *outcome;
+	unsigned int i;
+
+	test = &(test_descriptions[test_number]);
+	if (result->outcome == TEST_PASS)
+	{
+		outcome = "pass";
+	}
+	else if (result->outcome == TEST_FAIL)
+	{
+		outcome = "fail";
+	}
+	else
+	{
+		outcome = "bad_parameters";
+	}
+	buffer += sprintf(buffer, "result %u %s %s duration_us=%lu", test_number, test->name, outcome, (unsigned long)result->duration);
+	for (i = 0; (i < result->num_values) && (i < MAX_TEST_VALUES); i++)
+	{
+		if (test->value_names[i] == NULL)
+		{
+			break;
+		}
+		if ((test->hex_values & (1 << i)) != 0)
+		{
+			buffer += sprintf(buffer, " %s=0x%08lx", test->value_names[i], (unsigned long)(uint32_t)result->values[i]);
+		}
+		else
+		{
+			buffer += sprintf(buffer, " %s=%ld", test->value_names[i], (long)result->values[i]);
+		}
+	}
+	strcpy(buffer, "\n");
+}
+
+/** Send a line to the host on the #CHANNEL_LOG channel. This doesn't block;
+  * if the channel is full (because no host is reading it), the line (or
+  * the end of it) is dropped.
+  * \param line The null-terminated line, including its '\n'.
+  */
+static void sendLog(const char *line)
+{
+	channelWriteNonBlocking(CHANNEL_LOG, (const uint8_t *)line, strlen(line));
+}
+
+/** Send a test's result line to the host on the #CHANNEL_LOG channel. This
+  * doesn't block; if the channel is full (because no host is reading it),
+  * the line is dropped.
+  * \param test_number Which test the result is for.
+  * \param result The result.
+  */
+void reportTestResult(unsigned int test_number, const TestResult *result)
+{
+	char response[MAX_RESPONSE_LENGTH];
+
+	formatTestResult(response, test_number, result);
+	sendLog(response);
+}
+
+/** Send a response line to the host on the #CHANNEL_COMMAND channel.
+  * \param line The null-terminated line, including its '\n'.
+  */
+static void sendResponse(const char *line)
+{
+	channelWrite(CHANNEL_COMMAND, (const uint8_t *)line, strlen(line));
+}
+
+/** Write a budget line, which looks like
+  * "budget <number> <name> duration_us=<duration> budget_us=<budget> ok",
+  * with "over" instead of "ok" if the test went over budget.
+  * \param buffer The line (including '\n' and a null terminator) will be
+  *               written here. This must have space for
+  *               #MAX_RESPONSE_LENGTH bytes.
+  * \param test_number Which test the line is for.
+  * \param result The test's result.
+  */
+static void formatBudgetLine(char *buffer, unsigned int test_number, const TestResult *result)
+{
+	uint32_t budget;
+
+	budget = test_descriptions[test_number].budget;
+	sprintf(buffer, "budget %u %s duration_us=%lu budget_us=%lu %s\n", test_number, test_descriptions[test_number].name, (unsigned long)result->duration, (unsigned long)budget, (result->duration > budget) ? "over" : "ok");
+}
+
+/** Run every test once, without parameters, overlapping them where
+  * possible. The flash and ADC tests spend most of their time waiting for
+  * hardware (the flash erasing or programming, and DMA filling the sample
+  * buffer), so those are started first. The display and ATSHA204 tests,
+  * which keep the CPU busy, run while they wait. The ATSHA204 still
+  * disables interrupts while it talks, but that doesn't stop the flash or
+  * the DMA. The flash test needs the CPU once the erase is done and after
+  * every programmed word, so it is serviced between the other tests, and
+  * then until it finishes.
+  *
+  * This writes #sequence_results; the duration of each test is measured
+  * from when it was started to when it finished, so durations overlap.
+  * Each test still writes to the display as it goes, but since they share
+  * it, the display will be a jumble until the summary is shown.
+  */
+static void runTestsConcurrently(void)
+{
+	uint32_t start[NUM_TESTS];
+	unsigned int is_flash_running;
+
+	clearDisplay();
+	memset(sequence_results, 0, sizeof(sequence_results));
+	start[TEST_ADC] = getCoreTimer();
+	beginFillingADCBuffer();
+	start[TEST_FLASH] = getCoreTimer();
+	beginSST25xTest(NULL, 0, &(sequence_results[TEST_FLASH]));
+
+	start[TEST_DISPLAY] = getCoreTimer();
+	testSSD1306(NULL, 0, &(sequence_results[TEST_DISPLAY]));
+	sequence_results[TEST_DISPLAY].duration = microsecondsSince(start[TEST_DISPLAY]);
+	is_flash_running = continueSST25xTest(&(sequence_results[TEST_FLASH]));
+	if (!is_flash_running)
+	{
+		sequence_results[TEST_FLASH].duration = microsecondsSince(start[TEST_FLASH]);
+	}
+	start[TEST_ATSHA204] = getCoreTimer();
+	testATSHA204(NULL, 0, &(sequence_results[TEST_ATSHA204]));
+	sequence_results[TEST_ATSHA204].duration = microsecondsSince(start[TEST_ATSHA204]);
+
+	if (is_flash_running)
+	{
+		while (continueSST25xTest(&(sequence_results[TEST_FLASH])))
+		{
+			// do nothing
+		}
+		sequence_results[TEST_FLASH].duration = microsecondsSince(start[TEST_FLASH]);
+	}
+	while (isADCBufferFull() == 0)
+	{
+		// do nothing
+	}
+	finishADCTest(NULL, 0, &(sequence_results[TEST_ADC]));
+	sequence_results[TEST_ADC].duration = microsecondsSince(start[TEST_ADC]);
+}
+
+/** Run every test once, without parameters, and report how long they took.
+  * There are no pauses in between tests, so the total time is close to the
+  * time a DUT would spend on the fixture. The results are kept for
+  * showSequenceSummary().
+  *
+  * If the tests are run one after the other, each test's result line (see
+  * formatTestResult()) and budget line (see formatBudgetLine()) are sent
+  * after it finishes. Sending them as each test finishes gives the host
+  * time to drain them while the next test runs. The sequence's budget is
+  * the sum of every test's budget.
+  *
+  * If the tests are run concurrently (see runTestsConcurrently()), each
+  * test's duration includes time spent on other tests, so there are no
+  * per-test budget lines; the result lines are sent once every test has
+  * finished. The aim of running concurrently is to take about as long as
+  * the longest test, so the sequence's budget is the largest of the
+  * tests' budgets.
+  *
+  * After the last test, a line of the form
+  * "budget total duration_us=<duration> budget_us=<budget> over=<count>
+  * failed=<count>" is sent, where over is the number of budgets (per-test
+  * or, if the tests are run concurrently, for the whole sequence) which
+  * were exceeded. The total duration is measured around the whole
+  * sequence, so it includes the overhead of reporting.
+  * \param send Function which sends each line.
+  * \param concurrent Non-zero to run the tests concurrently, zero to run
+  *                   them one after the other.
+  */
+static void runSequence(void (*send)(const char *line), unsigned int concurrent)
+{
+	char response[MAX_RESPONSE_LENGTH];
+	uint32_t start;
+	unsigned int i;
+
+	sequence_budget = 0;
+	sequence_num_over = 0;
+	sequence_num_failed = 0;
+	is_sequence_concurrent = concurrent;
+	start = getCoreTimer();
+	if (concurrent)
+	{
+		runTestsConcurrently();
+	}
+	for (i = 0; i < NUM_TESTS; i++)
+	{
+		if (!concurrent)
+		{
+			runTest(i, NULL, 0, &(sequence_results[i]));
+		}
+		formatTestResult(response, i, &(sequence_results[i]));
+		send(response);
+		if (concurrent)
+		{
+			if (test_descriptions[i].budget > sequence_budget)
+			{
+				sequence_budget = test_descriptions[i].budget;
+			}
+		}
+		else
+		{
+			formatBudgetLine(response, i, &(sequence_results[i]));
+			send(response);
+			sequence_budget += test_descriptions[i].budget;
+			if (sequence_results[i].duration > test_descriptions[i].budget)
+			{
+				sequence_num_over++;
+			}
+		}
+		if (sequence_results[i].outcome != TEST_PASS)
+		{
+			sequence_num_failed++;
+		}
+	}
+	sequence_duration = microsecondsSince(start);
+	if (concurrent && (sequence_duration > sequence_budget))
+	{
+		sequence_num_over = 1;
+	}
+	sprintf(response, "budget total duration_us=%lu budget_us=%lu over=%u failed=%u\n", (unsigned long)sequence_duration, (unsigned long)sequence_budget, sequence_num_over, sequence_num_failed);
+	send(response);
+	showSequenceSummary(0);
+}
+
+/** Run every test back to back and report a time budget summary (see
+  * runSequence()) on the #CHANNEL_LOG channel. This doesn't need any button
+  * input, so it is suitable for automated fixtures. When this returns,
+  * page 0 of the summary will be on the display.
+  * \param concurrent Non-zero to overlap the tests (see
+  *                   runTestsConcurrently()), zero to run them one after
+  *                   the other.
+  */
+void runTestSequence(unsigned int concurrent)
+{
+	runSequence(&sendLog, concurrent);
+}
+
+/** Show the summary of the most recent sequence on the display. This should
+  * only be called after runTestSequence() (or the "sequence" command).
+  * \param page Which page to show. Page 0 has one line per test, with its
+  *             duration in milliseconds; tests which went over budget are
+  *             marked with '!' (unless the tests were run concurrently).
+  *             Page 1 has the totals.
+  */
+void showSequenceSummary(unsigned int page)
+{
+	char sbuffer[32];
+	unsigned int is_over;
+	unsigned int i;
+
+	clearDisplay();
+	if (page == 0)
+	{
+		for (i = 0; i < NUM_TESTS; i++)
+		{
+			is_over = !is_sequence_concurrent && (sequence_results[i].duration > test_descriptions[i].budget);
+			sprintf(sbuffer, "%-8.8s%5lums%c", test_descriptions[i].name, (unsigned long)(sequence_results[i].duration / 1000), is_over ? '!' : ' ');
+			writeStringToDisplay(sbuffer);
+			nextLine();
+		}
+	}
+	else
+	{
+		sprintf(sbuffer, "Total: %lu ms", (unsigned long)(sequence_duration / 1000));
+		writeStringToDisplay(sbuffer);
+		nextLine();
+		sprintf(sbuffer, "Budget: %lu ms", (unsigned long)(sequence_budget / 1000));
+		writeStringToDisplay(sbuffer);
+		nextLine();
+		sprintf(sbuffer, "Over budget: %u", sequence_num_over);
+		writeStringToDisplay(sbuffer);
+		nextLine();
+		sprintf(sbuffer, "Failed: %u", sequence_num_failed);
+		writeStringToDisplay(sbuffer);
+	}
+}
+
+/** Parse a decimal (or 0x-prefixed hexadecimal) integer.
+  * \param word The null-terminated word to parse.
+  * \param value The integer will be written here.
+  * \return 0 on success, non-zero if word isn't an integer.
+  */
+static int parseInteger(const char *word, int32_t *value)
+{
+	char *end;
+
+	*value = (int32_t)strtol(word, &end, 0);
+	if ((end == word) || (*end != '\0'))
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/** Handle a "run" command. */
+static void runCommand(void)
+{
+	char response[MAX_RESPONSE_LENGTH];
+	int32_t parameters[MAX_TEST_PARAMETERS];
+	unsigned int num_parameters;
+	int32_t test_number;
+	TestResult result;
+	char *word;
+
+	word = strtok(NULL, " ");
+	if ((word == NULL) || parseInteger(word, &test_number)
+		|| (test_number < 0) || (test_number >= NUM_TESTS))
+	{
+		sendResponse("error bad test number\n");
+		return;
+	}
+	num_parameters = 0;
+	while ((word = strtok(NULL, " ")) != NULL)
+	{
+		if (num_parameters >= MAX_TEST_PARAMETERS)
+		{
+			sendResponse("error too many parameters\n");
+			return;
+		}
+		if (parseInteger(word, &(parameters[num_parameters])))
+		{
+			sendResponse("error bad parameter\n");
+			return;
+		}
+		num_parameters++;
+	}
+	runTest((unsigned int)test_number, parameters, num_parameters, &result);
+	formatTestResult(response, (unsigned int)test_number, &result);
+	sendResponse(response);
+}
+
+/** Handle a "list" command. */
+static void listCommand(void)
+{
+	char response[MAX_RESPONSE_LENGTH];
+	char *p;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < NUM_TESTS; i++)
+	{
+		p = response;
+		p += sprintf(p, "test %u %s", i, test_descriptions[i].name);
+		for (j = 0; (j < MAX_TEST_VALUES) && (test_descriptions[i].value_names[j] != NULL); j++)
+		{
+			p += sprintf(p, " %s", test_descriptions[i].value_names[j]);
+		}
+		strcpy(p, "\n");
+		sendResponse(response);
+	}
+	sendResponse("end\n");
+}
+
+/** Handle a "stats" command. */
+static void statsCommand(void)
+{
+	char response[MAX_RESPONSE_LENGTH];
+	HIDStreamStatistics statistics;
+	uint32_t status;
+	char *word;
+
+	word = strtok(NULL, " ");
+	if ((word != NULL) && strcmp(word, "clear"))
+	{
+		sendResponse("error unknown stats option\n");
+		return;
+	}
+	// Read and clear together, so that nothing is counted twice or lost.
+	status = disableInterrupts();
+	streamGetStatistics(&statistics);
+	if (word != NULL)
+	{
+		streamClearStatistics();
+	}
+	restoreInterrupts(status);
+	sprintf(response, "stats reports_tx=%lu bytes_tx=%lu reports_rx=%lu bytes_rx=%lu callbacks=%lu critical_sections=%lu\n", (unsigned long)statistics.reports_transmitted, (unsigned long)statistics.bytes_transmitted, (unsigned long)statistics.reports_received, (unsigned long)statistics.bytes_received, (unsigned long)statistics.callbacks, (unsigned long)statistics.critical_sections);
+	sendResponse(response);
+}
+
+/** Handle an "interrupts" command. */
+static void interruptsCommand(void)
+{
+	char response[MAX_RESPONSE_LENGTH];
+	USBInterruptStatistics statistics;
+	uint32_t status;
+	char *word;
+
+	word = strtok(NULL, " ");
+	if ((word != NULL) && strcmp(word, "clear"))
+	{
+		sendResponse("error unknown interrupts option\n");
+		return;
+	}
+	status = disableInterrupts();
+	usbGetInterruptStatistics(&statistics);
+	if (word != NULL)
+	{
+		usbClearInterruptStatistics();
+	}
+	restoreInterrupts(status);
+	sprintf(response, "interrupts count=%lu events=%lu last_batch=%lu max_batch=%lu\n", (unsigned long)statistics.interrupts, (unsigned long)statistics.events, (unsigned long)statistics.last_batch_size, (unsigned long)statistics.max_batch_size);
+	sendResponse(response);
+}
+
+/** Handle a "dump" command. The "dump <bytes>" response goes out on the
+  * HID stream before any data, so that the host knows how much to read
+  * from the Bulk stream (and knows not to read anything if the response is
+  * an error instead).
+  *
+  * The data is written with bulkStreamWrite(), which blocks once the Bulk
+  * stream's transmit FIFO is full, so the host must be reading the Bulk IN
+  * endpoint; no other commands are handled until the whole dump has been
+  * queued. A dump of the ADC waits for #adc_sample_buffer to be filled
+  * (see beginFillingADCBuffer()). If the Isochronous stream is running, the
+  * buffer keeps being overwritten while it is sent, so the dump won't be
+  * one consistent run of samples.
+  */
+static void dumpCommand(void)
+{
+	static uint8_t chunk[DUMP_CHUNK_SIZE];
+	char response[MAX_RESPONSE_LENGTH];
+	int32_t address;
+	int32_t length;
+	uint32_t count;
+	char *word;
+
+	word = strtok(NULL, " ");
+	if ((word != NULL) && !strcmp(word, "flash"))
+	{
+		word = strtok(NULL, " ");
+		if ((word == NULL) || parseInteger(word, &address)
+			|| (address < 0) || (address >= (SECTOR_SIZE * NUM_SECTORS)))
+		{
+			sendResponse("error bad address\n");
+			return;
+		}
+		word = strtok(NULL, " ");
+		if ((word == NULL) || parseInteger(word, &length)
+			|| (length < 0) || (length > ((SECTOR_SIZE * NUM_SECTORS) - address)))
+		{
+			sendResponse("error bad length\n");
+			return;
+		}
+		sprintf(response, "dump %ld\n", (long)length);
+		sendResponse(response);
+		while (length > 0)
+		{
+			count = ((uint32_t)length < DUMP_CHUNK_SIZE) ? (uint32_t)length : DUMP_CHUNK_SIZE;
+			sst25xRead(chunk, (uint32_t)address, count);
+			bulkStreamWrite(chunk, count);
+			address += count;
+			length -= count;
+		}
+	}
+	else if ((word != NULL) && !strcmp(word, "adc"))
+	{
+		beginFillingADCBuffer();
+		while (isADCBufferFull() == 0)
+		{
+			// do nothing
+		}
+		sprintf(response, "dump %u\n", (unsigned int)sizeof(adc_sample_buffer));
+		sendResponse(response);
+		// The PIC32 is little-endian, so the buffer can be sent as-is.
+		bulkStreamWrite((const uint8_t *)adc_sample_buffer, sizeof(adc_sample_buffer));
+	}
+	else
+	{
+		sendResponse("error unknown dump source\n");
+	}
+}
+
+/** Carry out one command line from the host. */
+static void executeCommand(void)
+{
+	char response[MAX_RESPONSE_LENGTH];
+	char *word;
+
+	word = strtok(command_line, " ");
+	if (word == NULL)
+	{
+		return; // ignore empty lines
+	}
+	if (!strcmp(word, "run"))
+	{
+		runCommand();
+	}
+	else if (!strcmp(word, "list"))
+	{
+		listCommand();
+	}
+	else if (!strcmp(word, "sequence"))
+	{
+		word = strtok(NULL, " ");
+		if (word == NULL)
+		{
+			runSequence(&sendResponse, 0);
+		}
+		else if (!strcmp(word, "concurrent"))
+		{
+			runSequence(&sendResponse, 1);
+		}
+		else
+		{
+			sendResponse("error unknown sequence type\n");
+		}
+	}
+	else if (!strcmp(word, "wakeups"))
+	{
+		sprintf(response, "wakeups %lu\n", (unsigned long)getIdleWakeUpCount());
+		sendResponse(response);
+	}
+	else if (!strcmp(word, "stats"))
+	{
+		statsCommand();
+	}
+	else if (!strcmp(word, "interrupts"))
+	{
+		interruptsCommand();
+	}
+	else if (!strcmp(word, "dump"))
+	{
+		dumpCommand();
+	}
+	else
+	{
+		sendResponse("error unknown command\n");
+	}
+}
+
+/** Handle any commands which the host has sent on the #CHANNEL_COMMAND
+  * channel. This doesn't wait for commands, but if a command runs a test,
+  * this won't return until the test has finished. It should be called
+  * regularly.
+  */
+void serviceRemoteCommands(void)
+{
+	uint8_t one_byte;
+
+	while (channelReadNonBlocking(CHANNEL_COMMAND, &one_byte, 1) == 1)
+	{
+		if (one_byte == '\n')
+		{
+			command_line[command_length] = '\0';
+			if (is_command_too_long)
+			{
+				sendResponse("error command too long\n");
+			}
+			else
+			{
+				executeCommand();
+			}
+			command_length = 0;
+			is_command_too_long = 0;
+		}
+		else if (one_byte == '\r')
+		{
+			// ignore, so that "\r\n" line endings work
+		}
+		else if (command_length < MAX_COMMAND_LENGTH)
+		{
+			command_line[command_length] = (char)one_byte;
+			command_length++;
+		}
+		else
+		{
+			is_command_too_long = 1;
+		}
+	}
+}
@@ -0,0 +1,23 @@
+/** \file test_runner.h
+  *
+  * \brief Describes functions and constants exported by test_runner.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef TEST_RUNNER_H
+#define	TEST_RUNNER_H
+
+#include <stdint.h>
+#include "test_result.h"
+
+/** Total number of tests. */
+#define NUM_TESTS		4
+
+extern void runTest(unsigned int test_number, const int32_t *parameters, unsigned int num_parameters, TestResult *result);
+extern void reportTestResult(unsigned int test_number, const TestResult *result);
+extern void serviceRemoteCommands(void);
+extern void runTestSequence(unsigned int concurrent);
+extern void showSequenceSummary(unsigned int page);
+
+#endif	// #ifndef TEST_RUNNER_H
@@ -0,0 +1,262 @@
+/** \file usb_adc_stream.c
+  *
+  * \brief Vendor-specific USB class driver which streams ADC samples over an
+  *        Isochronous IN endpoint.
+  *
+  * This file implements a device-side class driver for a vendor-specific
+  * interface (interface 2), which continuously streams samples from the
+  * ADC (see adc.c) to the host. An Isochronous endpoint is used because it
+  * gets guaranteed bandwidth in every frame, so as long as the host keeps
+  * reading, no samples are lost.
+  *
+  * The interface has two alternate settings. Alternate setting 0 (the
+  * default) has no endpoints, so that the device doesn't reserve any bus
+  * bandwidth unless it's actually needed. Alternate setting 1 has the
+  * Isochronous IN endpoint; selecting it (with a "Set Interface" request)
+  * starts continuous ADC sampling and streaming, and selecting alternate
+  * setting 0 again stops it.
+  *
+  * The ADC takes about 24 samples per frame. The endpoint is asynchronous
+  * (see section 5.12.4.1.1 of the USB specification): each packet contains
+  * however many samples have been taken since the previous packet, up to
+  * #MAX_SAMPLES_PER_PACKET. So packets will usually contain 24 samples, but
+  * occasionally 23 or 25, since the ADC sample clock isn't locked to the USB
+  * frame clock. Each sample is a 16 bit little-endian integer.
+  *
+  * The ADC fills #adc_sample_buffer continuously using DMA, so packets
+  * aren't transmitted out of it directly: the DMA would keep writing into
+  * a packet while the packet waited (for up to two frames) to be sent.
+  * Instead, when a packet is queued, its samples are copied into one of two
+  * packet buffers (#packet_samples), and the USB module only ever reads
+  * those. Only samples before getADCWritePosition() are copied, i.e. ones
+  * which the DMA has already written, and the copy must finish before the
+  * DMA comes back around to them, so a packet is never a mixture of old and
+  * new samples. That holds as long as the samples are at least
+  * #OVERRUN_GUARD samples ahead of the DMA (going around the ring).
+  *
+  * #adc_sample_buffer holds about 170 ms worth of samples. If the host
+  * stops reading for long enough that the DMA gets within #OVERRUN_GUARD
+  * samples of the next sample to be sent, the unsent samples are dropped
+  * and the stream restarts at the newest sample, so the host sees one
+  * discontinuity.
+  *
+  * All references to the "USB specification" refer to revision 2.0, obtained
+  * from http://www.usb.org/developers/docs/usb_20_110512.zip (see usb_20.pdf)
+  * on 26 March 2012.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include "usb_hal.h"
+#include "usb_adc_stream.h"
+#include "usb_callbacks.h"
+#include "usb_defs.h"
+#include "adc.h"
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used in #adc_stream_class_driver and #isochronous_endpoint_state for
+  * callbacks which aren't needed. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
+/** The endpoint number for transmission (Isochronous IN). */
+#define ISOCHRONOUS_ENDPOINT_NUMBER	5
+
+/** Maximum number of samples in one packet. This is a bit more than the
+  * average number of samples per frame, so that the stream can catch up
+  * after the host misses a frame. */
+#define MAX_SAMPLES_PER_PACKET		(MAX_PACKET_SIZE / sizeof(uint16_t))
+/** How close (in samples) the DMA may get to the next sample to be sent
+  * before those unsent samples are treated as overwritten. One packet's
+  * worth is enough for the copy in queueIsochronousTransmits() to stay
+  * ahead of the DMA; the second packet is margin for interrupt latency.
+  */
+#define OVERRUN_GUARD				(2 * MAX_SAMPLES_PER_PACKET)
+
+/** Non-zero if alternate setting 1 is selected (i.e. samples are being
+  * streamed), zero if alternate setting 0 is selected. */
+static unsigned int is_streaming;
+/** Number of transfers (0, 1 or 2) submitted on the Isochronous IN
+  * endpoint. */
+static volatile unsigned int transmit_queued;
+/** Transfers for the Isochronous IN endpoint. Each one is a single packet.
+  * They are used alternately, so the one which completes is always the
+  * older of the two. */
+static USBTransfer transmit_transfers[2];
+/** Index into #transmit_transfers of the transfer to submit next. */
+static unsigned int next_transmit_transfer;
+/** Packet buffers for #transmit_transfers (one each). Samples are copied
+  * here from #adc_sample_buffer when a transfer is submitted, so that the
+  * DMA can't change them before they are sent. */
+static uint16_t packet_samples[2][MAX_SAMPLES_PER_PACKET];
+/** Index into #adc_sample_buffer of the next sample to queue for
+  * transmission. */
+static uint32_t read_position;
+
+/** Persistent endpoint state for the Isochronous IN endpoint. */
+static EndpointState isochronous_endpoint_state;
+
+/** Submit as many single-packet transfers as possible on the Isochronous IN
+  * endpoint. If no new samples are available, a zero-length packet is
+  * queued, so that the host doesn't see a missing packet.
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler).
+  */
+static void queueIsochronousTransmits(void)
+{
+	uint32_t available;
+	uint32_t count;
+	uint32_t i;
+	USBTransfer *transfer;
+	uint16_t *samples;
+
+	while (is_streaming && (transmit_queued < 2))
+	{
+		available = (getADCWritePosition() - read_position) & (SAMPLE_BUFFER_SIZE - 1);
+		if (available > (SAMPLE_BUFFER_SIZE - OVERRUN_GUARD))
+		{
+			// The DMA is about to overwrite (or already has overwritten)
+			// samples which haven't been sent. Skip them.
+			read_position = getADCWritePosition();
+			available = 0;
+		}
+		count = available;
+		if (count > MAX_SAMPLES_PER_PACKET)
+		{
+			count = MAX_SAMPLES_PER_PACKET;
+		}
+		samples = packet_samples[next_transmit_transfer];
+		for (i = 0; i < count; i++)
+		{
+			samples[i] = adc_sample_buffer[(read_position + i) & (SAMPLE_BUFFER_SIZE - 1)];
+		}
+		transfer = &(transmit_transfers[next_transmit_transfer]);
+		transfer->buffer = (uint8_t *)samples;
+		transfer->length = count * sizeof(uint16_t);
+		transfer->zero_length_packet = 0;
+		transmit_queued++;
+		next_transmit_transfer ^= 1;
+		usbSubmitTransmitTransfer(ISOCHRONOUS_ENDPOINT_NUMBER, transfer);
+		read_position = (read_position + count) & (SAMPLE_BUFFER_SIZE - 1);
+	}
+}
+
+/** Completion callback for transfers on the Isochronous IN endpoint. This
+  * will be called once per frame while the host is reading.
+  * \param transfer The transfer which completed.
+  */
+static void transmitTransferComplete(USBTransfer *transfer)
+{
+	if (transfer->aborted)
+	{
+		// The endpoint was disabled by stopStreaming().
+		return;
+	}
+	if (transmit_queued == 0)
+	{
+		// This should never happen.
+		usbFatalError();
+		return;
+	}
+	transmit_queued--;
+	queueIsochronousTransmits();
+}
+
+/** Begin streaming: start continuous ADC sampling and enable the
+  * Isochronous IN endpoint. */
+static void startStreaming(void)
+{
+	beginContinuousADCSampling();
+	read_position = getADCWritePosition();
+	transmit_queued = 0;
+	next_transmit_transfer = 0;
+	is_streaming = 1;
+	usbEnableEndpoint(ISOCHRONOUS_ENDPOINT_NUMBER, ISOCHRONOUS_IN_ENDPOINT, &isochronous_endpoint_state);
+	queueIsochronousTransmits();
+}
+
+/** Stop streaming: disable the Isochronous IN endpoint and stop continuous
+  * ADC sampling. This does nothing if streaming has already stopped. */
+static void stopStreaming(void)
+{
+	if (is_streaming)
+	{
+		is_streaming = 0;
+		usbDisableEndpoint(ISOCHRONOUS_ENDPOINT_NUMBER);
+		transmit_queued = 0;
+		endContinuousADCSampling();
+	}
+}
+
+/** Callback which will be called whenever a successful "Set Configuration"
+  * request (see section 9.4.7 of the USB specification) is encountered.
+  * Either way, alternate setting 0 is selected, so streaming stops.
+  * \param new_configuration_value 0 means unconfigure device, 1 means
+  *                                configure device.
+  */
+static void adcStreamSetConfiguration(uint8_t new_configuration_value)
+{
+	stopStreaming();
+}
+
+/** Callback which will be called whenever a "Set Interface" request (see
+  * section 9.4.10 of the USB specification) is encountered for this
+  * interface.
+  * \param alternate_setting 0 to stop streaming, 1 to (re)start streaming.
+  * \return Zero if the alternate setting was selected, non-zero if it
+  *         doesn't exist.
+  */
+static unsigned int adcStreamSetInterface(uint16_t alternate_setting)
+{
+	if (alternate_setting == 0)
+	{
+		stopStreaming();
+	}
+	else if (alternate_setting == 1)
+	{
+		// Selecting the same alternate setting again still resets the
+		// endpoint (see section 9.1.1.5 of the USB specification).
+		stopStreaming();
+		startStreaming();
+	}
+	else
+	{
+		return 1; // no such alternate setting
+	}
+	return 0;
+}
+
+/** This will be called whenever a USB reset is seen. */
+static void adcStreamResetSeen(void)
+{
+	stopStreaming();
+}
+
+/** Class driver callbacks for the ADC stream interface. usb_composite.c
+  * calls these. There are no class-specific requests. */
+const USBClassDriver adc_stream_class_driver = {
+	NULL,
+	NULL,
+	NULL,
+	&adcStreamSetConfiguration,
+	&adcStreamSetInterface,
+	&adcStreamResetSeen,
+	NULL
+};
+
+/** Initialise ADC stream driver. This must be called before connecting the
+  * USB device (usbConnect()). */
+void usbADCStreamInit(void)
+{
+	is_streaming = 0;
+	transmit_queued = 0;
+	next_transmit_transfer = 0;
+	read_position = 0;
+	transmit_transfers[0].completionCallback = &transmitTransferComplete;
+	transmit_transfers[1].completionCallback = &transmitTransferComplete;
+	// The endpoint only uses transfers (see usbEnableEndpoint()).
+	isochronous_endpoint_state.receiveCallback = NULL;
+	isochronous_endpoint_state.transmitCallback = NULL;
+}
@@ -0,0 +1,18 @@
+/** \file usb_adc_stream.h
+  *
+  * \brief Describes functions exported by usb_adc_stream.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef USB_ADC_STREAM_H
+#define	USB_ADC_STREAM_H
+
+#include <stdint.h>
+#include "usb_composite.h"
+
+extern const USBClassDriver adc_stream_class_driver;
+
+extern void usbADCStreamInit(void);
+
+#endif	// #ifndef USB_ADC_STREAM_H
@@ -0,0 +1,560 @@
+/** \file usb_bulk_stream.c
+  *
+  * \brief Vendor-specific USB class driver which transfers data as a stream
+  *        over a pair of Bulk endpoints.
+  *
+  * This file implements a device-side class driver for a vendor-specific
+  * interface (interface 1), which transfers a data stream using a Bulk IN
+  * and a Bulk OUT endpoint. Unlike the HID stream (see usb_hid_stream.c),
+  * there is no framing at all: the bytes of each packet are the stream
+  * bytes. Bulk endpoints aren't limited to one packet per frame, so this is
+  * much faster than the HID stream, but it does need a driver (eg. libusb)
+  * on the host. The HID stream remains available as the driverless
+  * fallback.
+  *
+  * Both endpoints use the USB HAL's transfers (see #USBTransfer), so the
+  * HAL does the packetising and this driver only hears about whole
+  * transfers. On the Bulk IN endpoint, up to two transfers are queued,
+  * each covering a contiguous region of the transmit FIFO which hasn't been
+  * queued yet; the USB module reads the packets straight out of the FIFO
+  * storage. On the Bulk OUT endpoint, one transfer at a time receives
+  * straight into the free space of the receive FIFO. Each receive transfer
+  * is only one packet long, because a receive transfer only ends early on a
+  * short packet, and a host which writes a multiple of #MAX_PACKET_SIZE
+  * bytes needn't send one; with longer transfers, those bytes could sit in
+  * a half-full transfer indefinitely.
+  *
+  * If the stream runs dry just after a transfer which ended with a maximum
+  * size packet, a zero-length packet is transmitted, so that a host reading
+  * into a large buffer will see the end of the transfer (see section 5.8.3
+  * of the USB specification).
+  *
+  * The interface also has two vendor-specific control requests, which give
+  * access to the USB HAL's capture mode (see usbSetCaptureEndpoints()):
+  * #VENDOR_SET_CAPTURE and #VENDOR_GET_CAPTURE. They go through the control
+  * endpoint, so they work no matter what state the streams are in.
+  *
+  * The same assumption as in usb_hid_stream.c is made: there is only one
+  * interrupt context (i.e. USB interrupts cannot interrupt USB interrupts).
+  *
+  * All references to the "USB specification" refer to revision 2.0, obtained
+  * from http://www.usb.org/developers/docs/usb_20_110512.zip (see usb_20.pdf)
+  * on 26 March 2012.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include <string.h>
+#include "usb_hal.h"
+#include "usb_bulk_stream.h"
+#include "usb_callbacks.h"
+#include "usb_defs.h"
+#include "usb_standard_requests.h"
+#include "serial_fifo.h"
+#include "pic32_system.h"
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used in #bulk_stream_class_driver and the endpoint states for
+  * callbacks which aren't needed. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
+/** The endpoint number for transmission (Bulk IN). */
+#define TRANSMIT_ENDPOINT_NUMBER	3
+/** The endpoint number for reception (Bulk OUT). */
+#define RECEIVE_ENDPOINT_NUMBER		4
+
+/** Interface number of the Bulk stream interface. Vendor-specific requests
+  * must have this in wIndex. */
+#define INTERFACE_NUMBER			1
+
+/** Vendor-specific request (bmRequestType = 0x41) which enables or
+  * disables capture mode. wValue is the bit mask of endpoints to capture
+  * (see usbSetCaptureEndpoints()), and there is no Data stage. */
+#define VENDOR_SET_CAPTURE			1
+/** Vendor-specific request (bmRequestType = 0xc1) which removes records from
+  * the capture ring and sends them to the host. See getCapture() for the
+  * format of the data. */
+#define VENDOR_GET_CAPTURE			2
+
+/** Size, in bytes, of each record sent in response to #VENDOR_GET_CAPTURE. */
+#define CAPTURE_RECORD_LENGTH		(12 + USB_CAPTURE_DATA_SIZE)
+/** Maximum number of records sent in response to one #VENDOR_GET_CAPTURE
+  * request. */
+#define MAX_CAPTURE_RECORDS			12
+
+/** Size of transmit FIFO buffer, in number of bytes. This is much larger than
+  * the HID stream's transmit FIFO, because the host can take up to 19
+  * packets per frame (see section 5.8.4 of the USB specification).
+  * \warning This must be a power of 2.
+  */
+#define TRANSMIT_FIFO_SIZE			1024
+/** Maximum size, in bytes, of one transfer on the Bulk IN endpoint. If one
+  * transfer could cover everything in the transmit FIFO, the FIFO would be
+  * empty whenever it completed (the interrupt service handler gets there
+  * before bulkStreamWrite() can refill the FIFO), and every one of those
+  * would cost a zero-length packet. Half the FIFO keeps the second transfer
+  * in flight while the first one's bytes are replaced.
+  * \warning This must be a multiple of #MAX_PACKET_SIZE.
+  */
+#define MAX_TRANSMIT_TRANSFER_SIZE	(TRANSMIT_FIFO_SIZE / 2)
+/** Size of receive FIFO buffer, in number of bytes.
+  * \warning This must be a power of 2.
+  * \warning This must be >= #MAX_PACKET_SIZE, otherwise nothing will ever
+  *          be received.
+  */
+#define RECEIVE_FIFO_SIZE			1024
+
+/** The transmit FIFO buffer. */
+static volatile CircularBuffer bulk_transmit_fifo;
+/** The receive FIFO buffer. */
+static volatile CircularBuffer bulk_receive_fifo;
+/** Storage for the transmit FIFO buffer. Packets on the Bulk IN endpoint are
+  * transmitted directly out of this storage. */
+static volatile uint8_t transmit_fifo_storage[TRANSMIT_FIFO_SIZE];
+/** Storage for the receive FIFO buffer. Packets on the Bulk OUT endpoint
+  * are received directly into this storage. Like the HID stream's receive
+  * FIFO, it has an extra #MAX_PACKET_SIZE bytes past the end of the FIFO
+  * storage proper, so that a packet can be received across the wrap point
+  * (see circularBufferCommitWrite()). */
+static volatile uint8_t receive_fifo_storage[RECEIVE_FIFO_SIZE + MAX_PACKET_SIZE];
+
+/** Transfers for the Bulk IN endpoint. They are used alternately, so the
+  * one which completes is always the older of the two. */
+static USBTransfer transmit_transfers[2];
+/** Index into #transmit_transfers of the transfer to submit next. */
+static unsigned int next_transmit_transfer;
+/** Number of transfers (0, 1 or 2) submitted on the Bulk IN endpoint. */
+static volatile unsigned int transmit_queued;
+/** Total number of bytes submitted for transmission on the Bulk IN
+  * endpoint. These bytes remain at the front of #bulk_transmit_fifo until
+  * their transfer completes. */
+static uint32_t transmit_in_flight;
+/** Flag (non-zero = set, zero = clear) which, when set, indicates that the
+  * most recently submitted transfer ended with a maximum size packet. If the
+  * transmit FIFO runs dry, a zero-length packet is needed to end the
+  * host's transfer. */
+static unsigned int last_transmit_was_full;
+
+/** Transfer for the Bulk OUT endpoint. */
+static USBTransfer receive_transfer;
+/** Flag (non-zero = set, zero = clear) which, when set, indicates that
+  * #receive_transfer has been submitted and hasn't completed yet. */
+static volatile unsigned int receive_queued;
+
+/** Persistent endpoint state for the transmit endpoint (with endpoint
+  * number #TRANSMIT_ENDPOINT_NUMBER). */
+static EndpointState transmit_endpoint_state;
+/** Persistent endpoint state for the receive endpoint (with endpoint
+  * number #RECEIVE_ENDPOINT_NUMBER). */
+static EndpointState receive_endpoint_state;
+
+/** Buffer for the Data stage of a #VENDOR_GET_CAPTURE request. This needs to
+  * be persistent because the data is transmitted after the request handler
+  * returns. */
+static uint8_t capture_packet_buffer[4 + (MAX_CAPTURE_RECORDS * CAPTURE_RECORD_LENGTH)];
+
+/** Transmit packet buffer to use when sending 0 length packets (on the
+  * control endpoint and the Bulk IN endpoint). It's probably okay to use
+  * NULL, but it's safer to always point the transmit buffer at
+  * something. */
+static const uint8_t null_packet[4];
+
+/** Previous configuration value passed to bulkStreamSetConfiguration(). This
+  * is used to detect configuration changes. */
+static uint8_t old_configuration_value;
+
+/** Submit as many transfers as possible on the Bulk IN endpoint, using the
+  * bytes in the transmit FIFO which haven't been submitted yet. Each
+  * transfer covers one contiguous region of the FIFO storage. No copying is
+  * done; the USB module will read the packets straight out of the transmit
+  * FIFO storage.
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler).
+  */
+static void queueBulkTransmits(void)
+{
+	uint32_t count;
+	volatile uint8_t *transfer_data;
+	USBTransfer *transfer;
+
+	if (!usbEndpointEnabled(TRANSMIT_ENDPOINT_NUMBER))
+	{
+		// Not configured yet; bytes will wait in the transmit FIFO until
+		// bulkStreamSetConfiguration() is called.
+		return;
+	}
+	while (transmit_queued < 2)
+	{
+		count = circularBufferPeekAt(&bulk_transmit_fifo, transmit_in_flight, &transfer_data);
+		if (count > MAX_TRANSMIT_TRANSFER_SIZE)
+		{
+			count = MAX_TRANSMIT_TRANSFER_SIZE;
+		}
+		if ((count == 0) && !last_transmit_was_full)
+		{
+			break; // nothing to transmit
+		}
+		transfer = &(transmit_transfers[next_transmit_transfer]);
+		if (count == 0)
+		{
+			// A transfer of length 0 transmits one zero-length packet.
+			transfer->buffer = (uint8_t *)null_packet;
+		}
+		else
+		{
+			transfer->buffer = (uint8_t *)transfer_data;
+		}
+		transfer->length = count;
+		transfer->zero_length_packet = 0;
+		last_transmit_was_full = (count != 0) && ((count % MAX_PACKET_SIZE) == 0);
+		transmit_in_flight += count;
+		transmit_queued++;
+		next_transmit_transfer ^= 1;
+		usbSubmitTransmitTransfer(TRANSMIT_ENDPOINT_NUMBER, transfer);
+	}
+}
+
+/** Submit a transfer on the Bulk OUT endpoint, if there isn't one already
+  * and if there is enough space in the receive FIFO for a maximum size
+  * packet. The packet will be received directly into the free space of the
+  * receive FIFO.
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler).
+  */
+static void queueBulkReceives(void)
+{
+	volatile uint8_t *free_space;
+
+	if (!usbEndpointEnabled(RECEIVE_ENDPOINT_NUMBER) || receive_queued)
+	{
+		return;
+	}
+	// If there isn't enough space, subsequent OUT transactions will be
+	// NAKed until bulkStreamReadNonBlocking() frees up some space.
+	if (circularBufferSpaceRemaining(&bulk_receive_fifo) >= MAX_PACKET_SIZE)
+	{
+		// The contiguous free space may stop at the wrap point, but that's
+		// okay because receive_fifo_storage has room past the end of the
+		// FIFO storage.
+		circularBufferPeekFree(&bulk_receive_fifo, &free_space);
+		receive_transfer.buffer = (uint8_t *)free_space;
+		receive_transfer.length = MAX_PACKET_SIZE;
+		receive_queued = 1;
+		usbSubmitReceiveTransfer(RECEIVE_ENDPOINT_NUMBER, &receive_transfer);
+	}
+}
+
+/** Completion callback for transfers on the Bulk IN endpoint (endpoint
+  * number #TRANSMIT_ENDPOINT_NUMBER).
+  * \param transfer The transfer which completed.
+  */
+static void transmitTransferComplete(USBTransfer *transfer)
+{
+	if (transfer->aborted)
+	{
+		// The endpoint was disabled. bulkStreamSetConfiguration() leaves
+		// the bytes in the transmit FIFO, to be sent after reconfiguration.
+		return;
+	}
+	if ((transmit_queued == 0) || (transfer->actual_length != transfer->length))
+	{
+		// This should never happen.
+		usbFatalError();
+		return;
+	}
+	// The transfer has been transmitted, so its bytes can finally be
+	// released from the transmit FIFO.
+	circularBufferCommitRead(&bulk_transmit_fifo, transfer->length);
+	transmit_in_flight -= transfer->length;
+	transmit_queued--;
+	queueBulkTransmits();
+}
+
+/** Completion callback for transfers on the Bulk OUT endpoint (endpoint
+  * number #RECEIVE_ENDPOINT_NUMBER).
+  * \param transfer The transfer which completed.
+  */
+static void receiveTransferComplete(USBTransfer *transfer)
+{
+	if (transfer->aborted)
+	{
+		return;
+	}
+	// The packet was received directly into the receive FIFO, so there's
+	// nothing to copy.
+	circularBufferCommitWrite(&bulk_receive_fifo, transfer->actual_length);
+	receive_queued = 0;
+	queueBulkReceives();
+}
+
+/** Write a 16 bit value to a buffer, in little-endian format.
+  * \param buffer The buffer to write to. This must have space for 2 bytes.
+  * \param value The value to write.
+  */
+static void writeU16LittleEndian(uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = (uint8_t)value;
+	buffer[1] = (uint8_t)(value >> 8);
+}
+
+/** Write a 32 bit value to a buffer, in little-endian format.
+  * \param buffer The buffer to write to. This must have space for 4 bytes.
+  * \param value The value to write.
+  */
+static void writeU32LittleEndian(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = (uint8_t)value;
+	buffer[1] = (uint8_t)(value >> 8);
+	buffer[2] = (uint8_t)(value >> 16);
+	buffer[3] = (uint8_t)(value >> 24);
+}
+
+/** Vendor-specific #VENDOR_GET_CAPTURE request. This removes as many records
+  * from the capture ring as will fit in length bytes (up to
+  * #MAX_CAPTURE_RECORDS) and sends them to the host. The data is:
+  * - Bytes 0 to 3: free-running count of transactions which weren't
+  *   captured because the capture ring was full (see
+  *   usbGetCaptureDropped()), as a little-endian 32 bit number.
+  * - Then zero or more records of #CAPTURE_RECORD_LENGTH bytes each. Each
+  *   record is the fields of #USBCaptureRecord in order, with
+  *   multi-byte fields in little-endian format.
+  *
+  * The host can tell how many records were sent from the length of the
+  * Data stage. Records are removed from the ring as soon as the request is
+  * handled, so if the Data stage fails, they are lost.
+  * \param length Maximum number of bytes to send.
+  */
+static void getCapture(uint16_t length)
+{
+	USBCaptureRecord records[MAX_CAPTURE_RECORDS];
+	uint8_t *p;
+	uint32_t count;
+	uint32_t i;
+
+	usbControlNextStage();
+	if (length < 4)
+	{
+		// Not enough space for the dropped count.
+		usbControlProtocolStall();
+		return;
+	}
+	count = usbReadCaptureRecords(records, MIN((length - 4) / CAPTURE_RECORD_LENGTH, MAX_CAPTURE_RECORDS));
+	writeU32LittleEndian(capture_packet_buffer, usbGetCaptureDropped());
+	p = &(capture_packet_buffer[4]);
+	for (i = 0; i < count; i++)
+	{
+		writeU32LittleEndian(&(p[0]), records[i].timestamp);
+		p[4] = records[i].endpoint;
+		p[5] = records[i].direction;
+		p[6] = records[i].pid;
+		p[7] = records[i].data_toggle;
+		writeU16LittleEndian(&(p[8]), records[i].length);
+		writeU16LittleEndian(&(p[10]), records[i].captured_length);
+		memcpy(&(p[12]), records[i].data, USB_CAPTURE_DATA_SIZE);
+		p += CAPTURE_RECORD_LENGTH;
+	}
+	usbQueueTransmitPacket(capture_packet_buffer, 4 + (count * CAPTURE_RECORD_LENGTH), CONTROL_ENDPOINT_NUMBER, 1);
+}
+
+/** Handle vendor-specific requests directed at the Bulk stream interface.
+  * See usbClassHandleControlSetup() for the meaning of the parameters.
+  * \return Zero if the request was handled, non-zero if the request was not
+  *         handled.
+  */
+static unsigned int bulkStreamHandleControlSetup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+	if ((bmRequestType == 0x41) && (bRequest == VENDOR_SET_CAPTURE)
+		&& (wIndex == INTERFACE_NUMBER) && (wLength == 0))
+	{
+		usbSetCaptureEndpoints(wValue);
+		usbControlNextStage(); // no Data stage for this request
+		usbControlNextStage();
+		// Send success packet.
+		usbQueueTransmitPacket(null_packet, 0, CONTROL_ENDPOINT_NUMBER, 0);
+	}
+	else if ((bmRequestType == 0xc1) && (bRequest == VENDOR_GET_CAPTURE)
+		&& (wIndex == INTERFACE_NUMBER))
+	{
+		getCapture(wLength);
+	}
+	else
+	{
+		return 1; // unknown or unsupported request.
+	}
+	return 0; // success
+}
+
+/** Callback which will be called whenever a successful "Set Configuration"
+  * request (see section 9.4.7 of the USB specification) is encountered. This
+  * enables or disables the Bulk endpoints.
+  * \param new_configuration_value 0 means unconfigure device, 1 means
+  *                                configure device.
+  */
+static void bulkStreamSetConfiguration(uint8_t new_configuration_value)
+{
+	if ((old_configuration_value == 0) && (new_configuration_value != 0))
+	{
+		// Transition from unconfigured to configured.
+		transmit_queued = 0;
+		transmit_in_flight = 0;
+		last_transmit_was_full = 0;
+		receive_queued = 0;
+		usbEnableEndpoint(TRANSMIT_ENDPOINT_NUMBER, IN_ENDPOINT, &transmit_endpoint_state);
+		usbEnableEndpoint(RECEIVE_ENDPOINT_NUMBER, OUT_ENDPOINT, &receive_endpoint_state);
+		queueBulkReceives();
+		// Send anything that was written before the device was configured.
+		queueBulkTransmits();
+	}
+	else if ((old_configuration_value != 0) && (new_configuration_value == 0))
+	{
+		// Transition from configured to unconfigured.
+		usbDisableEndpoint(TRANSMIT_ENDPOINT_NUMBER);
+		usbDisableEndpoint(RECEIVE_ENDPOINT_NUMBER);
+		// Any bytes which were submitted but not transmitted remain in the
+		// transmit FIFO, and will be transmitted after reconfiguration.
+		transmit_queued = 0;
+		transmit_in_flight = 0;
+		last_transmit_was_full = 0;
+		receive_queued = 0;
+	}
+	old_configuration_value = new_configuration_value;
+}
+
+/** This will be called whenever a USB reset is seen. */
+static void bulkStreamResetSeen(void)
+{
+	bulkStreamSetConfiguration(0);
+}
+
+/** Class driver callbacks for the Bulk stream interface. usb_composite.c
+  * calls these. */
+const USBClassDriver bulk_stream_class_driver = {
+	&bulkStreamHandleControlSetup,
+	NULL,
+	NULL,
+	&bulkStreamSetConfiguration,
+	NULL,
+	&bulkStreamResetSeen,
+	NULL
+};
+
+/** Initialise Bulk stream driver. This must be called before connecting the
+  * USB device (usbConnect()) or calling any of the other bulkStream...()
+  * functions, otherwise race conditions with the FIFOs could occur. */
+void usbBulkStreamInit(void)
+{
+	old_configuration_value = 0;
+	next_transmit_transfer = 0;
+	transmit_queued = 0;
+	transmit_in_flight = 0;
+	last_transmit_was_full = 0;
+	receive_queued = 0;
+	initCircularBuffer(&bulk_transmit_fifo, transmit_fifo_storage, TRANSMIT_FIFO_SIZE);
+	initCircularBuffer(&bulk_receive_fifo, receive_fifo_storage, RECEIVE_FIFO_SIZE);
+	transmit_transfers[0].completionCallback = &transmitTransferComplete;
+	transmit_transfers[1].completionCallback = &transmitTransferComplete;
+	receive_transfer.completionCallback = &receiveTransferComplete;
+	// Both endpoints only use transfers, so they have no packet callbacks
+	// (see usbEnableEndpoint()).
+	transmit_endpoint_state.receiveCallback = NULL;
+	transmit_endpoint_state.transmitCallback = NULL;
+	receive_endpoint_state.receiveCallback = NULL;
+	receive_endpoint_state.transmitCallback = NULL;
+}
+
+/** Grab bytes from the Bulk stream, without blocking. This reads as many
+  * bytes as are currently available, up to the specified length.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The maximum number of bytes to read.
+  * \return The number of bytes actually read. This may be less than length
+  *         (including 0) if fewer bytes were available.
+  */
+uint32_t bulkStreamReadNonBlocking(uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+
+	done = circularBufferReadBlock(&bulk_receive_fifo, buffer, length);
+	// There may now be enough space in the receive FIFO to queue receives.
+	status = disableInterrupts();
+	queueBulkReceives();
+	restoreInterrupts(status);
+	return done;
+}
+
+/** Grab bytes from the Bulk stream. This will block until exactly length
+  * bytes have been read.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The number of bytes to read.
+  */
+void bulkStreamRead(uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+	uint32_t got;
+
+	done = 0;
+	while (done < length)
+	{
+		// Like streamRead() in usb_hid_stream.c, the attempt and the idle
+		// are both done with interrupts disabled.
+		status = disableInterrupts();
+		got = bulkStreamReadNonBlocking(&(buffer[done]), length - done);
+		done += got;
+		if (got == 0)
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	}
+}
+
+/** Send bytes to the Bulk stream, without blocking. This writes as many
+  * bytes as there is space for, up to the specified length.
+  * \param buffer The bytes to send.
+  * \param length The maximum number of bytes to send.
+  * \return The number of bytes actually sent. This may be less than length
+  *         (including 0) if there wasn't enough space in the transmit FIFO.
+  */
+uint32_t bulkStreamWriteNonBlocking(const uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+
+	done = circularBufferWriteBlock(&bulk_transmit_fifo, buffer, length);
+	status = disableInterrupts();
+	queueBulkTransmits();
+	restoreInterrupts(status);
+	return done;
+}
+
+/** Send bytes to the Bulk stream. This will block until all length bytes
+  * have been sent (or at least, queued for sending).
+  * \param buffer The bytes to send.
+  * \param length The number of bytes to send.
+  */
+void bulkStreamWrite(const uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+	uint32_t got;
+
+	done = 0;
+	while (done < length)
+	{
+		// See bulkStreamRead().
+		status = disableInterrupts();
+		got = bulkStreamWriteNonBlocking(&(buffer[done]), length - done);
+		done += got;
+		if (got == 0)
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	}
+}
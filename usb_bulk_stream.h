@@ -0,0 +1,22 @@
+/** \file usb_bulk_stream.h
+  *
+  * \brief Describes functions exported by usb_bulk_stream.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef USB_BULK_STREAM_H
+#define	USB_BULK_STREAM_H
+
+#include <stdint.h>
+#include "usb_composite.h"
+
+extern const USBClassDriver bulk_stream_class_driver;
+
+extern void usbBulkStreamInit(void);
+extern uint32_t bulkStreamReadNonBlocking(uint8_t *buffer, uint32_t length);
+extern void bulkStreamRead(uint8_t *buffer, uint32_t length);
+extern uint32_t bulkStreamWriteNonBlocking(const uint8_t *buffer, uint32_t length);
+extern void bulkStreamWrite(const uint8_t *buffer, uint32_t length);
+
+#endif	// #ifndef USB_BULK_STREAM_H
@@ -59,8 +59,32 @@ extern void usbClassAbortControlTransfer(void);
   *                                configure device.
   */
 extern void usbClassSetConfiguration(uint8_t new_configuration_value);
+/** Callback which will be called whenever a "Set Interface" request (see
+  * section 9.4.10 of the USB specification) is encountered while the device
+  * is configured. This gives the class driver an opportunity to switch
+  * endpoints, buffers, state etc. to the requested alternate setting.
+  * \param interface The interface number of the interface to change.
+  * \param alternate_setting The alternate setting to select.
+  * \return Zero if the alternate setting was selected, non-zero if the
+  *         interface or alternate setting doesn't exist.
+  */
+extern unsigned int usbClassSetInterface(uint16_t interface, uint16_t alternate_setting);
+/** Callback which will be called whenever a "Get Interface" request (see
+  * section 9.4.4 of the USB specification) is encountered while the device
+  * is configured.
+  * \param interface The interface number of the interface to query.
+  * \param alternate_setting The currently selected alternate setting should
+  *                          be written here.
+  * \return Zero if the interface exists, non-zero if it doesn't.
+  */
+extern unsigned int usbClassGetInterface(uint16_t interface, uint8_t *alternate_setting);
 /** This will be called whenever a USB reset is seen. This callback gives
   * class drivers the opportunity to reset their state. */
 extern void usbClassResetSeen(void);
+/** This will be called at the start of every USB frame (i.e. every
+  * millisecond), but only while the start-of-frame interrupt is enabled
+  * (see usbEnableSOFInterrupt()). This gives class drivers a cheap,
+  * bus-synchronised timebase. */
+extern void usbClassStartOfFrame(void);
 
 #endif	// #ifndef USB_CALLBACKS_H
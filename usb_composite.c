@@ -0,0 +1,222 @@
+/** \file usb_composite.c
+  *
+  * \brief Passes class driver callbacks on to each interface's class driver.
+  *
+  * The device has more than one interface, and each interface has its own
+  * class driver. However, usb_standard_requests.c and usb_hal.c only know
+  * about one set of class driver callbacks (see usb_callbacks.h). This file
+  * implements those callbacks by calling the corresponding callback of every
+  * class driver listed in #class_drivers.
+  *
+  * Class-specific control requests are offered to each class driver in turn,
+  * until one of them handles the request. That class driver then gets all
+  * the data for the Data stage of the request.
+  *
+  * Each class driver has exactly one interface, whose interface number is
+  * the class driver's index in #class_drivers. This file keeps track of the
+  * selected alternate setting of each interface.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#include <stdint.h>
+#include "usb_callbacks.h"
+#include "usb_composite.h"
+#include "usb_hid_stream.h"
+#include "usb_bulk_stream.h"
+#include "usb_adc_stream.h"
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used to signify that a class driver doesn't have a callback. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
+/** Class drivers for each interface, in order of interface number. */
+static const USBClassDriver * const class_drivers[] = {
+	&hid_stream_class_driver,
+	&bulk_stream_class_driver,
+	&adc_stream_class_driver
+};
+
+/** Number of entries in #class_drivers. */
+#define NUM_CLASS_DRIVERS	(sizeof(class_drivers) / sizeof(class_drivers[0]))
+
+/** The currently selected alternate setting of each interface. */
+static uint8_t alternate_settings[NUM_CLASS_DRIVERS];
+
+/** The class driver which handled the Setup stage of the current control
+  * transfer. This is NULL if no class driver handled it. */
+static const USBClassDriver *control_transfer_driver;
+
+/** All standard requests (as described in chapter 9 of the USB specification)
+  * are issued to the control endpoint (endpoint 0). However, sometimes
+  * class-specific requests are sent to the control endpoint. This offers the
+  * request to each class driver, until one of them handles it.
+  * \param bmRequestType Characteristics of request.
+  * \param bRequest Specifies which request to perform.
+  * \param wValue Request-dependent parameter.
+  * \param wIndex Request-dependent parameter.
+  * \param wLength Maximum number of bytes to transfer during the Data stage.
+  *                This is allowed to be zero. If it is zero, then there is
+  *                no Data stage.
+  * \return Zero if the request was handled, non-zero if the request was not
+  *         handled by any class driver.
+  */
+unsigned int usbClassHandleControlSetup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_CLASS_DRIVERS; i++)
+	{
+		if (class_drivers[i]->handleControlSetup != NULL)
+		{
+			if (class_drivers[i]->handleControlSetup(bmRequestType, bRequest, wValue, wIndex, wLength) == 0)
+			{
+				control_transfer_driver = class_drivers[i];
+				return 0; // success
+			}
+		}
+	}
+	return 1; // no-one handled the request
+}
+
+/** This will be called if the control endpoint (endpoint 0) receives data
+  * during the Data stage of a class-specific request. The data is passed on
+  * to the class driver which handled the Setup stage.
+  * \param packet_buffer The contents of the data packet are placed here.
+  * \param length The length (in bytes) of the received data packet.
+  * \return Zero if the data was accepted, non-zero if the data was not
+  *         handled.
+  */
+unsigned int usbClassHandleControlData(uint8_t *packet_buffer, uint32_t length)
+{
+	if ((control_transfer_driver == NULL)
+		|| (control_transfer_driver->handleControlData == NULL))
+	{
+		return 1; // no-one expected any data
+	}
+	return control_transfer_driver->handleControlData(packet_buffer, length);
+}
+
+/** This will be called whenever a control transfer needs to be aborted (for
+  * any reason, including reset). Every class driver is told about this. */
+void usbClassAbortControlTransfer(void)
+{
+	unsigned int i;
+
+	control_transfer_driver = NULL;
+	for (i = 0; i < NUM_CLASS_DRIVERS; i++)
+	{
+		if (class_drivers[i]->abortControlTransfer != NULL)
+		{
+			class_drivers[i]->abortControlTransfer();
+		}
+	}
+}
+
+/** Callback which will be called whenever a successful "Set Configuration"
+  * request (see section 9.4.7 of the USB specification) is encountered.
+  * Every class driver is told about this.
+  * \param new_configuration_value 0 means unconfigure device, 1 means
+  *                                configure device.
+  */
+void usbClassSetConfiguration(uint8_t new_configuration_value)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_CLASS_DRIVERS; i++)
+	{
+		// From section 9.1.1.5 of the USB specification, configuring a
+		// device selects the default alternate setting of every interface.
+		alternate_settings[i] = 0;
+		if (class_drivers[i]->setConfiguration != NULL)
+		{
+			class_drivers[i]->setConfiguration(new_configuration_value);
+		}
+	}
+}
+
+/** Callback which will be called whenever a "Set Interface" request (see
+  * section 9.4.10 of the USB specification) is encountered while the device
+  * is configured. This is passed on to the class driver for that interface.
+  * \param interface The interface number of the interface to change.
+  * \param alternate_setting The alternate setting to select.
+  * \return Zero if the alternate setting was selected, non-zero if the
+  *         interface or alternate setting doesn't exist.
+  */
+unsigned int usbClassSetInterface(uint16_t interface, uint16_t alternate_setting)
+{
+	const USBClassDriver *driver;
+
+	if (interface >= NUM_CLASS_DRIVERS)
+	{
+		return 1; // no such interface
+	}
+	driver = class_drivers[interface];
+	if (driver->setInterface == NULL)
+	{
+		if (alternate_setting != 0)
+		{
+			return 1; // no such alternate setting
+		}
+	}
+	else
+	{
+		if (driver->setInterface(alternate_setting))
+		{
+			return 1; // class driver rejected alternate setting
+		}
+	}
+	alternate_settings[interface] = (uint8_t)alternate_setting;
+	return 0;
+}
+
+/** Callback which will be called whenever a "Get Interface" request (see
+  * section 9.4.4 of the USB specification) is encountered while the device
+  * is configured.
+  * \param interface The interface number of the interface to query.
+  * \param alternate_setting The currently selected alternate setting will
+  *                          be written here.
+  * \return Zero if the interface exists, non-zero if it doesn't.
+  */
+unsigned int usbClassGetInterface(uint16_t interface, uint8_t *alternate_setting)
+{
+	if (interface >= NUM_CLASS_DRIVERS)
+	{
+		return 1; // no such interface
+	}
+	*alternate_setting = alternate_settings[interface];
+	return 0;
+}
+
+/** This will be called whenever a USB reset is seen. Every class driver is
+  * told about this. */
+void usbClassResetSeen(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_CLASS_DRIVERS; i++)
+	{
+		alternate_settings[i] = 0;
+		if (class_drivers[i]->resetSeen != NULL)
+		{
+			class_drivers[i]->resetSeen();
+		}
+	}
+}
+
+/** This will be called at the start of every frame, while the start-of-frame
+  * interrupt is enabled. Every class driver is told about this. */
+void usbClassStartOfFrame(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_CLASS_DRIVERS; i++)
+	{
+		if (class_drivers[i]->startOfFrame != NULL)
+		{
+			class_drivers[i]->startOfFrame();
+		}
+	}
+}
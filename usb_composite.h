@@ -0,0 +1,39 @@
+/** \file usb_composite.h
+  *
+  * \brief Describes types and functions exported by usb_composite.c.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef USB_COMPOSITE_H
+#define	USB_COMPOSITE_H
+
+#include <stdint.h>
+
+/** Callbacks for one class driver (i.e. the driver for one interface). These
+  * have the same meaning as the usbClass...() callbacks described in
+  * usb_callbacks.h. Any of them may be NULL if the class driver isn't
+  * interested in that callback. */
+typedef struct USBClassDriverStruct
+{
+	/** See usbClassHandleControlSetup(). */
+	unsigned int (*handleControlSetup)(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength);
+	/** See usbClassHandleControlData(). This will only be called for the
+	  * class driver which handled the Setup stage of the current control
+	  * transfer. */
+	unsigned int (*handleControlData)(uint8_t *packet_buffer, uint32_t length);
+	/** See usbClassAbortControlTransfer(). */
+	void (*abortControlTransfer)(void);
+	/** See usbClassSetConfiguration(). */
+	void (*setConfiguration)(uint8_t new_configuration_value);
+	/** See usbClassSetInterface(). This doesn't need to be given the
+	  * interface number, since each class driver only has one interface.
+	  * If this is NULL, the interface only has alternate setting 0. */
+	unsigned int (*setInterface)(uint16_t alternate_setting);
+	/** See usbClassResetSeen(). */
+	void (*resetSeen)(void);
+	/** See usbClassStartOfFrame(). */
+	void (*startOfFrame)(void);
+} USBClassDriver;
+
+#endif	// #ifndef USB_COMPOSITE_H
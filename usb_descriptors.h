@@ -78,6 +78,15 @@ SERIAL_NO_STRING_INDEX, // index of string descriptor describing serial number
   * 6.2.1 of the HID specification for details on the format of the HID
   * descriptor. Section 7.1 of the HID specification describes the ordering
   * of descriptors (configuration, then interface, then HID, then endpoint).
+  *
+  * There are two interfaces. Interface 0 is the HID stream interface (see
+  * usb_hid_stream.c), which works without any drivers. Interface 1 is a
+  * vendor-specific interface with a pair of Bulk endpoints (see
+  * usb_bulk_stream.c), which is much faster but requires a driver such
+  * as libusb. Interface 2 is a vendor-specific interface which streams ADC
+  * samples over an Isochronous endpoint (see usb_adc_stream.c); its
+  * endpoint only exists in alternate setting 1, so that no bus bandwidth is
+  * reserved until the host asks for the stream.
   * \showinitializer
   */
 static const uint8_t configuration_descriptor[] = {
@@ -85,11 +94,11 @@ static const uint8_t configuration_descriptor[] = {
 0x09, // length of this descriptor in bytes
 DESCRIPTOR_CONFIGURATION, // descriptor type
 #ifdef NO_INTERRUPT_OUT
-0x22, 0x00, // total length of all included descriptors in bytes (little-endian)
+0x52, 0x00, // total length of all included descriptors in bytes (little-endian)
 #else
-0x29, 0x00, // total length of all included descriptors in bytes (little-endian)
+0x59, 0x00, // total length of all included descriptors in bytes (little-endian)
 #endif // #ifdef NO_INTERRUPT_OUT
-0x01, // number of interfaces supported by this configuration
+0x03, // number of interfaces supported by this configuration
 0x01, // configuration value (must be 1, usb_standard_requests.c assumes this)
 0x00, // index of string descriptor describing configuration (0 = none)
 0x80, // attributes (0x80 = not self-powered, no remote wakeup)
@@ -115,7 +124,7 @@ DESCRIPTOR_HID, // descriptor type
 0x00, // country code (0 = not supported)
 0x01, // number of report descriptors
 DESCRIPTOR_REPORT, // descriptor type of report descriptor
-0x03, 0x03, // total size of report descriptors in bytes (little-endian)
+0x13, 0x03, // total size of report descriptors in bytes (little-endian)
 // Endpoint 1 descriptor:
 0x07, // length of this descriptor in bytes
 DESCRIPTOR_ENDPOINT, // descriptor type
@@ -130,8 +139,59 @@ DESCRIPTOR_ENDPOINT, // descriptor type
 0x02, // endpoint number; bit 7 clear means OUT, endpoint 2
 0x03, // attributes (3 = interrupt transfers)
 0x40, 0x00, // maximum packet size of this endpoint in bytes (little-endian)
-0x01 // polling interval, in millisecond
+0x01, // polling interval, in millisecond
 #endif // #ifndef NO_INTERRUPT_OUT
+// Interface descriptor:
+0x09, // length of this descriptor in bytes
+DESCRIPTOR_INTERFACE, // descriptor type
+0x01, // number of this interface (1 = second)
+0x00, // alternate setting (0 = default)
+0x02, // number of endpoints used by this interface, not including control endpoint
+0xff, // interface class (0xff = vendor-specific)
+0x00, // interface subclass (0 = no subclass)
+0x00, // interface protocol (0 = none)
+0x00, // index of string descriptor describing interface (0 = none)
+// Endpoint 3 descriptor:
+0x07, // length of this descriptor in bytes
+DESCRIPTOR_ENDPOINT, // descriptor type
+0x83, // endpoint number; bit 7 set means IN, endpoint 3
+0x02, // attributes (2 = bulk transfers)
+0x40, 0x00, // maximum packet size of this endpoint in bytes (little-endian)
+0x00, // polling interval (ignored for bulk endpoints)
+// Endpoint 4 descriptor:
+0x07, // length of this descriptor in bytes
+DESCRIPTOR_ENDPOINT, // descriptor type
+0x04, // endpoint number; bit 7 clear means OUT, endpoint 4
+0x02, // attributes (2 = bulk transfers)
+0x40, 0x00, // maximum packet size of this endpoint in bytes (little-endian)
+0x00, // polling interval (ignored for bulk endpoints)
+// Interface descriptor:
+0x09, // length of this descriptor in bytes
+DESCRIPTOR_INTERFACE, // descriptor type
+0x02, // number of this interface (2 = third)
+0x00, // alternate setting (0 = default, not streaming)
+0x00, // number of endpoints used by this interface, not including control endpoint
+0xff, // interface class (0xff = vendor-specific)
+0x00, // interface subclass (0 = no subclass)
+0x00, // interface protocol (0 = none)
+0x00, // index of string descriptor describing interface (0 = none)
+// Interface descriptor:
+0x09, // length of this descriptor in bytes
+DESCRIPTOR_INTERFACE, // descriptor type
+0x02, // number of this interface (2 = third)
+0x01, // alternate setting (1 = streaming)
+0x01, // number of endpoints used by this interface, not including control endpoint
+0xff, // interface class (0xff = vendor-specific)
+0x00, // interface subclass (0 = no subclass)
+0x00, // interface protocol (0 = none)
+0x00, // index of string descriptor describing interface (0 = none)
+// Endpoint 5 descriptor:
+0x07, // length of this descriptor in bytes
+DESCRIPTOR_ENDPOINT, // descriptor type
+0x85, // endpoint number; bit 7 set means IN, endpoint 5
+0x05, // attributes (1 = isochronous transfers, 4 = asynchronous, data endpoint)
+0x40, 0x00, // maximum packet size of this endpoint in bytes (little-endian)
+0x01 // polling interval, in frames (must be 1 for full-speed isochronous)
 };
 
 /** Section 9.6.7 of the USB specification states that if a device returns
@@ -208,6 +268,10 @@ DESCRIPTOR_STRING,
   * The "USAGE (Vendor Usage 1)" item appears multiple times because it is
   * a Local Item (see section 6.2.2.8 of the USB HID specification) and thus is
   * consumed by the Main Items: COLLECTION, INPUT and OUTPUT.
+  * There is also an 8 byte feature report with report ID 64, which the host
+  * can use to get receive credit (see getCreditReport() in
+  * usb_hid_stream.c), and a 4 byte feature report with report ID 65, which
+  * contains the device's core timer (see getTimestampReport()).
   * Note that it is essential to provide a valid description of every report,
   * otherwise Windows will refuse to transfer reports to/from the device.
   *
@@ -609,6 +673,14 @@ static const uint8_t report_descriptor[] = {
 0x81, 0x82,                    //   INPUT (Data,Var,Abs,Vol)
 0x09, 0x01,                    //   USAGE (Vendor Usage 1)
 0x91, 0x82,                    //   OUTPUT (Data,Var,Abs,Vol)
+0x85, 0x40,                    //   REPORT_ID (64)
+0x95, 0x08,                    //   REPORT_COUNT (8)
+0x09, 0x01,                    //   USAGE (Vendor Usage 1)
+0xb1, 0x82,                    //   FEATURE (Data,Var,Abs,Vol)
+0x85, 0x41,                    //   REPORT_ID (65)
+0x95, 0x04,                    //   REPORT_COUNT (4)
+0x09, 0x01,                    //   USAGE (Vendor Usage 1)
+0xb1, 0x82,                    //   FEATURE (Data,Var,Abs,Vol)
 0xc0                           // END_COLLECTION
 };
 
@@ -4,10 +4,23 @@
   *
   * This file provides an abstract interface for USB operations on the PIC32
   * USB module. It is quite simple and doesn't support many features.
-  * The PIC32 USB module supports "ping-pong buffering" (double buffering),
-  * but this implementation does not use this feature, as throughput is not
-  * expected to be a concern. Furthermore, this doesn't support USB suspend or
-  * resume.
+  * The PIC32 USB module's "ping-pong buffering" (double buffering) is used,
+  * so that up to two packets can be queued in each direction of each
+  * endpoint. This allows the next packet to be ready while the previous one
+  * is still in flight, which eliminates the turnaround gap between packets.
+  * This doesn't support USB suspend or resume.
+  *
+  * Class drivers can either queue individual packets (for example, using
+  * usbQueueTransmitPacket()), or submit transfers (see #USBTransfer) which
+  * are split up into packets by the interrupt service handler. Each endpoint
+  * direction has its own queue of transfers, so that a class driver can
+  * hand over large amounts of data at once. The two approaches can't be
+  * mixed on the same endpoint direction at the same time.
+  *
+  * For debugging, there is an optional capture mode (see
+  * usbSetCaptureEndpoints()), which records a summary of every completed
+  * transaction into a RAM ring, so that the device's view of the bus can be
+  * examined later.
   *
   * From a device's perspective, USB transactions are asynchronous. That is
   * because the host tells the device when it can transmit or receive.
@@ -34,26 +47,6 @@
 #include "usb_standard_requests.h" // for usbResetSeen() callback
 #include "pic32_system.h"
 
-/** Each endpoint has 4 buffer descriptor entries: even receive, odd receive,
-  * even transmit and odd transmit. The even/odd buffers allow for double
-  * buffering. This macro generates a readable index into #bdt_table. For
-  * dir, use #BDT_RX or #BDT_TX. For pp, use #BDT_EVEN or #BDT_ODD. */
-#define BDT_IDX(endpoint, dir, pp)	((((endpoint) & 15) << 2) \
-									| (((dir) & 1) << 1) \
-									| ((pp) & 1))
-/** Value for dir parameter of #BDT_IDX macro which is used to access the
-  * receive descriptors. */
-#define BDT_RX						0
-/** Value for dir parameter of #BDT_IDX macro which is used to access the
-  * transmit descriptors. */
-#define BDT_TX						1
-/** Value for pp parameter of #BDT_IDX macro which is used to access the
-  * even descriptors. */
-#define BDT_EVEN					0
-/** Value for pp parameter of #BDT_IDX macro which is used to access the
-  * odd descriptors. */
-#define BDT_ODD						1
-
 /** Because stdlib.h might not be included, NULL might be undefined. NULL
   * is used in #endpoint_states to signify that no state structure has
   * been supplied. */
@@ -116,9 +109,12 @@ typedef union __attribute__((__packed__)) USBBufferDescriptorStruct
   */
 static USBBufferDescriptor bdt_table[NUM_ENDPOINTS * 4] __attribute__((aligned(512)));
 
-/** Array of endpoint state pointers. NULL means no state. This is accessed by
-  * the interrupt service routine whenever a successful transaction occurs. */
-static EndpointState *endpoint_states[NUM_ENDPOINTS];
+/** Point a buffer descriptor at a packet buffer. The USB module wants a
+  * physical address (see #VIRTUAL_TO_PHYSICAL). */
+#define SET_BUFFER_ADDRESS(index, buffer)	\
+	(bdt_table[(index)].CTRL.BUFFER_ADDRESS = VIRTUAL_TO_PHYSICAL(buffer))
+
+#include "usb_hal_queue.h"
 
 /** Resets the USB HAL state. This doesn't reset as much as usbInit(), but
   * resets everything appropriate to a USB protocol reset (as defined in
@@ -126,15 +122,57 @@ static EndpointState *endpoint_states[NUM_ENDPOINTS];
 static void usbHALReset(void)
 {
 	unsigned int endpoint;
+	unsigned int i;
+	unsigned int num_receives;
+	uint8_t *receive_buffers[2];
+	uint32_t receive_lengths[2];
+	USBTransfer *receive_transfers;
+	USBTransfer *transmit_transfers;
+	PingPongState *pp_state;
 
 	U1ADDRbits.DEVADDR = 0; // default to device address = 0
-	// Reset all data sequence bits.
+	// There can't be any transactions during a USB reset, so it's safe to
+	// reset the ping-pong buffer pointers now.
+	U1CONbits.PPBRST = 1; // reset ping-pong buffer pointers to EVEN
+	U1CONbits.PPBRST = 0;
 	for (endpoint = 0; endpoint < NUM_ENDPOINTS; endpoint++)
 	{
+		// Since the ping-pong buffer pointers have been reset, any queued
+		// buffer descriptors may now be in the wrong place. Queued
+		// transmits are discarded (they are meaningless after a reset), but
+		// queued receives are moved, so that endpoints (especially the
+		// control endpoint) can continue to receive.
+		pp_state = &(ping_pong_states[endpoint][BDT_RX]);
+		num_receives = 0;
+		for (i = 0; i < pp_state->queued; i++)
+		{
+			if ((bdt_table[BDT_IDX(endpoint, BDT_RX, pp_state->next_pp ^ i)].CTRL.UOWN != 0)
+				&& (pp_state->transfer[pp_state->next_pp ^ i] == NULL))
+			{
+				receive_buffers[num_receives] = pp_state->buffer[pp_state->next_pp ^ i];
+				receive_lengths[num_receives] = pp_state->length[pp_state->next_pp ^ i];
+				num_receives++;
+			}
+		}
+		// Queued transfers are aborted.
+		receive_transfers = detachTransfers(endpoint, BDT_RX);
+		transmit_transfers = detachTransfers(endpoint, BDT_TX);
+		for (i = 0; i < 4; i++)
+		{
+			bdt_table[(endpoint << 2) | i].CTRL.UOWN = 0;
+		}
+		memset(ping_pong_states[endpoint], 0, sizeof(ping_pong_states[endpoint]));
+		// Reset all data sequence bits.
 		if (endpoint_states[endpoint] != NULL)
 		{
 			endpoint_states[endpoint]->data_sequence = 0;
+			for (i = 0; i < num_receives; i++)
+			{
+				usbQueueReceivePacketToBuffer(endpoint, receive_buffers[i], receive_lengths[i]);
+			}
 		}
+		abortTransfers(receive_transfers);
+		abortTransfers(transmit_transfers);
 	}
 	usbResetSeen();
 }
@@ -147,6 +185,12 @@ void usbInit(void)
 
 	// Initialise buffer descriptor table.
 	memset(bdt_table, 0, sizeof(bdt_table));
+	memset(ping_pong_states, 0, sizeof(ping_pong_states));
+	memset(&interrupt_statistics, 0, sizeof(interrupt_statistics));
+	capture_head = 0;
+	capture_tail = 0;
+	capture_dropped = 0;
+	capture_endpoint_mask = 0;
 	// Enable power to module.
 	while (U1PWRCbits.USBBUSY != 0)
 	{
@@ -177,6 +221,7 @@ void usbInit(void)
 	U1CONbits.HOSTEN = 0; // device mode
 	U1CONbits.RESUME = 0; // don't send RESUME signal
 	U1CONbits.PPBRST = 1; // reset ping-pong buffer pointers to EVEN
+	U1CONbits.PPBRST = 0;
 	U1ADDRbits.LSPDEN = 0; // full-speed mode
 	U1ADDRbits.DEVADDR = 0; // default to device address = 0
 	U1CNFG1 = 0; // disable USB test mode features
@@ -211,9 +256,39 @@ void usbDisconnect(void)
   */
 void usbQueueReceivePacket(unsigned int endpoint)
 {
-	unsigned int index;
-	uint8_t *packet_buffer;
-	uint32_t length;
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		// Bad endpoint number.
+		usbFatalError();
+		return;
+	}
+	if (endpoint_states[endpoint] == NULL)
+	{
+		// Attempting to access non-existent state.
+		usbFatalError();
+		return;
+	}
+	usbQueueReceivePacketToBuffer(endpoint, endpoint_states[endpoint]->receive_buffer, sizeof(endpoint_states[endpoint]->receive_buffer));
+}
+
+/** Handoff a caller-supplied receive buffer to the USB module, so that it is
+  * ready to receive another packet. The USB module will write the packet
+  * directly into that buffer, and the receiveCallback function of the
+  * endpoint state (see #EndpointState) will be passed a pointer to it. This
+  * allows class drivers to receive packets without any copying.
+  * \param endpoint The device endpoint number.
+  * \param packet_buffer Persistent buffer to receive the packet into.
+  * \param length Size of packet_buffer, in bytes. This should normally
+  *               be #MAX_PACKET_SIZE, since the host is permitted to send
+  *               packets of that size.
+  * \warning Since this is non-blocking, packet_buffer must persist until the
+  *          receiveCallback function is called.
+  * \warning At most two receives can be queued at once (one in each
+  *          ping-pong buffer descriptor).
+  */
+void usbQueueReceivePacketToBuffer(unsigned int endpoint, uint8_t *packet_buffer, uint32_t length)
+{
+	PingPongState *pp_state;
 
 	if (endpoint >= NUM_ENDPOINTS)
 	{
@@ -227,27 +302,32 @@ void usbQueueReceivePacket(unsigned int endpoint)
 		usbFatalError();
 		return;
 	}
-	index = BDT_IDX(endpoint, BDT_RX, BDT_EVEN);
-	if (bdt_table[index].CTRL.UOWN != 0)
+	if (endpoint_states[endpoint]->receiveCallback == NULL)
 	{
-		// Attempting to overwrite another queued receive.
+		// There would be nothing to tell about the received packet.
 		usbFatalError();
 		return;
 	}
-	packet_buffer = endpoint_states[endpoint]->receive_buffer;
-	length = sizeof(endpoint_states[endpoint]->receive_buffer);
-	// Set buffer parameters.
-	bdt_table[index].CTRL.BSTALL = 0;
-	// Data sequence checking is done in software. This is because SETUP
-	// transactions need to be handled specially.
-	bdt_table[index].CTRL.DTS = 0;
-	bdt_table[index].CTRL.NINC = 0;
-	bdt_table[index].CTRL.KEEP = 0;
-	bdt_table[index].CTRL.DATA0_1 = endpoint_states[endpoint]->data_sequence;
-	bdt_table[index].CTRL.BYTE_COUNT = length;
-	bdt_table[index].CTRL.BUFFER_ADDRESS = VIRTUAL_TO_PHYSICAL(packet_buffer);
-	// Tell USB module to process buffer.
-	bdt_table[index].CTRL.UOWN = 1;
+	if (length > MAX_PACKET_SIZE)
+	{
+		// Receive buffer is larger than what this implementation can handle.
+		usbFatalError();
+		return;
+	}
+	pp_state = &(ping_pong_states[endpoint][BDT_RX]);
+	if (pp_state->transfer_head != NULL)
+	{
+		// Receive transfers are in progress on this endpoint.
+		usbFatalError();
+		return;
+	}
+	if (pp_state->queued >= 2)
+	{
+		// Both ping-pong buffer descriptors are already in use.
+		usbFatalError();
+		return;
+	}
+	armBufferDescriptor(endpoint, BDT_RX, packet_buffer, length, NULL);
 }
 
 /** Interrupt service handler for USB interrupts. */
@@ -257,141 +337,233 @@ void __attribute__((vector(_USB_1_VECTOR), interrupt(ipl2), nomips16)) _USBHandl
 	unsigned int direction;
 	unsigned int is_setup;
 	unsigned int is_extended;
+	unsigned int pp;
 	EndpointState *state;
+	PingPongState *pp_state;
+	USBTransfer *transfer;
 	uint32_t index;
 	uint32_t length;
 	uint32_t transmitted_bytes;
+	uint32_t batch_size;
 
 	usbActivityLED();
-	U1CONbits.PPBRST = 1; // reset ping-pong buffer pointers to EVEN
-	// Determine cause of interrupt.
-	if (U1IRbits.TRNIF)
-	{
-		// Packet transmitted or received.
-		// Clearing TRNIF advances the U1STAT FIFO (see Note 1 of Register
-		// 27-10 in the PIC32 family reference manual). Therefore U1STAT must
-		// be read before clearing TRNIF.
-		endpoint = U1STATbits.ENDPT;
-		if (endpoint >= NUM_ENDPOINTS)
-		{
-			// Bad endpoint number.
-			usbFatalError();
-			return;
-		}
-		direction = U1STATbits.DIR;
-		// TRNIF needs to be cleared before the next transaction, otherwise
-		// an interrupt could be missed. Fourtunately, the minimum time for a
-		// valid 0-length data transaction is 32 + 3 + 32 + 3 + 16 + 3 bit
-		// periods (token + data + handshake), or 534 cycles at 72 MHz. That's
-		// plenty of time, however, TRNIF should still be cleared before
-		// doing any packet processing.
-		U1IRbits.TRNIF = 1; // clear interrupt flag in USB module
+	// The U1STAT FIFO can hold several completed transactions, so keep
+	// handling events until there are none left. This avoids paying the
+	// interrupt entry/exit cost for every packet.
+	batch_size = 0;
+	while (1)
+	{
+		// The interrupt controller flag is cleared before checking for
+		// events, so that any event which occurs after the last check will
+		// cause another interrupt.
 		IFS1bits.USBIF = 0; // clear interrupt flag in interrupt controller
-		state = endpoint_states[endpoint];
-		if (state == NULL)
+		// Determine cause of interrupt.
+		if (U1IRbits.TRNIF)
 		{
-			// Attempting to access non-existent state.
-			usbFatalError();
-			return;
-		}
-		if (direction == 0)
-		{
-			// Last transaction was receive.
-			index = BDT_IDX(endpoint, BDT_RX, BDT_EVEN);
-			length = bdt_table[index].STATUS.BYTE_COUNT;
-			is_setup = 0;
-			if (bdt_table[index].STATUS.PID == USBPID_SETUP)
+			// Packet transmitted or received.
+			// Clearing TRNIF advances the U1STAT FIFO (see Note 1 of Register
+			// 27-10 in the PIC32 family reference manual). Therefore U1STAT must
+			// be read before clearing TRNIF.
+			endpoint = U1STATbits.ENDPT;
+			if (endpoint >= NUM_ENDPOINTS)
 			{
-				is_setup = 1;
-				// From section 8.5.3 of the USB specification, SETUP
-				// transactions always use DATA0.
-				state->data_sequence = 0;
+				// Bad endpoint number.
+				usbFatalError();
+				return;
 			}
-			// From section 8.6.4 of the USB specification, if a receiver
-			// sees mismatching data toggle sequence bits, it should ACK
-			// the packet but ignore its contents. This will result in
-			// the transmitter and receiver re-synchronising.
-			if (bdt_table[index].STATUS.DATA0_1 == state->data_sequence)
+			direction = U1STATbits.DIR;
+			pp = U1STATbits.PPBI;
+			// TRNIF needs to be cleared before the next transaction, otherwise
+			// an interrupt could be missed. Fourtunately, the minimum time for a
+			// valid 0-length data transaction is 32 + 3 + 32 + 3 + 16 + 3 bit
+			// periods (token + data + handshake), or 534 cycles at 72 MHz. That's
+			// plenty of time, however, TRNIF should still be cleared before
+			// doing any packet processing.
+			U1IRbits.TRNIF = 1; // clear interrupt flag in USB module
+			state = endpoint_states[endpoint];
+			if (state == NULL)
 			{
-				state->data_sequence ^= 1;
-				state->receiveCallback(state->receive_buffer, length, is_setup);
+				// Attempting to access non-existent state.
+				usbFatalError();
+				return;
 			}
-			else
+			pp_state = &(ping_pong_states[endpoint][direction]);
+			if ((pp_state->queued == 0) || (pp != pp_state->next_pp))
 			{
-				usbQueueReceivePacket(endpoint);
+				// Ping-pong state is out of sync with the USB module. This
+				// should never happen.
+				usbFatalError();
+				return;
 			}
-			if (is_setup)
-			{
-				// Whenever the USB module sees a SETUP packet, it sets
-				// PKTDIS, halting all subsequent packet processing. This
-				// gives us the opportunity to safely cancel transactions.
-				// PKTDIS needs to be cleared, after processing the SETUP
-				// packet, otherwise there will be no further transactions.
-				U1CONbits.PKTDIS = 0;
-			}
-		}
-		else
-		{
-			// Last transaction was transmit.
-			state->data_sequence ^= 1;
-			if (state->is_extended_transmit)
+			// Buffer descriptor has been handed back, so the next transaction
+			// will use the other one.
+			pp_state->next_pp ^= 1;
+			pp_state->queued--;
+			transfer = pp_state->transfer[pp];
+			pp_state->transfer[pp] = NULL;
+			// This must be done before any callbacks are called, since they
+			// may reuse the packet buffer.
+			captureTransaction(endpoint, direction, pp, pp_state->buffer[pp]);
+			if (direction == 0)
 			{
-				index = BDT_IDX(endpoint, BDT_TX, BDT_EVEN);
-				transmitted_bytes = bdt_table[index].STATUS.BYTE_COUNT;
-				// Advance transmission by transmitted_bytes bytes.
-				if (state->transmit_remaining < transmitted_bytes)
+				// Last transaction was receive.
+				index = BDT_IDX(endpoint, BDT_RX, pp);
+				length = bdt_table[index].STATUS.BYTE_COUNT;
+				is_setup = 0;
+				if (bdt_table[index].STATUS.PID == USBPID_SETUP)
 				{
-					// This should never happen.
-					usbFatalError();
+					is_setup = 1;
+					// From section 8.5.3 of the USB specification, SETUP
+					// transactions always use DATA0.
+					state->data_sequence = 0;
 				}
-				state->transmit_remaining -= transmitted_bytes;
-				state->transmit_buffer += transmitted_bytes;
-				length = state->transmit_remaining;
-				// The idea here is to have every packet except the last be
-				// marked as an extended transmit. That way, after the last
-				// packet is successfully transmitted, the transmit callback
-				// will be called.
-				// Note that the comparison below is "<" instead of "<="
-				// because the last packet must not be of
-				// size MAX_PACKET_SIZE, otherwise the other end doesn't
-				// know whether the transmission has finished or not. In
-				// those cases, an extra zero-length packet is transmitted
-				// to resolve the ambiguity (see section 8.5.3.2 of the
-				// USB specification).
-				if (length < MAX_PACKET_SIZE)
+				// From section 8.6.4 of the USB specification, if a receiver
+				// sees mismatching data toggle sequence bits, it should ACK
+				// the packet but ignore its contents. This will result in
+				// the transmitter and receiver re-synchronising.
+				if (bdt_table[index].STATUS.DATA0_1 == state->data_sequence)
 				{
-					is_extended = 0;
+					state->data_sequence ^= 1;
+					if (transfer != NULL)
+					{
+						transfer->actual_length += length;
+						// A short packet ends the transfer early.
+						if ((length < pp_state->length[pp])
+							|| (transfer->actual_length == transfer->length))
+						{
+							completeTransfer(endpoint, BDT_RX, transfer);
+						}
+						else
+						{
+							armTransfers(endpoint, BDT_RX);
+						}
+					}
+					else
+					{
+						state->receiveCallback(pp_state->buffer[pp], length, is_setup);
+					}
 				}
 				else
 				{
-					is_extended = 1;
+					// Reuse the same buffer, since the packet was ignored.
+					if (transfer != NULL)
+					{
+						transfer->armed_length -= pp_state->length[pp];
+						transfer->fully_armed = 0;
+						armTransfers(endpoint, BDT_RX);
+					}
+					else
+					{
+						usbQueueReceivePacketToBuffer(endpoint, pp_state->buffer[pp], pp_state->length[pp]);
+					}
+				}
+				if (is_setup)
+				{
+					// Whenever the USB module sees a SETUP packet, it sets
+					// PKTDIS, halting all subsequent packet processing. This
+					// gives us the opportunity to safely cancel transactions.
+					// PKTDIS needs to be cleared, after processing the SETUP
+					// packet, otherwise there will be no further transactions.
+					U1CONbits.PKTDIS = 0;
 				}
-				usbQueueTransmitPacket(state->transmit_buffer, length, endpoint, is_extended);
 			}
 			else
 			{
-				state->transmitCallback();
+				// Last transaction was transmit.
+				if (!state->is_isochronous)
+				{
+					state->data_sequence ^= 1;
+				}
+				if (transfer != NULL)
+				{
+					index = BDT_IDX(endpoint, BDT_TX, pp);
+					transfer->actual_length += bdt_table[index].STATUS.BYTE_COUNT;
+					// The transfer is complete once its last packet has been
+					// transmitted, which may be the packet queued in the other
+					// buffer descriptor.
+					if (transfer->fully_armed
+						&& ((pp_state->queued == 0) || (pp_state->transfer[pp_state->next_pp] != transfer)))
+					{
+						completeTransfer(endpoint, BDT_TX, transfer);
+					}
+					else
+					{
+						armTransfers(endpoint, BDT_TX);
+					}
+				}
+				else if (state->is_extended_transmit)
+				{
+					index = BDT_IDX(endpoint, BDT_TX, pp);
+					transmitted_bytes = bdt_table[index].STATUS.BYTE_COUNT;
+					// Advance transmission by transmitted_bytes bytes.
+					if (state->transmit_remaining < transmitted_bytes)
+					{
+						// This should never happen.
+						usbFatalError();
+					}
+					state->transmit_remaining -= transmitted_bytes;
+					state->transmit_buffer += transmitted_bytes;
+					length = state->transmit_remaining;
+					// The idea here is to have every packet except the last be
+					// marked as an extended transmit. That way, after the last
+					// packet is successfully transmitted, the transmit callback
+					// will be called.
+					// Note that the comparison below is "<" instead of "<="
+					// because the last packet must not be of
+					// size MAX_PACKET_SIZE, otherwise the other end doesn't
+					// know whether the transmission has finished or not. In
+					// those cases, an extra zero-length packet is transmitted
+					// to resolve the ambiguity (see section 8.5.3.2 of the
+					// USB specification).
+					if (length < MAX_PACKET_SIZE)
+					{
+						is_extended = 0;
+					}
+					else
+					{
+						is_extended = 1;
+					}
+					usbQueueTransmitPacket(state->transmit_buffer, length, endpoint, is_extended);
+				}
+				else
+				{
+					state->transmitCallback();
+				}
 			}
 		}
+		else if (U1IRbits.URSTIF)
+		{
+			// USB reset seen.
+			U1IRbits.URSTIF = 1; // clear interrupt flag in USB module
+			usbHALReset();
+		}
+		else if (U1IRbits.UERRIF)
+		{
+			// USB error.
+			U1IRbits.UERRIF = 1; // clear interrupt flag in USB module
+			usbFatalError();
+		}
+		else if (U1IEbits.SOFIE && U1IRbits.SOFIF)
+		{
+			// Start of frame.
+			U1IRbits.SOFIF = 1; // clear interrupt flag in USB module
+			usbClassStartOfFrame();
+		}
+		else
+		{
+			// Nothing left to do.
+			break;
+		}
+		batch_size++;
 	}
-	else if (U1IRbits.URSTIF)
-	{
-		// USB reset seen.
-		U1IRbits.URSTIF = 1; // clear interrupt flag in USB module
-		IFS1bits.USBIF = 0; // clear interrupt flag in interrupt controller
-		usbHALReset();
-	}
-	else if (U1IRbits.UERRIF)
-	{
-		// USB error.
-		U1IRbits.UERRIF = 1; // clear interrupt flag in USB module
-		IFS1bits.USBIF = 0; // clear interrupt flag in interrupt controller
-		usbFatalError();
-	}
-	else
+	// batch_size can be 0 if the events which caused this interrupt were
+	// handled by the loop of the previous invocation.
+	interrupt_statistics.interrupts++;
+	interrupt_statistics.events += batch_size;
+	interrupt_statistics.last_batch_size = batch_size;
+	if (batch_size > interrupt_statistics.max_batch_size)
 	{
-		// This should never happen.
-		usbFatalError();
+		interrupt_statistics.max_batch_size = batch_size;
 	}
 }
 
@@ -443,13 +615,17 @@ static volatile uint32_t *getEndpointControlRegister(unsigned int endpoint)
 }
 
 /** Disable an endpoint. A disabled endpoint cannot receive or transmit
-  * packets. This will also clear any pending I/O.
+  * packets. This will also clear any pending I/O. Any submitted transfers
+  * are aborted (see #USBTransfer).
   * \param endpoint The device endpoint number.
+  * \warning Aborted transfers must not be resubmitted to the endpoint from
+  *          their completion callback, since it is now disabled.
   */
 void usbDisableEndpoint(unsigned int endpoint)
 {
-	uint32_t index;
 	volatile uint32_t *reg;
+	USBTransfer *receive_transfers;
+	USBTransfer *transmit_transfers;
 
 	// Disable transmit/receive for the endpoint.
 	if (endpoint >= NUM_ENDPOINTS)
@@ -468,19 +644,24 @@ void usbDisableEndpoint(unsigned int endpoint)
 	// It's now safe to modify endpoint_states and bdt_table without worrying
 	// about screwing up the interrupt service handler.
 	endpoint_states[endpoint] = NULL;
-	index = BDT_IDX(endpoint, BDT_RX, BDT_EVEN);
-	bdt_table[index].CTRL.UOWN = 0;
-	index = BDT_IDX(endpoint, BDT_TX, BDT_EVEN);
-	bdt_table[index].CTRL.UOWN = 0;
+	reclaimBufferDescriptors(endpoint, BDT_RX);
+	reclaimBufferDescriptors(endpoint, BDT_TX);
+	receive_transfers = detachTransfers(endpoint, BDT_RX);
+	transmit_transfers = detachTransfers(endpoint, BDT_TX);
+	abortTransfers(receive_transfers);
+	abortTransfers(transmit_transfers);
 }
 
 /** Enable endpoint, so that it can begin transmitting and/or receiving.
-  * This will automatically call usbQueueReceivePacket() for the endpoint,
-  * so it is ready to begin receiving. However, don't forget to call
-  * usbQueueReceivePacket() again for each received packet so that
-  * subsequent packets can be received.
+  * If the endpoint state has a receiveCallback, this will automatically
+  * call usbQueueReceivePacket() for the endpoint, so it is ready to begin
+  * receiving. However, don't forget to call usbQueueReceivePacket() again
+  * for each received packet so that subsequent packets can be received.
+  * Endpoints which only use transfers (see usbSubmitReceiveTransfer() and
+  * usbSubmitTransmitTransfer()) can leave the callbacks as NULL.
   * \param endpoint The endpoint number to activate.
-  * \param type The type of endpoint (IN, OUT or CONTROL; see #EndpointType).
+  * \param type The type of endpoint (IN, OUT, CONTROL or ISOCHRONOUS_IN; see
+  *             #EndpointType).
   * \param state Pointer to buffer which holds per-endpoint state.
   * \warning state must actually be persistent (i.e. do not allocate it on
   *          the stack). This is because it will be accessed by the USB
@@ -490,12 +671,6 @@ void usbEnableEndpoint(unsigned int endpoint, EndpointType type, EndpointState *
 {
 	volatile uint32_t *reg;
 
-	if ((state->transmitCallback == NULL) || (state->receiveCallback == NULL))
-	{
-		// This should never happen.
-		usbFatalError();
-		return;
-	}
 	if (endpoint >= NUM_ENDPOINTS)
 	{
 		// Bad endpoint number.
@@ -504,7 +679,18 @@ void usbEnableEndpoint(unsigned int endpoint, EndpointType type, EndpointState *
 	}
 	endpoint_states[endpoint] = state;
 	state->data_sequence = 0;
-	usbQueueReceivePacket(endpoint);
+	if (type == ISOCHRONOUS_IN_ENDPOINT)
+	{
+		state->is_isochronous = 1;
+	}
+	else
+	{
+		state->is_isochronous = 0;
+	}
+	if (state->receiveCallback != NULL)
+	{
+		usbQueueReceivePacket(endpoint);
+	}
 	reg = getEndpointControlRegister(endpoint);
 	if (type == IN_ENDPOINT)
 	{
@@ -519,6 +705,10 @@ void usbEnableEndpoint(unsigned int endpoint, EndpointType type, EndpointState *
 		// Bidirectional control endpoint.
 		*reg = 0b00001101; // enable handshake, transmit and receive
 	}
+	else if (type == ISOCHRONOUS_IN_ENDPOINT)
+	{
+		*reg = 0b00000100; // enable transmit only (no handshake)
+	}
 	else
 	{
 		usbFatalError();
@@ -563,10 +753,14 @@ unsigned int usbEndpointEnabled(unsigned int endpoint)
   *                    need to do an extended transmit.
   * \warning Since this is non-blocking, the data specified by packet_buffer
   *          must persist until the transmitCallback function is called.
+  * \warning Up to two non-extended transmissions can be queued at once (one
+  *          in each ping-pong buffer descriptor). An extended transmission
+  *          cannot share the endpoint with any other queued transmission.
   */
 void usbQueueTransmitPacket(const uint8_t *packet_buffer, uint32_t length, unsigned int endpoint, unsigned int is_extended)
 {
 	unsigned int index;
+	PingPongState *pp_state;
 
 	if (endpoint >= NUM_ENDPOINTS)
 	{
@@ -574,16 +768,43 @@ void usbQueueTransmitPacket(const uint8_t *packet_buffer, uint32_t length, unsig
 		usbFatalError();
 		return;
 	}
-	index = BDT_IDX(endpoint, BDT_TX, BDT_EVEN);
-	if (bdt_table[index].CTRL.UOWN != 0)
+	if (endpoint_states[endpoint] == NULL)
 	{
-		// Attempting to overwrite another queued transmission.
+		// Attempting to transmit from a disabled endpoint.
 		usbFatalError();
 		return;
 	}
-	if (endpoint_states[endpoint] == NULL)
+	if (endpoint_states[endpoint]->transmitCallback == NULL)
 	{
-		// Attempting to transmit from a disabled endpoint.
+		// There would be nothing to tell about the transmission.
+		usbFatalError();
+		return;
+	}
+	pp_state = &(ping_pong_states[endpoint][BDT_TX]);
+	if (pp_state->transfer_head != NULL)
+	{
+		// Transmit transfers are in progress on this endpoint.
+		usbFatalError();
+		return;
+	}
+	if (pp_state->queued >= 2)
+	{
+		// Both ping-pong buffer descriptors are already in use.
+		usbFatalError();
+		return;
+	}
+	if ((pp_state->queued != 0)
+		&& (is_extended || endpoint_states[endpoint]->is_extended_transmit))
+	{
+		// Extended transmissions keep their progress in the endpoint state,
+		// so they can't be queued alongside another transmission.
+		usbFatalError();
+		return;
+	}
+	index = BDT_IDX(endpoint, BDT_TX, pp_state->next_pp ^ pp_state->queued);
+	if (bdt_table[index].CTRL.UOWN != 0)
+	{
+		// Attempting to overwrite another queued transmission.
 		usbFatalError();
 		return;
 	}
@@ -618,19 +839,11 @@ void usbQueueTransmitPacket(const uint8_t *packet_buffer, uint32_t length, unsig
 			usbFatalError();
 		}
 	}
-	// Set buffer parameters.
-	bdt_table[index].CTRL.BSTALL = 0;
-	bdt_table[index].CTRL.DTS = 0;
-	bdt_table[index].CTRL.NINC = 0;
-	bdt_table[index].CTRL.KEEP = 0;
-	bdt_table[index].CTRL.DATA0_1 = endpoint_states[endpoint]->data_sequence;
-	bdt_table[index].CTRL.BYTE_COUNT = length;
-	bdt_table[index].CTRL.BUFFER_ADDRESS = VIRTUAL_TO_PHYSICAL(packet_buffer);
-	// Tell USB module to process buffer.
-	bdt_table[index].CTRL.UOWN = 1;
+	armBufferDescriptor(endpoint, BDT_TX, packet_buffer, length, NULL);
 }
 
-/** Cancel a queued transmission.
+/** Cancel queued transmissions. If two transmissions are queued, both are
+  * cancelled.
   * \param endpoint The endpoint number of the transmission to cancel.
   * \warning It is almost always unsafe to call this, because the USB module
   *          operates asynchronously and independently of the CPU. There is
@@ -639,8 +852,6 @@ void usbQueueTransmitPacket(const uint8_t *packet_buffer, uint32_t length, unsig
   */
 void usbCancelTransmit(unsigned int endpoint)
 {
-	unsigned int index;
-
 	if (U1CONbits.PKTDIS == 0)
 	{
 		// Unsafe situation; the transmit could be in progress.
@@ -652,13 +863,36 @@ void usbCancelTransmit(unsigned int endpoint)
 		usbFatalError();
 		return;
 	}
-	index = BDT_IDX(endpoint, BDT_TX, BDT_EVEN);
-	if (bdt_table[index].CTRL.UOWN == 0)
+	if (cancelBufferDescriptors(endpoint, BDT_TX) == 0)
 	{
 		// Try to cancel non-existent transmit.
 		usbFatalError();
 	}
-	bdt_table[index].CTRL.UOWN = 0;
+}
+
+/** Cancel queued receives. If two receives are queued, both are cancelled.
+  * \param endpoint The endpoint number of the receive to cancel.
+  * \return Number of queued receives which were cancelled (0, 1 or 2). Any
+  *         receive which was queued but not cancelled has just completed, in
+  *         which case the receiveCallback function of the endpoint state (see
+  *         #EndpointState) will still be called.
+  * \warning Like usbCancelTransmit(), this is only safe to call during the
+  *          Setup stage of a control transfer.
+  */
+unsigned int usbCancelReceive(unsigned int endpoint)
+{
+	if (U1CONbits.PKTDIS == 0)
+	{
+		// Unsafe situation; the receive could be in progress.
+		usbFatalError();
+	}
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		// Bad endpoint number.
+		usbFatalError();
+		return 0;
+	}
+	return cancelBufferDescriptors(endpoint, BDT_RX);
 }
 
 /** Stall an endpoint. If the host tries to transact with a stalled endpoint,
@@ -734,34 +968,23 @@ void usbSetDeviceAddress(unsigned int address)
 	U1ADDRbits.DEVADDR = address;
 }
 
-/** This function allows drivers to override the next transaction's data
-  * sequence toggle bit. For example, section 8.5.3 of the USB specification
-  * says that the Status stage of a control transfer always uses a value
-  * of 1, regardless of the previous value.
-  * \param endpoint The endpoint number of the endpoint to modify.
-  * \param new_data_sequence Data toggle sequence bit for next packet to be
-  *                          transmitted or received (0 = DATA0, 1 = DATA1).
+/** Enable or disable the start-of-frame interrupt. While it is enabled,
+  * usbClassStartOfFrame() will be called at the start of every frame. Since
+  * that's 1000 times per second, it's best to only enable it when it's
+  * actually needed.
+  * \param enable Non-zero to enable, zero to disable.
   */
-void usbOverrideDataSequence(unsigned int endpoint, unsigned int new_data_sequence)
+void usbEnableSOFInterrupt(unsigned int enable)
 {
-	if (endpoint >= NUM_ENDPOINTS)
-	{
-		// Bad endpoint number.
-		usbFatalError();
-		return;
-	}
-	if (endpoint_states[endpoint] == NULL)
-	{
-		// Attempting to override non-existent state.
-		usbFatalError();
-		return;
-	}
-	if (new_data_sequence == 0)
+	if (enable)
 	{
-		endpoint_states[endpoint]->data_sequence = 0;
+		// Clear any stale start-of-frame event, so that the first callback
+		// comes at the start of the next frame.
+		U1IRbits.SOFIF = 1;
+		U1IEbits.SOFIE = 1;
 	}
 	else
 	{
-		endpoint_states[endpoint]->data_sequence = 1;
+		U1IEbits.SOFIE = 0;
 	}
 }
@@ -2,6 +2,16 @@
   *
   * \brief Describes functions, types and constants exported by usb_hal.c
   *
+  * usb_standard_requests.c, usb_composite.c, usb_hid_stream.c and
+  * serial_fifo.c don't touch any PIC32 registers. They only depend on this
+  * API, the callbacks in usb_callbacks.h and the interrupt-related functions
+  * and timer functions of pic32_system.h (disableInterrupts(),
+  * restoreInterrupts(), idleWithInterruptsDisabled() and getCoreTimer());
+  * usb_hid_stream.c also calls signalEvents() from scheduler.c. So they can
+  * be built against any implementation of those, for example a host-side
+  * model of the USB module which calls the endpoint callbacks as the
+  * interrupt service handler in usb_hal.c would.
+  *
   * All references to the "USB specification" refer to revision 2.0, obtained
   * from http://www.usb.org/developers/docs/usb_20_110512.zip (see usb_20.pdf)
   * on 26 March 2012.
@@ -31,15 +41,67 @@ typedef enum EndpointTypeEnum
 	/** Endpoint for transmitting data to host. */
 	IN_ENDPOINT			= 24,
 	/** Endpoint for receiving data from host. */
-	OUT_ENDPOINT		= 27
+	OUT_ENDPOINT		= 27,
+	/** Isochronous endpoint for transmitting data to host. There are no
+	  * handshakes or retries, and every packet uses DATA0 (see section
+	  * 5.6.4 of the USB specification). */
+	ISOCHRONOUS_IN_ENDPOINT	= 30
 } EndpointType;
 
+/** A transfer: a buffer which is transmitted or received as a sequence of
+  * packets, without the class driver having to handle each packet (see
+  * usbSubmitTransmitTransfer() and usbSubmitReceiveTransfer()). Each
+  * endpoint direction has a queue of transfers; when one transfer
+  * completes, the interrupt service handler moves straight on to the next.
+  *
+  * The class driver fills in #buffer, #length, #zero_length_packet and
+  * #completionCallback before submitting the transfer. The other fields are
+  * written by usb_hal.c.
+  */
+typedef struct USBTransferStruct
+{
+	/** Data to transmit, or buffer to receive into. */
+	uint8_t *buffer;
+	/** Number of bytes to transmit, or size of #buffer for a receive. */
+	uint32_t length;
+	/** For transmit transfers only: if this is non-zero and #length is a
+	  * multiple of #MAX_PACKET_SIZE, the transfer is ended with an extra
+	  * zero-length packet, so that the host knows the transfer is complete
+	  * (see section 5.8.3 of the USB specification). */
+	unsigned int zero_length_packet;
+	/** Callback which is called (from the interrupt service handler) when the
+	  * transfer completes or is aborted. A new transfer can be submitted
+	  * from within this callback.
+	  * \param transfer The transfer which completed.
+	  */
+	void (*completionCallback)(struct USBTransferStruct *transfer);
+	/** Number of bytes actually transmitted or received. A receive transfer
+	  * completes early if the host sends a short packet, in which case this
+	  * will be less than #length. */
+	uint32_t actual_length;
+	/** Non-zero if the transfer was aborted because the endpoint was
+	  * disabled or a USB reset was seen. In that case, #actual_length is
+	  * meaningless. */
+	unsigned int aborted;
+	/** Number of bytes of #buffer which have been handed to the USB module.
+	  * This is private to usb_hal.c. */
+	uint32_t armed_length;
+	/** Non-zero if the last packet of the transfer has been handed to the
+	  * USB module. This is private to usb_hal.c. */
+	unsigned int fully_armed;
+	/** Next transfer in the endpoint's queue. This is private to
+	  * usb_hal.c. */
+	struct USBTransferStruct *next;
+} USBTransfer;
+
 /** Structure which holds per-endpoint state. Such a state is needed because
   * packets can be received and transmitted asynchronously. */
 typedef struct EndpointStateStruct
 {
 	/** Buffer for received packets. It needs to be persistent because packets
-	  * can be received at any time. */
+	  * can be received at any time. This is the buffer used by
+	  * usbQueueReceivePacket(); class drivers can supply their own buffer
+	  * using usbQueueReceivePacketToBuffer(). */
 	uint8_t receive_buffer[MAX_PACKET_SIZE];
 	/** Callback which is called whenever a packet is received.
 	  * \param packet_buffer The contents of the packet are placed here.
@@ -53,11 +115,18 @@ typedef struct EndpointStateStruct
 	  * \warning The usbQueueReceivePacket() function must be called to tell
 	  *          the USB module that it can accept another packet. If you
 	  *          forget to call it, the USB module will NAK packets forever!
+	  *          Up to two receives can be queued at once (see
+	  *          usbQueueReceivePacketToBuffer()), in which case this callback
+	  *          will be called once for each, in the order they were queued.
+	  * \note This may be NULL if the endpoint only receives using
+	  *       usbSubmitReceiveTransfer().
 	  */
 	void (*receiveCallback)(uint8_t *packet_buffer, uint32_t length, unsigned int is_setup);
 	/** Callback which is called whenever a packet is transmitted. For
 	  * extended packets, this will only be called after the last packet is
-	  * successfully transmitted. */
+	  * successfully transmitted. If two packets were queued, this will be
+	  * called once for each, in the order they were queued. This may be NULL
+	  * if the endpoint only transmits using usbSubmitTransmitTransfer(). */
 	void (*transmitCallback)(void);
 	/** Current value of the data toggle synchronisation counter. This should
 	  * be 0 or 1 and is used to handle cases where ACKs are dropped. See
@@ -72,6 +141,10 @@ typedef struct EndpointStateStruct
 	  * requests are split up into multiple packets, as described in section
 	  * 5.5.3 of the USB specification. */
 	unsigned int is_extended_transmit;
+	/** Non-zero if this is an isochronous endpoint, zero if it isn't.
+	  * Isochronous endpoints don't use data toggle synchronisation, so
+	  * #data_sequence stays at 0. This is set by usbEnableEndpoint(). */
+	unsigned int is_isochronous;
 	/** The number of bytes remaining in a transmit, including any currently
 	  * queued packet. */
 	uint32_t transmit_remaining;
@@ -79,6 +152,49 @@ typedef struct EndpointStateStruct
 	const uint8_t *transmit_buffer;
 } EndpointState;
 
+/** Statistics about the USB interrupt service handler, which can be used to
+  * see how many events (transactions, resets etc.) are handled per
+  * interrupt. */
+typedef struct USBInterruptStatisticsStruct
+{
+	/** Number of times the USB interrupt service handler has been called. */
+	uint32_t interrupts;
+	/** Total number of events handled. Divide this by #interrupts to get
+	  * the average batch size. */
+	uint32_t events;
+	/** Number of events handled by the most recent interrupt. */
+	uint32_t last_batch_size;
+	/** Largest number of events handled by a single interrupt. */
+	uint32_t max_batch_size;
+} USBInterruptStatistics;
+
+/** Number of data bytes which are kept in each #USBCaptureRecord. This is
+  * enough for a whole SETUP packet. */
+#define USB_CAPTURE_DATA_SIZE		8
+
+/** One completed transaction, as recorded by the capture mode (see
+  * usbSetCaptureEndpoints()). */
+typedef struct USBCaptureRecordStruct
+{
+	/** Value of the core timer (see getCoreTimer()) when the interrupt
+	  * service handler handled the transaction. */
+	uint32_t timestamp;
+	/** Device endpoint number. */
+	uint8_t endpoint;
+	/** 0 = OUT or SETUP (host to device), 1 = IN (device to host). */
+	uint8_t direction;
+	/** Token packet identifier (see #USBPIDEnum). */
+	uint8_t pid;
+	/** Data toggle (0 = DATA0, 1 = DATA1) of the transacted packet. */
+	uint8_t data_toggle;
+	/** Number of bytes actually transmitted or received. */
+	uint16_t length;
+	/** Number of valid bytes in #data. */
+	uint16_t captured_length;
+	/** The first few bytes of the packet. */
+	uint8_t data[USB_CAPTURE_DATA_SIZE];
+} USBCaptureRecord;
+
 extern void usbInit(void);
 extern void usbConnect(void);
 extern void usbDisconnect(void);
@@ -86,12 +202,22 @@ extern void usbDisableEndpoint(unsigned int endpoint);
 extern void usbEnableEndpoint(unsigned int endpoint, EndpointType type, EndpointState *state);
 extern unsigned int usbEndpointEnabled(unsigned int endpoint);
 extern void usbQueueReceivePacket(unsigned int endpoint);
+extern void usbQueueReceivePacketToBuffer(unsigned int endpoint, uint8_t *packet_buffer, uint32_t length);
+extern unsigned int usbCancelReceive(unsigned int endpoint);
 extern void usbQueueTransmitPacket(const uint8_t *packet_buffer, uint32_t length, unsigned int endpoint, unsigned int is_extended);
 extern void usbCancelTransmit(unsigned int endpoint);
+extern void usbSubmitReceiveTransfer(unsigned int endpoint, USBTransfer *transfer);
+extern void usbSubmitTransmitTransfer(unsigned int endpoint, USBTransfer *transfer);
 extern void usbStallEndpoint(unsigned int endpoint);
 extern void usbUnstallEndpoint(unsigned int endpoint);
 extern unsigned int usbGetStallStatus(unsigned int endpoint);
 extern void usbSetDeviceAddress(unsigned int address);
 extern void usbOverrideDataSequence(unsigned int endpoint, unsigned int new_data_sequence);
+extern void usbEnableSOFInterrupt(unsigned int enable);
+extern void usbGetInterruptStatistics(USBInterruptStatistics *statistics);
+extern void usbClearInterruptStatistics(void);
+extern void usbSetCaptureEndpoints(uint32_t endpoint_mask);
+extern uint32_t usbReadCaptureRecords(USBCaptureRecord *records, uint32_t max_records);
+extern uint32_t usbGetCaptureDropped(void);
 
 #endif	// #ifndef PIC32_USB_HAL_H
@@ -0,0 +1,607 @@
+/** \file usb_hal_queue.h
+  *
+  * \brief The hardware-independent part of the USB HAL (see usb_hal.c).
+  *
+  * This is the ping-pong buffer descriptor bookkeeping, the transfer queues,
+  * the capture ring and the interrupt statistics: everything which only
+  * touches the buffer descriptor table, and not the USB module's registers.
+  * It isn't an ordinary header. usb_hal.c includes it once, and so does the
+  * host's simulated USB module (host/usb_hal_sim.c), so that the simulation
+  * runs this code instead of a copy of it.
+  *
+  * Before including this, the includer must include string.h, usb_hal.h,
+  * usb_defs.h, usb_callbacks.h and pic32_system.h, and define:
+  * - bdt_table, an array of NUM_ENDPOINTS * 4 buffer descriptors, each with
+  *   the CTRL and STATUS bit fields described in section 27.3.5.3.4
+  *   ("Buffer Descriptor Format") of the PIC32 family reference manual;
+  * - SET_BUFFER_ADDRESS(index, buffer), which points entry index of
+  *   bdt_table at buffer.
+  *
+  * This file is licensed as described by the file LICENCE.
+  */
+
+#ifndef USB_HAL_QUEUE_H
+#define USB_HAL_QUEUE_H
+
+/** Each endpoint has 4 buffer descriptor entries: even receive, odd receive,
+  * even transmit and odd transmit. The even/odd buffers allow for double
+  * buffering. This macro generates a readable index into #bdt_table. For
+  * dir, use #BDT_RX or #BDT_TX. For pp, use #BDT_EVEN or #BDT_ODD. */
+#define BDT_IDX(endpoint, dir, pp)	((((endpoint) & 15) << 2) \
+									| (((dir) & 1) << 1) \
+									| ((pp) & 1))
+/** Value for dir parameter of #BDT_IDX macro which is used to access the
+  * receive descriptors. */
+#define BDT_RX						0
+/** Value for dir parameter of #BDT_IDX macro which is used to access the
+  * transmit descriptors. */
+#define BDT_TX						1
+/** Value for pp parameter of #BDT_IDX macro which is used to access the
+  * even descriptors. */
+#define BDT_EVEN					0
+/** Value for pp parameter of #BDT_IDX macro which is used to access the
+  * odd descriptors. */
+#define BDT_ODD						1
+
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used in #endpoint_states to signify that no state structure has
+  * been supplied, and to end transfer queues. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+/** Array of endpoint state pointers. NULL means no state. This is accessed by
+  * the interrupt service routine whenever a successful transaction occurs. */
+static EndpointState *endpoint_states[NUM_ENDPOINTS];
+
+/** Statistics about the interrupt service handler. These are written by the
+  * interrupt service handler, so they must only be read or cleared with
+  * interrupts disabled. */
+static USBInterruptStatistics interrupt_statistics;
+
+/** Number of records in #capture_ring.
+  * \warning This must be a power of 2.
+  */
+#define CAPTURE_RING_SIZE			128
+
+/** Ring of captured transaction records (see usbSetCaptureEndpoints()).
+  * The interrupt service handler writes records and usbReadCaptureRecords()
+  * reads them. */
+static USBCaptureRecord capture_ring[CAPTURE_RING_SIZE];
+/** Number of records ever written to #capture_ring. This is free-running;
+  * the index of the next record to write is this modulo
+  * #CAPTURE_RING_SIZE. */
+static volatile uint32_t capture_head;
+/** Number of records ever read from #capture_ring. This is free-running,
+  * like #capture_head. */
+static volatile uint32_t capture_tail;
+/** Number of transactions which weren't recorded because #capture_ring was
+  * full. */
+static volatile uint32_t capture_dropped;
+/** Bit mask of endpoints whose transactions are captured. Bit n corresponds
+  * to endpoint n. 0 means capture is disabled. */
+static volatile uint32_t capture_endpoint_mask;
+
+/** Ping-pong buffering state for one direction (receive or transmit) of one
+  * endpoint. The USB module alternates between the even and odd buffer
+  * descriptors every time a transaction completes, and it can't be told to
+  * do otherwise (except by resetting all pointers using PPBRST). So
+  * software needs to keep track of which buffer descriptor the USB module
+  * will use next. */
+typedef struct PingPongStateStruct
+{
+	/** The buffer descriptor (#BDT_EVEN or #BDT_ODD) which the USB module
+	  * will use for the next transaction. */
+	unsigned int next_pp;
+	/** Number of buffer descriptors (0, 1 or 2) which have been queued,
+	  * but whose transactions have not yet been handled by the interrupt
+	  * service handler. The oldest one is #next_pp. */
+	unsigned int queued;
+	/** Buffer which was handed to each buffer descriptor. */
+	uint8_t *buffer[2];
+	/** Size, in bytes, of each entry in #buffer. */
+	uint32_t length[2];
+	/** Transfer which each buffer descriptor is part of. This is NULL if
+	  * the buffer descriptor was queued using usbQueueReceivePacket(),
+	  * usbQueueReceivePacketToBuffer() or usbQueueTransmitPacket(). */
+	USBTransfer *transfer[2];
+	/** Oldest transfer in the transfer queue (see usbSubmitReceiveTransfer()
+	  * and usbSubmitTransmitTransfer()), or NULL if the queue is empty. */
+	USBTransfer *transfer_head;
+	/** Newest transfer in the transfer queue. This is only valid if
+	  * #transfer_head is not NULL. */
+	USBTransfer *transfer_tail;
+} PingPongState;
+
+/** Ping-pong buffering state for every endpoint. The second index should be
+  * #BDT_RX or #BDT_TX. */
+static PingPongState ping_pong_states[NUM_ENDPOINTS][2];
+
+/** Take back all queued buffer descriptors for one direction of one
+  * endpoint, so that nothing is queued. Buffer descriptors whose
+  * transactions have already completed are accounted for, so that the
+  * ping-pong state stays in sync with the USB module.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  */
+static void reclaimBufferDescriptors(unsigned int endpoint, unsigned int dir)
+{
+	PingPongState *pp_state;
+	unsigned int index;
+	unsigned int i;
+
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	for (i = 0; i < pp_state->queued; i++)
+	{
+		index = BDT_IDX(endpoint, dir, pp_state->next_pp);
+		if (bdt_table[index].CTRL.UOWN != 0)
+		{
+			// Still queued. Later buffer descriptors can't have completed
+			// either, since the USB module uses them in order.
+			bdt_table[index].CTRL.UOWN = 0;
+			index = BDT_IDX(endpoint, dir, pp_state->next_pp ^ 1);
+			bdt_table[index].CTRL.UOWN = 0;
+			break;
+		}
+		// Already completed, so the USB module has moved on.
+		pp_state->next_pp ^= 1;
+	}
+	pp_state->queued = 0;
+}
+
+/** Cancel all queued buffer descriptors for one direction of one endpoint
+  * which are still owned by the USB module. Buffer descriptors whose
+  * transactions have completed (but which haven't been processed by the
+  * interrupt service handler yet) are left alone.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \return Number of buffer descriptors which were cancelled.
+  */
+static unsigned int cancelBufferDescriptors(unsigned int endpoint, unsigned int dir)
+{
+	PingPongState *pp_state;
+	unsigned int index;
+	unsigned int cancelled;
+	unsigned int i;
+
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	cancelled = 0;
+	for (i = 0; i < pp_state->queued; i++)
+	{
+		index = BDT_IDX(endpoint, dir, pp_state->next_pp ^ i);
+		if (bdt_table[index].CTRL.UOWN != 0)
+		{
+			bdt_table[index].CTRL.UOWN = 0;
+			cancelled++;
+		}
+	}
+	// The USB module uses buffer descriptors in order, so the cancelled ones
+	// must be the most recently queued.
+	pp_state->queued -= cancelled;
+	return cancelled;
+}
+
+/** Hand one packet buffer to the USB module, using the next free ping-pong
+  * buffer descriptor.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \param buffer Packet buffer to receive into or transmit from.
+  * \param length Size of buffer (for receives) or number of bytes to
+  *               transmit (for transmits). This must not be larger than
+  *               #MAX_PACKET_SIZE.
+  * \param transfer The transfer which this packet is part of, or NULL if
+  *                 it isn't part of a transfer.
+  * \warning The caller must check that a buffer descriptor is free (i.e.
+  *          that fewer than 2 are queued).
+  */
+static void armBufferDescriptor(unsigned int endpoint, unsigned int dir, const uint8_t *buffer, uint32_t length, USBTransfer *transfer)
+{
+	unsigned int index;
+	unsigned int pp;
+	PingPongState *pp_state;
+
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	pp = pp_state->next_pp ^ pp_state->queued;
+	index = BDT_IDX(endpoint, dir, pp);
+	if (bdt_table[index].CTRL.UOWN != 0)
+	{
+		// Attempting to overwrite another queued packet.
+		usbFatalError();
+		return;
+	}
+	pp_state->buffer[pp] = (uint8_t *)buffer;
+	pp_state->length[pp] = length;
+	pp_state->transfer[pp] = transfer;
+	// Set buffer parameters.
+	bdt_table[index].CTRL.BSTALL = 0;
+	// Data sequence checking is done in software. This is because SETUP
+	// transactions need to be handled specially.
+	bdt_table[index].CTRL.DTS = 0;
+	bdt_table[index].CTRL.NINC = 0;
+	bdt_table[index].CTRL.KEEP = 0;
+	if (dir == BDT_RX)
+	{
+		bdt_table[index].CTRL.DATA0_1 = endpoint_states[endpoint]->data_sequence;
+	}
+	else if (endpoint_states[endpoint]->is_isochronous)
+	{
+		// Isochronous transmissions always use DATA0.
+		bdt_table[index].CTRL.DATA0_1 = 0;
+	}
+	else
+	{
+		// data_sequence is only advanced when a transmission completes, so
+		// if there is already a transmission queued, this one needs the
+		// opposite data toggle.
+		bdt_table[index].CTRL.DATA0_1 = endpoint_states[endpoint]->data_sequence ^ pp_state->queued;
+	}
+	bdt_table[index].CTRL.BYTE_COUNT = length;
+	SET_BUFFER_ADDRESS(index, buffer);
+	pp_state->queued++;
+	// Tell USB module to process buffer.
+	bdt_table[index].CTRL.UOWN = 1;
+}
+
+/** Hand as many packets as possible from the transfer queue of one direction
+  * of one endpoint to the USB module. Transmits use both ping-pong buffer
+  * descriptors. Receives only use one, because a short packet ends a
+  * receive transfer, and after that it's too late to change where the
+  * other buffer descriptor points.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler).
+  */
+static void armTransfers(unsigned int endpoint, unsigned int dir)
+{
+	PingPongState *pp_state;
+	USBTransfer *transfer;
+	unsigned int max_queued;
+	uint32_t count;
+
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	if (dir == BDT_RX)
+	{
+		max_queued = 1;
+	}
+	else
+	{
+		max_queued = 2;
+	}
+	transfer = pp_state->transfer_head;
+	while ((transfer != NULL) && (pp_state->queued < max_queued))
+	{
+		if (transfer->fully_armed)
+		{
+			transfer = transfer->next;
+			continue;
+		}
+		count = transfer->length - transfer->armed_length;
+		if (count > MAX_PACKET_SIZE)
+		{
+			count = MAX_PACKET_SIZE;
+		}
+		armBufferDescriptor(endpoint, dir, &(transfer->buffer[transfer->armed_length]), count, transfer);
+		transfer->armed_length += count;
+		if (dir == BDT_RX)
+		{
+			transfer->fully_armed = (transfer->armed_length == transfer->length);
+		}
+		else
+		{
+			// A short packet always ends a transmit transfer. A full packet
+			// only ends it if no zero-length packet was requested.
+			transfer->fully_armed = (count < MAX_PACKET_SIZE)
+				|| ((transfer->armed_length == transfer->length) && !transfer->zero_length_packet);
+		}
+	}
+}
+
+/** Remove the head of the transfer queue of one direction of one endpoint,
+  * start on the next transfer and then tell the class driver that the
+  * transfer has completed.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \param transfer The transfer which completed.
+  */
+static void completeTransfer(unsigned int endpoint, unsigned int dir, USBTransfer *transfer)
+{
+	PingPongState *pp_state;
+
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	if (pp_state->transfer_head != transfer)
+	{
+		// Transfers complete in the order they were submitted, so this
+		// should never happen.
+		usbFatalError();
+		return;
+	}
+	pp_state->transfer_head = transfer->next;
+	armTransfers(endpoint, dir);
+	transfer->completionCallback(transfer);
+}
+
+/** Empty the transfer queue of one direction of one endpoint. The buffer
+  * descriptors themselves are not touched.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \return The transfers which were in the queue (a list linked by the
+  *         next field of #USBTransfer), which should be passed to
+  *         abortTransfers() once the endpoint is in a consistent state.
+  */
+static USBTransfer *detachTransfers(unsigned int endpoint, unsigned int dir)
+{
+	PingPongState *pp_state;
+	USBTransfer *transfers;
+
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	transfers = pp_state->transfer_head;
+	pp_state->transfer_head = NULL;
+	pp_state->transfer[0] = NULL;
+	pp_state->transfer[1] = NULL;
+	return transfers;
+}
+
+/** Tell the class driver that transfers have been aborted.
+  * \param transfers List of transfers, as returned by detachTransfers().
+  */
+static void abortTransfers(USBTransfer *transfers)
+{
+	USBTransfer *next;
+
+	while (transfers != NULL)
+	{
+		next = transfers->next;
+		transfers->aborted = 1;
+		transfers->completionCallback(transfers);
+		transfers = next;
+	}
+}
+
+/** Record a completed transaction in #capture_ring, if capture is enabled
+  * for its endpoint. If the ring is full, the transaction is counted in
+  * #capture_dropped instead, so that old records are never overwritten
+  * while they are being read.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \param pp The buffer descriptor (#BDT_EVEN or #BDT_ODD) which was used.
+  * \param buffer The packet buffer which was handed to that buffer
+  *               descriptor.
+  * \warning This must be called from the interrupt service handler, before
+  *          the buffer descriptor is reused.
+  */
+static void captureTransaction(unsigned int endpoint, unsigned int dir, unsigned int pp, const uint8_t *buffer)
+{
+	USBCaptureRecord *record;
+	unsigned int index;
+	uint32_t length;
+
+	if ((capture_endpoint_mask & (1 << endpoint)) == 0)
+	{
+		return;
+	}
+	if ((capture_head - capture_tail) >= CAPTURE_RING_SIZE)
+	{
+		capture_dropped++;
+		return;
+	}
+	index = BDT_IDX(endpoint, dir, pp);
+	length = bdt_table[index].STATUS.BYTE_COUNT;
+	record = &(capture_ring[capture_head & (CAPTURE_RING_SIZE - 1)]);
+	record->timestamp = getCoreTimer();
+	record->endpoint = (uint8_t)endpoint;
+	record->direction = (uint8_t)dir;
+	record->pid = (uint8_t)bdt_table[index].STATUS.PID;
+	record->data_toggle = (uint8_t)bdt_table[index].STATUS.DATA0_1;
+	record->length = (uint16_t)length;
+	record->captured_length = (uint16_t)MIN(length, USB_CAPTURE_DATA_SIZE);
+	memcpy(record->data, buffer, record->captured_length);
+	// Only publish the record once it has been completely written.
+	capture_head++;
+}
+/** Get a snapshot of the USB interrupt service handler statistics.
+  * \param statistics The statistics will be written here.
+  */
+void usbGetInterruptStatistics(USBInterruptStatistics *statistics)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	*statistics = interrupt_statistics;
+	restoreInterrupts(status);
+}
+
+/** Reset all USB interrupt service handler statistics to zero. */
+void usbClearInterruptStatistics(void)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	memset(&interrupt_statistics, 0, sizeof(interrupt_statistics));
+	restoreInterrupts(status);
+}
+
+/** Enable or disable capture mode. In capture mode, the interrupt service
+  * handler records every completed transaction on the selected endpoints
+  * (see #USBCaptureRecord) into a RAM ring, from which they can be
+  * retrieved using usbReadCaptureRecords(). Records already in the ring are
+  * kept when capture is disabled.
+  *
+  * Capturing costs a few microseconds per transaction, so it will slightly
+  * reduce throughput.
+  * \param endpoint_mask Bit mask of endpoints to capture; bit n corresponds
+  *                      to endpoint n. Use 0 to disable capture.
+  */
+void usbSetCaptureEndpoints(uint32_t endpoint_mask)
+{
+	capture_endpoint_mask = endpoint_mask;
+}
+
+/** Remove the oldest records from the capture ring (see
+  * usbSetCaptureEndpoints()).
+  * \param records The records will be written here. This must have space
+  *                for at least max_records records.
+  * \param max_records The maximum number of records to read.
+  * \return The number of records actually read. This may be less than
+  *         max_records (including 0) if fewer records were available.
+  */
+uint32_t usbReadCaptureRecords(USBCaptureRecord *records, uint32_t max_records)
+{
+	uint32_t count;
+	uint32_t i;
+
+	count = MIN(capture_head - capture_tail, max_records);
+	for (i = 0; i < count; i++)
+	{
+		records[i] = capture_ring[(capture_tail + i) & (CAPTURE_RING_SIZE - 1)];
+	}
+	// Only free the records once they have been completely copied.
+	capture_tail += count;
+	return count;
+}
+
+/** Get the number of transactions which weren't captured because the
+  * capture ring was full.
+  * \return Free-running count of dropped transactions.
+  */
+uint32_t usbGetCaptureDropped(void)
+{
+	return capture_dropped;
+}
+
+/** Add a transfer to the end of the transfer queue of one direction of one
+  * endpoint, and start it if possible.
+  * \param endpoint The device endpoint number.
+  * \param dir #BDT_RX or #BDT_TX.
+  * \param transfer The transfer to submit.
+  */
+static void submitTransfer(unsigned int endpoint, unsigned int dir, USBTransfer *transfer)
+{
+	PingPongState *pp_state;
+	uint32_t status;
+
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		// Bad endpoint number.
+		usbFatalError();
+		return;
+	}
+	if (transfer->completionCallback == NULL)
+	{
+		// There would be no way to find out when the transfer completes.
+		usbFatalError();
+		return;
+	}
+	transfer->actual_length = 0;
+	transfer->aborted = 0;
+	transfer->armed_length = 0;
+	transfer->fully_armed = 0;
+	transfer->next = NULL;
+	status = disableInterrupts();
+	if (endpoint_states[endpoint] == NULL)
+	{
+		// Attempting to transfer using a disabled endpoint.
+		restoreInterrupts(status);
+		usbFatalError();
+		return;
+	}
+	pp_state = &(ping_pong_states[endpoint][dir]);
+	if (pp_state->transfer_head == NULL)
+	{
+		if (pp_state->queued != 0)
+		{
+			// Packets queued using the packet functions (eg.
+			// usbQueueTransmitPacket()) are still in progress.
+			restoreInterrupts(status);
+			usbFatalError();
+			return;
+		}
+		pp_state->transfer_head = transfer;
+	}
+	else
+	{
+		pp_state->transfer_tail->next = transfer;
+	}
+	pp_state->transfer_tail = transfer;
+	armTransfers(endpoint, dir);
+	restoreInterrupts(status);
+}
+
+/** Submit a receive transfer. This is non-blocking; the USB module will
+  * receive packets directly into the transfer's buffer and when the buffer
+  * is full or the host sends a short packet, the transfer's
+  * completionCallback will be called. Any number of transfers can be
+  * queued; they complete in the order they were submitted.
+  * \param endpoint The endpoint number to receive on.
+  * \param transfer The transfer to submit. The buffer, length and
+  *                 completionCallback fields must be filled in.
+  * \warning The transfer and its buffer must persist until the
+  *          completionCallback is called.
+  * \warning The length of the transfer should be a multiple of
+  *          #MAX_PACKET_SIZE, since the host could send a full packet at
+  *          any time.
+  * \warning Transfers are not suitable for the control endpoint, because
+  *          SETUP packets need special handling.
+  */
+void usbSubmitReceiveTransfer(unsigned int endpoint, USBTransfer *transfer)
+{
+	if (transfer->length == 0)
+	{
+		// There would be nowhere to put received data.
+		usbFatalError();
+		return;
+	}
+	submitTransfer(endpoint, BDT_RX, transfer);
+}
+
+/** Submit a transmit transfer. This is non-blocking; the transfer's buffer
+  * will be split into #MAX_PACKET_SIZE packets, which are transmitted
+  * directly from the buffer, and when the last packet has been transmitted
+  * the transfer's completionCallback will be called. Any number of transfers
+  * can be queued; they are transmitted back-to-back, in the order they were
+  * submitted.
+  * \param endpoint The endpoint number to transmit on.
+  * \param transfer The transfer to submit. The buffer, length,
+  *                 zero_length_packet and completionCallback fields must be
+  *                 filled in. A length of 0 transmits one zero-length
+  *                 packet.
+  * \warning The transfer and its buffer must persist until the
+  *          completionCallback is called.
+  */
+void usbSubmitTransmitTransfer(unsigned int endpoint, USBTransfer *transfer)
+{
+	submitTransfer(endpoint, BDT_TX, transfer);
+}
+
+/** This function allows drivers to override the next transaction's data
+  * sequence toggle bit. For example, section 8.5.3 of the USB specification
+  * says that the Status stage of a control transfer always uses a value
+  * of 1, regardless of the previous value.
+  * \param endpoint The endpoint number of the endpoint to modify.
+  * \param new_data_sequence Data toggle sequence bit for next packet to be
+  *                          transmitted or received (0 = DATA0, 1 = DATA1).
+  */
+void usbOverrideDataSequence(unsigned int endpoint, unsigned int new_data_sequence)
+{
+	if (endpoint >= NUM_ENDPOINTS)
+	{
+		// Bad endpoint number.
+		usbFatalError();
+		return;
+	}
+	if (endpoint_states[endpoint] == NULL)
+	{
+		// Attempting to override non-existent state.
+		usbFatalError();
+		return;
+	}
+	if (new_data_sequence == 0)
+	{
+		endpoint_states[endpoint]->data_sequence = 0;
+	}
+	else
+	{
+		endpoint_states[endpoint]->data_sequence = 1;
+	}
+}
+
+#endif // #ifndef USB_HAL_QUEUE_H
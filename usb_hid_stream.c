@@ -11,15 +11,19 @@
   *
   * Here's a high-level overview of what's provided in this file. There is
   * an implementation of streamGetOneByte() and streamPutOneByte(), which
-  * read from or write to FIFOs. The interface to USB happens mainly through
-  * callbacks, because USB is fundamentally asynchronous from a device's point
-  * of view. The nature of asynchronous I/O means that care must be taken to
-  * only queue (i.e. schedule) transfers if the appropriate FIFO is empty
-  * or full enough. Things are complicated by the fact that the host can
-  * get and send reports through both the Interrupt endpoints and the control
-  * endpoint.
+  * read from or write to FIFOs. streamRead() and streamWrite() (and their
+  * non-blocking variants) do the same thing for whole buffers. The
+  * interface to USB happens mainly through callbacks, because USB is
+  * fundamentally asynchronous from a device's point of view. The nature of
+  * asynchronous I/O means that care must be taken to only queue (i.e.
+  * schedule) transfers if the appropriate FIFO is empty or full enough.
+  * Things are complicated by the fact that the host can get and send reports
+  * through both the Interrupt endpoints and the control endpoint.
   *
   * Some additional notes:
+  * - This is the class driver for interface 0 of the device. It doesn't
+  *   implement the callbacks in usb_callbacks.h directly; instead,
+  *   usb_composite.c calls them through #hid_stream_class_driver.
   * - Care must be taken to avoid race conditions, since many of the callbacks
   *   can occur in an interrupt context. The assumption is made that there
   *   is only one interrupt context (i.e. USB interrupts cannot interrupt
@@ -31,6 +35,10 @@
   *   (see setReport()) because the hidraw driver on Linux kernels
   *   earlier than 2.6.35 use it, even if the device provides a perfectly
   *   working Interrupt OUT endpoint.
+  * - The host can optionally use credit-based flow control for reports it
+  *   sends on the Interrupt OUT endpoint (see getCreditReport()). A host
+  *   which stays within its credit will never be NAKed, so it doesn't
+  *   waste bus time polling a device whose receive FIFO is full.
   *
   * All references to the "USB specification" refer to revision 2.0, obtained
   * from http://www.usb.org/developers/docs/usb_20_110512.zip (see usb_20.pdf)
@@ -43,18 +51,28 @@
   */
 
 #include <stdint.h>
+#include <string.h>
 #include "usb_hal.h"
+#include "usb_hid_stream.h"
 #include "usb_callbacks.h"
 #include "usb_defs.h"
 #include "usb_standard_requests.h"
 #include "serial_fifo.h"
 #include "pic32_system.h"
+#include "scheduler.h"
 
 /** Only include the report descriptor when including the descriptors
   * in usb_descriptors.h. */
 #define ONLY_INCLUDE_REPORT_DESCRIPTOR
 #include "usb_descriptors.h"
 
+/** Because stdlib.h might not be included, NULL might be undefined. NULL
+  * is used in #interrupt_receive_buffer to signify that a packet will not be
+  * received directly into the receive FIFO. */
+#ifndef NULL
+#define NULL ((void *)0)
+#endif // #ifndef NULL
+
 /** The endpoint number for transmission (Interrupt IN). It's IN because
   * from the host's perspective, data is flowing into it. */
 #define TRANSMIT_ENDPOINT_NUMBER	1
@@ -62,19 +80,44 @@
   * from the host's perspective, data is flowing out of it. */
 #define RECEIVE_ENDPOINT_NUMBER		2
 
-/** Size of transmit FIFO buffer, in number of bytes. There isn't much to be
-  * gained from making this significantly larger.
+/** Size of transmit FIFO buffer, in number of bytes. Since packets are
+  * transmitted directly out of the transmit FIFO, this should be at least
+  * twice #MAX_PACKET_SIZE, so that one packet can be in flight while the
+  * next one is being filled. There isn't much to be gained from making this
+  * significantly larger.
   * \warning This must be a power of 2.
   */
-#define TRANSMIT_FIFO_SIZE			64
-/** Size of receive FIFO buffer, in number of bytes. There isn't much to be
-  * gained from making this significantly larger.
+#define TRANSMIT_FIFO_SIZE			128
+/** Size of receive FIFO buffer, in number of bytes. This is large enough
+  * that a host using credit-based flow control (see getCreditReport()) gets
+  * a few full reports' worth of credit at a time.
   * \warning This must be a power of 2.
   * \warning This must be >= #RECEIVE_HEADROOM, to handle the (unlikely)
   *          cases where the host does simultaneous writes to the
   *          Interrupt OUT endpoint and control endpoint.
   */
-#define RECEIVE_FIFO_SIZE			256
+#define RECEIVE_FIFO_SIZE			512
+
+/** Default value of #coalesce_threshold. Coalescing is off by default, so
+  * that reports are queued as soon as possible and the start-of-frame
+  * interrupt is never enabled unless a caller asks for it with
+  * streamSetTransmitCoalescing(). It isn't needed for throughput: when the
+  * stream is saturated, the transmit FIFO refills while each report waits
+  * to be polled, so reports are full anyway (host/hid_stream_bench.c
+  * measures an average fill of 62.99 bytes without coalescing, and 63.00
+  * with a threshold of 63). It only helps callers which trickle out small
+  * writes, and then it costs a wake-up every millisecond for as long as
+  * bytes are held back. The report fill counters in #HIDStreamStatistics
+  * show whether it's worth it for a particular caller. */
+#define DEFAULT_COALESCE_THRESHOLD	1
+/** Default value of #coalesce_max_latency, in frames (milliseconds). */
+#define DEFAULT_COALESCE_MAX_LATENCY	0
+
+/** Number of bytes in the transmit FIFO which the producer must always leave
+  * free. This ensures that the byte just before the front of the transmit
+  * FIFO is never overwritten, so that it can be used to store the report ID
+  * of a packet transmitted directly out of the FIFO. */
+#define TRANSMIT_FIFO_RESERVE		1
 
 /** Minimum number of bytes which must be available (free) in the receive
   * FIFO before a receive will be queued. This is not just #MAX_PACKET_SIZE
@@ -83,31 +126,114 @@
   * quick succession. */
 #define RECEIVE_HEADROOM			(2 * MAX_PACKET_SIZE)
 
+/** Report ID of the feature report which tells the host how much it is
+  * allowed to send (see getCreditReport()). This is outside the range of
+  * report IDs (1 to 63) used for stream data. */
+#define CREDIT_REPORT_ID			64
+/** Size of the credit feature report, in bytes, not including the report
+  * ID. */
+#define CREDIT_REPORT_LENGTH		8
+/** Report ID of the feature report which contains the current value of the
+  * core timer (see getTimestampReport()). */
+#define TIMESTAMP_REPORT_ID			65
+/** Size of the timestamp feature report, in bytes, not including the report
+  * ID. */
+#define TIMESTAMP_REPORT_LENGTH		4
+/** Number of receive FIFO bytes (including report IDs) which the host may
+  * have outstanding beyond what has been read out of the receive FIFO.
+  * A receive is only queued while at least #RECEIVE_HEADROOM bytes are free,
+  * so the FIFO must hold no more than
+  * #RECEIVE_FIFO_SIZE - #RECEIVE_HEADROOM bytes when each report arrives.
+  * The extra 1 is because every report includes at least its report ID. */
+#define CREDIT_WINDOW				(RECEIVE_FIFO_SIZE - RECEIVE_HEADROOM + 1)
+
 /** The transmit FIFO buffer. */
 volatile CircularBuffer transmit_fifo;
 /** The receive FIFO buffer. */
 volatile CircularBuffer receive_fifo;
 
-/** Storage for the transmit FIFO buffer. */
-static volatile uint8_t transmit_fifo_storage[TRANSMIT_FIFO_SIZE];
-/** Storage for the receive FIFO buffer. */
-static volatile uint8_t receive_fifo_storage[RECEIVE_FIFO_SIZE];
+/** Storage for the transmit FIFO buffer. Packets on the Interrupt IN
+  * endpoint are transmitted directly out of this storage, with the report
+  * ID stored inline, in the byte immediately before the report data.
+  * When the report data begins somewhere in the middle of the FIFO, that
+  * byte is the most recently consumed byte (see #TRANSMIT_FIFO_RESERVE).
+  * When the report data begins at the start of the FIFO, there is no
+  * such byte, so an extra byte is allocated here, in front of the FIFO
+  * storage proper.
+  *
+  * The USB module can only read from a contiguous region, so an extra
+  * #MAX_PACKET_SIZE - 1 bytes are also allocated past the end of the FIFO
+  * storage proper. When a report would wrap around, the bytes after the
+  * wrap point are copied there (see fillTransmitPacketBufferAndTransmit()),
+  * so that reports are always as full as they can be. */
+static volatile uint8_t transmit_fifo_storage[1 + TRANSMIT_FIFO_SIZE + (MAX_PACKET_SIZE - 1)];
+/** Storage for the receive FIFO buffer. Packets on the Interrupt OUT endpoint
+  * are received directly into this storage. Since the USB module can only
+  * write to a contiguous region, an extra #MAX_PACKET_SIZE bytes are
+  * allocated past the end of the FIFO storage proper, so that a packet can
+  * be received across the wrap point (see circularBufferCommitWrite()).
+  *
+  * The contents of the receive FIFO are whole reports, including the report
+  * ID. streamGetOneByte() uses the report ID (which is also the report's
+  * length) to skip over it. */
+static volatile uint8_t receive_fifo_storage[RECEIVE_FIFO_SIZE + MAX_PACKET_SIZE];
 
 /** Flag (non-zero = set, zero = clear) which when set, indicates that a
   * packet has been queued for transmission on the Interrupt IN endpoint. */
 static volatile int interrupt_transmit_queued;
+/** Number of report data bytes (i.e. not including the report ID) in the
+  * packet currently queued for transmission on the Interrupt IN endpoint.
+  * These bytes remain at the front of #transmit_fifo until the packet is
+  * transmitted. This is only valid when #interrupt_transmit_queued is
+  * set. */
+static uint32_t interrupt_transmit_length;
 /** Flag (non-zero = set, zero = clear) which when set, indicates that a
   * packet has been queued for reception on the Interrupt OUT endpoint. */
 static volatile int interrupt_receive_queued;
+/** Where in #receive_fifo_storage the packet queued for reception on the
+  * Interrupt OUT endpoint will go. This is NULL if the packet will go
+  * somewhere else. */
+static uint8_t *interrupt_receive_buffer;
+/** Number of report data bytes remaining in the report at the front of the
+  * receive FIFO. When this is 0, the next byte in the receive FIFO is a
+  * report ID. This is only used by streamGetOneByte(). */
+static uint32_t receive_report_remaining;
+
+/** Transmit coalescing threshold. A report will not be queued on the
+  * Interrupt IN endpoint until there are at least this many bytes in the
+  * transmit FIFO, or until #coalesce_max_latency frames have passed. A value
+  * of 1 or less means that reports are queued as soon as possible. */
+static uint32_t coalesce_threshold;
+/** Maximum number of frames (milliseconds) that bytes will be held back in
+  * the transmit FIFO because of #coalesce_threshold. */
+static uint32_t coalesce_max_latency;
+/** Number of frames that the bytes in the transmit FIFO have been held back
+  * for. */
+static volatile uint32_t coalesce_frames_waited;
+/** Flag (non-zero = set, zero = clear) which, when set, indicates that the
+  * start-of-frame interrupt is enabled, in order to time out held back
+  * bytes. */
+static volatile int coalesce_sof_enabled;
+
+/** Callback which is called (in interrupt context) whenever a report has
+  * been transmitted, to give a layer above this one the chance to write
+  * more bytes to the stream (see streamSetTransmitRefillCallback()). NULL
+  * means no callback. */
+static void (*transmit_refill_callback)(void);
+
+/** Statistics returned by streamGetStatistics(). */
+static HIDStreamStatistics stream_statistics;
 
-/** Persistent packet buffer for packets sent from the Interrupt IN endpoint
-  * (see #TRANSMIT_ENDPOINT_NUMBER). */
-static uint8_t interrupt_packet_buffer[MAX_PACKET_SIZE];
 /** Persistent packet buffer for packets sent from the control endpoint. This
-  * needs to be separate from #interrupt_packet_buffer because both the
-  * Interrupt IN endpoint and control endpoint can be transmitting
-  * simultaneously. */
+  * needs to be separate from #transmit_fifo because both the Interrupt IN
+  * endpoint and control endpoint can be transmitting simultaneously. */
 static uint8_t get_report_packet_buffer[MAX_PACKET_SIZE];
+/** Persistent packet buffer for the credit feature report (see
+  * getCreditReport()). */
+static uint8_t credit_report_packet_buffer[CREDIT_REPORT_LENGTH + 1];
+/** Persistent packet buffer for the timestamp feature report (see
+  * getTimestampReport()). */
+static uint8_t timestamp_report_packet_buffer[TIMESTAMP_REPORT_LENGTH + 1];
 
 /** Persistent endpoint state for the transmit endpoint (with endpoint
   * number #TRANSMIT_ENDPOINT_NUMBER. */
@@ -121,7 +247,7 @@ static EndpointState receive_endpoint_state;
   * something. */
 static const uint8_t null_packet[4];
 
-/** Previous configuration value passed to usbClassSetConfiguration(). This
+/** Previous configuration value passed to hidStreamSetConfiguration(). This
   * is used to detect configuration changes. */
 static uint8_t old_configuration_value;
 
@@ -153,112 +279,162 @@ static uint32_t desired_transmit_report_length;
   * when #do_build_transmit_report is set. */
 static uint32_t current_transmit_report_length;
 
-/** Fill up transmit packet buffer with bytes obtained from the transmit
-  * FIFO buffer, then queue the packet for transmission, if necessary.
+/** Queue a packet for transmission on the Interrupt IN endpoint, using the
+  * bytes at the front of the transmit FIFO as the report data. Usually, no
+  * copying is done; the USB module will read the packet straight out of the
+  * transmit FIFO storage. The report ID is written into the byte just before
+  * the report data. If the report data wraps around the end of the FIFO,
+  * the bytes after the wrap point are copied to the spare bytes past the
+  * end of #transmit_fifo_storage, so that the report still holds as many
+  * bytes as possible.
+  * The transmitted bytes are not removed from the transmit FIFO until the
+  * packet has actually been transmitted (see ep1TransmitCallback()).
+  * \warning This must only be called when there is no packet queued on the
+  *          Interrupt IN endpoint.
   */
 static void fillTransmitPacketBufferAndTransmit(void)
 {
 	uint32_t status;
 	uint32_t count;
-	uint32_t i;
+	uint32_t available;
+	volatile uint8_t *report_data;
 
-	// Put everything in a critical section so that bytes are either in
-	// the transmit FIFO or in interrupt_packet_buffer.
+	// Put everything in a critical section so that interrupt_transmit_queued
+	// and interrupt_transmit_length always agree with the state of the
+	// Interrupt IN endpoint.
 	status = disableInterrupts();
-	i = 1;
-	while ((i < sizeof(interrupt_packet_buffer)) && !isCircularBufferEmpty(&transmit_fifo))
+	available = TRANSMIT_FIFO_SIZE - circularBufferSpaceRemaining(&transmit_fifo);
+	if (available > (MAX_PACKET_SIZE - 1))
 	{
-		// Note that is_irq is set because interrupts are disabled; that's
-		// equivalent to an interrupt request handler context.
-		interrupt_packet_buffer[i] = circularBufferRead(&transmit_fifo, 1);
-		i++;
+		available = MAX_PACKET_SIZE - 1;
 	}
-	count = i - 1;
-	interrupt_packet_buffer[0] = (uint8_t)count;
+	count = circularBufferPeek(&transmit_fifo, &report_data);
+	if (count < available)
+	{
+		// The report data wraps around. The bytes after the wrap point stay
+		// in the FIFO until the packet has been transmitted, so the producer
+		// can't change them while the copy is in use.
+		memcpy((void *)&(transmit_fifo_storage[1 + TRANSMIT_FIFO_SIZE]), (const void *)&(transmit_fifo_storage[1]), available - count);
+	}
+	count = available;
 	if (count > 0)
 	{
+		// The byte before report_data is either the spare byte at the start
+		// of transmit_fifo_storage or a byte which has already been consumed,
+		// so it's safe to overwrite it.
+		report_data[-1] = (uint8_t)count;
+		interrupt_transmit_length = count;
 		// Set transmit_queued before queueing transmit to avoid race
 		// condition where packet is transmitted just after
 		// usbQueueTransmitPacket() call.
 		interrupt_transmit_queued = 1;
-		usbQueueTransmitPacket(interrupt_packet_buffer, count + 1, TRANSMIT_ENDPOINT_NUMBER, 0);
+		usbQueueTransmitPacket((const uint8_t *)&(report_data[-1]), count + 1, TRANSMIT_ENDPOINT_NUMBER, 0);
 	}
 	else
 	{
+		interrupt_transmit_length = 0;
 		interrupt_transmit_queued = 0;
 	}
 	restoreInterrupts(status);
 }
 
-/** Transfer bytes from a receive buffer into receive FIFO.
+/** Queue a packet for transmission on the Interrupt IN endpoint if the
+  * transmit coalescing policy (see streamSetTransmitCoalescing()) allows it.
+  * If the policy doesn't allow it yet, the start-of-frame interrupt is
+  * enabled so that hidStreamStartOfFrame() can try again later.
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler), and only when there is no packet
+  *          queued on the Interrupt IN endpoint.
+  */
+static void transmitIfReady(void)
+{
+	uint32_t pending;
+	uint32_t threshold;
+
+	if (!usbEndpointEnabled(TRANSMIT_ENDPOINT_NUMBER))
+	{
+		// Not configured yet; bytes will wait in the transmit FIFO until
+		// hidStreamSetConfiguration() is called.
+		return;
+	}
+	pending = TRANSMIT_FIFO_SIZE - circularBufferSpaceRemaining(&transmit_fifo);
+	// A report can't hold more than MAX_PACKET_SIZE - 1 bytes, so there's no
+	// point waiting for more than that.
+	threshold = MIN(coalesce_threshold, MAX_PACKET_SIZE - 1);
+	if ((pending > 0) && (pending < threshold) && (coalesce_frames_waited < coalesce_max_latency))
+	{
+		// Hold back bytes, in the hope that more will arrive soon.
+		if (!coalesce_sof_enabled)
+		{
+			coalesce_frames_waited = 0;
+			coalesce_sof_enabled = 1;
+			usbEnableSOFInterrupt(1);
+		}
+	}
+	else
+	{
+		if (coalesce_sof_enabled)
+		{
+			coalesce_sof_enabled = 0;
+			usbEnableSOFInterrupt(0);
+		}
+		coalesce_frames_waited = 0;
+		fillTransmitPacketBufferAndTransmit();
+	}
+}
+
+/** Transfer a report (including its report ID) from a receive buffer into
+  * receive FIFO. This is only needed when the report was not received
+  * directly into the receive FIFO (see queueInterruptReceive()).
   * \warning This assumes there is enough space (if not, usbFatalError() will
   *          be called). There should always be enough space, since a receive
   *          is never queued unless there is enough space.
   */
 static void transferIntoReceiveFIFO(uint8_t *buffer, uint32_t length)
 {
-	uint32_t i;
-
-	if (circularBufferSpaceRemaining(&receive_fifo) < length)
+	if (circularBufferWriteBlock(&receive_fifo, buffer, length) != length)
 	{
 		// This should never happen.
 		usbFatalError();
 	}
-	for (i = 0; i < length; i++)
-	{
-		circularBufferWrite(&receive_fifo, buffer[i], 1);
-	}
 }
 
-/** Remove a byte from the existing queued packet which was intended to be
-  * sent out the Interrupt IN endpoint.
+/** Queue a receive on the Interrupt OUT endpoint, if there is enough space in
+  * the receive FIFO and if one isn't already queued. The packet will be
+  * received directly into the free space of the receive FIFO, so that
+  * ep2ReceiveCallback() doesn't need to copy anything.
   *
-  * This is a hack necessary to have the "Get Report" request work
-  * intuitively. Bytes sent using streamPutOneByte() will, by default, end up
-  * being queued for transmission via. the Interrupt IN endpoint. But if the
-  * host exclusively uses "Get Report" requests (which use the control
-  * endpoint), it will never see bytes queued for transmission via. the
-  * Interrupt IN endpoint. Therefore, there needs to be some way to obtain
-  * bytes from a queued Interrupt IN transmission.
-  * \return The byte that was removed.
-  * \warning This should only be called if there is actually a queued packet.
+  * Nothing will be queued while a "Set Report" request is in progress, since
+  * the report from that request will be written to the same place in the
+  * receive FIFO.
+  * \warning This must be called with interrupts disabled (or from an
+  *          interrupt service handler).
   */
-static uint8_t stealByteFromInterruptReport(void)
+static void queueInterruptReceive(void)
 {
-	uint8_t one_byte;
-	uint32_t count;
-	uint32_t i;
+	volatile uint8_t *free_space;
 
-	// Unqueue current transmit request.
-	if (interrupt_transmit_queued == 0)
+	if (!usbEndpointEnabled(RECEIVE_ENDPOINT_NUMBER)
+		|| interrupt_receive_queued
+		|| expect_control_report)
 	{
-		// This should never happen.
-		usbFatalError();
-	}
-	usbCancelTransmit(TRANSMIT_ENDPOINT_NUMBER);
-	interrupt_transmit_queued = 0;
-	// Remove first report data byte from packet, shifting the rest of the
-	// data to fill the space.
-	count = interrupt_packet_buffer[0];
-	if ((count < 1) || (count > (sizeof(interrupt_packet_buffer) - 1)))
-	{
-		// Bad packet ID; this should never happen.
-		usbFatalError();
-	}
-	one_byte = interrupt_packet_buffer[1];
-	for (i = 1; i < count; i++)
-	{
-		interrupt_packet_buffer[i] = interrupt_packet_buffer[i + 1];
+		return;
 	}
-	count--;
-	interrupt_packet_buffer[0] = (uint8_t)count;
-	// Queue updated transmit packet (if necessary).
-	if (count > 0)
+	// What happens if there isn't enough space in the receive buffer?
+	// Then a receive isn't queued up. This will cause subsequent OUT
+	// transactions to be NAKed, blocking the host. Each
+	// streamGetOneByte() call frees up space in the receive FIFO,
+	// until eventually there is enough space to queue a receive.
+	if (circularBufferSpaceRemaining(&receive_fifo) >= RECEIVE_HEADROOM)
 	{
-		interrupt_transmit_queued = 1;
-		usbQueueTransmitPacket(interrupt_packet_buffer, count + 1, TRANSMIT_ENDPOINT_NUMBER, 0);
+		// The contiguous free space returned by circularBufferPeekFree()
+		// may be less than MAX_PACKET_SIZE, but that's okay because
+		// receive_fifo_storage has room past the end of the FIFO storage.
+		circularBufferPeekFree(&receive_fifo, &free_space);
+		interrupt_receive_buffer = (uint8_t *)free_space;
+		interrupt_receive_queued = 1;
+		usbQueueReceivePacketToBuffer(RECEIVE_ENDPOINT_NUMBER, interrupt_receive_buffer, MAX_PACKET_SIZE);
 	}
-	return one_byte;
 }
 
 /** Incrementally build a report to send via. the control endpoint. This is
@@ -303,7 +479,22 @@ void ep1ReceiveCallback(uint8_t *packet_buffer, uint32_t length, unsigned int is
   * IN endpoint (endpoint number #TRANSMIT_ENDPOINT_NUMBER). */
 void ep1TransmitCallback(void)
 {
-	fillTransmitPacketBufferAndTransmit();
+	// The packet has been transmitted, so its report data can finally be
+	// released from the transmit FIFO.
+	circularBufferCommitRead(&transmit_fifo, interrupt_transmit_length);
+	stream_statistics.callbacks++;
+	stream_statistics.reports_transmitted++;
+	stream_statistics.bytes_transmitted += interrupt_transmit_length;
+	interrupt_transmit_length = 0;
+	// This is called while interrupt_transmit_queued is still set, so that
+	// anything the callback writes doesn't get queued by
+	// streamWriteNonBlocking(); transmitIfReady() below does that.
+	if (transmit_refill_callback != NULL)
+	{
+		transmit_refill_callback();
+	}
+	interrupt_transmit_queued = 0;
+	transmitIfReady();
 }
 
 /** Callback which is called whenever a packet is received on the Interrupt
@@ -331,21 +522,26 @@ void ep2ReceiveCallback(uint8_t *packet_buffer, uint32_t length, unsigned int is
 	}
 	else
 	{
-		transferIntoReceiveFIFO(&(packet_buffer[1]), length - 1);
-		// What happens if there isn't enough space in the receive buffer?
-		// Then a receive isn't queued up. This will cause subsequent OUT
-		// transactions to be NAKed, blocking the host. Each
-		// streamGetOneByte() call frees up space in the receive FIFO,
-		// until eventually there is enough space to queue a receive.
-		if (circularBufferSpaceRemaining(&receive_fifo) >= RECEIVE_HEADROOM)
+		stream_statistics.callbacks++;
+		stream_statistics.reports_received++;
+		stream_statistics.bytes_received += length - 1;
+		interrupt_receive_queued = 0;
+		if (packet_buffer == interrupt_receive_buffer)
 		{
-			interrupt_receive_queued = 1;
-			usbQueueReceivePacket(RECEIVE_ENDPOINT_NUMBER);
+			// The packet was received directly into the receive FIFO, so
+			// there's nothing to copy.
+			circularBufferCommitWrite(&receive_fifo, length);
 		}
 		else
 		{
-			interrupt_receive_queued = 0;
+			// The first receive after the endpoint is enabled goes into
+			// the endpoint state's own receive buffer (see
+			// usbEnableEndpoint()).
+			transferIntoReceiveFIFO(packet_buffer, length);
 		}
+		interrupt_receive_buffer = NULL;
+		queueInterruptReceive();
+		signalEvents(EVENT_STREAM_RECEIVED);
 	}
 }
 
@@ -400,6 +596,8 @@ static void getDescriptor(uint8_t type, uint8_t index, uint16_t lang_id, uint16_
   */
 static void getReport(uint8_t report_id, uint16_t length)
 {
+	uint32_t count;
+
 	usbControlNextStage();
 	if ((length < 1) || (length > MAX_PACKET_SIZE))
 	{
@@ -416,29 +614,37 @@ static void getReport(uint8_t report_id, uint16_t length)
 	else
 	{
 		// Build a report and send it.
-		do_build_transmit_report = 1;
-		current_transmit_report_length = 0;
+		// Bytes sent using streamPutOneByte() will, by default, end up being
+		// queued for transmission via. the Interrupt IN endpoint. But if the
+		// host exclusively uses "Get Report" requests (which use the control
+		// endpoint), it will never see those bytes. Therefore the bytes of
+		// any queued Interrupt IN packet need to go into this report. Since
+		// that packet is transmitted straight out of the transmit FIFO, its
+		// bytes are still at the front of the transmit FIFO; all that needs
+		// to be done is to cancel its transmission. This is safe because
+		// this is the Setup stage of a control transfer.
+		if (interrupt_transmit_queued)
+		{
+			usbCancelTransmit(TRANSMIT_ENDPOINT_NUMBER);
+			interrupt_transmit_queued = 0;
+			interrupt_transmit_length = 0;
+		}
+		get_report_packet_buffer[0] = report_id;
+		count = circularBufferReadBlock(&transmit_fifo, &(get_report_packet_buffer[1]), length - 1);
+		current_transmit_report_length = count + 1;
 		desired_transmit_report_length = length;
-		buildTransmitReport(report_id);
-		// Two ways this loop can end:
-		// 1. The report length reaches the desired length, in which case the
-		//    report is sent and do_build_transmit_report is set to 0.
-		// 2. The transmit interrupt report buffer is emptied, in which
-		//    case interrupt_transmit_queued will be set to 0. Further bytes
-		//    will have to come from somewhere else.
-		while (interrupt_transmit_queued && do_build_transmit_report)
+		if (current_transmit_report_length == desired_transmit_report_length)
 		{
-			buildTransmitReport(stealByteFromInterruptReport());
+			// Got desired size, send it.
+			usbQueueTransmitPacket(get_report_packet_buffer, desired_transmit_report_length, CONTROL_ENDPOINT_NUMBER, 0);
+			do_build_transmit_report = 0;
 		}
-		// Two ways this loop can end:
-		// 1. The report length reaches the desired length, in which case the
-		//    report is sent and do_build_transmit_report is set to 0.
-		// 2. The transmit FIFO is emptied before the report reaches the
-		//    desired size, so nothing is sent and do_build_transmit_report
-		//    remains set. streamPutOneByte() will handle the rest.
-		while (!isCircularBufferEmpty(&transmit_fifo) && do_build_transmit_report)
+		else
 		{
-			buildTransmitReport(circularBufferRead(&transmit_fifo, 1));
+			// The transmit FIFO was emptied before the report reached the
+			// desired size, so nothing is sent yet. streamPutOneByte() will
+			// handle the rest.
+			do_build_transmit_report = 1;
 		}
 		// If the control request ate up the entire interrupt transmit
 		// report but left the transmit FIFO full, streamPutOneByte() will
@@ -448,11 +654,85 @@ static void getReport(uint8_t report_id, uint16_t length)
 		// transmit if there is anything in the transmit FIFO.
 		if (!interrupt_transmit_queued)
 		{
-			fillTransmitPacketBufferAndTransmit();
+			transmitIfReady();
 		}
 	}
 }
 
+/** Write a 32 bit integer into a buffer, in little-endian format.
+  * \param buffer The buffer to write into. This must have space for at
+  *               least 4 bytes.
+  * \param value The integer to write.
+  */
+static void writeU32LittleEndian(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = (uint8_t)value;
+	buffer[1] = (uint8_t)(value >> 8);
+	buffer[2] = (uint8_t)(value >> 16);
+	buffer[3] = (uint8_t)(value >> 24);
+}
+
+/** HID class-specific "Get Report" request for the credit feature report
+  * (report ID #CREDIT_REPORT_ID). This implements the device side of
+  * credit-based flow control. The report contains two free-running 32 bit
+  * little-endian counters, which count receive FIFO bytes (including
+  * report IDs):
+  * - Bytes 0 to 3: the number of bytes received so far. The host should
+  *   copy this into its own count of bytes sent when it starts using
+  *   credit, while it has no reports in flight.
+  * - Bytes 4 to 7: the credit limit. The host may send a report of n data
+  *   bytes on the Interrupt OUT endpoint as long as its count of bytes sent
+  *   plus n + 1 does not exceed the credit limit. Once it runs out, it
+  *   should get this report again (which can be done at any time).
+  *
+  * The credit limit only ever increases (modulo 2 ^ 32), as the firmware
+  * reads from the stream. Reports sent using "Set Report" requests are not
+  * covered by this scheme.
+  * \param length Length, in bytes, of the report (including report ID).
+  */
+static void getCreditReport(uint16_t length)
+{
+	usbControlNextStage();
+	if (length < 1)
+	{
+		// Reports must have at least one byte for the report ID.
+		usbControlProtocolStall();
+	}
+	else
+	{
+		// This is called from the USB interrupt service handler, so the
+		// two counters are consistent with each other.
+		credit_report_packet_buffer[0] = CREDIT_REPORT_ID;
+		writeU32LittleEndian(&(credit_report_packet_buffer[1]), receive_fifo.head);
+		writeU32LittleEndian(&(credit_report_packet_buffer[5]), receive_fifo.tail + CREDIT_WINDOW);
+		usbQueueTransmitPacket(credit_report_packet_buffer, MIN(length, sizeof(credit_report_packet_buffer)), CONTROL_ENDPOINT_NUMBER, 0);
+	}
+}
+
+/** HID class-specific "Get Report" request for the timestamp feature report
+  * (report ID #TIMESTAMP_REPORT_ID). The report contains the value of the
+  * core timer (see getCoreTimer()) when the request was handled, as a
+  * 32 bit little-endian number. The host can use this to measure round-trip
+  * latency through the control endpoint and to relate device timestamps to
+  * its own clock.
+  * \param length Length, in bytes, of the report (including report ID).
+  */
+static void getTimestampReport(uint16_t length)
+{
+	usbControlNextStage();
+	if (length < 1)
+	{
+		// Reports must have at least one byte for the report ID.
+		usbControlProtocolStall();
+	}
+	else
+	{
+		timestamp_report_packet_buffer[0] = TIMESTAMP_REPORT_ID;
+		writeU32LittleEndian(&(timestamp_report_packet_buffer[1]), getCoreTimer());
+		usbQueueTransmitPacket(timestamp_report_packet_buffer, MIN(length, sizeof(timestamp_report_packet_buffer)), CONTROL_ENDPOINT_NUMBER, 0);
+	}
+}
+
 /** HID class-specific "Set Report" request, as defined in section 7.2.2
   * of the HID specification. This is an alternative way for the host to
   * send reports to a device, as opposed to the usual method writing to
@@ -480,6 +760,20 @@ static void setReport(uint8_t report_id, uint16_t length)
 		usbControlNextStage();
 		expected_control_report_id = report_id;
 		expect_control_report = 1;
+		// The Interrupt OUT endpoint receives directly into the receive FIFO,
+		// at the same place where the report from this request will be
+		// written. So it must not be left queued. It's safe to cancel the
+		// receive here because this is the Setup stage. If there's nothing to
+		// cancel, then a packet may have just been received; that will be
+		// handled (in order) before the Data stage of this request.
+		if (interrupt_receive_queued)
+		{
+			if (usbCancelReceive(RECEIVE_ENDPOINT_NUMBER))
+			{
+				interrupt_receive_queued = 0;
+				interrupt_receive_buffer = NULL;
+			}
+		}
 		if (circularBufferSpaceRemaining(&receive_fifo) < RECEIVE_HEADROOM)
 		{
 			// Not enough space in receive FIFO to handle request.
@@ -510,7 +804,7 @@ static void setReport(uint8_t report_id, uint16_t length)
   *         handled (i.e. the request did not match any supported
   *         class-specific request).
   */
-unsigned int usbClassHandleControlSetup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+static unsigned int hidStreamHandleControlSetup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
 {
 	if ((bmRequestType == 0x81) && (bRequest == GET_DESCRIPTOR))
 	{
@@ -521,6 +815,18 @@ unsigned int usbClassHandleControlSetup(uint8_t bmRequestType, uint8_t bRequest,
 	{
 		getReport((uint8_t)wValue, wLength);
 	}
+	else if ((bmRequestType == 0xa1) && (bRequest == GET_REPORT)
+			&& ((uint8_t)(wValue >> 8) == REPORT_TYPE_FEATURE)
+			&& ((uint8_t)wValue == CREDIT_REPORT_ID) && (wIndex == 0))
+	{
+		getCreditReport(wLength);
+	}
+	else if ((bmRequestType == 0xa1) && (bRequest == GET_REPORT)
+			&& ((uint8_t)(wValue >> 8) == REPORT_TYPE_FEATURE)
+			&& ((uint8_t)wValue == TIMESTAMP_REPORT_ID) && (wIndex == 0))
+	{
+		getTimestampReport(wLength);
+	}
 	else if ((bmRequestType == 0x21) && (bRequest == SET_REPORT)
 			&& ((uint8_t)(wValue >> 8) == REPORT_TYPE_OUTPUT) && (wIndex == 0))
 	{
@@ -542,7 +848,7 @@ unsigned int usbClassHandleControlSetup(uint8_t bmRequestType, uint8_t bRequest,
   * \return Zero if the data was accepted, non-zero if the data was not
   *         handled (i.e. the class driver did not expect any data).
   */
-unsigned int usbClassHandleControlData(uint8_t *packet_buffer, uint32_t length)
+static unsigned int hidStreamHandleControlData(uint8_t *packet_buffer, uint32_t length)
 {
 	if (expect_control_report)
 	{
@@ -559,7 +865,12 @@ unsigned int usbClassHandleControlData(uint8_t *packet_buffer, uint32_t length)
 			else
 			{
 				usbControlNextStage();
-				transferIntoReceiveFIFO(&(packet_buffer[1]), length - 1);
+				transferIntoReceiveFIFO(packet_buffer, length);
+				expect_control_report = 0;
+				queueInterruptReceive();
+				// Tasks waiting for data (see remoteCommandTask() in main.c)
+				// don't poll, so they must hear about this report too.
+				signalEvents(EVENT_STREAM_RECEIVED);
 				// Send success packet.
 				usbQueueTransmitPacket(null_packet, 0, CONTROL_ENDPOINT_NUMBER, 0);
 			}
@@ -580,11 +891,14 @@ unsigned int usbClassHandleControlData(uint8_t *packet_buffer, uint32_t length)
 /** This will be called whenever a control transfer needs to be aborted (for
   * any reason, including reset). This allows class drivers to reset their
   * control transfer-specific state. */
-void usbClassAbortControlTransfer(void)
+static void hidStreamAbortControlTransfer(void)
 {
 	do_control_receive_queue = 0;
 	expect_control_report = 0;
 	do_build_transmit_report = 0;
+	// If a "Set Report" request was aborted, the Interrupt OUT endpoint
+	// won't have been requeued.
+	queueInterruptReceive();
 }
 
 /** Callback which will be called whenever a successful "Set Configuration"
@@ -594,33 +908,147 @@ void usbClassAbortControlTransfer(void)
   * \param new_configuration_value 0 means unconfigure device, 1 means
   *                                configure device.
   */
-void usbClassSetConfiguration(uint8_t new_configuration_value)
+static void hidStreamSetConfiguration(uint8_t new_configuration_value)
 {
 	if ((old_configuration_value == 0) && (new_configuration_value != 0))
 	{
 		// Transition from unconfigured to configured.
 		interrupt_transmit_queued = 0;
+		interrupt_transmit_length = 0;
 		interrupt_receive_queued = 1;
+		interrupt_receive_buffer = NULL;
 		usbEnableEndpoint(TRANSMIT_ENDPOINT_NUMBER, IN_ENDPOINT, &transmit_endpoint_state);
 		usbEnableEndpoint(RECEIVE_ENDPOINT_NUMBER, OUT_ENDPOINT, &receive_endpoint_state);
+		// Send anything that was written before the device was configured.
+		transmitIfReady();
 	}
 	else if ((old_configuration_value != 0) && (new_configuration_value == 0))
 	{
 		// Transition from configured to unconfigured.
 		usbDisableEndpoint(TRANSMIT_ENDPOINT_NUMBER);
 		usbDisableEndpoint(RECEIVE_ENDPOINT_NUMBER);
+		// Any packet which was queued but not transmitted remains in the
+		// transmit FIFO, and will be transmitted after reconfiguration.
 		interrupt_transmit_queued = 0;
+		interrupt_transmit_length = 0;
 		interrupt_receive_queued = 0;
-		usbClassAbortControlTransfer(); // will reset state
+		interrupt_receive_buffer = NULL;
+		if (coalesce_sof_enabled)
+		{
+			coalesce_sof_enabled = 0;
+			usbEnableSOFInterrupt(0);
+		}
+		hidStreamAbortControlTransfer(); // will reset state
 	}
 	old_configuration_value = new_configuration_value;
 }
 
 /** This will be called whenever a USB reset is seen. This callback gives
   * class drivers the opportunity to reset their state. */
-void usbClassResetSeen(void)
+static void hidStreamResetSeen(void)
 {
-	usbClassSetConfiguration(0);
+	hidStreamSetConfiguration(0);
+}
+
+/** This will be called at the start of every frame, while transmit coalescing
+  * is holding back bytes (see transmitIfReady()). It's used to enforce the
+  * maximum latency set by streamSetTransmitCoalescing(). */
+static void hidStreamStartOfFrame(void)
+{
+	stream_statistics.callbacks++;
+	coalesce_frames_waited++;
+	if (!interrupt_transmit_queued)
+	{
+		transmitIfReady();
+	}
+}
+
+/** Class driver callbacks for the HID stream interface. usb_composite.c
+  * calls these. */
+const USBClassDriver hid_stream_class_driver = {
+	&hidStreamHandleControlSetup,
+	&hidStreamHandleControlData,
+	&hidStreamAbortControlTransfer,
+	&hidStreamSetConfiguration,
+	NULL,
+	&hidStreamResetSeen,
+	&hidStreamStartOfFrame
+};
+
+/** Set the transmit coalescing policy. Bytes written to the stream are held
+  * back until there are enough of them to fill a report of the specified
+  * size, or until the specified number of frames have passed, whichever
+  * happens first. This greatly improves the efficiency (measured in bytes
+  * per report) of the stream when lots of small writes are done, at the cost
+  * of some latency. While bytes are being held back, the start-of-frame
+  * interrupt is enabled, so the CPU is woken up every millisecond.
+  * Coalescing is disabled until this is called.
+  * \param threshold Number of bytes to wait for before queueing a report.
+  *                  Use 1 (or 0) to disable coalescing, so that reports are
+  *                  queued as soon as possible.
+  * \param max_latency Maximum number of frames (milliseconds) to hold back
+  *                    bytes for.
+  */
+void streamSetTransmitCoalescing(uint32_t threshold, uint32_t max_latency)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	coalesce_threshold = threshold;
+	coalesce_max_latency = max_latency;
+	if (!interrupt_transmit_queued)
+	{
+		transmitIfReady();
+	}
+	restoreInterrupts(status);
+}
+
+/** Set a callback which is called (in interrupt context) every time a
+  * report has been transmitted on the Interrupt IN endpoint. The callback
+  * can write more bytes to the stream using streamWriteNonBlocking(). This
+  * allows a layer above the stream to decide what goes into each report
+  * at the last possible moment, instead of committing bytes to the transmit
+  * FIFO long before they are sent.
+  * \param callback The callback, or NULL to remove the callback.
+  */
+void streamSetTransmitRefillCallback(void (*callback)(void))
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	transmit_refill_callback = callback;
+	restoreInterrupts(status);
+}
+
+/** Get the number of bytes which have been written to the stream but have
+  * not yet been transmitted.
+  * \return Number of bytes in the transmit FIFO.
+  */
+uint32_t streamTransmitPending(void)
+{
+	return TRANSMIT_FIFO_SIZE - circularBufferSpaceRemaining(&transmit_fifo);
+}
+
+/** Get statistics about the HID stream.
+  * \param statistics The current statistics will be written here.
+  */
+void streamGetStatistics(HIDStreamStatistics *statistics)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	*statistics = stream_statistics;
+	restoreInterrupts(status);
+}
+
+/** Reset all HID stream statistics to zero. */
+void streamClearStatistics(void)
+{
+	uint32_t status;
+
+	status = disableInterrupts();
+	memset(&stream_statistics, 0, sizeof(stream_statistics));
+	restoreInterrupts(status);
 }
 
 /** Initialise HID stream driver. This must be called before connecting the
@@ -630,47 +1058,36 @@ void usbClassResetSeen(void)
 void usbHIDStreamInit(void)
 {
 	old_configuration_value = 0;
-	usbClassAbortControlTransfer(); // will reset state
-	initCircularBuffer(&transmit_fifo, transmit_fifo_storage, TRANSMIT_FIFO_SIZE);
+	coalesce_threshold = DEFAULT_COALESCE_THRESHOLD;
+	coalesce_max_latency = DEFAULT_COALESCE_MAX_LATENCY;
+	coalesce_frames_waited = 0;
+	coalesce_sof_enabled = 0;
+	transmit_refill_callback = NULL;
+	memset(&stream_statistics, 0, sizeof(stream_statistics));
+	hidStreamAbortControlTransfer(); // will reset state
+	// The first byte of transmit_fifo_storage is reserved for the report ID
+	// of packets which begin at the start of the FIFO.
+	initCircularBuffer(&transmit_fifo, &(transmit_fifo_storage[1]), TRANSMIT_FIFO_SIZE);
 	initCircularBuffer(&receive_fifo, receive_fifo_storage, RECEIVE_FIFO_SIZE);
+	receive_report_remaining = 0;
 	transmit_endpoint_state.receiveCallback = &ep1ReceiveCallback;
 	transmit_endpoint_state.transmitCallback = &ep1TransmitCallback;
 	receive_endpoint_state.receiveCallback = &ep2ReceiveCallback;
 	receive_endpoint_state.transmitCallback = &ep2TransmitCallback;
 }
 
-/** Grab one byte from the communication stream. There is no way for this
-  * function to indicate a read error. This is intentional; it
-  * makes program flow simpler (no need to put checks everywhere). As a
-  * consequence, this function should only return if the received byte is
-  * free of read errors.
-  *
-  * Previously, if a read or write error occurred, processPacket() would
-  * return, an error message would be displayed and execution would halt.
-  * There is no reason why this couldn't be done inside streamGetOneByte()
-  * or streamPutOneByte(). So nothing was lost by omitting the ability to
-  * indicate read or write errors.
-  *
-  * Perhaps the argument can be made that if this function indicated read
-  * errors, the caller could attempt some sort of recovery. Perhaps
-  * processPacket() could send something to request the retransmission of
-  * a packet. But retransmission requests are something which can be dealt
-  * with by the implementation of the stream. Thus a caller of
-  * streamGetOneByte() will assume that the implementation handles things
-  * like automatic repeat request, flow control and error detection and that
-  * if a true "stream read error" occurs, the communication link is shot to
-  * bits and nothing the caller can do will fix that.
-  * \return The received byte.
+/** Queue a receive on the control endpoint or Interrupt OUT endpoint, if
+  * there is now enough space in the receive FIFO. This should be called
+  * after removing bytes from the receive FIFO.
   */
-uint8_t streamGetOneByte(void)
+static void updateReceiveQueue(void)
 {
 	uint32_t status;
-	uint8_t one_byte;
 
-	one_byte = circularBufferRead(&receive_fifo, 0);
 	// It's probably safe to leave interrupts enabled, but just to be sure,
 	// disable them so that no race conditions can occur.
 	status = disableInterrupts();
+	stream_statistics.critical_sections++;
 	// Control transfers take precedence over interrupt transfers, because
 	// a control transfer will block all subsequent control transfers, which
 	// would make device reconfiguration difficult.
@@ -682,63 +1099,210 @@ uint8_t streamGetOneByte(void)
 			usbQueueReceivePacket(CONTROL_ENDPOINT_NUMBER);
 		}
 	}
-	else if (!interrupt_receive_queued)
+	else
 	{
-		if (circularBufferSpaceRemaining(&receive_fifo) >= RECEIVE_HEADROOM)
+		queueInterruptReceive();
+	}
+	restoreInterrupts(status);
+}
+
+/** Grab bytes from the communication stream, without blocking. This reads
+  * as many bytes as are currently available, up to the specified length.
+  * The receive queue is only updated once per call, so reading a large
+  * buffer with this is much more efficient than repeatedly calling
+  * streamGetOneByte().
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The maximum number of bytes to read.
+  * \return The number of bytes actually read. This may be less than length
+  *         (including 0) if fewer bytes were available.
+  */
+uint32_t streamReadNonBlocking(uint8_t *buffer, uint32_t length)
+{
+	uint32_t done;
+	uint32_t wanted;
+	uint32_t got;
+
+	done = 0;
+	while (done < length)
+	{
+		if (receive_report_remaining == 0)
+		{
+			if (isCircularBufferEmpty(&receive_fifo))
+			{
+				break;
+			}
+			// Each report in the receive FIFO begins with its report ID,
+			// which is the number of data bytes in the report.
+			receive_report_remaining = circularBufferRead(&receive_fifo, 0);
+		}
+		else
 		{
-			interrupt_receive_queued = 1;
-			usbQueueReceivePacket(RECEIVE_ENDPOINT_NUMBER);
+			wanted = MIN(receive_report_remaining, length - done);
+			got = circularBufferReadBlock(&receive_fifo, &(buffer[done]), wanted);
+			done += got;
+			receive_report_remaining -= got;
+			if (got < wanted)
+			{
+				break; // receive FIFO is empty
+			}
 		}
 	}
-	restoreInterrupts(status);
-	return one_byte;
+	updateReceiveQueue();
+	return done;
 }
 
-/** Send one byte to the communication stream. There is no way for this
-  * function to indicate a write error. This is intentional; it
-  * makes program flow simpler (no need to put checks everywhere). As a
-  * consequence, this function should only return if the byte was sent
-  * free of write errors.
-  *
-  * See streamGetOneByte() for some justification about why write errors
-  * aren't indicated by a return value.
-  * \param one_byte The byte to send.
+/** Grab bytes from the communication stream. This will block until exactly
+  * length bytes have been read. See streamGetOneByte() for why there is no
+  * way for this to indicate a read error.
+  * \param buffer The received bytes will be written here. This must have
+  *               space for at least length bytes.
+  * \param length The number of bytes to read.
   */
-void streamPutOneByte(uint8_t one_byte)
+void streamRead(uint8_t *buffer, uint32_t length)
 {
 	uint32_t status;
+	uint32_t done;
+	uint32_t got;
 
-	// Ensure that there is space in the transmit FIFO so that the call to
-	// circularBufferWrite() below cannot fail.
-	while (isCircularBufferFull(&transmit_fifo))
+	done = 0;
+	while (done < length)
 	{
-		enterIdleMode();
+		// If nothing can be done, idle until something happens. Interrupts
+		// are disabled from the attempt until then, so that nothing can
+		// happen unnoticed in between (see idleWithInterruptsDisabled()).
+		status = disableInterrupts();
+		got = streamReadNonBlocking(&(buffer[done]), length - done);
+		done += got;
+		if (got == 0)
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
 	}
+}
+
+/** Send bytes to the communication stream, without blocking. This writes as
+  * many bytes as there is space for, up to the specified length. Transmit
+  * queueing is only done once per call, so writing a large buffer with this
+  * is much more efficient than repeatedly calling streamPutOneByte(). It
+  * also means that the bytes can be grouped into fuller reports.
+  * \param buffer The bytes to send.
+  * \param length The maximum number of bytes to send.
+  * \return The number of bytes actually sent. This may be less than length
+  *         (including 0) if there wasn't enough space in the transmit FIFO.
+  */
+uint32_t streamWriteNonBlocking(const uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+	uint32_t space;
+
+	done = 0;
 	// Everything below is in a critical section to avoid race conditions
 	// with the "Get Report" request.
 	status = disableInterrupts();
-	if (do_build_transmit_report)
+	stream_statistics.critical_sections++;
+	while ((done < length) && do_build_transmit_report)
 	{
 		// Keep adding bytes to the transmit report until it reaches the
 		// desired length.
-		buildTransmitReport(one_byte);
+		buildTransmitReport(buffer[done]);
+		done++;
 	}
-	else
+	space = circularBufferSpaceRemaining(&transmit_fifo);
+	if (space > TRANSMIT_FIFO_RESERVE)
 	{
-		// Since transmitted bytes are fed to this function one-at-a-time,
-		// there's no way to determine whether there are bytes after this one
-		// or not. So this function will just transmit the first byte in a
-		// packet all by itself (which isn't very efficient). If there are
-		// bytes immediately after this one, they will queue up in the transmit
-		// FIFO, where they will be efficiently grouped into a packet by
-		// ep1TransmitCallback().
-		// Note that is_irq is set because interrupts are disabled; that's
-		// equivalent to an interrupt request handler context.
-		circularBufferWrite(&transmit_fifo, one_byte, 1);
+		space -= TRANSMIT_FIFO_RESERVE;
+		done += circularBufferWriteBlock(&transmit_fifo, &(buffer[done]), MIN(space, length - done));
 	}
 	if (!interrupt_transmit_queued)
 	{
-		fillTransmitPacketBufferAndTransmit();
+		transmitIfReady();
 	}
 	restoreInterrupts(status);
+	return done;
+}
+
+/** Send bytes to the communication stream. This will block until all length
+  * bytes have been sent (or at least, queued for sending). See
+  * streamPutOneByte() for why there is no way for this to indicate a
+  * write error.
+  * \param buffer The bytes to send.
+  * \param length The number of bytes to send.
+  */
+void streamWrite(const uint8_t *buffer, uint32_t length)
+{
+	uint32_t status;
+	uint32_t done;
+	uint32_t got;
+
+	done = 0;
+	while (done < length)
+	{
+		// See streamRead() for why this idles with interrupts disabled.
+		status = disableInterrupts();
+		got = streamWriteNonBlocking(&(buffer[done]), length - done);
+		done += got;
+		if (got == 0)
+		{
+			idleWithInterruptsDisabled();
+		}
+		restoreInterrupts(status);
+	}
+}
+
+/** Grab one byte from the communication stream. There is no way for this
+  * function to indicate a read error. This is intentional; it
+  * makes program flow simpler (no need to put checks everywhere). As a
+  * consequence, this function should only return if the received byte is
+  * free of read errors.
+  *
+  * Previously, if a read or write error occurred, processPacket() would
+  * return, an error message would be displayed and execution would halt.
+  * There is no reason why this couldn't be done inside streamGetOneByte()
+  * or streamPutOneByte(). So nothing was lost by omitting the ability to
+  * indicate read or write errors.
+  *
+  * Perhaps the argument can be made that if this function indicated read
+  * errors, the caller could attempt some sort of recovery. Perhaps
+  * processPacket() could send something to request the retransmission of
+  * a packet. But retransmission requests are something which can be dealt
+  * with by the implementation of the stream. Thus a caller of
+  * streamGetOneByte() will assume that the implementation handles things
+  * like automatic repeat request, flow control and error detection and that
+  * if a true "stream read error" occurs, the communication link is shot to
+  * bits and nothing the caller can do will fix that.
+  * \return The received byte.
+  */
+uint8_t streamGetOneByte(void)
+{
+	uint8_t one_byte;
+
+	streamRead(&one_byte, 1);
+	return one_byte;
+}
+
+/** Send one byte to the communication stream. There is no way for this
+  * function to indicate a write error. This is intentional; it
+  * makes program flow simpler (no need to put checks everywhere). As a
+  * consequence, this function should only return if the byte was sent
+  * free of write errors.
+  *
+  * See streamGetOneByte() for some justification about why write errors
+  * aren't indicated by a return value.
+  *
+  * Since transmitted bytes are fed to this function one-at-a-time, there's
+  * no way to determine whether there are bytes after this one or not. So
+  * unless transmit coalescing is enabled (see streamSetTransmitCoalescing()),
+  * this function will just transmit the first byte in a packet all by itself
+  * (which isn't very efficient). If there are bytes immediately after this
+  * one, they will queue up in the transmit FIFO, where they will be
+  * efficiently grouped into a packet by ep1TransmitCallback(). Where
+  * possible, use streamWrite() instead.
+  * \param one_byte The byte to send.
+  */
+void streamPutOneByte(uint8_t one_byte)
+{
+	streamWrite(&one_byte, 1);
 }
@@ -8,7 +8,51 @@
 #ifndef USB_HID_STREAM_H
 #define	USB_HID_STREAM_H
 
+#include <stdint.h>
+#include "usb_composite.h"
+
+/** Statistics about the HID stream, which can be used to measure how
+  * efficiently it is using the USB bus and the CPU. To benchmark the
+  * stream, clear the statistics, push a known number of bytes through it
+  * (timing this with the core timer) and then divide these counters by the
+  * number of kilobytes transferred. */
+typedef struct HIDStreamStatisticsStruct
+{
+	/** Number of reports which have been transmitted on the Interrupt IN
+	  * endpoint. */
+	uint32_t reports_transmitted;
+	/** Number of report data bytes (i.e. not including report IDs) which
+	  * have been transmitted on the Interrupt IN endpoint. Divide this by
+	  * #reports_transmitted to get the average report fill. */
+	uint32_t bytes_transmitted;
+	/** Number of reports which have been received on the Interrupt OUT
+	  * endpoint. */
+	uint32_t reports_received;
+	/** Number of report data bytes (i.e. not including report IDs) which
+	  * have been received on the Interrupt OUT endpoint. */
+	uint32_t bytes_received;
+	/** Number of endpoint and start-of-frame callbacks (i.e. calls from
+	  * the USB interrupt service handler) which the stream has handled. */
+	uint32_t callbacks;
+	/** Number of times the stream API (streamRead(), streamWrite() and
+	  * friends) has disabled interrupts. */
+	uint32_t critical_sections;
+} HIDStreamStatistics;
+
+extern const USBClassDriver hid_stream_class_driver;
+
 extern void usbHIDStreamInit(void);
+extern void streamSetTransmitCoalescing(uint32_t threshold, uint32_t max_latency);
+extern void streamSetTransmitRefillCallback(void (*callback)(void));
+extern uint32_t streamTransmitPending(void);
+extern void streamGetStatistics(HIDStreamStatistics *statistics);
+extern void streamClearStatistics(void);
+extern uint8_t streamGetOneByte(void);
+extern void streamPutOneByte(uint8_t one_byte);
+extern uint32_t streamReadNonBlocking(uint8_t *buffer, uint32_t length);
+extern void streamRead(uint8_t *buffer, uint32_t length);
+extern uint32_t streamWriteNonBlocking(const uint8_t *buffer, uint32_t length);
+extern void streamWrite(const uint8_t *buffer, uint32_t length);
 
 #endif	// #ifndef USB_HID_STREAM_H
 
@@ -7,8 +7,8 @@
   * facilitate device enumeration and are described in chapter 9 of the
   * USB specification. This file handles those standard requests. It handles
   * a next-to-minimal set of requests: Clear Feature (endpoint halt only),
-  * Get Configuration, Get Descriptor, Get Status, Set Address,
-  * Set Configuration and Set Feature (endpoint halt only).
+  * Get Configuration, Get Descriptor, Get Interface, Get Status, Set Address,
+  * Set Configuration, Set Feature (endpoint halt only) and Set Interface.
   *
   * Some notes about the implemented requests:
   * - Set/Get Configuration, Get Descriptor and Set Address are essential
@@ -21,8 +21,11 @@
   * - Clear Feature, Set Feature and Get Status are required to implement
   *   the "endpoint halt" feature, which is required for interrupt
   *   endpoints (see section 9.4.5 of the USB specification).
-  * - Only a single configuration (with configuration value = 1) and a single
-  *   interface is supported.
+  * - Only a single configuration (with configuration value = 1) is
+  *   supported. That configuration may have several interfaces (see
+  *   usb_composite.c). Get Interface and Set Interface are implemented
+  *   because some interfaces have alternate settings; the class drivers
+  *   decide which alternate settings are valid.
   *
   * All references to the "USB specification" refer to revision 2.0, obtained
   * from http://www.usb.org/developers/docs/usb_20_110512.zip (see usb_20.pdf)
@@ -75,6 +78,10 @@ static const uint8_t null_packet[4];
   * "Status stage" of the control transfer. */
 static uint8_t status_packet[2];
 
+/** Transmit buffer for sending the results of a "Get Interface" request (see
+  * getInterface()). */
+static uint8_t interface_packet[1];
+
 /** If this is non-zero, then the device address will be switched
   * to #new_address upon the completion of the next Status stage. */
 static unsigned int do_set_new_address;
@@ -306,6 +313,51 @@ static void getConfiguration(void)
 	usbQueueTransmitPacket(&current_configuration_value, 1, CONTROL_ENDPOINT_NUMBER, 0);
 }
 
+/** "Get Interface" request, as defined in section 9.4.4 of the USB
+  * specification. The host can use this to determine which alternate
+  * setting of an interface is selected.
+  * \param interface The interface number to query.
+  */
+static void getInterface(uint16_t interface)
+{
+	if ((current_configuration_value == 0)
+		|| usbClassGetInterface(interface, &(interface_packet[0])))
+	{
+		// Section 9.4.4 of the USB specification says that this request is
+		// invalid when the device isn't configured or when the interface
+		// doesn't exist.
+		usbControlProtocolStall();
+	}
+	else
+	{
+		usbControlNextStage();
+		usbQueueTransmitPacket(interface_packet, 1, CONTROL_ENDPOINT_NUMBER, 0);
+	}
+}
+
+/** "Set Interface" request, as defined in section 9.4.10 of the USB
+  * specification. This allows the host to select an alternate setting of an
+  * interface.
+  * \param alternate_setting The alternate setting to select.
+  * \param interface The interface number of the interface to change.
+  */
+static void setInterface(uint16_t alternate_setting, uint16_t interface)
+{
+	if ((current_configuration_value == 0)
+		|| usbClassSetInterface(interface, alternate_setting))
+	{
+		// Invalid state, interface or alternate setting.
+		usbControlProtocolStall();
+	}
+	else
+	{
+		usbControlNextStage(); // no Data stage for this request
+		usbControlNextStage();
+		// Send success packet.
+		usbQueueTransmitPacket(null_packet, 0, CONTROL_ENDPOINT_NUMBER, 0);
+	}
+}
+
 /** This implements the endpoint halt feature, which is controlled by the
   * "Clear Feature" (see section 9.4.1 of the USB specification) and
   * "Set Feature" (see section 9.4.9 of the USB specification) requests.
@@ -459,6 +511,16 @@ static unsigned int handleControlSetup(uint8_t bmRequestType, uint8_t bRequest,
 	{
 		clearOrSetEndpointHalt(wIndex, 1);
 	}
+	else if ((bmRequestType == 0x81) && (bRequest == GET_INTERFACE)
+		&& (wValue == 0) && (wLength == 1))
+	{
+		getInterface(wIndex);
+	}
+	else if ((bmRequestType == 0x01) && (bRequest == SET_INTERFACE)
+		&& (wLength == 0))
+	{
+		setInterface(wValue, wIndex);
+	}
 	else
 	{
 		return 1; // unknown or unsupported request.